@@ -0,0 +1,1123 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+/**
+ * @file feng-load.c
+ * @brief Load generator for RTSP servers
+ *
+ * Runs many concurrent RTSP sessions against a single URI from one
+ * event loop: each simulated client connects, sends DESCRIBE, SETUP
+ * for each track and PLAY, receives the RTP packets over UDP,
+ * interleaved TCP or HTTP tunnelling, optionally pauses and seeks at
+ * regular intervals, and tears the session down after its duration,
+ * to start a new one until the end of the run.
+ *
+ * At the end it reports the latency percentiles of the requests, the
+ * time to the first RTP packet, the per-stream jitter, loss and
+ * sequence gaps, and the aggregate throughput.
+ *
+ * Usage: feng-load -n 100 -r 10 -d 30 -T 120 -t tcp rtsp://host/file
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+#include <ev.h>
+
+typedef enum {
+    LOAD_UDP,
+    LOAD_TCP,
+    LOAD_HTTP
+} LoadTransport;
+
+typedef enum {
+    STAT_DESCRIBE,
+    STAT_SETUP,
+    STAT_PLAY,
+    STAT_SEEK,
+    STAT_FIRST_RTP,
+    STAT_JITTER,
+    _STAT_MAX
+} LoadStat;
+
+static const char *const stat_names[_STAT_MAX] = {
+    [STAT_DESCRIBE] = "DESCRIBE",
+    [STAT_SETUP] = "SETUP",
+    [STAT_PLAY] = "PLAY",
+    [STAT_SEEK] = "PLAY after seek",
+    [STAT_FIRST_RTP] = "first RTP packet",
+    [STAT_JITTER] = "stream jitter"
+};
+
+typedef enum {
+    CLIENT_CONNECTING,
+    CLIENT_TUNNEL,
+    CLIENT_DESCRIBE,
+    CLIENT_SETUP,
+    CLIENT_PLAY,
+    CLIENT_PLAYING,
+    CLIENT_PAUSE,
+    CLIENT_PAUSED,
+    CLIENT_TEARDOWN
+} ClientState;
+
+/** Phases the failures are counted by */
+static const char *const state_names[] = {
+    [CLIENT_CONNECTING] = "connect",
+    [CLIENT_TUNNEL] = "tunnel",
+    [CLIENT_DESCRIBE] = "DESCRIBE",
+    [CLIENT_SETUP] = "SETUP",
+    [CLIENT_PLAY] = "PLAY",
+    [CLIENT_PLAYING] = "playing",
+    [CLIENT_PAUSE] = "PAUSE",
+    [CLIENT_PAUSED] = "paused",
+    [CLIENT_TEARDOWN] = "TEARDOWN"
+};
+
+typedef struct {
+    char *control;
+    unsigned int clock_rate;
+
+    /** UDP sockets, -1 for the interleaved transports */
+    int rtp_sd, rtcp_sd;
+    ev_io rtp_reader;
+
+    gboolean started;
+    uint16_t max_seq;
+    uint32_t base_seq;
+    uint32_t cycles;
+    guint64 received;
+    guint64 gaps;
+    guint64 reordered;
+    double transit;
+    double jitter;
+
+    struct LoadClient *client;
+} LoadStream;
+
+typedef struct LoadClient {
+    guint id;
+    ClientState state;
+
+    /** Connection receiving the responses and interleaved data */
+    int sd;
+    /** Connection the requests are sent on, the POST one for HTTP */
+    int out_sd;
+    ev_io reader;
+    GByteArray *input;
+    /** Requests not yet taken by @ref out_sd, see @ref load_send */
+    GByteArray *output;
+    ev_io writer;
+    /** The HTTP response to the tunnel's GET is still to be read */
+    gboolean tunnel_pending;
+    gchar *cookie;
+
+    guint cseq;
+    ev_tstamp request_time;
+    ev_tstamp session_start;
+    ev_tstamp play_time;
+    gboolean first_rtp;
+    gboolean seeking;
+    /** Increased each time the session is reset */
+    guint generation;
+
+    gchar *session;
+    gchar *base;
+    GPtrArray *streams;
+    guint setup_index;
+    double range_end;
+
+    ev_timer timer;
+} LoadClient;
+
+static struct {
+    gchar *uri;
+    gchar *host;
+    gchar *port;
+    gchar *path;
+    LoadTransport transport;
+
+    gint clients;
+    gdouble ramp;
+    gdouble duration;
+    gdouble run_time;
+    gdouble seek_interval;
+    gdouble pause_time;
+} conf = {
+    .clients = 10,
+    .duration = 30,
+    .run_time = 60,
+    .pause_time = 0.5
+};
+
+static struct {
+    GArray *samples[_STAT_MAX];
+    guint sessions;
+    guint completed;
+    guint active;
+    guint failures[G_N_ELEMENTS(state_names)];
+    guint streams;
+    guint64 received;
+    guint64 lost;
+    guint64 gaps;
+    guint64 reordered;
+    guint64 bytes;
+    ev_tstamp start;
+    gboolean stopping;
+} stats;
+
+static struct ev_loop *loop;
+
+static void client_start(LoadClient *client);
+static void client_fail(LoadClient *client);
+
+static void stat_add(LoadStat stat, double value)
+{
+    g_array_append_val(stats.samples[stat], value);
+}
+
+static int double_compare(gconstpointer a, gconstpointer b)
+{
+    const double da = *(const double*)a, db = *(const double*)b;
+
+    return da < db ? -1 : da > db;
+}
+
+static double percentile(GArray *samples, double p)
+{
+    const guint i = (guint)(p * (samples->len - 1) + 0.5);
+
+    return g_array_index(samples, double, i);
+}
+
+/**
+ * @brief Connect a socket to the server, without blocking
+ */
+static int load_connect(void)
+{
+    struct addrinfo hints, *res;
+    int sd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ( getaddrinfo(conf.host, conf.port, &hints, &res) != 0 )
+        return -1;
+
+    if ( (sd = socket(res->ai_family, SOCK_STREAM, 0)) < 0 ) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    fcntl(sd, F_SETFL, O_NONBLOCK);
+
+    if ( connect(sd, res->ai_addr, res->ai_addrlen) < 0 &&
+         errno != EINPROGRESS ) {
+        close(sd);
+        sd = -1;
+    }
+
+    freeaddrinfo(res);
+    return sd;
+}
+
+/**
+ * @brief Send as much of the queued requests as the socket takes
+ *
+ * The writer is only watched while something is left, which includes
+ * the time the connection takes to be established.
+ */
+static gboolean client_flush(LoadClient *client)
+{
+    GByteArray *output = client->output;
+
+    while ( output->len > 0 ) {
+        const ssize_t sent = send(client->out_sd, output->data, output->len,
+                                  MSG_NOSIGNAL);
+
+        if ( sent < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                return false;
+
+            if ( !ev_is_active(&client->writer) ) {
+                ev_io_set(&client->writer, client->out_sd, EV_WRITE);
+                ev_io_start(loop, &client->writer);
+            }
+            return true;
+        }
+
+        g_byte_array_remove_range(output, 0, sent);
+    }
+
+    ev_io_stop(loop, &client->writer);
+    return true;
+}
+
+static void client_write_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
+                            ATTR_UNUSED int revents)
+{
+    LoadClient *client = w->data;
+
+    if ( !client_flush(client) )
+        client_fail(client);
+}
+
+/**
+ * @brief Queue data on the connection the requests are sent on
+ */
+static gboolean load_send(LoadClient *client, const char *data, size_t len)
+{
+    g_byte_array_append(client->output, (const guint8*)data, len);
+    return client_flush(client);
+}
+
+/**
+ * @brief Send a request, with the common headers
+ *
+ * @param extra Further headers, each ending with CRLF, or NULL
+ *
+ * Tunnelled requests are base64-encoded on the POST connection; the
+ * User-Agent is padded so that each request encodes without padding
+ * characters, which can't appear in the middle of the stream.
+ */
+static gboolean client_request(LoadClient *client, const char *method,
+                               const char *uri, const char *extra)
+{
+    GString *req = g_string_sized_new(512);
+    gboolean ret;
+
+    client->request_time = ev_time();
+
+    g_string_append_printf(req, "%s %s RTSP/1.0\r\nCSeq: %u\r\n",
+                           method, uri, ++client->cseq);
+    if ( client->session != NULL )
+        g_string_append_printf(req, "Session: %s\r\n", client->session);
+    if ( extra != NULL )
+        g_string_append(req, extra);
+
+    g_string_append(req, "User-Agent: feng-load");
+
+    if ( conf.transport == LOAD_HTTP ) {
+        gchar *encoded;
+
+        while ( (req->len + 4) % 3 != 0 )
+            g_string_append_c(req, ' ');
+        g_string_append(req, "\r\n\r\n");
+
+        encoded = g_base64_encode((const guchar*)req->str, req->len);
+        ret = load_send(client, encoded, strlen(encoded));
+        g_free(encoded);
+    } else {
+        g_string_append(req, "\r\n\r\n");
+        ret = load_send(client, req->str, req->len);
+    }
+
+    g_string_free(req, true);
+    return ret;
+}
+
+static void stream_receive(LoadStream *stream, const uint8_t *packet, size_t len)
+{
+    LoadClient *client = stream->client;
+    const ev_tstamp now = ev_time();
+    uint16_t seq;
+    uint32_t timestamp;
+    double transit;
+
+    if ( len < 12 || (packet[0] >> 6) != 2 )
+        return;
+
+    seq = (packet[2] << 8) | packet[3];
+    timestamp = ((uint32_t)packet[4] << 24) | (packet[5] << 16) |
+        (packet[6] << 8) | packet[7];
+
+    stats.bytes += len;
+    stream->received++;
+
+    if ( !client->first_rtp ) {
+        client->first_rtp = true;
+        stat_add(STAT_FIRST_RTP, now - client->play_time);
+    }
+
+    /* RFC 3550 Appendix A.1 and A.8 */
+    if ( !stream->started ) {
+        stream->started = true;
+        stream->base_seq = seq;
+        stream->max_seq = seq;
+    } else {
+        const uint16_t delta = seq - stream->max_seq;
+
+        if ( delta == 0 || delta >= 0x8000 ) {
+            stream->reordered++;
+        } else {
+            if ( seq < stream->max_seq )
+                stream->cycles += 65536;
+            if ( delta > 1 )
+                stream->gaps++;
+            stream->max_seq = seq;
+        }
+    }
+
+    transit = now * stream->clock_rate - timestamp;
+    if ( stream->received > 1 ) {
+        double d = transit - stream->transit;
+
+        if ( d < 0 )
+            d = -d;
+        /* the timestamps wrap around as well */
+        if ( d < (double)G_MAXUINT32 / 2 )
+            stream->jitter += (d - stream->jitter) / 16;
+    }
+    stream->transit = transit;
+}
+
+static void stream_udp_read_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
+                               ATTR_UNUSED int revents)
+{
+    LoadStream *stream = w->data;
+    uint8_t buffer[65536];
+    ssize_t len;
+
+    while ( (len = recv(stream->rtp_sd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0 )
+        stream_receive(stream, buffer, len);
+}
+
+/**
+ * @brief Bind the UDP sockets of a stream
+ *
+ * @return The client_port parameter of the Transport header
+ */
+static gchar *stream_udp_bind(LoadStream *stream)
+{
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    int ports[2], *sds[2] = { &stream->rtp_sd, &stream->rtcp_sd };
+    int i;
+
+    for ( i = 0; i < 2; i++ ) {
+        const int size = 1 << 20;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+
+        if ( (*sds[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+             bind(*sds[i], (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+             getsockname(*sds[i], (struct sockaddr*)&sa, &sa_len) < 0 )
+            return NULL;
+
+        setsockopt(*sds[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        ports[i] = ntohs(sa.sin_port);
+    }
+
+    stream->rtp_reader.data = stream;
+    ev_io_init(&stream->rtp_reader, stream_udp_read_cb, stream->rtp_sd, EV_READ);
+    ev_io_start(loop, &stream->rtp_reader);
+
+    return g_strdup_printf("client_port=%d-%d", ports[0], ports[1]);
+}
+
+static void stream_free(gpointer stream_p, ATTR_UNUSED gpointer unused)
+{
+    LoadStream *stream = stream_p;
+
+    if ( stream->started ) {
+        const guint64 expected = stream->cycles + stream->max_seq -
+            stream->base_seq + 1;
+
+        stats.streams++;
+        stats.received += stream->received;
+        stats.gaps += stream->gaps;
+        stats.reordered += stream->reordered;
+        if ( expected > stream->received )
+            stats.lost += expected - stream->received;
+        if ( stream->clock_rate != 0 )
+            stat_add(STAT_JITTER, stream->jitter / stream->clock_rate);
+    }
+
+    if ( stream->rtp_sd >= 0 ) {
+        ev_io_stop(loop, &stream->rtp_reader);
+        close(stream->rtp_sd);
+    }
+    if ( stream->rtcp_sd >= 0 )
+        close(stream->rtcp_sd);
+
+    g_free(stream->control);
+    g_slice_free(LoadStream, stream);
+}
+
+/**
+ * @brief Find the tracks of the resource in the DESCRIBE response
+ */
+static gboolean client_parse_sdp(LoadClient *client, const char *sdp)
+{
+    gchar **lines = g_strsplit(sdp, "\n", 0);
+    LoadStream *stream = NULL;
+    guint i;
+
+    for ( i = 0; lines[i] != NULL; i++ ) {
+        const char *line = g_strchomp(lines[i]);
+        unsigned int pt, rate;
+
+        if ( g_str_has_prefix(line, "m=") ) {
+            stream = g_slice_new0(LoadStream);
+            stream->client = client;
+            stream->rtp_sd = stream->rtcp_sd = -1;
+            g_ptr_array_add(client->streams, stream);
+        } else if ( sscanf(line, "a=range:npt=%*f-%lf", &client->range_end) == 1 ) {
+            continue;
+        } else if ( stream == NULL ) {
+            continue;
+        } else if ( g_str_has_prefix(line, "a=control:") ) {
+            const char *control = line + strlen("a=control:");
+
+            if ( strstr(control, "://") != NULL )
+                stream->control = g_strdup(control);
+            else
+                stream->control = g_strdup_printf("%s%s%s", client->base,
+                                                  g_str_has_suffix(client->base, "/") ? "" : "/",
+                                                  control);
+        } else if ( sscanf(line, "a=rtpmap:%u %*[^/]/%u", &pt, &rate) == 2 ) {
+            stream->clock_rate = rate;
+        }
+    }
+
+    g_strfreev(lines);
+
+    for ( i = 0; i < client->streams->len; i++ )
+        if ( ((LoadStream*)g_ptr_array_index(client->streams, i))->control == NULL )
+            return false;
+
+    return client->streams->len > 0;
+}
+
+static gboolean client_setup(LoadClient *client)
+{
+    LoadStream *stream = g_ptr_array_index(client->streams, client->setup_index);
+    gchar *transport, *params = NULL;
+    gboolean ret;
+
+    switch ( conf.transport ) {
+    case LOAD_UDP:
+        if ( (params = stream_udp_bind(stream)) == NULL )
+            return false;
+        transport = g_strdup_printf("Transport: RTP/AVP;unicast;%s\r\n", params);
+        break;
+    default:
+        transport = g_strdup_printf("Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u\r\n",
+                                    client->setup_index * 2,
+                                    client->setup_index * 2 + 1);
+        break;
+    }
+
+    client->state = CLIENT_SETUP;
+    ret = client_request(client, "SETUP", stream->control, transport);
+
+    g_free(params);
+    g_free(transport);
+    return ret;
+}
+
+static gboolean client_play(LoadClient *client, const char *range)
+{
+    client->state = CLIENT_PLAY;
+    client->play_time = ev_time();
+    return client_request(client, "PLAY", conf.uri, range);
+}
+
+static void client_timer_cb(struct ev_loop *loop, ev_timer *w,
+                            ATTR_UNUSED int revents)
+{
+    LoadClient *client = w->data;
+    const ev_tstamp played = ev_now(loop) - client->session_start;
+
+    switch ( client->state ) {
+    case CLIENT_CONNECTING:
+        client_start(client);
+        return;
+    case CLIENT_PLAYING:
+        if ( conf.seek_interval > 0 && played < conf.duration ) {
+            client->state = CLIENT_PAUSE;
+            if ( !client_request(client, "PAUSE", conf.uri, NULL) )
+                client_fail(client);
+            return;
+        }
+
+        client->state = CLIENT_TEARDOWN;
+        if ( !client_request(client, "TEARDOWN", conf.uri, NULL) )
+            client_fail(client);
+        return;
+    case CLIENT_PAUSED: {
+        gchar *range = g_strdup_printf("Range: npt=%.3f-\r\n",
+                                       g_random_double_range(0, MAX(client->range_end, 1)));
+        if ( !client_play(client, range) )
+            client_fail(client);
+        g_free(range);
+        return;
+    }
+    default:
+        return;
+    }
+}
+
+static void client_schedule(LoadClient *client, ev_tstamp after)
+{
+    ev_timer_stop(loop, &client->timer);
+    ev_timer_set(&client->timer, after, 0);
+    ev_timer_start(loop, &client->timer);
+}
+
+/**
+ * @brief Act on the response to the request in flight
+ */
+static gboolean client_response(LoadClient *client, int status,
+                                const char *headers, const char *body)
+{
+    const ev_tstamp latency = ev_time() - client->request_time;
+    const char *value;
+
+    if ( status != 200 )
+        return false;
+
+    switch ( client->state ) {
+    case CLIENT_DESCRIBE:
+        stat_add(STAT_DESCRIBE, latency);
+
+        if ( (value = strstr(headers, "\nContent-Base:")) != NULL ) {
+            value += strlen("\nContent-Base:");
+            g_free(client->base);
+            client->base = g_strndup(value, strcspn(value, "\r\n"));
+            g_strstrip(client->base);
+        }
+
+        if ( body == NULL || !client_parse_sdp(client, body) )
+            return false;
+
+        client->setup_index = 0;
+        return client_setup(client);
+
+    case CLIENT_SETUP:
+        stat_add(STAT_SETUP, latency);
+
+        if ( client->session == NULL &&
+             (value = strstr(headers, "\nSession:")) != NULL ) {
+            value += strlen("\nSession:");
+            value += strspn(value, " ");
+            client->session = g_strndup(value, strcspn(value, ";\r\n"));
+        }
+
+        if ( ++client->setup_index < client->streams->len )
+            return client_setup(client);
+
+        client->first_rtp = false;
+        client->seeking = false;
+        client->session_start = ev_now(loop);
+        return client_play(client, "Range: npt=0-\r\n");
+
+    case CLIENT_PLAY: {
+        const ev_tstamp left = conf.duration - (ev_now(loop) - client->session_start);
+
+        /* the time to the first packet is only measured once */
+        stat_add(client->seeking ? STAT_SEEK : STAT_PLAY, latency);
+        client->state = CLIENT_PLAYING;
+        client_schedule(client, conf.seek_interval > 0 ?
+                        MIN(conf.seek_interval, left) : left);
+        return true;
+    }
+
+    case CLIENT_PAUSE:
+        client->state = CLIENT_PAUSED;
+        client->seeking = true;
+        client_schedule(client, conf.pause_time);
+        return true;
+
+    case CLIENT_TEARDOWN:
+        stats.completed++;
+        client_start(client);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Process the data received from the server
+ *
+ * @return The bytes consumed, or -1 on error
+ */
+static gssize client_parse(LoadClient *client, const char *data, size_t len)
+{
+    const char *end, *body = NULL;
+    size_t header_len, content_len = 0;
+    int status;
+    gchar *headers, *content = NULL;
+    gboolean ret;
+
+    if ( len < 4 )
+        return 0;
+
+    if ( data[0] == '$' ) {
+        const size_t frame = ((uint8_t)data[2] << 8) | (uint8_t)data[3];
+        const guint channel = (uint8_t)data[1];
+
+        if ( len < 4 + frame )
+            return 0;
+
+        if ( channel % 2 == 0 && channel / 2 < client->streams->len )
+            stream_receive(g_ptr_array_index(client->streams, channel / 2),
+                           (const uint8_t*)data + 4, frame);
+
+        return 4 + frame;
+    }
+
+    if ( (end = g_strstr_len(data, len, "\r\n\r\n")) == NULL )
+        return 0;
+
+    header_len = end + 4 - data;
+    headers = g_strndup(data, header_len);
+
+    if ( client->tunnel_pending ) {
+        client->tunnel_pending = false;
+        g_free(headers);
+
+        if ( strncmp(data, "HTTP/1.0 200", 12) != 0 &&
+             strncmp(data, "HTTP/1.1 200", 12) != 0 )
+            return -1;
+
+        /* the server takes the POST once the GET is set up; the GET
+         * itself was sent, since it was answered */
+        ev_io_stop(loop, &client->writer);
+        g_byte_array_set_size(client->output, 0);
+        if ( (client->out_sd = load_connect()) < 0 )
+            return -1;
+
+        {
+            gchar *post = g_strdup_printf("POST %s HTTP/1.0\r\n"
+                                          "x-sessioncookie: %s\r\n"
+                                          "Content-Type: application/x-rtsp-tunnelled\r\n"
+                                          "Pragma: no-cache\r\n"
+                                          "Cache-Control: no-cache\r\n"
+                                          "Content-Length: 32767\r\n\r\n",
+                                          conf.path, client->cookie);
+
+            /* queued until the connection is established */
+            ret = load_send(client, post, strlen(post));
+            g_free(post);
+        }
+
+        client->state = CLIENT_DESCRIBE;
+        if ( !ret || !client_request(client, "DESCRIBE", conf.uri,
+                                     "Accept: application/sdp\r\n") )
+            return -1;
+
+        return header_len;
+    }
+
+    if ( (body = strstr(headers, "\nContent-Length:")) != NULL )
+        content_len = strtoul(body + strlen("\nContent-Length:"), NULL, 10);
+
+    if ( len < header_len + content_len ) {
+        g_free(headers);
+        return 0;
+    }
+
+    if ( sscanf(data, "RTSP/1.0 %d", &status) != 1 ) {
+        g_free(headers);
+        return -1;
+    }
+
+    if ( content_len > 0 )
+        content = g_strndup(data + header_len, content_len);
+
+    ret = client_response(client, status, headers, content);
+
+    g_free(headers);
+    g_free(content);
+
+    return ret ? (gssize)(header_len + content_len) : -1;
+}
+
+static void client_read_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
+                           ATTR_UNUSED int revents)
+{
+    LoadClient *client = w->data;
+    const guint prev_len = client->input->len;
+    const guint generation = client->generation;
+    ssize_t len;
+    gssize used;
+    size_t offset = 0;
+
+    g_byte_array_set_size(client->input, prev_len + 65536);
+    len = recv(client->sd, client->input->data + prev_len, 65536, MSG_DONTWAIT);
+
+    if ( len <= 0 ) {
+        g_byte_array_set_size(client->input, prev_len);
+        if ( len < 0 && errno == EAGAIN )
+            return;
+        client_fail(client);
+        return;
+    }
+
+    g_byte_array_set_size(client->input, prev_len + len);
+
+    while ( (used = client_parse(client, (const char*)client->input->data + offset,
+                                 client->input->len - offset)) > 0 ) {
+        /* the session is over, and its input gone with it */
+        if ( client->generation != generation )
+            return;
+        offset += used;
+    }
+
+    if ( used < 0 ) {
+        client_fail(client);
+        return;
+    }
+
+    g_byte_array_remove_range(client->input, 0, offset);
+}
+
+static void client_connected_cb(int revents, void *arg)
+{
+    LoadClient *client = arg;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if ( (revents & EV_TIMEOUT) ||
+         getsockopt(client->sd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+         error != 0 ) {
+        client_fail(client);
+        return;
+    }
+
+    client->reader.data = client;
+    ev_io_init(&client->reader, client_read_cb, client->sd, EV_READ);
+    ev_io_start(loop, &client->reader);
+
+    if ( conf.transport == LOAD_HTTP ) {
+        gchar *get;
+
+        g_free(client->cookie);
+        client->cookie = g_strdup_printf("%08x%08x", g_random_int(), client->id);
+        get = g_strdup_printf("GET %s HTTP/1.0\r\n"
+                              "x-sessioncookie: %s\r\n"
+                              "Accept: application/x-rtsp-tunnelled\r\n"
+                              "Pragma: no-cache\r\n"
+                              "Cache-Control: no-cache\r\n\r\n",
+                              conf.path, client->cookie);
+
+        client->state = CLIENT_TUNNEL;
+        client->tunnel_pending = true;
+        if ( !load_send(client, get, strlen(get)) )
+            client_fail(client);
+        g_free(get);
+        return;
+    }
+
+    client->state = CLIENT_DESCRIBE;
+    if ( !client_request(client, "DESCRIBE", conf.uri, "Accept: application/sdp\r\n") )
+        client_fail(client);
+}
+
+/**
+ * @brief Release the session of a client, and its connections
+ */
+static void client_reset(LoadClient *client)
+{
+    ev_timer_stop(loop, &client->timer);
+    ev_io_stop(loop, &client->writer);
+
+    if ( client->sd >= 0 ) {
+        ev_io_stop(loop, &client->reader);
+        close(client->sd);
+        stats.active--;
+    }
+    if ( client->out_sd >= 0 && client->out_sd != client->sd )
+        close(client->out_sd);
+    client->sd = client->out_sd = -1;
+
+    g_byte_array_set_size(client->input, 0);
+    g_byte_array_set_size(client->output, 0);
+    g_ptr_array_foreach(client->streams, stream_free, NULL);
+    g_ptr_array_set_size(client->streams, 0);
+    client->generation++;
+
+    g_free(client->session);
+    client->session = NULL;
+    client->cseq = 0;
+    client->range_end = 0;
+    client->tunnel_pending = false;
+}
+
+static void client_start(LoadClient *client)
+{
+    client_reset(client);
+
+    if ( stats.stopping )
+        return;
+
+    g_free(client->base);
+    client->base = g_strdup(conf.uri);
+
+    stats.sessions++;
+    client->state = CLIENT_CONNECTING;
+
+    if ( (client->sd = load_connect()) < 0 ) {
+        stats.failures[CLIENT_CONNECTING]++;
+        client_schedule(client, 1.0);
+        return;
+    }
+
+    stats.active++;
+    client->out_sd = client->sd;
+
+    ev_once(loop, client->sd, EV_WRITE, 10.0, client_connected_cb, client);
+}
+
+/**
+ * @brief Count the failure of a session, and retry after a while
+ */
+static void client_fail(LoadClient *client)
+{
+    stats.failures[client->state]++;
+    client_reset(client);
+
+    client->state = CLIENT_CONNECTING;
+    client_schedule(client, 1.0);
+}
+
+static void client_ramp_cb(struct ev_loop *loop, ev_timer *w,
+                           ATTR_UNUSED int revents)
+{
+    LoadClient *client = w->data;
+
+    ev_timer_stop(loop, w);
+    ev_init(w, client_timer_cb);
+    client_start(client);
+}
+
+static void progress_cb(struct ev_loop *loop, ev_timer *w,
+                        ATTR_UNUSED int revents)
+{
+    static guint64 last_bytes;
+    const ev_tstamp elapsed = ev_now(loop) - stats.start;
+
+    fprintf(stderr, "%6.0fs: %u connected, %u sessions, %u completed, %.2f Mbit/s\n",
+            elapsed, stats.active, stats.sessions, stats.completed,
+            (stats.bytes - last_bytes) * 8 / w->repeat / 1e6);
+
+    last_bytes = stats.bytes;
+}
+
+static void stop_cb(struct ev_loop *loop, ATTR_UNUSED ev_timer *w,
+                    ATTR_UNUSED int revents)
+{
+    ev_unloop(loop, EVUNLOOP_ALL);
+}
+
+static void report(LoadClient *clients)
+{
+    const ev_tstamp elapsed = ev_time() - stats.start;
+    guint64 expected;
+    gint i;
+
+    stats.stopping = true;
+    for ( i = 0; i < conf.clients; i++ )
+        client_reset(&clients[i]);
+
+    printf("sessions: %u started, %u completed\n", stats.sessions, stats.completed);
+    printf("failures:");
+    for ( i = 0; i < (gint)G_N_ELEMENTS(state_names); i++ )
+        if ( stats.failures[i] != 0 )
+            printf(" %s %u", state_names[i], stats.failures[i]);
+    printf("\n\n%-18s %8s %10s %10s %10s %10s\n",
+           "(ms)", "count", "p50", "p90", "p99", "max");
+
+    for ( i = 0; i < _STAT_MAX; i++ ) {
+        GArray *samples = stats.samples[i];
+
+        if ( samples->len == 0 ) {
+            printf("%-18s %8u\n", stat_names[i], 0);
+            continue;
+        }
+
+        g_array_sort(samples, double_compare);
+        printf("%-18s %8u %10.2f %10.2f %10.2f %10.2f\n",
+               stat_names[i], samples->len,
+               percentile(samples, 0.50) * 1000,
+               percentile(samples, 0.90) * 1000,
+               percentile(samples, 0.99) * 1000,
+               g_array_index(samples, double, samples->len - 1) * 1000);
+    }
+
+    expected = stats.received + stats.lost;
+    printf("\nstreams: %u, packets %" G_GUINT64_FORMAT
+           ", lost %" G_GUINT64_FORMAT " (%.3f%%), sequence gaps %" G_GUINT64_FORMAT
+           ", reordered %" G_GUINT64_FORMAT "\n",
+           stats.streams, stats.received, stats.lost,
+           expected ? stats.lost * 100.0 / expected : 0.0,
+           stats.gaps, stats.reordered);
+    printf("throughput: %.2f Mbit/s over %.1f s\n",
+           stats.bytes * 8 / elapsed / 1e6, elapsed);
+}
+
+static gboolean parse_uri(void)
+{
+    const char *p = conf.uri;
+    const char *host, *slash, *colon;
+
+    if ( !g_str_has_prefix(p, "rtsp://") )
+        return false;
+
+    host = p + strlen("rtsp://");
+    slash = strchr(host, '/');
+    if ( slash == NULL )
+        slash = host + strlen(host);
+
+    colon = memchr(host, ':', slash - host);
+    if ( colon != NULL ) {
+        conf.host = g_strndup(host, colon - host);
+        conf.port = g_strndup(colon + 1, slash - colon - 1);
+    } else {
+        conf.host = g_strndup(host, slash - host);
+        conf.port = g_strdup("554");
+    }
+
+    conf.path = *slash ? g_strdup(slash) : g_strdup("/");
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    gchar *transport = NULL;
+    GError *error = NULL;
+    GOptionContext *context;
+    LoadClient *clients;
+    ev_timer stop, progress;
+    gint i;
+
+    const GOptionEntry entries[] = {
+        { "clients", 'n', 0, G_OPTION_ARG_INT, &conf.clients,
+          "Concurrent sessions (default 10)", "N" },
+        { "ramp", 'r', 0, G_OPTION_ARG_DOUBLE, &conf.ramp,
+          "Seconds over which the sessions are started (default 0)", "SECONDS" },
+        { "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &conf.duration,
+          "Seconds each session plays before its TEARDOWN (default 30)", "SECONDS" },
+        { "time", 'T', 0, G_OPTION_ARG_DOUBLE, &conf.run_time,
+          "Seconds the whole run lasts (default 60)", "SECONDS" },
+        { "transport", 't', 0, G_OPTION_ARG_STRING, &transport,
+          "udp, tcp (interleaved) or http (tunnelled; default udp)", "TRANSPORT" },
+        { "seek-interval", 's', 0, G_OPTION_ARG_DOUBLE, &conf.seek_interval,
+          "Pause and seek to a random position this often (default never)", "SECONDS" },
+        { "pause-time", 'p', 0, G_OPTION_ARG_DOUBLE, &conf.pause_time,
+          "Seconds to stay paused before seeking (default 0.5)", "SECONDS" },
+        { NULL }
+    };
+
+    context = g_option_context_new("rtsp://host[:port]/resource");
+    g_option_context_set_summary(context, "Run concurrent RTSP sessions against a server.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if ( !g_option_context_parse(context, &argc, &argv, &error) ) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+
+    if ( argc != 2 || conf.clients <= 0 ) {
+        gchar *help = g_option_context_get_help(context, true, NULL);
+        fputs(help, stderr);
+        return 1;
+    }
+
+    conf.uri = argv[1];
+    if ( !parse_uri() ) {
+        fprintf(stderr, "invalid URI: %s\n", conf.uri);
+        return 1;
+    }
+
+    if ( transport == NULL || strcmp(transport, "udp") == 0 )
+        conf.transport = LOAD_UDP;
+    else if ( strcmp(transport, "tcp") == 0 )
+        conf.transport = LOAD_TCP;
+    else if ( strcmp(transport, "http") == 0 )
+        conf.transport = LOAD_HTTP;
+    else {
+        fprintf(stderr, "unknown transport: %s\n", transport);
+        return 1;
+    }
+
+    /* tunnelled clients connect to the HTTP port of the server */
+    if ( conf.transport == LOAD_HTTP && strchr(conf.uri + strlen("rtsp://"), ':') == NULL ) {
+        g_free(conf.port);
+        conf.port = g_strdup("80");
+    }
+
+    loop = ev_default_loop(0);
+
+    for ( i = 0; i < _STAT_MAX; i++ )
+        stats.samples[i] = g_array_new(false, false, sizeof(double));
+
+    clients = g_new0(LoadClient, conf.clients);
+    for ( i = 0; i < conf.clients; i++ ) {
+        LoadClient *client = &clients[i];
+
+        client->id = i;
+        client->sd = client->out_sd = -1;
+        client->input = g_byte_array_new();
+        client->output = g_byte_array_new();
+        client->streams = g_ptr_array_new();
+
+        client->writer.data = client;
+        ev_init(&client->writer, client_write_cb);
+
+        client->timer.data = client;
+        ev_timer_init(&client->timer, client_ramp_cb,
+                      conf.ramp * i / conf.clients, 0);
+        ev_timer_start(loop, &client->timer);
+    }
+
+    ev_timer_init(&stop, stop_cb, conf.run_time, 0);
+    ev_timer_start(loop, &stop);
+    ev_timer_init(&progress, progress_cb, 1.0, 1.0);
+    ev_timer_start(loop, &progress);
+
+    stats.start = ev_time();
+    ev_loop(loop, 0);
+
+    report(clients);
+
+    return 0;
+}
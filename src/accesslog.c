@@ -45,21 +45,46 @@
 #endif
 
 /**
- * @brief Initialise access log for a socket
- *
- * @param socket_p Generic pointer to @ref specific_config object
- * @param user_data Unused
+ * @brief Batched writer of an access log
  *
- * @TODO this should actually be moved to vhosts, not sockets
+ * The client threads only append the formatted records to @ref
+ * AccessLog::buffer; a writer thread swaps it out and writes it to
+ * the file when it grows past @ref cfg_vhost_t::access_log_buffer
+ * bytes, or every @ref cfg_vhost_t::access_log_flush milliseconds.
  */
-void accesslog_init(gpointer vhost_p, ATTR_UNUSED gpointer user_data)
+struct AccessLog {
+    GMutex *lock;
+    /** Signalled when the buffer is past its size, or to stop */
+    GCond *wakeup;
+    GString *buffer;
+    /** Records dropped because the writer could not keep up */
+    guint dropped;
+    gboolean stop;
+    GThread *writer;
+    cfg_vhost_t *vhost;
+    /** Last value of @ref accesslog_generation the file was opened at */
+    gint generation;
+};
+
+/** Records are dropped once the buffer is this many times its size */
+#define ACCESSLOG_BACKLOG 8
+
+/** Increased on SIGHUP, to reopen the files after they are rotated */
+static gint accesslog_generation;
+
+/** Scratch buffer of each thread, to format the records into */
+static GStaticPrivate accesslog_scratch = G_STATIC_PRIVATE_INIT;
+
+static void accesslog_scratch_free(gpointer str)
+{
+    g_string_free(str, true);
+}
+
+static FILE *accesslog_open(cfg_vhost_t *vhost)
 {
-    cfg_vhost_t *vhost = vhost_p;
     FILE *access_log = stderr;
 
-    if ( strcmp(vhost->access_log, "syslog") == 0 ) {
-        vhost->access_log_file = NULL;
-    } else if ( strcmp(vhost->access_log, "stderr") != 0 ) {
+    if ( strcmp(vhost->access_log, "stderr") != 0 ) {
         FILE *new_access_log = fopen(vhost->access_log, "a+");
         if ( new_access_log == NULL ) {
             fnc_perror("unable to open access log");
@@ -68,7 +93,159 @@ void accesslog_init(gpointer vhost_p, ATTR_UNUSED gpointer user_data)
         }
     }
 
-    vhost->access_log_file = access_log;
+    return access_log;
+}
+
+/**
+ * @brief Reopen the file of an access log, if it was asked to
+ *
+ * If the file cannot be opened again (for instance because the
+ * privileges were dropped), the old one is kept.
+ */
+static void accesslog_reopen(struct AccessLog *log)
+{
+    cfg_vhost_t *vhost = log->vhost;
+    const gint generation = g_atomic_int_get(&accesslog_generation);
+    FILE *new_access_log;
+
+    if ( log->generation == generation || vhost->access_log_file == stderr )
+        return;
+
+    log->generation = generation;
+
+    if ( (new_access_log = fopen(vhost->access_log, "a+")) == NULL ) {
+        fnc_perror("unable to reopen access log");
+        return;
+    }
+
+    fclose(vhost->access_log_file);
+    vhost->access_log_file = new_access_log;
+}
+
+static gpointer accesslog_writer(gpointer log_p)
+{
+    struct AccessLog *log = log_p;
+    GString *pending = g_string_sized_new(log->vhost->access_log_buffer);
+    gboolean stop;
+
+    do {
+        GTimeVal deadline;
+        guint dropped;
+        GString *swap;
+
+        g_get_current_time(&deadline);
+        g_time_val_add(&deadline, log->vhost->access_log_flush * 1000);
+
+        g_mutex_lock(log->lock);
+        if ( !log->stop && log->buffer->len < log->vhost->access_log_buffer )
+            g_cond_timed_wait(log->wakeup, log->lock, &deadline);
+
+        swap = log->buffer;
+        log->buffer = pending;
+        pending = swap;
+
+        dropped = log->dropped;
+        log->dropped = 0;
+        stop = log->stop;
+        g_mutex_unlock(log->lock);
+
+        accesslog_reopen(log);
+
+        if ( pending->len == 0 && dropped == 0 )
+            continue;
+
+        fwrite(pending->str, 1, pending->len, log->vhost->access_log_file);
+        fflush(log->vhost->access_log_file);
+        g_string_truncate(pending, 0);
+
+        if ( dropped != 0 )
+            fnc_log(FNC_LOG_WARN, "%u access log records dropped", dropped);
+    } while ( !stop );
+
+    g_string_free(pending, true);
+
+    return NULL;
+}
+
+/**
+ * @brief Initialise access log for a socket
+ *
+ * @param socket_p Generic pointer to @ref specific_config object
+ * @param user_data Unused
+ *
+ * @TODO this should actually be moved to vhosts, not sockets
+ */
+void accesslog_init(gpointer vhost_p, ATTR_UNUSED gpointer user_data)
+{
+    cfg_vhost_t *vhost = vhost_p;
+    struct AccessLog *log;
+
+    vhost->access_log_file = NULL;
+    vhost->access_log_writer = NULL;
+
+    if ( strcmp(vhost->access_log, "syslog") == 0 )
+        return;
+
+    vhost->access_log_file = accesslog_open(vhost);
+
+    log = g_slice_new0(struct AccessLog);
+    log->lock = g_mutex_new();
+    log->wakeup = g_cond_new();
+    log->buffer = g_string_sized_new(vhost->access_log_buffer);
+    log->vhost = vhost;
+    log->generation = g_atomic_int_get(&accesslog_generation);
+
+    if ( (log->writer = g_thread_create(accesslog_writer, log,
+                                        true, NULL)) == NULL ) {
+        fnc_log(FNC_LOG_ERR, "unable to start the access log writer");
+        g_mutex_free(log->lock);
+        g_cond_free(log->wakeup);
+        g_string_free(log->buffer, true);
+        g_slice_free(struct AccessLog, log);
+        return;
+    }
+
+    vhost->access_log_writer = log;
+}
+
+/**
+ * @brief Stop the writer of an access log, writing what's left
+ *
+ * @param vhost_p Generic pointer to a @ref cfg_vhost_t object
+ * @param user_data Unused
+ */
+void accesslog_cleanup(gpointer vhost_p, ATTR_UNUSED gpointer user_data)
+{
+    cfg_vhost_t *vhost = vhost_p;
+    struct AccessLog *log = vhost->access_log_writer;
+
+    if ( log == NULL )
+        return;
+
+    g_mutex_lock(log->lock);
+    log->stop = true;
+    g_cond_signal(log->wakeup);
+    g_mutex_unlock(log->lock);
+
+    g_thread_join(log->writer);
+
+    g_mutex_free(log->lock);
+    g_cond_free(log->wakeup);
+    g_string_free(log->buffer, true);
+    g_slice_free(struct AccessLog, log);
+
+    vhost->access_log_writer = NULL;
+}
+
+/**
+ * @brief Ask the access logs to be reopened
+ *
+ * Called on SIGHUP, after the files are rotated; the writers reopen
+ * them before their next write.
+ */
+void accesslog_reopen_all(void)
+{
+    g_atomic_int_inc(&accesslog_generation);
 }
 
 #define PRINT_STRING \
@@ -77,16 +254,72 @@ void accesslog_init(gpointer vhost_p, ATTR_UNUSED gpointer user_data)
         rfc822_headers_lookup(response->headers, RFC822_Header_Date),\
         response->request->method_str, response->request->object,\
         response->request->protocol_str,\
-        response->status, response_length ? response_length : "-",\
+        response->status, response_length,\
         referer ? referer : "-",\
         useragent ? useragent : "-"
 
+/**
+ * @brief Append a JSON string, quoted and escaped
+ */
+static void accesslog_json_string(GString *str, const char *value)
+{
+    if ( value == NULL ) {
+        g_string_append(str, "null");
+        return;
+    }
+
+    g_string_append_c(str, '"');
+    for ( ; *value; value++ ) {
+        const unsigned char c = *value;
+
+        if ( c == '"' || c == '\\' ) {
+            g_string_append_c(str, '\\');
+            g_string_append_c(str, c);
+        } else if ( c < 0x20 )
+            g_string_append_printf(str, "\\u%04x", c);
+        else
+            g_string_append_c(str, c);
+    }
+    g_string_append_c(str, '"');
+}
+
+static void accesslog_format_json(GString *str,
+                                  struct RTSP_Client *client,
+                                  struct RFC822_Response *response,
+                                  const char *referer,
+                                  const char *useragent)
+{
+    g_string_append(str, "{\"remote\":");
+    accesslog_json_string(str, client->remote_host);
+    g_string_append(str, ",\"date\":");
+    accesslog_json_string(str, rfc822_headers_lookup(response->headers,
+                                                     RFC822_Header_Date));
+    g_string_append(str, ",\"method\":");
+    accesslog_json_string(str, response->request->method_str);
+    g_string_append(str, ",\"object\":");
+    accesslog_json_string(str, response->request->object);
+    g_string_append(str, ",\"protocol\":");
+    accesslog_json_string(str, response->request->protocol_str);
+    g_string_append_printf(str, ",\"status\":%d,\"length\":%" G_GSSIZE_FORMAT ",\"referer\":",
+                           response->status,
+                           response->body ? (gssize)response->body->len : -1);
+    accesslog_json_string(str, referer);
+    g_string_append(str, ",\"user_agent\":");
+    accesslog_json_string(str, useragent);
+    g_string_append(str, "}\n");
+}
+
 void accesslog_log(struct RTSP_Client *client, struct RFC822_Response *response)
 {
     const char *referer = rfc822_headers_lookup(response->request->headers, RFC822_Header_Referer);
     const char *useragent = rfc822_headers_lookup(response->request->headers, RFC822_Header_User_Agent);
-    char *response_length = response->body ?
-        g_strdup_printf("%zd", response->body->len) : NULL;
+    struct AccessLog *log = client->vhost->access_log_writer;
+    char response_length[24] = "-";
+    GString *str;
+
+    if ( response->body )
+        g_snprintf(response_length, sizeof(response_length),
+                   "%zd", response->body->len);
 
     if (client->vhost->access_log_file == NULL) {
 #if HAVE_SYSLOG_H
@@ -94,10 +327,35 @@ void accesslog_log(struct RTSP_Client *client, struct RFC822_Response *response)
 #else
         fnc_log(FNC_LOG_ERR, "unable to log access");
 #endif
-    }  else {
+        return;
+    }
+
+    if ( log == NULL ) {
         FILE *fp = client->vhost->access_log_file;
         fprintf(fp, PRINT_STRING);
         fflush(fp);
+        return;
     }
-    g_free(response_length);
+
+    if ( (str = g_static_private_get(&accesslog_scratch)) == NULL ) {
+        str = g_string_sized_new(512);
+        g_static_private_set(&accesslog_scratch, str, accesslog_scratch_free);
+    }
+
+    if ( client->vhost->access_log_json )
+        accesslog_format_json(str, client, response, referer, useragent);
+    else
+        g_string_printf(str, PRINT_STRING);
+
+    g_mutex_lock(log->lock);
+    if ( log->buffer->len >= client->vhost->access_log_buffer * ACCESSLOG_BACKLOG )
+        log->dropped++;
+    else {
+        g_string_append_len(log->buffer, str->str, str->len);
+        if ( log->buffer->len >= client->vhost->access_log_buffer )
+            g_cond_signal(log->wakeup);
+    }
+    g_mutex_unlock(log->lock);
+
+    g_string_truncate(str, 0);
 }
@@ -0,0 +1,338 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "affinity.h"
+#include "media/media.h"
+
+/**
+ * @defgroup affinity CPU affinity and NUMA placement
+ *
+ * @brief Keep the threads, and the memory they touch, on one node
+ *
+ * The client loops can be pinned to CPU sets, one per loop, with
+ * @ref cfg_options_t::client_loops_cpus, and the demuxer threads to
+ * one with @ref cfg_options_t::demux_threads_cpus. Since memory is
+ * placed on the node of the thread first touching it, a pinned loop
+ * gets its output queues and RTP buffers from its local node, and so
+ * do the pinned demuxer threads for the packets they produce.
+ *
+ * The consumers of each track are counted by the node of the loop
+ * that serves them; with @ref cfg_options_t::live_ingest_follow the
+ * thread reading a live track moves, once a second at most, to the
+ * CPUs of the node serving most of its consumers, so that its
+ * packets are allocated where they're sent from.
+ *
+ * The nodes are found in sysfs; without it, or without
+ * pthread_setaffinity_np(), the threads float freely.
+ *
+ * @{
+ */
+
+/** Seconds between two checks of an ingest thread's placement */
+#define AFFINITY_FOLLOW_INTERVAL 1.0
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+
+/** CPUs of each NUMA node */
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+static int nodes_count;
+
+/** CPU sets of the client loops, from the configuration */
+static cpu_set_t *loop_cpus;
+static guint loop_cpus_count;
+
+static cpu_set_t demux_cpus;
+static gboolean demux_pinned;
+
+/**
+ * @brief Parse a list of CPUs, in the kernel's cpulist format
+ *
+ * @param list The list, such as "0-3,8,10-11"
+ * @param set Where to store the CPUs
+ *
+ * @retval true The list is valid and not empty.
+ */
+static gboolean affinity_parse(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+
+    CPU_ZERO(set);
+
+    while ( *p != '\0' && *p != '\n' ) {
+        char *end;
+        long first, last;
+
+        first = last = strtol(p, &end, 10);
+        if ( end == p || first < 0 )
+            return false;
+
+        if ( *end == '-' ) {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if ( end == p || last < first )
+                return false;
+        }
+
+        if ( last >= CPU_SETSIZE )
+            return false;
+
+        for ( ; first <= last; first++ )
+            CPU_SET(first, set);
+
+        p = end;
+        if ( *p == ',' )
+            p++;
+        else if ( *p != '\0' && *p != '\n' )
+            return false;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * @brief Find the node of a CPU set
+ *
+ * @return The node holding the first CPU of the set, or -1.
+ */
+static int affinity_node_of(const cpu_set_t *set)
+{
+    int cpu, node;
+
+    for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+        if ( CPU_ISSET(cpu, set) )
+            break;
+
+    for ( node = 0; node < nodes_count; node++ )
+        if ( cpu < CPU_SETSIZE && CPU_ISSET(cpu, &node_cpus[node]) )
+            return node;
+
+    return -1;
+}
+
+static void affinity_pin(const cpu_set_t *set, const char *what)
+{
+    int err;
+
+    if ( (err = pthread_setaffinity_np(pthread_self(),
+                                       sizeof(cpu_set_t), set)) != 0 )
+        fnc_log(FNC_LOG_WARN, "[affinity] unable to pin %s: %s",
+                what, strerror(err));
+}
+
+/* the nodes are numbered from zero without holes on all the
+   supported systems */
+static void affinity_read_nodes()
+{
+    for ( nodes_count = 0; nodes_count < AFFINITY_MAX_NODES; nodes_count++ ) {
+        gchar *path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist",
+                                      nodes_count);
+        gchar *list = NULL;
+        gboolean valid;
+
+        valid = g_file_get_contents(path, &list, NULL, NULL) &&
+            affinity_parse(list, &node_cpus[nodes_count]);
+
+        g_free(path);
+        g_free(list);
+
+        if ( !valid )
+            break;
+    }
+}
+
+/**
+ * @brief Read the NUMA topology and the CPU sets of the configuration
+ *
+ * To be called before @ref clients_init and @ref r_init.
+ */
+void affinity_init()
+{
+    GList *item;
+    guint i;
+
+    affinity_read_nodes();
+
+    if ( feng_srv.client_loops_cpus != NULL ) {
+        loop_cpus_count = g_list_length(feng_srv.client_loops_cpus);
+        loop_cpus = g_new0(cpu_set_t, loop_cpus_count);
+
+        for ( item = feng_srv.client_loops_cpus, i = 0; item != NULL;
+              item = item->next, i++ )
+            if ( !affinity_parse(item->data, &loop_cpus[i]) ) {
+                fnc_log(FNC_LOG_ERR, "[affinity] invalid CPU list '%s'",
+                        (const char*)item->data);
+                g_free(loop_cpus);
+                loop_cpus = NULL;
+                loop_cpus_count = 0;
+                break;
+            }
+    }
+
+    if ( feng_srv.demux_threads_cpus != NULL &&
+         !(demux_pinned = affinity_parse(feng_srv.demux_threads_cpus,
+                                         &demux_cpus)) )
+        fnc_log(FNC_LOG_ERR, "[affinity] invalid CPU list '%s'",
+                feng_srv.demux_threads_cpus);
+
+    fnc_log(FNC_LOG_DEBUG, "[affinity] %d NUMA nodes, %u client loop CPU sets",
+            nodes_count, loop_cpus_count);
+}
+
+/**
+ * @brief Get the node a client loop is pinned to
+ *
+ * @param index The index of the loop
+ *
+ * @return The node, or -1 if the loop is not pinned or the nodes are
+ *         not known.
+ */
+int affinity_loop_node(guint index)
+{
+    if ( loop_cpus_count == 0 )
+        return -1;
+
+    return affinity_node_of(&loop_cpus[index % loop_cpus_count]);
+}
+
+/**
+ * @brief Pin the calling client loop thread to its CPU set
+ *
+ * @param index The index of the loop; the CPU sets are used in turn
+ *              when there are more loops than sets.
+ */
+void affinity_pin_loop(guint index)
+{
+    if ( loop_cpus_count != 0 )
+        affinity_pin(&loop_cpus[index % loop_cpus_count], "client loop");
+}
+
+/**
+ * @brief Pin the calling demuxer thread to its CPU set
+ */
+void affinity_pin_demux()
+{
+    if ( demux_pinned )
+        affinity_pin(&demux_cpus, "demuxer thread");
+}
+
+/**
+ * @brief Count a consumer of a track joining or leaving its node
+ *
+ * @param tr The track consumed
+ * @param node The node of the loop serving the consumer, or -1
+ * @param delta +1 for a new consumer, -1 for one going away
+ */
+void affinity_track_consumer(Track *tr, int node, int delta)
+{
+    if ( node >= 0 && node < AFFINITY_MAX_NODES )
+        g_atomic_int_add(&tr->node_consumers[node], delta);
+}
+
+/**
+ * @brief Move the calling ingest thread to its consumers' node
+ *
+ * @param tr The live track the calling thread reads
+ *
+ * Called for each packet read; the placement is only checked once
+ * every @ref AFFINITY_FOLLOW_INTERVAL seconds.
+ */
+void affinity_follow(Track *tr)
+{
+    const double now = ev_time();
+    int node, best = -1, best_count = 0;
+
+    if ( !feng_srv.live_ingest_follow || nodes_count < 2 ||
+         now < tr->ingest_checked + AFFINITY_FOLLOW_INTERVAL )
+        return;
+
+    tr->ingest_checked = now;
+
+    for ( node = 0; node < nodes_count; node++ ) {
+        const int count = g_atomic_int_get(&tr->node_consumers[node]);
+
+        if ( count > best_count ) {
+            best = node;
+            best_count = count;
+        }
+    }
+
+    if ( best < 0 || best == tr->ingest_node )
+        return;
+
+    fnc_log(FNC_LOG_DEBUG, "[affinity] moving the ingest of %s to node %d",
+            tr->name, best);
+
+    affinity_pin(&node_cpus[best], "ingest thread");
+    tr->ingest_node = best;
+}
+
+#else
+
+void affinity_init()
+{
+    if ( feng_srv.client_loops_cpus != NULL ||
+         feng_srv.demux_threads_cpus != NULL ||
+         feng_srv.live_ingest_follow )
+        fnc_log(FNC_LOG_WARN,
+                "[affinity] CPU affinity not supported, the threads are not pinned");
+}
+
+int affinity_loop_node(ATTR_UNUSED guint index)
+{
+    return -1;
+}
+
+void affinity_pin_loop(ATTR_UNUSED guint index)
+{
+}
+
+void affinity_pin_demux()
+{
+}
+
+void affinity_track_consumer(ATTR_UNUSED Track *tr, ATTR_UNUSED int node,
+                             ATTR_UNUSED int delta)
+{
+}
+
+void affinity_follow(ATTR_UNUSED Track *tr)
+{
+}
+
+#endif
+
+/**
+ * @}
+ */
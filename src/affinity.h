@@ -0,0 +1,57 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+
+/**
+ * @file affinity.h
+ * CPU and NUMA placement of the threads, see @ref affinity
+ */
+
+#ifndef FN_AFFINITY_H
+#define FN_AFFINITY_H
+
+#include <config.h>
+
+#include <glib.h>
+
+/**
+ * @addtogroup affinity
+ * @{
+ */
+
+/** Most NUMA nodes the consumers of a track are counted on */
+#define AFFINITY_MAX_NODES 8
+
+struct Track;
+
+void affinity_init(void);
+int affinity_loop_node(guint index);
+void affinity_pin_loop(guint index);
+void affinity_pin_demux(void);
+void affinity_track_consumer(struct Track *tr, int node, int delta);
+void affinity_follow(struct Track *tr);
+
+/**
+ * @}
+ */
+
+#endif // FN_AFFINITY_H
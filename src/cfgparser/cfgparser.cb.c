@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <glib.h>
 
 #include "cfgparser.h"
@@ -33,6 +34,7 @@
 #include "feng.h"
 #include "fnc_log.h"
 #include "network/rtp.h"
+#include "media/media.h"
 
 static const char *cfg_file_name;
 
@@ -81,7 +83,49 @@ bool cfg_options_callback(cfg_options_t *section)
         section->groupname = cfg_default_string("feng");
 
     if ( section->buffered_frames == 0 )
-        section->buffered_frames = 16;
+        section->buffered_frames = BUFFERED_FRAMES_DEFAULT;
+
+    /* One event loop per online CPU; if we cannot tell how many
+       there are, fall back to a single one. */
+    if ( section->client_loops == 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        section->client_loops = cpus > 0 ? cpus : 1;
+    }
+
+    /* Same for the threads reading the stored resources */
+    if ( section->demux_threads == 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        section->demux_threads = cpus > 0 ? cpus : 1;
+    }
+
+    if ( section->readahead_window == 0 )
+        section->readahead_window = 1024*1024;
+
+    if ( section->prewarm_threads == 0 )
+        section->prewarm_threads = 2;
+
+    if ( section->cluster_threshold == 0 )
+        section->cluster_threshold = 80;
+
+    if ( section->relay_linger == 0 )
+        section->relay_linger = 30;
+
+    if ( section->rtp_burst == 0 )
+        section->rtp_burst = 32;
+
+    if ( section->udp_pacing != NULL &&
+         strcmp(section->udp_pacing, "timer") != 0 &&
+         strcmp(section->udp_pacing, "txtime") != 0 &&
+         strcmp(section->udp_pacing, "rate") != 0 ) {
+        yyerror("udp-pacing has to be one of timer, txtime or rate");
+        return false;
+    }
+
+    if ( section->udp_pacing_lookahead == 0 )
+        section->udp_pacing_lookahead = 40;
+
+    if ( section->output_queue_limit == 0 )
+        section->output_queue_limit = 1024*1024;
 
     if ( section->log_level == 0 )
         section->log_level = FNC_LOG_WARN;
@@ -145,9 +189,56 @@ bool cfg_vhost_callback(cfg_vhost_t *section)
     if ( section->access_log == NULL )
         section->access_log = cfg_default_string("stderr");
 
+    if ( section->access_log_buffer == 0 )
+        section->access_log_buffer = 64*1024;
+
+    if ( section->access_log_flush == 0 )
+        section->access_log_flush = 1000;
+
     if ( section->max_connections == 0 )
         section->max_connections = FENG_MAX_SESSION_DEFAULT;
 
+    if ( section->mtu == 0 )
+        section->mtu = DEFAULT_MTU;
+
+    if ( section->interleaved_mtu == 0 )
+        section->interleaved_mtu = section->mtu;
+
+    if ( section->video_buffer_low == 0 )
+        section->video_buffer_low = DEFAULT_BUFFER_LOW;
+    if ( section->video_buffer_high == 0 )
+        section->video_buffer_high = DEFAULT_BUFFER_HIGH;
+    if ( section->audio_buffer_low == 0 )
+        section->audio_buffer_low = DEFAULT_BUFFER_LOW;
+    if ( section->audio_buffer_high == 0 )
+        section->audio_buffer_high = DEFAULT_BUFFER_HIGH;
+
+    if ( section->video_buffer_low > section->video_buffer_high ||
+         section->audio_buffer_low > section->audio_buffer_high ) {
+        yyerror("buffer-low has to be smaller than buffer-high");
+        return false;
+    }
+
+    if ( section->sctp_rtp_lifetime == 0 )
+        section->sctp_rtp_lifetime = 2000;
+
+    if ( section->fast_start_speed == 0 )
+        section->fast_start_speed = 4;
+
+    if ( section->loss_thinning_threshold > 100 ) {
+        yyerror("loss-thinning-threshold is a percentage");
+        return false;
+    }
+
+    /* the payload has to fit a single RTP packet even on TCP, where
+       the framing has a 16-bit length */
+    if ( section->mtu < MIN_MTU || section->mtu > MAX_MTU ||
+         section->interleaved_mtu < MIN_MTU || section->interleaved_mtu > MAX_MTU ) {
+        yyerror("mtu and interleaved-mtu have to be between %d and %d",
+                MIN_MTU, MAX_MTU);
+        return false;
+    }
+
     configured_vhosts = g_list_append(configured_vhosts,
                                       g_slice_dup(cfg_vhost_t, section));
 
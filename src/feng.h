@@ -42,6 +42,12 @@ extern const char feng_signature[];
 typedef struct feng_socket_listener {
     int fd;
     ev_io io;
+
+    /**
+     * Index of the client loop accepting from the socket, or -1 if
+     * it's accepted by the main loop.
+     */
+    int worker;
 } feng_socket_listener;
 
 extern cfg_options_t feng_srv;
@@ -61,6 +67,13 @@ struct RFC822_Response;
 
 void accesslog_init(gpointer socket_p, gpointer user_data);
 void accesslog_log(struct RTSP_Client *client, struct RFC822_Response *response);
+void accesslog_cleanup(gpointer vhost_p, gpointer user_data);
+void accesslog_reopen_all(void);
+
+void prewarm_init(void);
+guint prewarm_queue(cfg_vhost_t *vhost, const char *pattern);
+void feng_send_prewarm(struct RTSP_Client *rtsp);
+void prewarm_cleanup(void);
 
 #if HAVE_JSON
 void stats_init();
@@ -23,6 +23,7 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <stdarg.h>
@@ -42,27 +43,29 @@
 
 static FILE *error_log;
 
+unsigned int fnc_log_level = FNC_LOG_WARN;
+
+static const char *const log_prefix[] = {
+    [FNC_LOG_FATAL] = "[fatal error] ",
+    [FNC_LOG_ERR] = "[error] ",
+    [FNC_LOG_WARN] = "[warning] ",
+    [FNC_LOG_INFO] = "",
+    [FNC_LOG_CLIENT] = "[client] ",
+    [FNC_LOG_DEBUG] = "[debug] ",
+    [FNC_LOG_VERBOSE] = "[verbose debug] "
+};
+
 /**
  * Log to file descriptor
  * @brief print on standard error or file
  */
 static void fnc_filelog(unsigned int level, const char *fmt, va_list args)
 {
-    static const char *const log_prefix[] = {
-        [FNC_LOG_FATAL] = "[fatal error] ",
-        [FNC_LOG_ERR] = "[error] ",
-        [FNC_LOG_WARN] = "[warning] ",
-        [FNC_LOG_INFO] = "",
-        [FNC_LOG_CLIENT] = "[client] ",
-        [FNC_LOG_DEBUG] = "[debug] ",
-        [FNC_LOG_VERBOSE] = "[verbose debug] "
-    };
-
     time_t now;
     char date[MAX_LEN_DATE];
     const struct tm *tm;
 
-    if (level > feng_srv.log_level) return;
+    if (level > fnc_log_level) return;
 
     time(&now);
     tm = localtime(&now);
@@ -92,12 +95,217 @@ static void fnc_syslog(unsigned int level, const char *fmt, va_list args)
         [FNC_LOG_VERBOSE] = LOG_DEBUG
     };
 
-    if (level > feng_srv.log_level) return;
+    if (level > fnc_log_level) return;
 
     vsyslog(fnc_to_syslog_level[level], fmt, args);
 }
 #endif
 
+/**
+ * @defgroup async_log Asynchronous logging
+ *
+ * @brief Log to file without blocking the threads that log
+ *
+ * When @ref cfg_options_t::log_async is set, the messages logged to
+ * file or standard error are formatted by the logging thread into a
+ * ring of its own, and written by a single writer thread, which only
+ * formats the date once per second and flushes the file once per
+ * batch. Each ring has a single producer (the thread) and a single
+ * consumer (the writer), so no lock is taken to log; when a ring is
+ * full, the messages are dropped and counted.
+ *
+ * Fatal errors are written right away, after what is queued, since
+ * the process is usually about to terminate.
+ *
+ * @{
+ */
+
+#define LOG_RING_SLOTS 128
+#define LOG_MESSAGE_SIZE 512
+
+/** How long the writer sleeps when there's nothing to write, in µs */
+#define LOG_WRITER_IDLE 10000
+
+typedef struct {
+    unsigned int level;
+    time_t time;
+    char message[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+typedef struct {
+    /** Next slot to write; only moved by the producer */
+    guint head;
+    /** Next slot to read; only moved by the writer */
+    guint tail;
+    /** Messages dropped because the ring was full */
+    guint dropped;
+    /** The thread is gone, the writer frees the ring once empty */
+    gint orphaned;
+    LogEntry entries[LOG_RING_SLOTS];
+} LogRing;
+
+static GStaticPrivate log_ring_key = G_STATIC_PRIVATE_INIT;
+
+/** All the rings, only locked to add or remove one */
+static GPtrArray *log_rings;
+static GStaticMutex log_rings_lock = G_STATIC_MUTEX_INIT;
+
+static GThread *log_writer;
+static gint log_writer_stop;
+
+static void log_ring_release(gpointer ring)
+{
+    g_atomic_int_set(&((LogRing*)ring)->orphaned, 1);
+}
+
+static LogRing *log_ring_get(void)
+{
+    LogRing *ring = g_static_private_get(&log_ring_key);
+
+    if ( ring == NULL ) {
+        ring = g_new0(LogRing, 1);
+
+        g_static_mutex_lock(&log_rings_lock);
+        g_ptr_array_add(log_rings, ring);
+        g_static_mutex_unlock(&log_rings_lock);
+
+        g_static_private_set(&log_ring_key, ring, log_ring_release);
+    }
+
+    return ring;
+}
+
+/**
+ * @brief Write the messages queued in a ring
+ *
+ * @return The number of messages written
+ *
+ * @note Only called by the writer, or with the writer stopped.
+ */
+static guint log_ring_drain(LogRing *ring, char *date, time_t *date_time)
+{
+    const guint head = g_atomic_int_get(&ring->head);
+    const guint dropped = g_atomic_int_get(&ring->dropped);
+    guint tail = ring->tail;
+    const guint count = head - tail;
+
+    /* read the entries only after reading head */
+    __sync_synchronize();
+
+    for ( ; tail != head; tail++ ) {
+        const LogEntry *entry = &ring->entries[tail % LOG_RING_SLOTS];
+
+        if ( entry->time != *date_time ) {
+            *date_time = entry->time;
+            strftime(date, MAX_LEN_DATE, ERR_FORMAT, localtime(date_time));
+        }
+
+        fprintf(error_log, "[%s] %s%s\n", date,
+                log_prefix[entry->level], entry->message);
+    }
+
+    /* done with the entries before giving them back */
+    __sync_synchronize();
+    g_atomic_int_set(&ring->tail, tail);
+
+    if ( dropped != 0 ) {
+        __sync_sub_and_fetch(&ring->dropped, dropped);
+        fprintf(error_log, "[%s] %s%u log messages dropped\n", date,
+                log_prefix[FNC_LOG_WARN], dropped);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Write the messages of all the rings
+ *
+ * @return The number of messages written
+ */
+static guint log_drain(void)
+{
+    static char date[MAX_LEN_DATE];
+    static time_t date_time;
+    guint written = 0, i;
+
+    g_static_mutex_lock(&log_rings_lock);
+
+    for ( i = 0; i < log_rings->len; ) {
+        LogRing *ring = g_ptr_array_index(log_rings, i);
+        const gboolean orphaned = g_atomic_int_get(&ring->orphaned);
+
+        written += log_ring_drain(ring, date, &date_time);
+
+        if ( orphaned ) {
+            g_ptr_array_remove_index_fast(log_rings, i);
+            g_free(ring);
+        } else
+            i++;
+    }
+
+    g_static_mutex_unlock(&log_rings_lock);
+
+    if ( written > 0 )
+        fflush(error_log);
+
+    return written;
+}
+
+static gpointer log_writer_thread(ATTR_UNUSED gpointer unused)
+{
+    while ( !g_atomic_int_get(&log_writer_stop) )
+        if ( log_drain() == 0 )
+            g_usleep(LOG_WRITER_IDLE);
+
+    return NULL;
+}
+
+/**
+ * @brief Stop the writer, writing what's left
+ */
+static void log_writer_finish(void)
+{
+    g_atomic_int_set(&log_writer_stop, 1);
+    g_thread_join(log_writer);
+    log_drain();
+}
+
+static void fnc_asynclog(unsigned int level, const char *fmt, va_list args)
+{
+    LogRing *ring;
+    LogEntry *entry;
+    guint head;
+
+    if (level > fnc_log_level) return;
+
+    if ( level == FNC_LOG_FATAL ) {
+        log_drain();
+        fnc_filelog(level, fmt, args);
+        return;
+    }
+
+    ring = log_ring_get();
+    head = ring->head;
+
+    if ( head - g_atomic_int_get(&ring->tail) >= LOG_RING_SLOTS ) {
+        __sync_add_and_fetch(&ring->dropped, 1);
+        return;
+    }
+
+    entry = &ring->entries[head % LOG_RING_SLOTS];
+    entry->level = level;
+    entry->time = time(NULL);
+    g_vsnprintf(entry->message, LOG_MESSAGE_SIZE, fmt, args);
+
+    /* publish the entry only once it's complete */
+    __sync_synchronize();
+    g_atomic_int_set(&ring->head, head + 1);
+}
+
+/**
+ * @}
+ */
+
 static void (*fnc_vlog)(unsigned int, const char*, va_list) = fnc_filelog;
 
 /**
@@ -105,6 +313,8 @@ static void (*fnc_vlog)(unsigned int, const char*, va_list) = fnc_filelog;
  **/
 void fnc_log_init(const char *progname)
 {
+    fnc_log_level = feng_srv.log_level;
+
     /* If the error_log is set to the constant "syslog" use syslog as
        output. */
     if ( strcmp(feng_srv.error_log, "syslog") == 0 ) {
@@ -125,6 +335,26 @@ void fnc_log_init(const char *progname)
 
         error_log = new_error_log;
     }
+
+    if ( feng_srv.log_async && fnc_vlog == fnc_filelog ) {
+        GError *err = NULL;
+
+        if ( error_log == NULL )
+            error_log = stderr;
+
+        log_rings = g_ptr_array_new();
+
+        if ( (log_writer = g_thread_create(log_writer_thread, NULL,
+                                           true, &err)) == NULL ) {
+            fnc_log(FNC_LOG_ERR, "Unable to start the log writer: %s",
+                    err->message);
+            g_error_free(err);
+            return;
+        }
+
+        fnc_vlog = fnc_asynclog;
+        atexit(log_writer_finish);
+    }
 }
 
 /**
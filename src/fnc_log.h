@@ -45,9 +45,26 @@ enum {
 
 void fnc_log(unsigned int level, const char *fmt, ...);
 
+/**
+ * @brief Most verbose level logged, copied from the configuration by
+ *        @ref fnc_log_init
+ */
+extern unsigned int fnc_log_level;
+
+/* The level is checked before calling, so that the disabled levels
+ * cost a single branch, without evaluating their arguments. */
 #ifdef TRACE
-#define fnc_log(level, fmt, string...)                              \
-    fnc_log(level, "[%s - %d]" fmt, __FILE__, __LINE__ , ## string)
+#define fnc_log(level, fmt, string...)                                  \
+    do {                                                                \
+        if ( __builtin_expect((level) <= fnc_log_level, 0) )            \
+            fnc_log(level, "[%s - %d]" fmt, __FILE__, __LINE__ , ## string); \
+    } while(0)
+#else
+#define fnc_log(level, fmt, string...)                                  \
+    do {                                                                \
+        if ( __builtin_expect((level) <= fnc_log_level, 0) )            \
+            fnc_log(level, fmt , ## string);                            \
+    } while(0)
 #endif
 
 void _fnc_perror(int errno_val, const char *function, const char *comment);
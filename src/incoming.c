@@ -45,19 +45,32 @@
 # endif
 #endif
 
-#ifdef CLEANUP_DESTRUCTOR
 /**
- * @brief List of created @ref feng_socket_listener objects to be cleaned up
+ * @brief List of created @ref feng_socket_listener objects
  *
  * This is an array of feng_socket_listener objects allocated
  * with the g_slice_new() function (which this need to be freed with
  * g_slice_free()).
  *
- * @note Part of the cleanup destructors code, not compiled in
- *       production use.
+ * It's used to attach the per-worker listeners to their loops (see
+ * @ref feng_listeners_each) and to clean up at exit.
  */
 static GSList *listeners;
 
+/**
+ * @brief Execute a function for each of the listeners
+ *
+ * @param func The function to execute
+ * @param user_data The value to pass as second parameter to each
+ *                  call.
+ */
+void feng_listeners_each(GFunc func, gpointer user_data)
+{
+    g_slist_foreach(listeners, func, user_data);
+}
+
+#ifdef CLEANUP_DESTRUCTOR
+
 /**
  * @brief Free socket configurations in the @ref feng_srv::sockets array
  *
@@ -107,10 +120,14 @@ static void CLEANUP_DESTRUCTOR feng_sockets_cleanup()
  *
  * @param ai Address to bind the socket to
  * @param s The specific vhost configuration to bind for
+ * @param ipproto The protocol to bind for
+ * @param worker Index of the worker loop accepting from the socket,
+ *               or -1 to accept from the main loop.
  */
 static gboolean feng_bind_addr(struct addrinfo *ai,
                                cfg_socket_t *s,
-                               int ipproto)
+                               int ipproto,
+                               int worker)
 {
     int sock;
     static const int on = 1;
@@ -154,6 +171,15 @@ static gboolean feng_bind_addr(struct addrinfo *ai,
         goto open_error;
     }
 
+#ifdef SO_REUSEPORT
+    if ( worker >= 0 &&
+         setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                    &on, sizeof(on)) < 0 ) {
+        fnc_perror("setsockopt(SO_REUSEPORT)");
+        goto open_error;
+    }
+#endif
+
 #if defined(IPV6_V6ONLY) && defined(IPPROTO_IPV6)
     if (ai->ai_addr->sa_family == AF_INET6) {
         if ( setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
@@ -176,15 +202,18 @@ static gboolean feng_bind_addr(struct addrinfo *ai,
 
     listener = g_slice_new0(feng_socket_listener);
     listener->fd = sock;
+    listener->worker = worker;
     io = &listener->io;
 
     io->data = listener;
     ev_io_init(io, rtsp_client_incoming_cb, sock, EV_READ);
-    ev_io_start(feng_loop, io);
 
-#ifdef CLEANUP_DESTRUCTOR
+    /* per-worker listeners are started by clients_init() on their
+       own loop */
+    if ( worker < 0 )
+        ev_io_start(feng_loop, io);
+
     listeners = g_slist_prepend(listeners, listener);
-#endif
 
     return true;
 
@@ -236,14 +265,29 @@ void feng_bind_socket(gpointer socket_p, ATTR_UNUSED gpointer user_data)
         }
     }
 
+#ifndef SO_REUSEPORT
+    if ( socket->reuseport ) {
+        fnc_log(FNC_LOG_WARN, "SO_REUSEPORT not supported, accepting from the main loop");
+        socket->reuseport = false;
+    }
+#endif
+
     it = res;
     do {
-        if ( !feng_bind_addr(it, socket, IPPROTO_TCP) )
+        if ( socket->reuseport ) {
+            /* one listener per worker loop, the kernel will spread
+               the incoming connections among them */
+            guint i;
+
+            for ( i = 0; i < feng_srv.client_loops; i++ )
+                if ( !feng_bind_addr(it, socket, IPPROTO_TCP, i) )
+                    goto error;
+        } else if ( !feng_bind_addr(it, socket, IPPROTO_TCP, -1) )
             goto error;
 #if ENABLE_SCTP
         /* Only enable SCTP following TCP, otherwise Linux can become
            messed up and tries to feed TCP connections via SCTP */
-        if ( socket->sctp && !feng_bind_addr(it, socket, IPPROTO_SCTP) )
+        if ( socket->sctp && !feng_bind_addr(it, socket, IPPROTO_SCTP, -1) )
             goto error;
 #endif
     } while ( (it = it->ai_next) != NULL );
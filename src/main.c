@@ -96,6 +96,9 @@ static void vhost_cleanup(gpointer vhost_p, ATTR_UNUSED gpointer user_data)
     g_list_foreach(vhost->aliases, feng_glist_free, NULL);
     g_list_free(vhost->aliases);
 
+    g_list_foreach(vhost->mp2t_paths, feng_glist_free, NULL);
+    g_list_free(vhost->mp2t_paths);
+
     g_slice_free(cfg_vhost_t, vhost);
 }
 
@@ -152,6 +155,27 @@ static void sigint_cb (struct ev_loop *loop,
     ev_unloop (loop, EVUNLOOP_ALL);
 }
 
+/**
+ *  Handler to reopen the logs after they are rotated
+ */
+static void sighup_cb (ATTR_UNUSED struct ev_loop *loop,
+                       ATTR_UNUSED ev_signal * w,
+                       ATTR_UNUSED int revents)
+{
+    accesslog_reopen_all();
+}
+
+/**
+ *  Handler to start or stop redirecting the new sessions to the
+ *  cluster peers
+ */
+static void sigusr2_cb (ATTR_UNUSED struct ev_loop *loop,
+                        ATTR_UNUSED ev_signal * w,
+                        ATTR_UNUSED int revents)
+{
+    rtsp_cluster_toggle_drain();
+}
+
 /**
  * Drop privileges to the configured user
  *
@@ -197,11 +221,15 @@ static void feng_drop_privs()
 
 /**
  * catch TERM and INT signals
+ * catch HUP signal to reopen the logs
+ * catch USR2 signal to drain the sessions to the cluster
  * block PIPE signal
  */
 
 static ev_signal signal_watcher_int;
 static ev_signal signal_watcher_term;
+static ev_signal signal_watcher_hup;
+static ev_signal signal_watcher_usr2;
 
 static void feng_handle_signals()
 {
@@ -212,6 +240,12 @@ static void feng_handle_signals()
     sig = &signal_watcher_term;
     ev_signal_init (sig, sigint_cb, SIGTERM);
     ev_signal_start (feng_loop, sig);
+    sig = &signal_watcher_hup;
+    ev_signal_init (sig, sighup_cb, SIGHUP);
+    ev_signal_start (feng_loop, sig);
+    sig = &signal_watcher_usr2;
+    ev_signal_init (sig, sigusr2_cb, SIGUSR2);
+    ev_signal_start (feng_loop, sig);
 
     /* block PIPE signal */
     sigemptyset(&block_set);
@@ -308,17 +342,35 @@ int main(int argc, char **argv)
 
     stats_init();
 
+    affinity_init();
+
+    r_init();
+
     feng_drop_privs();
 
     http_tunnel_initialise();
 
     clients_init();
 
+    rtsp_resume_init();
+
+    rtsp_cluster_init();
+
+    prewarm_init();
+
     ev_loop (feng_loop, 0);
 
+    prewarm_cleanup();
+
     /* This is explicit to send disconnections! */
     clients_cleanup();
 
+    rtsp_resume_cleanup();
+
+    rtsp_cluster_cleanup();
+
+    accesslog_cleanup(feng_default_vhost, NULL);
+
 #ifdef CLEANUP_DESTRUCTOR
     ev_loop_destroy(feng_loop);
 #endif
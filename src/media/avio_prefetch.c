@@ -0,0 +1,510 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+
+#include "feng.h"
+#include "fnc_log.h"
+
+#include "media/media.h"
+
+#include <libavformat/avformat.h>
+
+/**
+ * @defgroup avio_prefetch Readahead I/O for stored files
+ * @ingroup resources
+ *
+ * @brief AVIOContext reading the stored files ahead of the demuxer
+ *
+ * Rather than letting libavformat issue a blocking read(2) each time
+ * its buffer is empty, the stored files are read through a custom
+ * AVIOContext that keeps a window of @ref PREFETCH_BLOCK_SIZE bytes
+ * blocks (see @ref cfg_options_t::readahead_window) in flight past
+ * the current position.
+ *
+ * The reads are submitted to io_uring when available, and otherwise
+ * run by a small pool of threads shared by all the resources; either
+ * way the demuxer only blocks when it catches up with the disk, and
+ * @ref avio_prefetch_wait lets the demuxing thread do that before
+ * taking @ref Resource::lock.
+ *
+ * With @ref cfg_options_t::mmap_io the file is mapped instead, and
+ * the reads are served straight from the mapping, saving a syscall
+ * for each buffer of the demuxer on files already in the page cache;
+ * the window is then only requested to the kernel with
+ * madvise(MADV_WILLNEED) as the position moves.
+ *
+ * @{
+ */
+
+/** Size of each read submitted */
+#define PREFETCH_BLOCK_SIZE (64*1024)
+
+/** Size of the buffer of the AVIOContext itself */
+#define PREFETCH_AVIO_BUFFER (32*1024)
+
+typedef enum {
+    BLOCK_EMPTY,
+    BLOCK_PENDING,
+    BLOCK_READY
+} PrefetchBlockState;
+
+typedef struct {
+    struct AVIOPrefetch *parent;
+    /** Offset of the block in the file, a multiple of the block size */
+    int64_t offset;
+    /** Bytes read, or negative errno */
+    ssize_t len;
+    PrefetchBlockState state;
+    uint8_t *data;
+} PrefetchBlock;
+
+struct AVIOPrefetch {
+    int fd;
+    int64_t size;
+    int64_t pos;
+
+    unsigned int nblocks;
+    PrefetchBlock *blocks;
+
+    /** The mapped file, if read through mmap(2) */
+    uint8_t *map;
+    /** End of the range last given to madvise() */
+    int64_t advised;
+
+    /** Protects all the fields past this point, and the blocks */
+    GMutex *lock;
+    /** Signalled by the pool threads when a block is read */
+    GCond *done;
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    gboolean uring;
+#endif
+
+    AVIOContext *avio;
+};
+
+/** Threads reading for the resources that can't use io_uring */
+static GThreadPool *prefetch_pool;
+
+static void prefetch_pool_read(gpointer data, ATTR_UNUSED gpointer user_data)
+{
+    PrefetchBlock *b = data;
+    AVIOPrefetch *p = b->parent;
+    ssize_t len = pread(p->fd, b->data, PREFETCH_BLOCK_SIZE, b->offset);
+
+    g_mutex_lock(p->lock);
+    b->len = len < 0 ? -errno : len;
+    b->state = BLOCK_READY;
+    g_cond_broadcast(p->done);
+    g_mutex_unlock(p->lock);
+}
+
+/**
+ * @brief Submit the read of a block
+ *
+ * @note Has to be called with @ref AVIOPrefetch::lock held.
+ */
+static void prefetch_submit(AVIOPrefetch *p, PrefetchBlock *b, int64_t offset)
+{
+    b->offset = offset;
+    b->state = BLOCK_PENDING;
+
+#ifdef HAVE_LIBURING
+    if ( p->uring ) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&p->ring);
+
+        /* never more in flight than the ring size */
+        g_assert(sqe != NULL);
+
+        io_uring_prep_read(sqe, p->fd, b->data, PREFETCH_BLOCK_SIZE, offset);
+        io_uring_sqe_set_data(sqe, b);
+        return;
+    }
+#endif
+
+    g_thread_pool_push(prefetch_pool, b, NULL);
+}
+
+/**
+ * @brief Collect the completed reads
+ *
+ * @param wait Block until at least one read completes
+ *
+ * @note Has to be called with @ref AVIOPrefetch::lock held.
+ */
+static void prefetch_reap(AVIOPrefetch *p, gboolean wait)
+{
+#ifdef HAVE_LIBURING
+    if ( p->uring ) {
+        struct io_uring_cqe *cqe;
+        int ret = wait ?
+            io_uring_wait_cqe(&p->ring, &cqe) :
+            io_uring_peek_cqe(&p->ring, &cqe);
+
+        while ( ret == 0 ) {
+            PrefetchBlock *b = io_uring_cqe_get_data(cqe);
+
+            b->len = cqe->res;
+            b->state = BLOCK_READY;
+            io_uring_cqe_seen(&p->ring, cqe);
+
+            ret = io_uring_peek_cqe(&p->ring, &cqe);
+        }
+        return;
+    }
+#endif
+
+    if ( wait )
+        g_cond_wait(p->done, p->lock);
+}
+
+/**
+ * @brief Fill the window past the current position
+ *
+ * Blocks already holding a part of the window are kept, so that
+ * short seeks back, as done while probing, don't read again; blocks
+ * still in flight for an older window are left alone until they
+ * complete.
+ *
+ * @note Has to be called with @ref AVIOPrefetch::lock held.
+ */
+static void prefetch_fill(AVIOPrefetch *p)
+{
+    const int64_t first = p->pos / PREFETCH_BLOCK_SIZE;
+    unsigned int i;
+
+    prefetch_reap(p, false);
+
+    for ( i = 0; i < p->nblocks; i++ ) {
+        const int64_t offset = (first + i) * PREFETCH_BLOCK_SIZE;
+        PrefetchBlock *b = &p->blocks[(first + i) % p->nblocks];
+
+        if ( offset >= p->size )
+            break;
+
+        if ( b->state == BLOCK_PENDING ||
+             ( b->state == BLOCK_READY && b->offset == offset ) )
+            continue;
+
+        prefetch_submit(p, b, offset);
+    }
+
+#ifdef HAVE_LIBURING
+    if ( p->uring )
+        io_uring_submit(&p->ring);
+#endif
+}
+
+/**
+ * @brief Ask the kernel to read the window past the current position
+ *
+ * Only done once half the previous window is consumed, or after
+ * seeking out of it, so that the syscall stays rare.
+ *
+ * @note Has to be called with @ref AVIOPrefetch::lock held.
+ */
+static void prefetch_advise(AVIOPrefetch *p)
+{
+    const int64_t window = (int64_t)p->nblocks * PREFETCH_BLOCK_SIZE;
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start;
+
+    if ( p->pos >= p->advised - window &&
+         p->pos + window / 2 <= p->advised )
+        return;
+
+    start = p->pos - p->pos % page;
+    p->advised = MIN(p->pos + window, p->size);
+
+    if ( start < p->advised )
+        madvise(p->map + start, p->advised - start, MADV_WILLNEED);
+}
+
+/**
+ * @brief Wait for the block holding the current position
+ *
+ * @return The block, or NULL at the end of the file.
+ *
+ * @note Has to be called with @ref AVIOPrefetch::lock held.
+ */
+static PrefetchBlock *prefetch_current(AVIOPrefetch *p)
+{
+    const int64_t first = p->pos / PREFETCH_BLOCK_SIZE;
+    PrefetchBlock *b = &p->blocks[first % p->nblocks];
+
+    if ( p->pos >= p->size )
+        return NULL;
+
+    prefetch_fill(p);
+
+    while ( b->state != BLOCK_READY ||
+            b->offset != first * PREFETCH_BLOCK_SIZE ) {
+        prefetch_reap(p, true);
+        prefetch_fill(p);
+    }
+
+    return b;
+}
+
+static int prefetch_read(void *opaque, uint8_t *buf, int size)
+{
+    AVIOPrefetch *p = opaque;
+    PrefetchBlock *b;
+    int ret;
+
+    g_mutex_lock(p->lock);
+
+    if ( p->map != NULL ) {
+        ret = p->pos < p->size ? MIN(size, p->size - p->pos) : AVERROR_EOF;
+        if ( ret > 0 ) {
+            memcpy(buf, p->map + p->pos, ret);
+            p->pos += ret;
+            prefetch_advise(p);
+        }
+    } else if ( (b = prefetch_current(p)) == NULL ) {
+        ret = AVERROR_EOF;
+    } else if ( b->len < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[avio] read error: %s", strerror(-b->len));
+        b->state = BLOCK_EMPTY;
+        ret = AVERROR(-b->len);
+    } else if ( b->offset + b->len <= p->pos ) {
+        /* the file was truncated after we opened it */
+        ret = AVERROR_EOF;
+    } else {
+        ret = MIN(size, b->offset + b->len - p->pos);
+        memcpy(buf, b->data + (p->pos - b->offset), ret);
+        p->pos += ret;
+        prefetch_fill(p);
+    }
+
+    g_mutex_unlock(p->lock);
+
+    return ret;
+}
+
+static int64_t prefetch_seek(void *opaque, int64_t offset, int whence)
+{
+    AVIOPrefetch *p = opaque;
+    int64_t ret;
+
+    g_mutex_lock(p->lock);
+
+    switch ( whence & ~AVSEEK_FORCE ) {
+    case AVSEEK_SIZE:
+        g_mutex_unlock(p->lock);
+        return p->size;
+    case SEEK_SET:
+        ret = offset;
+        break;
+    case SEEK_CUR:
+        ret = p->pos + offset;
+        break;
+    case SEEK_END:
+        ret = p->size + offset;
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+
+    if ( ret < 0 ) {
+        g_mutex_unlock(p->lock);
+        return AVERROR(EINVAL);
+    }
+
+    p->pos = ret;
+    if ( p->map != NULL )
+        prefetch_advise(p);
+    else
+        prefetch_fill(p);
+
+    g_mutex_unlock(p->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Open a file for reading through the readahead window
+ *
+ * @param path The path of the file
+ * @param window The amount of bytes to keep in flight
+ * @param use_mmap Map the file rather than reading it; if the map
+ *                 fails the file is read as usual.
+ *
+ * @return A new prefetcher, or NULL if the file cannot be opened, in
+ *         which case libavformat will open it by itself.
+ */
+AVIOPrefetch *avio_prefetch_open(const char *path, size_t window,
+                                 gboolean use_mmap)
+{
+    static gsize pool_initialized = 0;
+    AVIOPrefetch *p;
+    struct stat st;
+    unsigned int i;
+    int fd;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 ) {
+        fnc_perror("open");
+        return NULL;
+    }
+
+    if ( fstat(fd, &st) < 0 ) {
+        fnc_perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    p = g_slice_new0(AVIOPrefetch);
+    p->fd = fd;
+    p->size = st.st_size;
+    p->nblocks = MAX(window / PREFETCH_BLOCK_SIZE, 2);
+    p->lock = g_mutex_new();
+    p->done = g_cond_new();
+
+    p->avio = avio_alloc_context(av_malloc(PREFETCH_AVIO_BUFFER),
+                                 PREFETCH_AVIO_BUFFER,
+                                 0, p,
+                                 prefetch_read, NULL, prefetch_seek);
+
+    if ( use_mmap && p->size > 0 && (uint64_t)p->size <= SIZE_MAX ) {
+        void *map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if ( map != MAP_FAILED ) {
+            p->map = map;
+            madvise(p->map, p->size, MADV_SEQUENTIAL);
+            prefetch_advise(p);
+            return p;
+        }
+
+        fnc_perror("mmap");
+    }
+
+    p->blocks = g_new0(PrefetchBlock, p->nblocks);
+    for ( i = 0; i < p->nblocks; i++ ) {
+        p->blocks[i].parent = p;
+        p->blocks[i].data = g_malloc(PREFETCH_BLOCK_SIZE);
+    }
+
+#ifdef HAVE_LIBURING
+    p->uring = io_uring_queue_init(p->nblocks, &p->ring, 0) == 0;
+#endif
+
+    /* the pool only starts its threads once something is pushed */
+    if ( g_once_init_enter(&pool_initialized) ) {
+        prefetch_pool = g_thread_pool_new(prefetch_pool_read, NULL,
+                                          feng_srv.demux_threads,
+                                          false, NULL);
+        g_once_init_leave(&pool_initialized, 1);
+    }
+
+    g_mutex_lock(p->lock);
+    prefetch_fill(p);
+    g_mutex_unlock(p->lock);
+
+    return p;
+}
+
+/**
+ * @brief Get the AVIOContext to give to libavformat
+ */
+AVIOContext *avio_prefetch_context(AVIOPrefetch *p)
+{
+    return p->avio;
+}
+
+/**
+ * @brief Wait until the data at the current position is read
+ *
+ * Meant to be called before taking the resource's lock, so that
+ * whatever else does need the lock does not wait for the disk; the
+ * mapped files only wait while page faulting, in the read itself.
+ */
+void avio_prefetch_wait(AVIOPrefetch *p)
+{
+    if ( p->map != NULL )
+        return;
+
+    g_mutex_lock(p->lock);
+    prefetch_current(p);
+    g_mutex_unlock(p->lock);
+}
+
+/**
+ * @brief Close the file, once all the reads in flight are done
+ *
+ * @note The AVFormatContext using the prefetcher has to be closed
+ *       first.
+ */
+void avio_prefetch_close(AVIOPrefetch *p)
+{
+    unsigned int i;
+
+    if ( p == NULL )
+        return;
+
+    if ( p->map != NULL ) {
+        munmap(p->map, p->size);
+    } else {
+        g_mutex_lock(p->lock);
+        for ( i = 0; i < p->nblocks; i++ )
+            while ( p->blocks[i].state == BLOCK_PENDING )
+                prefetch_reap(p, true);
+        g_mutex_unlock(p->lock);
+
+#ifdef HAVE_LIBURING
+        if ( p->uring )
+            io_uring_queue_exit(&p->ring);
+#endif
+
+        for ( i = 0; i < p->nblocks; i++ )
+            g_free(p->blocks[i].data);
+        g_free(p->blocks);
+    }
+
+    av_free(p->avio->buffer);
+    av_free(p->avio);
+
+    g_mutex_free(p->lock);
+    g_cond_free(p->done);
+    close(p->fd);
+
+    g_slice_free(AVIOPrefetch, p);
+}
+
+/**
+ * @}
+ */
@@ -82,3 +82,128 @@ void sdp_descr_append_rtpmap(Track *track)
                            track->clock_rate,
                            track->audio_channels);
 }
+
+/**
+ * @defgroup mparser_bundle Audio frames bundling
+ * @ingroup parsers
+ *
+ * @brief Pack more audio frames in a single packet
+ *
+ * Audio frames are small enough that sending each in a packet of its
+ * own means lots of packets for few bytes; the AAC and AMR parsers
+ * can instead hold them back in the track, up to the settings' @ref
+ * Track::bundle_time, and send them together, each format adding its
+ * own per-frame headers.
+ *
+ * @{
+ */
+
+/**
+ * @brief Add a frame to the ones held back in the track
+ *
+ * @param tr The track the frame belongs to
+ * @param timestamp The presentation time of the frame
+ * @param duration The duration of the frame
+ * @param header The per-frame header to add to the packet
+ * @param header_len Length of @p header
+ * @param payload The frame's data
+ * @param payload_len Length of @p payload
+ */
+void mparser_bundle_append(Track *tr, double timestamp, double duration,
+                           const uint8_t *header, size_t header_len,
+                           const uint8_t *payload, size_t payload_len)
+{
+    if ( tr->bundle.headers == NULL ) {
+        tr->bundle.headers = g_byte_array_new();
+        tr->bundle.payload = g_byte_array_new();
+    }
+
+    if ( tr->bundle.count == 0 ) {
+        tr->bundle.timestamp = timestamp;
+        tr->bundle.delivery = tr->dts + (timestamp - tr->pts);
+        tr->bundle.duration = 0;
+    }
+
+    g_byte_array_append(tr->bundle.headers, header, header_len);
+    g_byte_array_append(tr->bundle.payload, payload, payload_len);
+    tr->bundle.count++;
+    tr->bundle.duration += duration;
+}
+
+/**
+ * @brief Tells whether the frames held back have to be sent
+ *
+ * @retval true The first frame held back has been delayed as long as
+ *              allowed; with no bundle time configured this is true
+ *              as soon as there is a frame.
+ */
+gboolean mparser_bundle_full(Track *tr)
+{
+    return tr->bundle.count > 0 &&
+        tr->bundle.duration >= tr->bundle_time;
+}
+
+/**
+ * @brief Get the size of the frames held back, headers included
+ */
+size_t mparser_bundle_size(Track *tr)
+{
+    if ( tr->bundle.count == 0 )
+        return 0;
+
+    return tr->bundle.headers->len + tr->bundle.payload->len;
+}
+
+/**
+ * @brief Take the frames held back into a new buffer
+ *
+ * @param tr The track to take the frames of
+ * @param prefix_len Room to leave for the format's payload header
+ *
+ * @return A new buffer, with the headers of the frames after @p
+ *         prefix_len bytes, followed by their data, and their timing;
+ *         the caller has to fill the prefix and write it to the
+ *         track. NULL if no frame was held back.
+ */
+struct MParserBuffer *mparser_bundle_take(Track *tr, size_t prefix_len)
+{
+    struct MParserBuffer *buffer;
+
+    if ( tr->bundle.count == 0 )
+        return NULL;
+
+    buffer = mparser_buffer_alloc(tr, prefix_len + mparser_bundle_size(tr));
+
+    buffer->timestamp = tr->bundle.timestamp;
+    buffer->delivery = tr->bundle.delivery;
+    buffer->duration = tr->bundle.duration;
+
+    memcpy(buffer->data + prefix_len,
+           tr->bundle.headers->data, tr->bundle.headers->len);
+    memcpy(buffer->data + prefix_len + tr->bundle.headers->len,
+           tr->bundle.payload->data, tr->bundle.payload->len);
+
+    g_byte_array_set_size(tr->bundle.headers, 0);
+    g_byte_array_set_size(tr->bundle.payload, 0);
+    tr->bundle.count = 0;
+
+    return buffer;
+}
+
+/**
+ * @brief Free the frames held back, if any
+ *
+ * To be used as @ref Track::uninit by the parsers bundling frames.
+ */
+void mparser_bundle_uninit(Track *tr)
+{
+    if ( tr->bundle.headers == NULL )
+        return;
+
+    g_byte_array_free(tr->bundle.headers, true);
+    g_byte_array_free(tr->bundle.payload, true);
+}
+
+/**
+ * @}
+ */
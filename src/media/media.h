@@ -31,6 +31,9 @@
 #include <stdbool.h>
 #include <unistd.h>
 
+#include "trace.h"
+#include "affinity.h"
+
 struct feng;
 struct RTP_session;
 struct AVFormatContext;
@@ -38,7 +41,16 @@ struct AVFormatContext;
 #define RESOURCE_OK 0
 #define RESOURCE_ERR -1
 #define RESOURCE_EOF -2
+/** Nothing to read yet, try again at the next fill request */
+#define RESOURCE_AGAIN -3
 #define DEFAULT_MTU 1440
+/** Smallest MTU the parsers' headers leave room for payload in */
+#define MIN_MTU 256
+/** Biggest payload that fits an interleaved RTP packet */
+#define MAX_MTU 65000
+/** Default buffering watermarks, in milliseconds of media */
+#define DEFAULT_BUFFER_LOW 500
+#define DEFAULT_BUFFER_HIGH 2000
 
 typedef enum {
     MP_undef = -1,
@@ -58,6 +70,36 @@ typedef enum {
 typedef GList *TrackList;
 
 typedef struct Resource Resource;
+
+/**
+ * @brief Packetization settings of a stored resource
+ *
+ * Packets are produced once per resource rather than per client, so
+ * these are fixed when the resource is opened; clients can only share
+ * a resource packetized with the same settings.
+ *
+ * The buffering watermarks, in milliseconds, travel along but don't
+ * affect the packets: a shared resource keeps those it opened with.
+ */
+typedef struct MParserSettings {
+    /** Biggest payload to produce, see @ref Track::mtu */
+    size_t mtu;
+    /** Most audio to hold back for a packet, see @ref Track::bundle_time */
+    unsigned int bundle_time;
+    /** Buffering of video tracks, see @ref Track::buffer_low */
+    unsigned int video_buffer_low, video_buffer_high;
+    /** Buffering of the other tracks, see @ref Track::buffer_low */
+    unsigned int audio_buffer_low, audio_buffer_high;
+    /** Mux all the tracks in a single MPEG-TS one, see @ref mp2t */
+    gboolean mp2t;
+} MParserSettings;
+
+static inline gboolean mparser_settings_equal(const MParserSettings *a,
+                                              const MParserSettings *b)
+{
+    return a->mtu == b->mtu && a->bundle_time == b->bundle_time &&
+        a->mp2t == b->mp2t;
+}
 typedef struct Track Track;
 
 /**
@@ -86,8 +128,24 @@ struct Resource {
     time_t mtime;
     double duration;
 
+    /** Settings the tracks are packetized with */
+    MParserSettings settings;
+
     int (*read_packet)(Resource *);
     int (*seek)(Resource *, double time_sec);
+    /**
+     * @brief Play at a speed other than 1.0, sending keyframes only
+     *
+     * Applies from the next seek; optional, see @ref r_set_scale.
+     */
+    int (*set_scale)(Resource *, double scale);
+    /**
+     * @brief Wait for the data needed by the next read_packet, if any
+     *
+     * Called without @ref Resource::lock held, so that the lock is
+     * not held while waiting for the disk; optional.
+     */
+    void (*read_wait)(Resource *);
     GDestroyNotify uninit;
 
     /* Multiformat related things */
@@ -104,6 +162,9 @@ struct Resource {
              * It is not defined for non-virtual resources.
              */
             gint count;
+
+            /** @brief Recorder of the time-shift window, if any */
+            struct Timeshift *timeshift;
         } live;
 
         struct {
@@ -111,23 +172,83 @@ struct Resource {
             Track **tracks;
 
             /**
-             * @brief Pool of one thread for filling up data for the session
+             * @brief Whether the resource can be read by the demuxer pool
              *
-             * This is a pool consisting of exactly one thread that is used to
-             * fill up the resource's tracks' @ref Track with data when it's
-             * running low.
+             * Set during the resume phase (@ref r_resume), and cleared
+             * during the pause phase (@ref r_pause), which also happens
+             * before the final free (@ref r_close).
              *
-             * Since we do want to do this asynchronously but we don't really
-             * want race conditions (and they would anyway just end up waiting
-             * on the same lock), there is no need to allow multiple threads
-             * to do the same thing here.
+             * @note Do not change this to gboolean because it is used
+             *       through g_atomic_int_get/g_atomic_int_set.
+             */
+            gint fill_active;
+
+            /** @brief Position in the demuxer pool (FILL_* values) */
+            int fill_state;
+
+            /** @brief A fill request arrived while being read */
+            gboolean fill_again;
+
+            /** @brief Seconds left to the consumer when last queued */
+            double fill_buffered;
+
+            /** @brief The consumer with the least data that asked for more */
+            struct RTP_session *fill_consumer;
+
+            /** @brief The consumer a demuxer thread is reading for */
+            struct RTP_session *fill_reading;
+
+            /**
+             * @brief URL the resource was opened with, for shared
+             *        resources only
+             */
+            gchar *shared_url;
+
+            /** @brief RTSP sessions using the shared resource */
+            int shared_viewers;
+
+            /** @brief The shared resource can still be joined */
+            gboolean shared_published;
+
+            /** @brief The shared timeline was started by a PLAY */
+            gboolean shared_started;
+
+            /** @brief Time at which the timeline was at position zero */
+            double shared_origin;
+
+            /** @brief Reader state, for resources served from the RTP cache */
+            struct RTPCache *cache;
+
+            /** @brief Recording in progress into the RTP cache, if any */
+            struct RTPCacheWriter *cache_writer;
+
+            /** @brief Keyframe index of the file, if already built */
+            struct SeekIndex *seek_index;
+
+            /** @brief Readahead of the file, if not read by libavformat */
+            struct AVIOPrefetch *prefetch;
+
+            /** @brief Speed of the trick play in progress, 0 if none */
+            double trick_scale;
+
+            /** @brief Stream time the trick play was started at */
+            double trick_origin;
+
+            /** @brief Keyframe of the seek index to send next */
+            const struct SeekIndexEntry *trick_entry;
+
+            /** @brief Reader state, for time-shifted live resources */
+            struct TimeshiftReader *timeshift;
+
+            /**
+             * @brief Muxer of the tracks, for resources sent as MPEG-TS
              *
-             * Please note that this is created, for stored resources only,
-             * during the resume phase (@ref r_resume), and stopped during
-             * either the pause phase (@ref r_pause) or during the final free
-             * (@ref r_free_cb).
+             * When set, @ref tracks are the elementary streams read
+             * from the file, and the only entry of @ref
+             * Resource::tracks is the transport stream muxed out of
+             * them.
              */
-            GThreadPool *fill_pool;
+            struct MP2TMux *mp2t;
         } stored;
     };
 };
@@ -170,6 +291,62 @@ struct Track {
      */
     GQueue *queue;
 
+    /**
+     * @brief GOP cache for live tracks
+     *
+     * References to the buffers written since the start of the most
+     * recent keyframe, sent in a burst to the consumers joining the
+     * track (see @ref bq_consumer_new); NULL when the cache is
+     * disabled. Protected by @ref lock.
+     */
+    GQueue *gop;
+
+#ifdef FENG_BQ_RING
+    /**
+     * @brief Ring buffer backend of the buffer queue
+     *
+     * Used in place of @ref Track::queue when feng is built with
+     * --enable-ring-bufferqueue; see @ref track_ring.c.
+     */
+    struct {
+        /** Slots of the ring; the size is a power of two */
+        struct MParserBuffer **slots;
+
+        /**
+         * @brief Position of the next slot to write
+         *
+         * Positions are free-running counters, the slot is found by
+         * masking them with the size of the ring. Only the producer
+         * writes this, the consumers read it atomically.
+         */
+        guint head;
+
+        /**
+         * @brief Position of the oldest slot still holding a buffer
+         *
+         * Never ahead of the cursor of any registered consumer.
+         */
+        guint tail;
+
+        /**
+         * @brief Position of the first slot written after the last reset
+         *
+         * Consumers that notice a new @ref serial jump forward to
+         * this position, skipping the buffers queued before the reset.
+         */
+        guint reset;
+
+        /**
+         * @brief Serial of the ring, increased at each reset
+         */
+        guint serial;
+
+        /**
+         * @brief Registered consumers, protected by @ref Track::lock
+         */
+        GPtrArray *consumers;
+    } ring;
+#endif
 
     /**
      * @brief Stopped flag
@@ -213,6 +390,32 @@ struct Track {
      */
     gint consumers;
 
+    /**
+     * @brief Consumers of the track by the NUMA node serving them
+     *
+     * See @ref affinity_track_consumer; only accessed atomically.
+     */
+    gint node_consumers[AFFINITY_MAX_NODES];
+
+    /** @brief Node the ingest thread was moved to, or -1 */
+    int ingest_node;
+
+    /** @brief Last time the ingest thread's placement was checked */
+    double ingest_checked;
+
+    /**
+     * @brief Bytes of buffers in the queue
+     *
+     * Counted in @ref bq_memory_usage as well; updated with the
+     * track's lock held.
+     */
+    gsize queue_bytes;
+
+#ifdef FENG_TRACE
+    /** @brief Timing of the packets, see @ref pipeline_trace */
+    TrackTrace trace;
+#endif
+
     /**
      * @brief Last consumer exited condition
      *
@@ -223,6 +426,15 @@ struct Track {
      */
     GCond *last_consumer;
 
+    /**
+     * @brief Pool of recycled buffers for the track
+     *
+     * Buffers of up to @ref mtu bytes are allocated by @ref
+     * mparser_buffer_alloc out of this pool, and go back to it once
+     * the last reference is released.
+     */
+    struct MParserBufferPool *buffer_pool;
+
     Resource *parent;
 
     /**
@@ -272,6 +484,14 @@ struct Track {
      */
     void (*uninit)(Track *track);
 
+    /**
+     * @brief Send the data held back by the parser, if any
+     *
+     * Called at the end of the resource and before seeking it; can
+     * be NULL for parsers sending each packet right away.
+     */
+    void (*flush)(Track *track);
+
     /** @} */
 
     /**
@@ -282,12 +502,34 @@ struct Track {
      * @{ */
     int payload_type;
     unsigned int clock_rate;
+    /** Bitrate declared by the container, in bit/s; 0 if unknown */
+    unsigned int bitrate;
+    /**
+     * @brief Rate last measured on a session sending the track, in kbit/s
+     *
+     * Written atomically by the sessions' RTCP reports, see @ref
+     * rtp_admission_measure.
+     */
+    gint measured_kbps;
     char *encoding_name;
     MediaType media_type;
     int audio_channels;
     double pts;             //time is in seconds
     double dts;             //time is in seconds
     double frame_duration;  //time is in seconds
+    /** Biggest payload to produce, see @ref track_set_mtu */
+    size_t mtu;
+    /** Most audio, in seconds, the parser can hold back to fill a packet */
+    double bundle_time;
+    /**
+     * @brief Buffering watermarks, in seconds of media
+     *
+     * A consumer with less than buffer_low seconds queued asks for
+     * its resource to be read, and the reading then goes on until it
+     * has buffer_high seconds; see @ref bq_consumer_buffered.
+     */
+    double buffer_low, buffer_high;
+    gboolean keyframe;      //the packet being parsed is a keyframe
     uint8_t *extradata;
     size_t extradata_len;
     /** @} */
@@ -300,10 +542,30 @@ struct Track {
         struct {
             bool is_avc;
             uint8_t nal_length_size; // used in avc
+            /** Pack the small NALs in STAP-A packets */
+            bool aggregate;
         } h264;
 
+        /**
+         * @brief Audio frames held back, see @ref mparser_bundle
+         */
+        struct {
+            /** Per-frame headers: AAC AU-headers or AMR ToC entries */
+            GByteArray *headers;
+            /** Frames' data, one after the other */
+            GByteArray *payload;
+            unsigned int count;
+            double timestamp;
+            double delivery;
+            double duration;
+        } bundle;
+
         struct {
             char *mq_path;
+            /** Shared memory ring the track is read from, if any */
+            struct FluxShmRing *shm;
+            /** Sender to the configured multicast group, if any */
+            struct RTP_multicast *multicast;
         } live;
     };
 };
@@ -329,29 +591,105 @@ struct MParserBuffer {
      */
     gulong seen;
 
+    /**
+     * @brief Count of consumers whose current element this is
+     *
+     * These buffers might be in use by the consumer outside of the
+     * producer's lock, so @ref bq_producer_evict leaves them alone.
+     * Like @ref seen, is only accessed with the producer lock held.
+     */
+    gulong held;
+
+    /**
+     * @brief Reference counter
+     *
+     * The track's queue holds one reference to the buffer; each RTP
+     * packet in flight holds one more, so that the payload can be
+     * handed over to the transports without copying it.
+     *
+     * @see mparser_buffer_ref
+     * @see mparser_buffer_unref
+     */
+    gint refcount;
+
     double timestamp;   /*!< presentation time of packet */
     double delivery;    /*!< decoding time of packet */
     double duration;    /*!< packet duration */
 
     gboolean marker;    /*!< marker bit, set if we are sending the last frag */
+    gboolean keyframe;  /*!< part of a keyframe, see @ref Track::keyframe */
     uint32_t rtp_timestamp; /*!< RTP version of the presenation time, used only by live */
     uint16_t seq_no;    /*!< Packet sequence number, used only by live */
 
     size_t data_size;   /*!< packet size */
-    uint8_t *data;      /*!< actual packet data */
+    uint8_t *data;      /*!< actual packet data, allocated together with the buffer */
+
+    /**
+     * @brief Pool the buffer has been allocated from
+     *
+     * NULL for buffers too big to fit in a pool slot, and for the
+     * ones wrapping somebody else's memory.
+     */
+    struct MParserBufferPool *pool;
+
+    /**
+     * @brief Release function for wrapped data
+     *
+     * Called once the last reference is gone, for buffers created by
+     * @ref mparser_buffer_wrap.
+     */
+    void (*release)(struct MParserBuffer *buffer);
+    gpointer release_data;
+
+#ifdef FENG_TRACE
+    /** Monotonic times of ingest and queueing, see @ref pipeline_trace */
+    double trace_ingest;
+    double trace_queued;
+#endif
 };
 
+/**
+ * @brief Counters for the buffer pools
+ *
+ * These are process-wide, summed over all the tracks' pools.
+ */
+typedef struct MParserBufferPoolStats {
+    guint hits;         /*!< allocations served by a recycled slot */
+    guint misses;       /*!< allocations that required a new slot */
+    guint oversize;     /*!< allocations too big to be pooled */
+    guint recycled;     /*!< slots given back to their pool */
+    guint trimmed;      /*!< slots freed because the pool was full or gone */
+} MParserBufferPoolStats;
+
 // --- functions --- //
 
-Resource *r_open(const char *inner_path);
+void r_init(void);
+Resource *r_open(const char *inner_path, const MParserSettings *settings);
 
 int r_read(Resource *resource);
 int r_seek(Resource *resource, double time);
+int r_set_scale(Resource *resource, double scale);
 
 void r_close(Resource *resource);
 void r_pause(Resource *resource);
 void r_resume(Resource *resource);
 void r_fill(Resource *resource, struct RTP_session *consumer);
+void r_detach(Resource *resource, struct RTP_session *consumer);
+
+/**
+ * @brief How a PLAY request uses a shared stored resource
+ * @ingroup shared_resources
+ */
+typedef enum {
+    SHARE_PRIVATE,
+    SHARE_JOIN,
+    SHARE_SPLIT
+} ResourceShare;
+
+ResourceShare r_share_play(Resource *resource, double begin_time,
+                           double playback_time, double *position);
+gboolean r_shared(Resource *resource);
+Resource *r_unshare(Resource *resource);
 
 Track *r_find_track(Resource *, const char *);
 
@@ -359,12 +697,132 @@ Track *track_new(char *name);
 void track_free(Track *track);
 void track_reset_queue(struct Track *);
 void track_write(Track *tr, struct MParserBuffer *buffer);
+void track_set_mtu(Track *track, size_t mtu);
+
+struct MParserBuffer *mparser_buffer_alloc(Track *tr, size_t size);
+struct MParserBuffer *mparser_buffer_wrap(Track *tr, uint8_t *data, size_t size,
+                                          void (*release)(struct MParserBuffer *buffer),
+                                          gpointer release_data);
+struct MParserBuffer *mparser_buffer_ref(struct MParserBuffer *buffer);
+void mparser_buffer_unref(struct MParserBuffer *buffer);
+void mparser_buffer_pool_stats(MParserBufferPoolStats *stats);
 
 struct MParserBuffer *bq_consumer_get(struct RTP_session *consumer);
 gulong bq_consumer_unseen(struct RTP_session *consumer);
+double bq_consumer_buffered(struct RTP_session *consumer);
+gsize bq_memory_usage(void);
+gboolean bq_memory_exhausted(void);
+gboolean bq_memory_share_exceeded(Track *producer);
+gsize r_queue_bytes(Resource *resource);
 gboolean bq_consumer_move(struct RTP_session *consumer);
+gboolean bq_consumer_skip(struct RTP_session *consumer);
 gboolean bq_consumer_stopped(struct RTP_session *consumer);
+void bq_consumer_new(struct RTP_session *consumer);
 void bq_consumer_free(struct RTP_session *consumer);
+void bq_producer_init(Track *producer);
+void bq_producer_destroy(Track *producer);
+void bq_producer_gop_write(Track *producer, struct MParserBuffer *buffer);
+void bq_memory_account(Track *producer, struct MParserBuffer *buffer,
+                       gboolean queued);
+gboolean bq_keyframe_start(struct MParserBuffer *buffer,
+                           struct MParserBuffer *previous);
+gboolean bq_consumer_gop_start(struct RTP_session *consumer);
+gboolean bq_consumer_gop_move(struct RTP_session *consumer);
+void bq_consumer_gop_free(struct RTP_session *consumer);
+
+Resource *rtp_cache_open(const char *url, const MParserSettings *settings);
+void rtp_cache_record_start(Resource *r, const char *url);
+void rtp_cache_record(Track *tr, struct MParserBuffer *buffer);
+void rtp_cache_record_seek(Resource *r, double time_sec);
+void rtp_cache_record_finish(Resource *r);
+void rtp_cache_record_abort(Resource *r);
+
+/**
+ * @brief Entry of the keyframe seek index of a stored file
+ */
+typedef struct SeekIndexEntry {
+    /** Presentation time of the keyframe, in seconds */
+    double time;
+    /** Byte offset of the packet in the file, -1 if unknown */
+    int64_t pos;
+    /** Presentation timestamp, in the time base of the stream */
+    int64_t timestamp;
+} SeekIndexEntry;
+
+typedef struct SeekIndex SeekIndex;
+
+struct stat;
+
+SeekIndex *seek_index_load(const char *mrl, const struct stat *source);
+const SeekIndexEntry *seek_index_lookup(const SeekIndex *index, double time);
+const SeekIndexEntry *seek_index_step(const SeekIndex *index,
+                                      const SeekIndexEntry *entry,
+                                      double distance);
+int seek_index_stream(const SeekIndex *index);
+void seek_index_free(SeekIndex *index);
+
+typedef struct AVIOPrefetch AVIOPrefetch;
+
+struct AVIOContext;
+
+AVIOPrefetch *avio_prefetch_open(const char *path, size_t window,
+                                 gboolean use_mmap);
+struct AVIOContext *avio_prefetch_context(AVIOPrefetch *p);
+void avio_prefetch_wait(AVIOPrefetch *p);
+void avio_prefetch_close(AVIOPrefetch *p);
+
+typedef struct MP2TMux MP2TMux;
+
+struct AVPacket;
+
+MP2TMux *mp2t_open(Resource *r);
+Track *mp2t_track(MP2TMux *mux);
+int mp2t_write(MP2TMux *mux, Track *tr, struct AVPacket *pkt);
+void mp2t_free(MP2TMux *mux);
+
+gboolean flux_track_wanted(Track *tr);
+gboolean flux_buffer_fill(Track *tr, struct MParserBuffer *buffer,
+                          double insertion_time, double start_time,
+                          uint32_t dts, uint32_t start_dts, double duration,
+                          gboolean marker, uint16_t seq_no, uint32_t package_timestamp);
+void flux_track_deliver(Track *tr, struct MParserBuffer *buffer);
+gboolean flux_packet_keyframe(Track *tr, const struct MParserBuffer *buffer);
+
+Resource *relay_open(const char *mrl, const char *upstream);
+
+typedef struct Timeshift Timeshift;
+
+Timeshift *timeshift_new(Resource *r, double window);
+void timeshift_record(Timeshift *ts, Track *tr,
+                      const struct MParserBuffer *buffer);
+Resource *timeshift_open(Resource *live);
+double timeshift_position(Resource *r, double wallclock);
+
+struct FluxShmRing *flux_shm_new(Track *tr);
+void flux_shm_start(struct FluxShmRing *ring);
+void flux_shm_free(struct FluxShmRing *ring);
+
+/**
+ * @brief One of the implementations of the start code scanner
+ *
+ * @see mparser_startcode_scanners
+ */
+typedef struct {
+    /** Name of the instruction set used */
+    const char *name;
+    const uint8_t *(*find)(const uint8_t *p, const uint8_t *end);
+} MParserStartcodeScanner;
+
+const uint8_t *mparser_find_startcode(const uint8_t *p, const uint8_t *end);
+const MParserStartcodeScanner *mparser_startcode_scanners(void);
+
+void mparser_bundle_append(Track *tr, double timestamp, double duration,
+                           const uint8_t *header, size_t header_len,
+                           const uint8_t *payload, size_t payload_len);
+gboolean mparser_bundle_full(Track *tr);
+size_t mparser_bundle_size(Track *tr);
+struct MParserBuffer *mparser_bundle_take(Track *tr, size_t prefix_len);
+void mparser_bundle_uninit(Track *tr);
 
 void sdp_descr_append_config(Track *track);
 void sdp_descr_append_rtpmap(Track *track);
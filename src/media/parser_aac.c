@@ -28,6 +28,30 @@
 #include "media/media.h"
 #include "fnc_log.h"
 
+#define HEADER_SIZE 4
+#define MAX_PAYLOAD_SIZE(tr) ((tr)->mtu - HEADER_SIZE)
+
+/* A bundle has the AU-headers-length, in bits, then one AU-header
+ * (13 bits of size, 3 of index delta) for each frame */
+#define AU_HEADERS_LENGTH_SIZE 2
+#define AU_HEADER_SIZE 2
+#define MAX_AU_HEADERS (0xffff / (AU_HEADER_SIZE * 8))
+
+static void aac_flush(Track *tr)
+{
+    const unsigned int headers_length = tr->bundle.count * AU_HEADER_SIZE * 8;
+    struct MParserBuffer *buffer = mparser_bundle_take(tr, AU_HEADERS_LENGTH_SIZE);
+
+    if (buffer == NULL)
+        return;
+
+    buffer->data[0] = headers_length >> 8;
+    buffer->data[1] = headers_length & 0xff;
+    buffer->marker = true;
+
+    track_write(tr, buffer);
+}
+
 int aac_init(Track *track)
 {
     sdp_descr_append_rtpmap(track);
@@ -42,26 +66,76 @@ int aac_init(Track *track)
     sdp_descr_append_config(track);
     g_string_append(track->sdp_description, "\r\n");
 
+    track->flush = aac_flush;
+    track->uninit = mparser_bundle_uninit;
+
     return 0;
 }
 
-#define HEADER_SIZE 4
-#define MAX_PAYLOAD_SIZE (DEFAULT_MTU - HEADER_SIZE)
+/**
+ * @brief Size of the ADTS header starting a frame, if any
+ *
+ * Raw AAC streams have no AudioSpecificConfig, and are demuxed as
+ * frames still carrying their ADTS header; the header is skipped
+ * here rather than running the aac_adtstoasc bitstream filter on each
+ * packet. The filter is only used once, by the demuxer, to build the
+ * configuration.
+ *
+ * @return The size of the header, or zero if the frame is not an
+ *         ADTS frame of exactly @p len bytes.
+ */
+static size_t aac_adts_header_size(const uint8_t *data, ssize_t len)
+{
+    size_t header_size, frame_size;
+
+    /* syncword, then layer 0 */
+    if (len < 7 || data[0] != 0xff || (data[1] & 0xf6) != 0xf0)
+        return 0;
+
+    /* protection_absent is set when there's no CRC */
+    header_size = (data[1] & 0x01) ? 7 : 9;
+    frame_size = ((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5);
+
+    if (frame_size != (size_t)len || frame_size <= header_size)
+        return 0;
+
+    return header_size;
+}
 
-int aac_parse(Track *tr, uint8_t *data, ssize_t len)
+int aac_parse(Track *tr, uint8_t *frame, ssize_t frame_len)
 {
+    const size_t skip = aac_adts_header_size(frame, frame_len);
+    uint8_t *data = frame + skip;
+    ssize_t len = frame_len - skip;
     const uint8_t prefix[HEADER_SIZE] = { 0x00, 0x10, (len & 0x1fe0) >> 5, (len & 0x1f) << 3 };
 
+    /* frames fitting a packet of their own can be bundled */
+    if (len <= MAX_PAYLOAD_SIZE(tr)) {
+        if (AU_HEADERS_LENGTH_SIZE + mparser_bundle_size(tr) +
+            AU_HEADER_SIZE + len > tr->mtu ||
+            tr->bundle.count == MAX_AU_HEADERS)
+            aac_flush(tr);
+
+        mparser_bundle_append(tr, tr->pts, tr->frame_duration,
+                              &prefix[AU_HEADERS_LENGTH_SIZE], AU_HEADER_SIZE,
+                              data, len);
+
+        if (mparser_bundle_full(tr))
+            aac_flush(tr);
+
+        return 0;
+    }
+
+    aac_flush(tr);
+
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_alloc(tr, MIN(MAX_PAYLOAD_SIZE(tr), len) + HEADER_SIZE);
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
-        buffer->marker = (len <= MAX_PAYLOAD_SIZE);
-
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
+        buffer->marker = (len <= MAX_PAYLOAD_SIZE(tr));
 
         memcpy(buffer->data, &prefix[0], HEADER_SIZE);
         memcpy(buffer->data + HEADER_SIZE, data,
@@ -69,8 +143,8 @@ int aac_parse(Track *tr, uint8_t *data, ssize_t len)
 
         track_write(tr, buffer);
 
-        len -= MAX_PAYLOAD_SIZE;
-        data += MAX_PAYLOAD_SIZE;
+        len -= MAX_PAYLOAD_SIZE(tr);
+        data += MAX_PAYLOAD_SIZE(tr);
     } while(len > 0);
 
     return 0;
@@ -28,6 +28,8 @@
 #include "media/media.h"
 #include "fnc_log.h"
 
+static void amr_flush(Track *tr);
+
 int amr_init(Track *track)
 {
     sdp_descr_append_rtpmap(track);
@@ -42,6 +44,9 @@ int amr_init(Track *track)
 
     g_string_append(track->sdp_description, "\r\n");
 
+    track->flush = amr_flush;
+    track->uninit = mparser_bundle_uninit;
+
     return 0;
 }
 
@@ -77,58 +82,66 @@ typedef struct
 } toc;
 
 #define AMR_CMR 0xf0
+#define AMR_FRAME_DURATION 0.02
+
+static void amr_flush(Track *tr)
+{
+    const unsigned int frames = tr->bundle.count;
+    struct MParserBuffer *buffer = mparser_bundle_take(tr, 1);
+    unsigned int i;
+    toc tocv;
+
+    if (buffer == NULL)
+        return;
+
+    buffer->data[0] = AMR_CMR;
+
+    /* all the frames but the last are followed by another one */
+    for (i = 0; i + 1 < frames; i++) {
+        memcpy(&tocv, buffer->data + 1 + i, 1);
+        tocv.f = 1;
+        memcpy(buffer->data + 1 + i, &tocv, 1);
+    }
+
+    track_write(tr, buffer);
+}
 
 int amr_parse(Track *tr, uint8_t *data, ssize_t len)
 {
-    uint8_t *packet = g_slice_alloc0(DEFAULT_MTU);
     static const uint32_t packet_size[] = {12, 13, 15, 17, 19, 20, 26, 31, 5, 0, 0, 0, 0, 0, 0, 0};
+    double timestamp = tr->pts;
 
     while (len > 0) {
-        struct MParserBuffer *buffer;
-
-        uint32_t read_offset = 0, frames = 0;
-        uint32_t body_len, i, off;
+        uint32_t body_len;
+        uint8_t toc_entry;
         toc tocv;
 
-        /* Count the number of frames that fit into the packet */
-        while (read_offset < len) {
-            memcpy(&tocv, &data[read_offset], 1);
-            body_len = packet_size[tocv.ft];
-            if (read_offset + 1 + body_len > len)
-                break; /* Not enough speech data */
-            if (read_offset + 1 + body_len > DEFAULT_MTU - 1)
-                break; /* This frame doesn't fit into the current packet */
-            read_offset += 1 + body_len;
-            frames++;
-        }
-        if (frames <= 0) /* No frames - bad trailing data? */
-            break;
-
-        buffer = g_slice_new0(struct MParserBuffer);
-
-        buffer->timestamp = tr->pts;
-        buffer->delivery = tr->dts;
-        buffer->duration = tr->frame_duration;
-
-        buffer->data = g_malloc(DEFAULT_MTU);
-        buffer->data[0] = AMR_CMR;
-
-        off = 1 + frames; /* Write the body data at this offset */
-        for (i = 0; i < frames; i++) {
-            memcpy(&tocv, data, 1);
-            body_len = packet_size[tocv.ft];
-            tocv.f = i < frames - 1;
-            memcpy(buffer->data + 1 + i, &tocv, 1);
-            memcpy(buffer->data + off, &data[1], body_len);
-            off  +=     body_len;
-            data += 1 + body_len;
-            len  -= 1 + body_len;
-        }
-
-        buffer->data_size = off;
-        track_write(tr, buffer);
+        memcpy(&tocv, data, 1);
+        body_len = packet_size[tocv.ft];
+        if (1 + body_len > len)
+            break; /* Not enough speech data - bad trailing data? */
+
+        /* The CMR, then a ToC entry and the speech data for each frame */
+        if (1 + mparser_bundle_size(tr) + 1 + body_len > tr->mtu)
+            amr_flush(tr);
+
+        tocv.f = 0;
+        memcpy(&toc_entry, &tocv, 1);
+        mparser_bundle_append(tr, timestamp, AMR_FRAME_DURATION,
+                              &toc_entry, 1, data + 1, body_len);
+
+        if (tr->bundle_time > 0 && mparser_bundle_full(tr))
+            amr_flush(tr);
+
+        timestamp += AMR_FRAME_DURATION;
+        data += 1 + body_len;
+        len  -= 1 + body_len;
     }
 
-    g_slice_free1(DEFAULT_MTU, packet);
+    /* Without a bundle time, only the frames demuxed together are
+     * sent together */
+    if (tr->bundle_time == 0)
+        amr_flush(tr);
+
     return 0;
 }
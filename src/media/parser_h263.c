@@ -46,22 +46,20 @@ int h263_parse(Track *tr, uint8_t *data, ssize_t len)
     }
 
     while (len - cur > 0) {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer = mparser_buffer_alloc(tr, tr->mtu);
         size_t payload, header_len;
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
 
-        buffer->data = g_malloc(buffer->data_size);
-
         if (cur == 0 && found_gob) {
-            payload = MIN(DEFAULT_MTU, len);
+            payload = MIN(tr->mtu, len);
             memcpy(buffer->data, data, payload);
             memcpy(buffer->data, gob_start_code, sizeof(gob_start_code));
             header_len = 0;
         } else {
-            payload = MIN(DEFAULT_MTU - 2, len - cur);
+            payload = MIN(tr->mtu - 2, len - cur);
             memset(buffer->data, 0, 2);
             memcpy(buffer->data + 2, data + cur, payload);
             header_len = 2;
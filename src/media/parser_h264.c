@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "feng.h"
 #include "fnc_log.h"
 #include "media/media.h"
 
@@ -45,7 +46,14 @@
  *  +---------------+
  */
 
-static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
+/*  STAP-A payload
+ *  +---------------+---------------+---------------+-----
+ *  |F|NRI|  24     | NAL size (16 bits, network)   | NAL ...
+ *  +---------------+---------------+---------------+-----
+ *  repeated for each aggregated NAL
+ */
+
+static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr, bool last)
 {
     int start = 1;
     const uint8_t fu_indicator = (nal[0] & 0xe0) | 28;
@@ -57,16 +65,13 @@ static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
     fragsize--;
 
     while(fragsize>0) {
-        const size_t fraglen = MIN(DEFAULT_MTU-2, fragsize);
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        const size_t fraglen = MIN(tr->mtu-2, fragsize);
+        struct MParserBuffer *buffer = mparser_buffer_alloc(tr, fraglen + 2);
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
 
-        buffer->data_size = fraglen + 2;
-        buffer->data = g_malloc(buffer->data_size);
-
         buffer->data[0] = fu_indicator;
         buffer->data[1] = fu_header;
 
@@ -76,7 +81,7 @@ static void frag_fu_a(uint8_t *nal, int fragsize, Track *tr)
         }
 
         if (fraglen == fragsize) {
-            buffer->marker = true;
+            buffer->marker = last;
             buffer->data[1] |= (1<<6);
         }
 
@@ -150,48 +155,8 @@ static char *encode_avc1_header(uint8_t *p, unsigned int len, int packet_mode)
     return NULL;
 }
 
-//Ripped directly from ffmpeg...
-
-static const uint8_t *find_startcode_internal(const uint8_t *p,
-                                             const uint8_t *end)
-{
-        const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-
-    for (end -= 3; p < a && p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    for (end -= 3; p < end; p += 4) {
-        uint32_t x = *(const uint32_t*)p;
-//      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-//      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
-            if (p[1] == 0) {
-                if (p[0] == 0 && p[2] == 1)
-                    return p;
-                if (p[2] == 0 && p[3] == 1)
-                    return p+1;
-            }
-            if (p[3] == 0) {
-                if (p[2] == 0 && p[4] == 1)
-                    return p+2;
-                if (p[4] == 0 && p[5] == 1)
-                    return p+3;
-            }
-        }
-    }
-
-    for (end += 3; p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    return end + 3;
-}
-
 static const uint8_t *find_startcode(const uint8_t *p, const uint8_t *end){
-    const uint8_t *out = find_startcode_internal(p, end);
+    const uint8_t *out = mparser_find_startcode(p, end);
     if(p<out && out<end && !out[-1]) out--;
     return out;
 }
@@ -253,6 +218,8 @@ int h264_init(Track *track)
         if (sprop == NULL) goto err_alloc;
     }
 
+    track->h264.aggregate = feng_srv.h264_aggregation;
+
     sdp_descr_append_rtpmap(track);
     g_string_append_printf(track->sdp_description,
                            "a=fmtp:%u %s\r\n",
@@ -274,11 +241,129 @@ int h264_init(Track *track)
 //  - fragmenting
 //  - feed a single NAL as is.
 
+/**
+ * @brief Send a single NAL, fragmenting it if needed
+ *
+ * @param last Whether the NAL is the last one of the frame, and the
+ *             marker bit has to be set.
+ */
+static void h264_send_nal(Track *tr, uint8_t *nal, size_t nalsize, bool last)
+{
+    if (tr->mtu >= nalsize) {
+        struct MParserBuffer *buffer = mparser_buffer_alloc(tr, nalsize);
+
+        buffer->timestamp = tr->pts;
+        buffer->delivery = tr->dts;
+        buffer->duration = tr->frame_duration;
+        buffer->marker = last;
+
+        memcpy(buffer->data, nal, nalsize);
+
+        track_write(tr, buffer);
+
+        fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL %d", nal[0]&0x1f);
+    } else {
+        // single NAL, to be fragmented, FU-A;
+        frag_fu_a(nal, nalsize, tr, last);
+    }
+}
+
+/**
+ * @brief Most NALs packed in a single STAP-A
+ *
+ * With the smallest useful NALs a full packet would hold more, but
+ * beside parameter sets and SEI a frame rarely has this many.
+ */
+#define H264_STAP_MAX 32
+
+/**
+ * @brief NALs of a frame waiting to be sent
+ *
+ * A NAL is only sent once the following one is known not to fit in
+ * the same packet, or the frame is over; when there's a single NAL
+ * pending, it's sent as is (or fragmented), otherwise they are all
+ * packed in a STAP-A.
+ */
+typedef struct {
+    uint8_t *nal[H264_STAP_MAX];
+    size_t size[H264_STAP_MAX];
+    unsigned int count;
+    /** Size of the STAP-A holding all the pending NALs */
+    size_t length;
+} H264Pending;
+
+static void h264_flush(Track *tr, H264Pending *pending, bool last)
+{
+    struct MParserBuffer *buffer;
+    uint8_t forbidden = 0, nri = 0, *q;
+    unsigned int i;
+
+    if (pending->count == 0)
+        return;
+
+    if (pending->count == 1) {
+        h264_send_nal(tr, pending->nal[0], pending->size[0], last);
+        pending->count = 0;
+        return;
+    }
+
+    buffer = mparser_buffer_alloc(tr, pending->length);
+
+    buffer->timestamp = tr->pts;
+    buffer->delivery = tr->dts;
+    buffer->duration = tr->frame_duration;
+    buffer->marker = last;
+
+    // F is set if any NAL has it, NRI is the highest one
+    q = buffer->data + 1;
+    for (i = 0; i < pending->count; i++) {
+        const uint8_t nal_header = pending->nal[i][0];
+
+        forbidden |= nal_header & 0x80;
+        nri = MAX(nri, nal_header & 0x60);
+
+        *q++ = pending->size[i] >> 8;
+        *q++ = pending->size[i] & 0xff;
+        memcpy(q, pending->nal[i], pending->size[i]);
+        q += pending->size[i];
+    }
+    buffer->data[0] = forbidden | nri | 24;
+
+    track_write(tr, buffer);
+
+    fnc_log(FNC_LOG_VERBOSE, "[h264] STAP-A of %u NALs", pending->count);
+
+    pending->count = 0;
+}
+
+/**
+ * @brief Queue a NAL of the frame being parsed
+ *
+ * The NAL has to stay valid until the frame is over.
+ */
+static void h264_queue_nal(Track *tr, H264Pending *pending,
+                           uint8_t *nal, size_t nalsize)
+{
+    if (pending->count > 0 &&
+        (!tr->h264.aggregate ||
+         pending->count == H264_STAP_MAX ||
+         pending->length + 2 + nalsize > tr->mtu))
+        h264_flush(tr, pending, false);
+
+    if (pending->count == 0)
+        pending->length = 1;
+
+    pending->nal[pending->count] = nal;
+    pending->size[pending->count] = nalsize;
+    pending->length += 2 + nalsize;
+    pending->count++;
+}
+
 int h264_parse(Track *tr, uint8_t *data, ssize_t len)
 {
 //    double nal_time; // see page 9 and 7.4.1.2
     size_t nalsize = 0, index = 0;
-    uint8_t *p, *q;
+    H264Pending pending = { .count = 0 };
 
     if (tr->h264.is_avc) {
         const size_t nal_length_size = tr->h264.nal_length_size;
@@ -299,91 +384,31 @@ int h264_parse(Track *tr, uint8_t *data, ssize_t len)
                     break;
                 }
             }
-            if (DEFAULT_MTU >= nalsize) {
-                struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-                buffer->timestamp = tr->pts;
-                buffer->delivery = tr->dts;
-                buffer->duration = tr->frame_duration;
-                buffer->marker = true;
-
-                buffer->data_size = nalsize;
-                buffer->data = g_memdup(data + index, buffer->data_size);
-
-                track_write(tr, buffer);
-
-                fnc_log(FNC_LOG_VERBOSE, "[h264] single NAL");
-            } else {
-            // single NAL, to be fragmented, FU-A;
-                frag_fu_a(data + index, nalsize, tr);
-            }
+            h264_queue_nal(tr, &pending, data + index, nalsize);
             index += nalsize;
         }
     } else {
-        //seek to the first startcode
-        for (p = data; p<data + len - 3; p++) {
-            if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
-                break;
-            }
-        }
-        if (p >= data + len) return -1;
-
-        while (1) {
-        //seek to the next startcode [0 0 1]
-            for (q = p; q<data+len-3;q++) {
-                if (q[0] == 0 && q[1] == 0 && q[2] == 1) {
-                    break;
-                }
-            }
-
-            if (q >= data + len) break;
+        const uint8_t *end = data + len;
+        const uint8_t *r = mparser_find_startcode(data, end);
 
-            if (DEFAULT_MTU >= q - p) {
-                struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        if (r == end) return -1;
 
-                buffer->timestamp = tr->pts;
-                buffer->delivery = tr->dts;
-                buffer->duration = tr->frame_duration;
-                buffer->marker = true;
+        // each NAL goes from after its start code up to the next one
+        while (r < end) {
+            const uint8_t *nal = r + 3, *nal_end;
 
-                buffer->data_size = q - p;
-                buffer->data = g_memdup(p, buffer->data_size);
+            r = mparser_find_startcode(nal, end);
 
-                track_write(tr, buffer);
+            // trailing zeros belong to the next four bytes start code
+            for (nal_end = r; nal_end > nal && !nal_end[-1]; nal_end--);
 
-                fnc_log(FNC_LOG_VERBOSE, "[h264] Sending single NAL %d",p[0]&0x1f);
-            } else {
-                //FU-A
-                fnc_log(FNC_LOG_VERBOSE, "[h264] frags");
-                frag_fu_a(p, q - p, tr);
-            }
-
-            p = q;
-
-        }
-        // last NAL
-        fnc_log(FNC_LOG_VERBOSE, "[h264] last NAL %d",p[0]&0x1f);
-        if (DEFAULT_MTU >= len - (p - data)) {
-            struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
-
-            buffer->timestamp = tr->pts;
-            buffer->delivery = tr->dts;
-            buffer->duration = tr->frame_duration;
-            buffer->marker = true;
-
-            buffer->data_size = len - (p - data);
-            buffer->data = g_memdup(p, buffer->data_size);
-
-            track_write(tr, buffer);
-
-            fnc_log(FNC_LOG_VERBOSE, "[h264] no frags");
-        } else {
-            //FU-A
-            fnc_log(FNC_LOG_VERBOSE, "[h264] frags");
-            frag_fu_a(p, len - (p - data), tr);
+            if (nal_end > nal)
+                h264_queue_nal(tr, &pending, data + (nal - data), nal_end - nal);
         }
     }
 
+    h264_flush(tr, &pending, true);
+
     fnc_log(FNC_LOG_VERBOSE, "[h264] Frame completed");
     return 0;
 }
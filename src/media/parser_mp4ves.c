@@ -46,20 +46,18 @@ int mp4ves_init(Track *track)
 int mp4ves_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_alloc(tr, MIN(tr->mtu, len));
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
-        buffer->marker = (len <= DEFAULT_MTU);
-
-        buffer->data_size = MIN(DEFAULT_MTU, len);
-        buffer->data = g_malloc(buffer->data_size);
+        buffer->marker = (len <= tr->mtu);
 
         memcpy(buffer->data, data, buffer->data_size);
 
-        len -= DEFAULT_MTU;
-        data += DEFAULT_MTU;
+        len -= tr->mtu;
+        data += tr->mtu;
     } while(len > 0);
 
     fnc_log(FNC_LOG_VERBOSE, "[mp4v]Frame completed");
@@ -27,35 +27,23 @@
 
 #include "media/media.h"
 
-// Stolen from ffmpeg (mpegvideo.c)
+/**
+ * @brief Find the next start code and its value
+ *
+ * @return A pointer to the byte following the start code value, that
+ *         is set in @p state; if there is no start code, @p end is
+ *         returned, and @p state is not changed.
+ */
 static uint8_t *find_start_code(uint8_t *p, uint8_t *end, uint32_t *state)
 {
-    int i;
+    const uint8_t *r = mparser_find_startcode(p, end);
 
-    if(p>=end)
+    if (end - r < 4)
         return end;
 
-    for(i=0; i<3; i++){
-        uint32_t tmp= *state << 8;
-        *state= tmp + *(p++);
-        if(tmp == 0x100 || p==end)
-            return p;
-    }
+    *state = 0x100 | r[3];
 
-    while(p<end){
-        if     (p[-1] > 1      ) p+= 3;
-        else if(p[-2]          ) p+= 2;
-        else if(p[-3]|(p[-1]-1)) p++;
-        else{
-            p++;
-            break;
-        }
-    }
-
-    p= MIN(p, end)-4;
-    *state= (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | (p[3]);
-
-    return p+4;
+    return p + (r - p) + 4;
 }
 
 /* Source code taken from ff_rtp_send_mpegvideo (ffmpeg libavformat) and
@@ -97,7 +85,7 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
     }
 
     while (rem > 0) {
-        payload = DEFAULT_MTU - 4;
+        payload = tr->mtu - 4;
 
         if (payload >= rem) {
             payload = rem;
@@ -119,7 +107,7 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
                         }
                         r1 = r;
                     } else {
-                        if (r - r1 < DEFAULT_MTU) {
+                        if (r - r1 < tr->mtu) {
                             payload = r1 - data - 4;
                             e = 1;
                         }
@@ -144,16 +132,14 @@ int mpv_parse(Track *tr, uint8_t *data, ssize_t len)
                 ffc;
             uint32_t header_n = htonl(header_h);
 
-            struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+            struct MParserBuffer *buffer =
+                mparser_buffer_alloc(tr, payload + 4);
 
             buffer->timestamp = tr->pts;
             buffer->delivery = tr->dts;
             buffer->duration = tr->frame_duration;
             buffer->marker = (payload == rem);
 
-            buffer->data_size = payload + 4;
-            buffer->data = g_malloc(buffer->data_size);
-
             memcpy(buffer->data, &header_n, sizeof(header_n));
             memcpy(buffer->data + 4, data, payload);
 
@@ -32,17 +32,14 @@ int mpa_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     ssize_t rem = len;
 
-    if (DEFAULT_MTU >= len + 4) {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+    if (tr->mtu >= len + 4) {
+        struct MParserBuffer *buffer = mparser_buffer_alloc(tr, len + 4);
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
         buffer->marker = true;
 
-        buffer->data_size = len + 4;
-        buffer->data = g_malloc(buffer->data_size);
-
         memset(buffer->data, 0, 4);
         memcpy(buffer->data + 4, data, len);
 
@@ -62,22 +59,19 @@ int mpa_parse(Track *tr, uint8_t *data, ssize_t len)
 
         offset = htonl(offset & 0xffff);
 
-        buffer = g_slice_new0(struct MParserBuffer);
+        buffer = mparser_buffer_alloc(tr, MIN(tr->mtu, rem + 4));
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
         buffer->marker = false;
 
-        buffer->data_size = MIN(DEFAULT_MTU, rem + 4);
-        buffer->data = g_malloc(buffer->data_size);
-
         memcpy(buffer->data, &offset, 4);
         memcpy(buffer->data + 4, data + offset, buffer->data_size - 4);
 
         track_write(tr, buffer);
 
-        rem -= DEFAULT_MTU - 4;
+        rem -= tr->mtu - 4;
         fnc_log(FNC_LOG_VERBOSE, "[mp3] frags");
     } while (rem >= 0);
 
@@ -23,6 +23,7 @@
 #include <config.h>
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "media/media.h"
 
@@ -30,18 +31,17 @@ int speex_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     struct MParserBuffer *buffer;
 
-    if (len > DEFAULT_MTU)
+    if (len > tr->mtu)
         return -1;
 
-    buffer = g_slice_new0(struct MParserBuffer);
+    buffer = mparser_buffer_alloc(tr, len);
 
     buffer->timestamp = tr->pts;
     buffer->delivery = tr->dts;
     buffer->duration = tr->frame_duration;
     buffer->marker = true;
 
-    buffer->data_size = len;
-    buffer->data = g_memdup(data, buffer->data_size);
+    memcpy(buffer->data, data, len);
 
     track_write(tr, buffer);
 
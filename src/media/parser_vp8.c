@@ -51,22 +51,20 @@ int vp8_init(Track *track)
 #define VP8_START_PACKET 1
 
 #define HEADER_SIZE 1
-#define MAX_PAYLOAD_SIZE (DEFAULT_MTU - HEADER_SIZE)
+#define MAX_PAYLOAD_SIZE(tr) ((tr)->mtu - HEADER_SIZE)
 
 int vp8_parse(Track *tr, uint8_t *data, ssize_t len)
 {
     uint8_t prefix[HEADER_SIZE] = { (data[0] & 1 ? 0 : 2) | VP8_START_PACKET };
 
     do {
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_alloc(tr, MIN(MAX_PAYLOAD_SIZE(tr), len) + HEADER_SIZE);
 
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
-        buffer->marker = (len <= MAX_PAYLOAD_SIZE);
-
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
+        buffer->marker = (len <= MAX_PAYLOAD_SIZE(tr));
 
         memcpy(buffer->data, &prefix[0], HEADER_SIZE);
         memcpy(buffer->data + HEADER_SIZE, data,
@@ -74,8 +72,8 @@ int vp8_parse(Track *tr, uint8_t *data, ssize_t len)
 
         track_write(tr, buffer);
 
-        len -= MAX_PAYLOAD_SIZE;
-        data += MAX_PAYLOAD_SIZE;
+        len -= MAX_PAYLOAD_SIZE(tr);
+        data += MAX_PAYLOAD_SIZE(tr);
 
         prefix[0] &= ~VP8_START_PACKET;
     } while (len > 0);
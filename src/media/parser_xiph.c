@@ -32,7 +32,7 @@
 #include "fnc_log.h"
 
 #define HEADER_SIZE 6
-#define MAX_PAYLOAD_SIZE (DEFAULT_MTU - HEADER_SIZE)
+#define MAX_PAYLOAD_SIZE(tr) ((tr)->mtu - HEADER_SIZE)
 
 int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
 {
@@ -41,13 +41,14 @@ int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
     do {
         uint16_t payload_size;
 
-        struct MParserBuffer *buffer = g_slice_new0(struct MParserBuffer);
+        struct MParserBuffer *buffer =
+            mparser_buffer_alloc(tr, MIN(MAX_PAYLOAD_SIZE(tr), len) + HEADER_SIZE);
 
-        if ( fragment == 0 && len <= MAX_PAYLOAD_SIZE )
+        if ( fragment == 0 && len <= MAX_PAYLOAD_SIZE(tr) )
             fragment = 1;
         else if ( fragment == 0 )
             fragment = 1 << 6; /* first frag */
-        else if ( len > MAX_PAYLOAD_SIZE )
+        else if ( len > MAX_PAYLOAD_SIZE(tr) )
             fragment = 2 << 6; /* middle frag */
         else
             fragment = 3 << 6; /* max frag */
@@ -55,10 +56,8 @@ int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
         buffer->timestamp = tr->pts;
         buffer->delivery = tr->dts;
         buffer->duration = tr->frame_duration;
-        buffer->marker = (len <= MAX_PAYLOAD_SIZE);
+        buffer->marker = (len <= MAX_PAYLOAD_SIZE(tr));
 
-        buffer->data_size = MIN(MAX_PAYLOAD_SIZE, len) + HEADER_SIZE;
-        buffer->data = g_malloc(buffer->data_size);
 
         payload_size = htons(buffer->data_size - HEADER_SIZE);
 
@@ -76,8 +75,8 @@ int xiph_parse(Track *tr, uint8_t *data, ssize_t len)
 
         track_write(tr, buffer);
 
-        len -= MAX_PAYLOAD_SIZE;
-        data += MAX_PAYLOAD_SIZE;
+        len -= MAX_PAYLOAD_SIZE(tr);
+        data += MAX_PAYLOAD_SIZE(tr);
     } while(len > 0);
 
     return 0;
@@ -21,12 +21,16 @@
  * */
 
 #include <glib.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
+#include <sys/stat.h>
 
 #include "media/media.h"
 #include "feng.h"
 #include "fnc_log.h"
+#include "metrics.h"
 
 /**
  * @defgroup resources Media backend resources handling
@@ -45,12 +49,24 @@ static Resource *sd2_open(const char *url)
 
     return false;
 }
+
+/* live resources are never recorded without live streaming support */
+Resource *timeshift_open(ATTR_UNUSED Resource *live)
+{
+    return NULL;
+}
+
+double timeshift_position(ATTR_UNUSED Resource *r,
+                          ATTR_UNUSED double wallclock)
+{
+    return 0;
+}
 #endif
 
 #ifdef HAVE_AVFORMAT
-extern Resource *avf_open(const char *url);
+extern Resource *avf_open(const char *url, gboolean mp2t);
 #else
-static Resource *avf_open(const char *url);
+static Resource *avf_open(const char *url, ATTR_UNUSED gboolean mp2t);
 {
     fnc_log(FNC_LOG_ERR,
             "unable to stream resource '%s', libavformat support not built in",
@@ -60,6 +76,59 @@ static Resource *avf_open(const char *url);
 }
 #endif
 
+static void r_set_settings(Resource *r, const MParserSettings *settings)
+{
+    GList *item;
+
+    r->settings = *settings;
+    for ( item = r->tracks; item != NULL; item = item->next ) {
+        Track *track = item->data;
+
+        track_set_mtu(track, settings->mtu);
+        track->bundle_time = settings->bundle_time / 1000.0;
+
+        if ( track->media_type == MP_video ) {
+            track->buffer_low = settings->video_buffer_low / 1000.0;
+            track->buffer_high = settings->video_buffer_high / 1000.0;
+        } else {
+            track->buffer_low = settings->audio_buffer_low / 1000.0;
+            track->buffer_high = settings->audio_buffer_high / 1000.0;
+        }
+    }
+}
+
+/**
+ * @brief Open a stored resource
+ *
+ * @param url The resolved URL of the resource within the vhost.
+ * @param settings How to packetize the tracks
+ *
+ * With the RTP cache enabled (see @ref rtp_cache), the resource is
+ * served from its cache file when valid; otherwise it's opened
+ * through libavformat and recorded into it while playing.
+ */
+static Resource *r_open_stored(const char *url,
+                               const MParserSettings *settings)
+{
+    Resource *r;
+
+    if ( feng_srv.rtp_cache_dir != NULL &&
+         (r = rtp_cache_open(url, settings)) != NULL ) {
+        r_set_settings(r, settings);
+        return r;
+    }
+
+    if ( (r = avf_open(url, settings->mp2t)) == NULL )
+        return NULL;
+
+    r_set_settings(r, settings);
+
+    if ( feng_srv.rtp_cache_dir != NULL )
+        rtp_cache_record_start(r, url);
+
+    return r;
+}
+
 /**
  * @brief Mutex regulating access to virtual resources
  *
@@ -83,6 +152,27 @@ static GStaticMutex virtual_resources_lock = G_STATIC_MUTEX_INIT;
  */
 static GHashTable *virtual_resources;
 
+/**
+ * @brief Seconds before opening again a virtual resource that failed
+ *
+ * Relayed resources are described by their upstream server, which
+ * might be unreachable; this spares each request the wait.
+ */
+#define VIRTUAL_RETRY_TIME 5.0
+
+/**
+ * @brief Virtual resource URLs being opened, outside of the lock
+ *
+ * The other requests for the same URL wait on @ref virtual_opened.
+ */
+static GHashTable *virtual_opening;
+static GCond *virtual_opened;
+
+/**
+ * @brief Time until which each virtual URL that failed is not opened
+ */
+static GHashTable *virtual_failures;
+
 /**
  * @brief Lock the mutex used for virtual resources
  */
@@ -108,32 +198,299 @@ static inline void r_virtual_unlock()
  *       error code when the resource is not found, not accessible or
  *       not readable.
  *
+ * The resource is opened without holding the lock, since it might
+ * have to be described by an upstream server (see @ref relay), so
+ * that the other virtual resources can still be opened meanwhile.
+ *
  * @see r_open
  */
 static Resource *r_open_virtual(const char *url)
 {
     Resource *r;
+    double *retry;
 
     r_virtual_lock();
 
-    if ( ! virtual_resources )
+    if ( ! virtual_resources ) {
         virtual_resources = g_hash_table_new(g_str_hash, g_str_equal);
+        virtual_opening = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, NULL);
+        virtual_failures = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+        virtual_opened = g_cond_new();
+    }
+
+    while ( (r = g_hash_table_lookup(virtual_resources, url)) == NULL &&
+            g_hash_table_lookup(virtual_opening, url) != NULL )
+        g_cond_wait(virtual_opened,
+                    g_static_mutex_get_mutex(&virtual_resources_lock));
 
-    if ( (r = g_hash_table_lookup(virtual_resources, url)) != NULL )
+    if ( r != NULL ) {
         g_atomic_int_inc(&r->live.count);
-    else {
-        r = sd2_open(url);
+        r_virtual_unlock();
+        return r;
+    }
+
+    if ( (retry = g_hash_table_lookup(virtual_failures, url)) != NULL &&
+         ev_time() < *retry ) {
+        r_virtual_unlock();
+        return NULL;
+    }
+
+    g_hash_table_insert(virtual_opening, g_strdup(url), GINT_TO_POINTER(1));
+    r_virtual_unlock();
+
+    r = sd2_open(url);
+
+    r_virtual_lock();
+    g_hash_table_remove(virtual_opening, url);
+
+    if ( r != NULL ) {
+        g_hash_table_remove(virtual_failures, url);
         g_hash_table_insert(virtual_resources, g_strdup(url), r);
+    } else {
+        retry = g_new(double, 1);
+        *retry = ev_time() + VIRTUAL_RETRY_TIME;
+        g_hash_table_replace(virtual_failures, g_strdup(url), retry);
     }
 
+    g_cond_broadcast(virtual_opened);
     r_virtual_unlock();
+
     return r;
 }
 
+/**
+ * @defgroup shared_resources Shared stored resources
+ *
+ * @brief Demux once for many viewers of the same stored file
+ *
+ * When @ref cfg_options_t::shared_vod_window is set, clients opening
+ * the same stored file (same URL and modification time) attach as
+ * consumers to the same Resource, so that its tracks are read and
+ * parsed only once, like it happens for live resources.
+ *
+ * A shared resource runs on a single timeline, started by the first
+ * PLAY: later viewers join it at its current position, as long as
+ * they ask to start within the window from it (see @ref
+ * r_share_play). A viewer seeking away from the timeline, or
+ * pausing, is split off onto a private resource of its own (see
+ * @ref r_unshare).
+ *
+ * Once a shared resource can't be joined anymore (it was paused or
+ * seeked by its only viewer, or it's past the window), it's removed
+ * from @ref shared_resources and a new one is opened for the next
+ * viewers.
+ *
+ * The shared_* fields of @ref Resource::stored are protected by
+ * @ref shared_resources_lock.
+ *
+ * @{
+ */
+
+static GStaticMutex shared_resources_lock = G_STATIC_MUTEX_INIT;
+
+/**
+ * @brief Shared resources that can still be joined, by URL
+ *
+ * The keys are owned by the resources themselves (@ref
+ * Resource::stored::shared_url).
+ */
+static GHashTable *shared_resources;
+
+/**
+ * @brief Make a shared resource non-joinable
+ *
+ * @note This function has to be called with @ref
+ *       shared_resources_lock held.
+ */
+static void r_unpublish(Resource *r)
+{
+    if ( !r->stored.shared_published )
+        return;
+
+    g_hash_table_remove(shared_resources, r->stored.shared_url);
+    r->stored.shared_published = false;
+}
+
+/**
+ * @brief Retrieve or create the shared resource for a stored file
+ *
+ * @param url The resolved URL of the resource within the vhost.
+ * @param settings How to packetize the tracks; clients asking for
+ *                 different settings get a private copy.
+ *
+ * @return Pointer to the Resource designed by @p url or NULL in case
+ *         of error.
+ *
+ * @see r_open
+ */
+static Resource *r_open_shared(const char *url,
+                               const MParserSettings *settings)
+{
+    const double window = feng_srv.shared_vod_window;
+    gchar *path = g_strjoin("/", feng_default_vhost->document_root,
+                            url, NULL);
+    struct stat filestat;
+    Resource *r, *other;
+    int stat_res = stat(path, &filestat);
+
+    g_free(path);
+
+    g_static_mutex_lock(&shared_resources_lock);
+
+    if ( ! shared_resources )
+        shared_resources = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( (r = g_hash_table_lookup(shared_resources, url)) != NULL ) {
+        if ( !mparser_settings_equal(&r->settings, settings) ) {
+            /* the packets don't suit the client, leave the shared
+               copy alone for the others */
+            g_static_mutex_unlock(&shared_resources_lock);
+            return r_open_stored(url, settings);
+        }
+
+        if ( stat_res == 0 && r->mtime == filestat.st_mtime &&
+             !g_atomic_int_get(&r->eor) &&
+             ( !r->stored.shared_started ||
+               ev_time() - r->stored.shared_origin <= window ) ) {
+            const int viewers = ++r->stored.shared_viewers;
+
+            g_static_mutex_unlock(&shared_resources_lock);
+
+            fnc_log(FNC_LOG_DEBUG, "[%s] joining shared resource (%d viewers)",
+                    url, viewers);
+            return r;
+        }
+
+        r_unpublish(r);
+    }
+
+    g_static_mutex_unlock(&shared_resources_lock);
+
+    /* don't keep the other clients waiting while opening */
+    if ( (r = r_open_stored(url, settings)) == NULL )
+        return NULL;
+
+    r->stored.shared_url = g_strdup(url);
+    r->stored.shared_viewers = 1;
+    r->stored.shared_published = true;
+
+    g_static_mutex_lock(&shared_resources_lock);
+
+    /* someone might have opened the same file in the meantime; the
+       newest one is the joinable copy */
+    if ( (other = g_hash_table_lookup(shared_resources, url)) != NULL )
+        r_unpublish(other);
+
+    g_hash_table_insert(shared_resources, r->stored.shared_url, r);
+
+    g_static_mutex_unlock(&shared_resources_lock);
+
+    return r;
+}
+
+/**
+ * @brief Decide how a PLAY request uses a shared resource
+ *
+ * @param resource The resource to play
+ * @param begin_time The requested starting position
+ * @param playback_time The time the playback is requested to start at
+ * @param position Where to store the position to join the timeline at
+ *
+ * @retval SHARE_PRIVATE The resource can be used as a private one:
+ *                       it's either not shared, only used by this
+ *                       viewer, or this is the first PLAY starting
+ *                       the shared timeline.
+ * @retval SHARE_JOIN The viewer joins the shared timeline at
+ *                    @p position; no seek has to happen.
+ * @retval SHARE_SPLIT The viewer is too far from the shared timeline
+ *                     and has to split off with @ref r_unshare.
+ */
+ResourceShare r_share_play(Resource *resource, double begin_time,
+                           double playback_time, double *position)
+{
+    ResourceShare ret = SHARE_PRIVATE;
+    double pos;
+
+    if ( resource->source == LIVE_SOURCE ||
+         resource->stored.shared_url == NULL )
+        return SHARE_PRIVATE;
+
+    g_static_mutex_lock(&shared_resources_lock);
+
+    if ( !resource->stored.shared_published )
+        goto end;
+
+    if ( !resource->stored.shared_started ) {
+        resource->stored.shared_started = true;
+        resource->stored.shared_origin = playback_time - begin_time;
+        goto end;
+    }
+
+    pos = playback_time - resource->stored.shared_origin;
+
+    if ( !g_atomic_int_get(&resource->eor) &&
+         fabs(begin_time - pos) <= feng_srv.shared_vod_window ) {
+        *position = pos;
+        ret = SHARE_JOIN;
+    } else if ( resource->stored.shared_viewers > 1 )
+        ret = SHARE_SPLIT;
+    else
+        r_unpublish(resource);
+
+ end:
+    g_static_mutex_unlock(&shared_resources_lock);
+    return ret;
+}
+
+/**
+ * @brief Tells whether a resource is used by more than one viewer
+ */
+gboolean r_shared(Resource *resource)
+{
+    gboolean ret;
+
+    if ( resource->source == LIVE_SOURCE ||
+         resource->stored.shared_url == NULL )
+        return false;
+
+    g_static_mutex_lock(&shared_resources_lock);
+    ret = resource->stored.shared_viewers > 1;
+    g_static_mutex_unlock(&shared_resources_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Open a private copy of a shared resource
+ *
+ * @param resource The shared resource to split off from
+ *
+ * @return A new resource for the same file, never shared, or NULL in
+ *         case of error.
+ *
+ * The caller is responsible for moving its consumers to the new
+ * resource's tracks, and closing @p resource afterwards.
+ */
+Resource *r_unshare(Resource *resource)
+{
+    g_assert(resource->stored.shared_url != NULL);
+
+    return r_open_stored(resource->stored.shared_url, &resource->settings);
+}
+
+/**
+ * @}
+ */
+
 /**
  * @brief Retrieve or create the resource for a given URL
  *
  * @param url The resolved URL of the resource within the vhost.
+ * @param settings How to packetize the resource for the client; it's
+ *                 ignored for live resources, that are packetized by
+ *                 their producers.
  *
  * @return Pointer to the Resource designed by @p url, or NULL in case
  *         of error.
@@ -149,12 +506,14 @@ static Resource *r_open_virtual(const char *url)
  *
  * @see r_open_virtual
  */
-Resource *r_open(const char *url)
+Resource *r_open(const char *url, const MParserSettings *settings)
 {
     if ( g_str_has_prefix(url, "/virtual/") )
         return r_open_virtual(url + strlen("/virtual/"));
+    else if ( feng_srv.shared_vod_window > 0 )
+        return r_open_shared(url, settings);
     else
-        return avf_open(url);
+        return r_open_stored(url, settings);
 }
 
 /**
@@ -217,6 +576,20 @@ static void r_track_producer_reset_queue(gpointer element,
     track_reset_queue(t);
 }
 
+/**
+ * @brief Send the data a track's parser is holding back
+ *
+ * @param element The Track element from the list
+ * @param user_data Unused, for compatibility with g_list_foreach().
+ */
+static void r_track_flush(gpointer element,
+                          ATTR_UNUSED gpointer user_data) {
+    Track *t = (Track*)element;
+
+    if ( t->flush != NULL )
+        t->flush(t);
+}
+
 /**
  * @brief Seek a resource to a given time in stream
  *
@@ -232,6 +605,11 @@ int r_seek(Resource *resource, double time) {
 
     g_mutex_lock(resource->lock);
 
+    /* whatever was held back is dropped with the queues */
+    g_list_foreach(resource->tracks, r_track_flush, NULL);
+
+    rtp_cache_record_seek(resource, time);
+
     res = resource->seek(resource, time);
 
     g_list_foreach(resource->tracks, r_track_producer_reset_queue, NULL);
@@ -242,68 +620,271 @@ int r_seek(Resource *resource, double time) {
 }
 
 /**
- * @brief Callback for the queue filling for the resource
+ * @brief Set the speed a resource is played at
+ *
+ * @param resource The Resource to play
+ * @param scale The speed, negative to play backward; 1.0 for the
+ *              normal playback
+ *
+ * @retval 0 The speed applies from the next seek (see @ref r_seek).
+ * @retval -1 The resource can only be played at the normal speed:
+ *            live and shared resources, and those that can't send
+ *            their keyframes alone (see @ref Resource::set_scale).
+ *
+ * @note This function will lock the @ref Resource::lock mutex.
+ */
+int r_set_scale(Resource *resource, double scale) {
+    int res;
+
+    if ( resource->source == LIVE_SOURCE || resource->set_scale == NULL ||
+         resource->stored.shared_url != NULL )
+        return scale == 1.0 ? 0 : -1;
+
+    g_mutex_lock(resource->lock);
+
+    /* the keyframes alone don't make for a cache of the file */
+    if ( scale != 1.0 )
+        rtp_cache_record_abort(resource);
+
+    res = resource->set_scale(resource, scale);
+
+    g_mutex_unlock(resource->lock);
+
+    return res;
+}
+
+/**
+ * @defgroup demux_pool Shared demuxer pool
+ *
+ * @brief Bounded set of threads reading the stored resources
+ *
+ * The stored resources are not read by a thread of their own;
+ * instead a fixed amount of threads (see @ref cfg_options_t::demux_threads)
+ * is shared among all of them. Each time a consumer asks for its
+ * queue to be filled (@ref r_fill), the resource is queued for
+ * reading, unless it's queued already; the requests are coalesced so
+ * that at most one is pending per resource, plus one for a resource
+ * being read at the time.
+ *
+ * The queue is ordered by how close each resource is to running out
+ * of data: the resource whose consumer has the fewest buffers left to
+ * send is read first.
+ *
+ * All the fill_* fields of @ref Resource::stored are protected by
+ * @ref demux_pool::lock.
+ *
+ * @{
+ */
+
+/**
+ * @brief Fill state of a stored resource
+ */
+enum {
+    FILL_IDLE,          /*!< Not queued, not being read */
+    FILL_QUEUED,        /*!< Waiting in the queue for a thread */
+    FILL_RUNNING        /*!< Being read by one of the threads */
+};
+
+static struct {
+    GMutex *lock;
+
+    /** Signalled when a resource is queued */
+    GCond *wakeup;
+
+    /** Signalled when a resource stops being read */
+    GCond *idle;
+
+    /** Resources waiting to be read, most urgent first */
+    GQueue *queue;
+} demux_pool;
+
+/**
+ * @brief Read from a resource until its consumer has enough data
  *
- * @param consumer_p A generic pointer to the consumer for non-live queues
- * @param resource_p A generic pointer to the resource to fill the queue of
+ * @param resource The resource to read from
+ * @param consumer The consumer that requested the data
  *
  * This function takes care of reading the data from the demuxer (via
  * @ref Resource::read_packet); it will executed repeatedly until
  * either the resources ends (@ref Resource::eor becomes non-zero),
- * the thread is requested to stop (@ref Resource::fill_pool becomes
- * NULL), or, for non-live resources only, when the @ref consumer_p
- * queue is long enough for the client to receive data.
- *
- * @note For live streams, the @ref consume_p pointer should have the
- *       value -1 to indicate that it shouldn't be used.
+ * the resource is paused (@ref Resource::stored::fill_active becomes
+ * zero), the resource has nothing more to read yet (@ref
+ * Resource::read_packet returns @c RESOURCE_AGAIN), or when the @p
+ * consumer has @ref Track::buffer_high seconds of media queued, plus
+ * the lead of its fast start, if any (@ref RTP_session::fast_start);
+ * @ref cfg_options_t::buffered_frames only bounds the packets queued,
+ * in case the timestamps don't move.
  *
  * @note This function will lock the @ref Resource::lock mutex
  *       (repeatedly).
  */
-static void r_read_cb(gpointer consumer_p, gpointer resource_p)
+static void r_read_unlocked(Resource *resource,
+                            struct RTP_session *consumer)
 {
-    Resource *resource = (Resource*)resource_p;
-    struct RTP_session *consumer = (struct RTP_session*)consumer_p;
     const gulong buffered_frames = feng_srv.buffered_frames;
+    GTimer *timer = g_timer_new();
+    gboolean again = false;
 
     g_assert(resource->source != LIVE_SOURCE);
-    g_assert(consumer != GINT_TO_POINTER(-1));
 
     do {
-        /* setting this to NULL with an atomic, non-locking operation
-           is our "stop" signal. */
-        if ( g_atomic_pointer_get(&resource->stored.fill_pool) == NULL )
-            return;
+        /* clearing this with an atomic, non-locking operation is our
+           "stop" signal. */
+        if ( g_atomic_int_get(&resource->stored.fill_active) == 0 )
+            break;
 
-        /* Only check for enough buffered frames if we're not doing
-           live; otherwise keep on filling; we also assume that
-           consumer will be NULL in that case. */
-        if ( bq_consumer_unseen(consumer) >= buffered_frames )
-            return;
+        if ( bq_consumer_buffered(consumer) >=
+             consumer->track->buffer_high + consumer->fast_start.lead ||
+             bq_consumer_unseen(consumer) >= buffered_frames )
+            break;
 
-        //        fprintf(stderr, "r_read_cb(%p)\n", resource);
+        if ( resource->read_wait != NULL )
+            resource->read_wait(resource);
 
         g_mutex_lock(resource->lock);
         switch( resource->read_packet(resource) ) {
         case RESOURCE_OK:
             break;
+        case RESOURCE_AGAIN:
+            /* the next fill request comes with the next packet sent */
+            again = true;
+            break;
         case RESOURCE_EOF:
             fnc_log(FNC_LOG_INFO,
                     "r_read_unlocked: %s read_packet() end of file.",
                     resource->mrl);
+            g_list_foreach(resource->tracks, r_track_flush, NULL);
+            rtp_cache_record_finish(resource);
             resource->eor = true;
             break;
         default:
             fnc_log(FNC_LOG_FATAL,
                     "r_read_unlocked: %s read_packet() error.",
                     resource->mrl);
+            rtp_cache_record_abort(resource);
             resource->eor = true;
             break;
         }
         g_mutex_unlock(resource->lock);
-    } while ( g_atomic_int_get(&resource->eor) == 0 );
+    } while ( !again && g_atomic_int_get(&resource->eor) == 0 );
+
+    metrics_observe(METRIC_FILL_DURATION, g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+}
+
+/**
+ * @brief Compare two queued resources by urgency
+ *
+ * @internal This function should _only_ be used by @ref r_fill_queue.
+ */
+static gint r_fill_cmp(gconstpointer a, gconstpointer b,
+                       ATTR_UNUSED gpointer user_data)
+{
+    const Resource *ra = a, *rb = b;
+
+    if ( ra->stored.fill_buffered == rb->stored.fill_buffered )
+        return 0;
+
+    return ra->stored.fill_buffered < rb->stored.fill_buffered ? -1 : 1;
 }
 
+/**
+ * @brief Queue a resource to be read by the pool
+ *
+ * @param resource The resource to queue
+ *
+ * @note This function has to be called with @ref demux_pool::lock
+ *       held.
+ */
+static void r_fill_queue(Resource *resource)
+{
+    resource->stored.fill_buffered =
+        bq_consumer_buffered(resource->stored.fill_consumer);
+    resource->stored.fill_state = FILL_QUEUED;
+
+    g_queue_insert_sorted(demux_pool.queue, resource, r_fill_cmp, NULL);
+    g_cond_signal(demux_pool.wakeup);
+}
+
+/**
+ * @brief Main function of the demuxer threads
+ *
+ * Picks the most urgent resource off the queue, and reads from it
+ * until it has enough data; if a new request arrived in the meantime,
+ * the resource is queued again.
+ */
+static gpointer r_demux_thread(ATTR_UNUSED gpointer unused)
+{
+    affinity_pin_demux();
+
+    g_mutex_lock(demux_pool.lock);
+
+    while ( true ) {
+        Resource *resource;
+        struct RTP_session *consumer;
+
+        while ( (resource = g_queue_pop_head(demux_pool.queue)) == NULL )
+            g_cond_wait(demux_pool.wakeup, demux_pool.lock);
+
+        resource->stored.fill_state = FILL_RUNNING;
+        resource->stored.fill_again = false;
+        consumer = resource->stored.fill_reading =
+            resource->stored.fill_consumer;
+
+        g_mutex_unlock(demux_pool.lock);
+
+        r_read_unlocked(resource, consumer);
+
+        g_mutex_lock(demux_pool.lock);
+
+        resource->stored.fill_reading = NULL;
+
+        if ( resource->stored.fill_again &&
+             resource->stored.fill_consumer != NULL &&
+             resource->stored.fill_active &&
+             !g_atomic_int_get(&resource->eor) )
+            r_fill_queue(resource);
+        else
+            resource->stored.fill_state = FILL_IDLE;
+
+        g_cond_broadcast(demux_pool.idle);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the shared demuxer threads
+ *
+ * This has to be called once, before any client is served.
+ */
+void r_init()
+{
+    guint i;
+
+    demux_pool.lock = g_mutex_new();
+    demux_pool.wakeup = g_cond_new();
+    demux_pool.idle = g_cond_new();
+    demux_pool.queue = g_queue_new();
+
+    for ( i = 0; i < feng_srv.demux_threads; i++ ) {
+        GError *err = NULL;
+
+        if ( g_thread_create(r_demux_thread, NULL, false, &err) == NULL ) {
+            fnc_log(FNC_LOG_FATAL, "Unable to start demuxer thread: %s",
+                    err->message);
+            exit(1);
+        }
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "Reading stored resources with %u threads",
+            feng_srv.demux_threads);
+}
+
+/**
+ * @}
+ */
+
 static void free_track(gpointer element,
                        ATTR_UNUSED gpointer user_data)
 {
@@ -319,15 +900,12 @@ static void free_track(gpointer element,
  * For virtual resources, closing the resource will not actually free
  * anything; only the count value will be decremented.
  *
- * This function stops the fill thread for a resource, before freeing
- * it. It's accomplished by first setting @ref Resource::fill_pool
- * attribute to NULL, then it stops the pool, dropping further threads
- * and waiting for the last one to complete.
+ * For stored resources, the resource is first paused (see @ref
+ * r_pause), so that no demuxer thread can access it anymore; shared
+ * resources are only freed once their last viewer closes them.
  */
 void r_close(Resource *resource)
 {
-    GThreadPool *pool;
-
     if ( resource == NULL )
         return;
 
@@ -336,16 +914,25 @@ void r_close(Resource *resource)
         return;
     }
 
-    if ( (pool = resource->stored.fill_pool) ) {
-        g_atomic_pointer_set(&resource->stored.fill_pool, NULL);
-        g_thread_pool_free(pool, true, true);
+    if ( resource->stored.shared_url != NULL ) {
+        g_static_mutex_lock(&shared_resources_lock);
+        if ( --resource->stored.shared_viewers > 0 ) {
+            g_static_mutex_unlock(&shared_resources_lock);
+            return;
+        }
+        r_unpublish(resource);
+        g_static_mutex_unlock(&shared_resources_lock);
     }
 
+    r_pause(resource);
+
+    rtp_cache_record_abort(resource);
+
+    g_free(resource->stored.shared_url);
+
     if (resource->lock)
         g_mutex_free(resource->lock);
 
-    g_free(resource->mrl);
-
     if ( resource->uninit != NULL )
         resource->uninit(resource);
 
@@ -354,6 +941,9 @@ void r_close(Resource *resource)
         g_list_free(resource->tracks);
     }
 
+    /* the metrics report the tracks by their resource's mrl */
+    g_free(resource->mrl);
+
     g_slice_free(Resource, resource);
 }
 
@@ -362,33 +952,84 @@ void r_close(Resource *resource)
  *
  * @param resource The resource to pause
  *
- * This function stops the "fill thread" for the resource, when it is
- * not shared among clients (i.e.: it's not a live resource).
+ * This function stops the reading of the resource, when it is not
+ * shared among clients (i.e.: it's not a live resource): a pending
+ * fill request is dropped, and if a demuxer thread is reading the
+ * resource, the function waits for it to be done.
  *
- * It removes @ref Resource::fill_pool and sets it to NULL to stop the
- * thread running.
+ * A shared resource is not paused while other viewers are using it;
+ * otherwise it can't be joined anymore, as its timeline stops.
  *
- * @note This function will lock the @ref Resource::lock mutex.
+ * @note This function will lock the @ref demux_pool::lock mutex.
  */
 void r_pause(Resource *resource)
 {
-    GThreadPool *pool;
-
     /* Don't even try to pause a live source! */
     if ( resource->source == LIVE_SOURCE )
         return;
 
-    /* we paused already */
-    if ( resource->stored.fill_pool == NULL )
+    if ( resource->stored.shared_url != NULL ) {
+        g_static_mutex_lock(&shared_resources_lock);
+        if ( resource->stored.shared_viewers > 1 ) {
+            g_static_mutex_unlock(&shared_resources_lock);
+            return;
+        }
+        r_unpublish(resource);
+        g_static_mutex_unlock(&shared_resources_lock);
+    }
+
+    g_mutex_lock(demux_pool.lock);
+
+    g_atomic_int_set(&resource->stored.fill_active, 0);
+
+    if ( resource->stored.fill_state == FILL_QUEUED ) {
+        g_queue_remove(demux_pool.queue, resource);
+        resource->stored.fill_state = FILL_IDLE;
+    }
+
+    while ( resource->stored.fill_state == FILL_RUNNING )
+        g_cond_wait(demux_pool.idle, demux_pool.lock);
+
+    resource->stored.fill_consumer = NULL;
+
+    g_mutex_unlock(demux_pool.lock);
+}
+
+/**
+ * @brief Stop reading a non-live resource on behalf of a consumer
+ *
+ * @param resource The resource the consumer is reading from
+ * @param consumer The consumer going away
+ *
+ * Drops the pending fill request of @p consumer, if any, and waits
+ * for a demuxer thread reading on its behalf to be done, so that the
+ * consumer can be freed or moved to a different track. The resource
+ * keeps being read for its other consumers.
+ *
+ * @note This function will lock the @ref demux_pool::lock mutex.
+ */
+void r_detach(Resource *resource, struct RTP_session *consumer)
+{
+    if ( resource->source == LIVE_SOURCE )
         return;
 
-    g_mutex_lock(resource->lock);
+    g_mutex_lock(demux_pool.lock);
 
-    pool = resource->stored.fill_pool;
-    g_atomic_pointer_set(&resource->stored.fill_pool, NULL);
-    g_thread_pool_free(pool, true, true);
+    if ( resource->stored.fill_consumer == consumer ) {
+        resource->stored.fill_consumer = NULL;
+        resource->stored.fill_again = false;
 
-    g_mutex_unlock(resource->lock);
+        if ( resource->stored.fill_state == FILL_QUEUED ) {
+            g_queue_remove(demux_pool.queue, resource);
+            resource->stored.fill_state = FILL_IDLE;
+        }
+    }
+
+    while ( resource->stored.fill_state == FILL_RUNNING &&
+            resource->stored.fill_reading == consumer )
+        g_cond_wait(demux_pool.idle, demux_pool.lock);
+
+    g_mutex_unlock(demux_pool.lock);
 }
 
 /**
@@ -396,27 +1037,22 @@ void r_pause(Resource *resource)
  *
  * @param resource The resource to resume
  *
- * This functions creates a new instance for @ref Resource::fill_pool,
- * and sets it into the resource so that it can be used to fill the
- * queue.
+ * This functions allows the fill requests for the resource to be
+ * served again by the demuxer threads.
  */
 void r_resume(Resource *resource)
 {
-    GThreadPool *pool;
-
     /* Don't even try to resume a live source! */
     if ( resource->source == LIVE_SOURCE )
         return;
 
-    /* running already, or auto-filled */
-    if ( g_atomic_pointer_get(&resource->stored.fill_pool) != NULL ||
-         g_atomic_pointer_get(&resource->read_packet) == NULL )
+    /* auto-filled */
+    if ( g_atomic_pointer_get(&resource->read_packet) == NULL )
         return;
 
-    pool = g_thread_pool_new(r_read_cb, resource,
-                             1, true, NULL);
-
-    g_atomic_pointer_set(&resource->stored.fill_pool, pool);
+    g_mutex_lock(demux_pool.lock);
+    g_atomic_int_set(&resource->stored.fill_active, 1);
+    g_mutex_unlock(demux_pool.lock);
 }
 
 /**
@@ -425,31 +1061,62 @@ void r_resume(Resource *resource)
  * @param resource The resource to fill the queue for
  * @param consumer The consumer of the queue to fill
  *
- * This function will create a new thread (or push a new one to be
- * executed afterwars) so that the consumer gets enough frames to send
- * the client.
+ * This function will queue the resource to be read by one of the
+ * demuxer threads, once the consumer has less than @ref
+ * Track::buffer_low seconds of media left to send (plus the lead of
+ * its fast start, since it's sending that much ahead), so that reads
+ * come in batches. If the resource is queued already, the request is
+ * merged with the pending one, and the read is sized on whichever
+ * consumer has the least data left; if it's being read, it's queued
+ * again once the current read is done.
  *
  * @note This function is no-op for live streams as they take care of
  *       the filling themselves.
  *
- * @note This function will lock the @ref Resource::lock mutex.
+ * @note This function will lock the @ref demux_pool::lock mutex.
  */
 void r_fill(Resource *resource, struct RTP_session *consumer)
 {
+    double buffered;
+
     /* Don't even try to fill a live source! */
     if ( resource->source == LIVE_SOURCE )
         return;
 
-    g_mutex_lock(resource->lock);
+    buffered = bq_consumer_buffered(consumer);
+    if ( buffered >= consumer->track->buffer_low + consumer->fast_start.lead )
+        return;
 
-    if ( resource->stored.fill_pool == NULL )
+    g_mutex_lock(demux_pool.lock);
+
+    if ( !resource->stored.fill_active )
         goto end;
 
-    g_thread_pool_push(resource->stored.fill_pool,
-                       consumer, NULL);
+    switch ( resource->stored.fill_state ) {
+    case FILL_IDLE:
+        resource->stored.fill_consumer = consumer;
+        r_fill_queue(resource);
+        break;
+    case FILL_QUEUED:
+        /* move it up the queue if this consumer is running lower */
+        if ( resource->stored.fill_consumer == NULL ||
+             buffered < resource->stored.fill_buffered ) {
+            g_queue_remove(demux_pool.queue, resource);
+            resource->stored.fill_consumer = consumer;
+            r_fill_queue(resource);
+        }
+        break;
+    case FILL_RUNNING:
+        if ( !resource->stored.fill_again ||
+             resource->stored.fill_consumer == NULL ||
+             buffered < bq_consumer_buffered(resource->stored.fill_consumer) )
+            resource->stored.fill_consumer = consumer;
+        resource->stored.fill_again = true;
+        break;
+    }
 
  end:
-    g_mutex_unlock(resource->lock);
+    g_mutex_unlock(demux_pool.lock);
 }
 
 /**
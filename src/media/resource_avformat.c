@@ -25,6 +25,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
 
 #include "feng.h"
 #include "fnc_log.h"
@@ -33,9 +34,17 @@
 
 #include <libavformat/avformat.h>
 
+/** Playback time between two keyframes sent in trick play */
+#define AVF_TRICK_INTERVAL 0.25
+
+/** Tolerance on the time of the keyframe sought in trick play */
+#define AVF_TRICK_SLACK 0.001
+
 static int avf_seek(Resource * r, double time_sec);
 static void avf_uninit(gpointer rgen);
 static int avf_read_packet(Resource * r);
+static void avf_read_wait(Resource *r);
+static int avf_set_scale(Resource *r, double scale);
 
 static int fc_lock_manager(void **mutex, enum AVLockOp op)
 {
@@ -71,7 +80,14 @@ void ffmpeg_init(void)
  * safe, and needs lock-protection;
  */
 
-Resource *avf_open(const char *url)
+/**
+ * @brief Open a stored file through libavformat
+ *
+ * @param url The path of the file, within the default vhost
+ * @param mp2t Whether to send the tracks muxed in MPEG-TS (see @ref
+ *             mp2t); the file is sent as is if they can't be muxed.
+ */
+Resource *avf_open(const char *url, gboolean mp2t)
 {
     Resource *r = NULL;
     Track *track = NULL;
@@ -111,6 +127,12 @@ Resource *avf_open(const char *url)
 
     r->stored.avfc->flags |= AVFMT_FLAG_GENPTS;
 
+    /* if the file can't be opened, libavformat will tell why */
+    r->stored.prefetch = avio_prefetch_open(mrl, feng_srv.readahead_window,
+                                            feng_srv.mmap_io);
+    if ( r->stored.prefetch != NULL )
+        r->stored.avfc->pb = avio_prefetch_context(r->stored.prefetch);
+
     i =  avformat_open_input(&r->stored.avfc, mrl, NULL, NULL);
 
     if ( i != 0 ) {
@@ -193,24 +215,33 @@ Resource *avf_open(const char *url)
             break;
 
         case AV_CODEC_ID_AAC:
+            /* ADTS streams: the filter sets the extradata up from the
+               first frame's header; the headers of the following
+               frames are skipped by aac_parse itself */
             if ( codec->extradata_size == 0 ) {
+                AVBitStreamFilterContext *bsfc;
                 AVPacket pkt;
 
-                if ( (st->codec->opaque = av_bitstream_filter_init("aac_adtstoasc")) == NULL )
+                if ( (bsfc = av_bitstream_filter_init("aac_adtstoasc")) == NULL )
                     goto err_alloc;
 
-                while((av_read_frame(r->stored.avfc, &pkt) >= 0) && !codec->extradata_size) {
-                    uint8_t *data;
-                    int size;
-                    if(pkt.stream_index != j)
-                        continue;
-                    av_bitstream_filter_filter(st->codec->opaque, codec, NULL,
-                                               &data, &size,
-                                               pkt.data, pkt.size,
-                                               pkt.flags & AV_PKT_FLAG_KEY);
-                    break;
+                while ( !codec->extradata_size &&
+                        av_read_frame(r->stored.avfc, &pkt) >= 0 ) {
+                    uint8_t *data = NULL;
+                    int size = 0;
+
+                    if ( pkt.stream_index == (int)j &&
+                         av_bitstream_filter_filter(bsfc, codec, NULL,
+                                                    &data, &size,
+                                                    pkt.data, pkt.size,
+                                                    pkt.flags & AV_PKT_FLAG_KEY) > 0 )
+                        av_free(data);
+
+                    av_free_packet(&pkt);
                 }
 
+                av_bitstream_filter_close(bsfc);
+
                 if (!codec->extradata_size)
                     goto err_alloc;
 
@@ -263,6 +294,8 @@ Resource *avf_open(const char *url)
         if ( track->payload_type == -1 )
             track->payload_type = pt++;
 
+        track->bitrate = codec->bit_rate;
+
         switch(codec->codec_type){
         case AVMEDIA_TYPE_AUDIO:
             track->media_type     = MP_audio;
@@ -318,18 +351,28 @@ Resource *avf_open(const char *url)
     /* Now that we know the resource is valid and we can read it,
        allocate the structure that will be returned. */
 
+    if ( mp2t && (r->stored.mp2t = mp2t_open(r)) == NULL )
+        fnc_log(FNC_LOG_WARN, "[avf] %s can't be sent as MPEG-TS", mrl);
+
     r->mrl = mrl;
     r->lock = g_mutex_new();
     r->mtime = filestat.st_mtime;
 
     r->read_packet = avf_read_packet;
     r->uninit = avf_uninit;
+    if ( r->stored.prefetch != NULL )
+        r->read_wait = avf_read_wait;
 
     /* Try seeking to make sure that we can seek, as libavformat might
        not implement seeking for the format we're using here; if it
        doesn't, do not set a seek method */
-    if ( !av_seek_frame(r->stored.avfc, -1, 0, 0) )
+    if ( !av_seek_frame(r->stored.avfc, -1, 0, 0) ) {
         r->seek = avf_seek;
+        r->stored.seek_index = seek_index_load(mrl, &filestat);
+        /* the trick play sends the keyframes of a single track */
+        if ( r->stored.seek_index != NULL && r->stored.mp2t == NULL )
+            r->set_scale = avf_set_scale;
+    }
 
     r->duration = (double)r->stored.avfc->duration /AV_TIME_BASE;
     fnc_log(FNC_LOG_DEBUG, "[avf] duration %f", r->duration);
@@ -337,9 +380,16 @@ Resource *avf_open(const char *url)
     for(j = 0; j < r->stored.avfc->nb_streams; j++)
         if ( r->stored.tracks[j] ) {
             r->stored.tracks[j]->parent = r;
-            r->tracks = g_list_append(r->tracks, r->stored.tracks[j]);
+            if ( r->stored.mp2t == NULL )
+                r->tracks = g_list_append(r->tracks, r->stored.tracks[j]);
         }
 
+    if ( r->stored.mp2t != NULL ) {
+        track = mp2t_track(r->stored.mp2t);
+        track->parent = r;
+        r->tracks = g_list_append(r->tracks, track);
+    }
+
     return r;
 
  err_alloc:
@@ -350,6 +400,7 @@ Resource *avf_open(const char *url)
             avformat_close_input(&r->stored.avfc);
         }
 
+        avio_prefetch_close(r->stored.prefetch);
         g_free(r->stored.tracks);
         g_slice_free(Resource, r);
     }
@@ -359,14 +410,103 @@ Resource *avf_open(const char *url)
     return false;
 }
 
+static void avf_read_wait(Resource *r)
+{
+    avio_prefetch_wait(r->stored.prefetch);
+}
+
+/**
+ * @brief Stream time the trick play shows a keyframe at
+ */
+static double avf_trick_time(Resource *r, double time)
+{
+    const double origin = r->stored.trick_origin;
+
+    /* backward the time still runs forward, from the origin */
+    return origin + fabs(time - origin) / fabs(r->stored.trick_scale);
+}
+
+static int avf_seek_entry(Resource *r, const SeekIndexEntry *entry)
+{
+    AVFormatContext *avfc = r->stored.avfc;
+
+    fnc_log(FNC_LOG_DEBUG, "[avf] indexed keyframe at %f", entry->time);
+
+    if ( (avfc->iformat->flags & AVFMT_TS_DISCONT) && entry->pos >= 0 )
+        return av_seek_frame(avfc, -1, entry->pos, AVSEEK_FLAG_BYTE);
+
+    return av_seek_frame(avfc, seek_index_stream(r->stored.seek_index),
+                         entry->timestamp, AVSEEK_FLAG_BACKWARD);
+}
+
+/**
+ * @brief Read the next keyframe of the trick play
+ *
+ * Only the keyframes of the indexed stream are sent, each one with
+ * its timestamps rewritten so that the client shows them at the
+ * requested speed, @ref AVF_TRICK_INTERVAL seconds of playback
+ * apart at most; all the other packets are skipped.
+ */
+static int avf_read_trick(Resource *r)
+{
+    const int index = seek_index_stream(r->stored.seek_index);
+    const SeekIndexEntry *entry = r->stored.trick_entry;
+    const double scale = r->stored.trick_scale;
+    AVStream *stream = r->stored.avfc->streams[index];
+    Track *tr = r->stored.tracks[index];
+    AVPacket pkt;
+    double time;
+    int ret;
+
+    if ( entry == NULL )
+        return RESOURCE_EOF;
+
+    while ( true ) {
+        if ( av_read_frame(r->stored.avfc, &pkt) < 0 )
+            return RESOURCE_EOF;
+
+        time = (pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts) *
+            av_q2d(stream->time_base);
+
+        /* a seek landing short of the keyframe, going forward, would
+           show the same one again */
+        if ( pkt.stream_index == index && (pkt.flags & AV_PKT_FLAG_KEY) &&
+             (scale < 0 || time >= entry->time - AVF_TRICK_SLACK) )
+            break;
+
+        av_free_packet(&pkt);
+    }
+
+    trace_ingest(tr);
+
+    tr->pts = tr->dts = avf_trick_time(r, time);
+    tr->keyframe = true;
+    tr->frame_duration = AVF_TRICK_INTERVAL;
+
+    ret = tr->parse(tr, pkt.data, pkt.size);
+
+    av_free_packet(&pkt);
+
+    /* the next keyframe to show, or the end of the trick play */
+    if ( (r->stored.trick_entry =
+          seek_index_step(r->stored.seek_index, entry,
+                          scale * AVF_TRICK_INTERVAL)) != NULL &&
+         avf_seek_entry(r, r->stored.trick_entry) < 0 )
+        r->stored.trick_entry = NULL;
+
+    return ret;
+}
+
 static int avf_read_packet(Resource * r)
 {
     int ret = RESOURCE_OK;
     AVPacket pkt;
     AVStream *stream;
-    AVBitStreamFilterContext *bsfc;
     Track *tr;
 
+    if ( r->stored.trick_scale != 0 )
+        return avf_read_trick(r);
+
 // get a packet
 retry:
     if(av_read_frame(r->stored.avfc, &pkt) < 0)
@@ -375,6 +515,8 @@ retry:
     if ( (tr = r->stored.tracks[pkt.stream_index]) == NULL )
         goto retry;
 
+    trace_ingest(tr);
+
     // push it to the framer
     stream = r->stored.avfc->streams[pkt.stream_index];
 
@@ -399,6 +541,8 @@ retry:
         fnc_log(FNC_LOG_VERBOSE, "[avf] missing presentation timestamp");
     }
 
+    tr->keyframe = !!(pkt.flags & AV_PKT_FLAG_KEY);
+
     if (pkt.duration) {
         tr->frame_duration = pkt.duration *
             av_q2d(stream->time_base);
@@ -416,30 +560,74 @@ retry:
     fnc_log(FNC_LOG_VERBOSE, "[avf] packet duration %f",
             tr->frame_duration);
 
-    bsfc = stream->codec->opaque;
-    if (bsfc) {
-        uint8_t *data = NULL;
-        int size = 0;
-        av_bitstream_filter_filter(bsfc, stream->codec, NULL,
-                                   &data, &size,
-                                   pkt.data, pkt.size,
-                                   pkt.flags & AV_PKT_FLAG_KEY);
+    if ( r->stored.mp2t != NULL )
+        ret = mp2t_write(r->stored.mp2t, tr, &pkt);
+    else
         ret = tr->parse(tr, pkt.data, pkt.size);
-    } else {
-        ret = tr->parse(tr, pkt.data, pkt.size);
-    }
 
     av_free_packet(&pkt);
 
     return ret;
 }
 
+/**
+ * @brief Seek to the last indexed keyframe before a time
+ *
+ * Formats without timestamps in their seek tables, such as MPEG
+ * transport and program streams, are seeked by byte offset; the
+ * others can land exactly on the keyframe's timestamp.
+ */
+static int avf_seek_indexed(Resource *r, double time_sec)
+{
+    AVFormatContext *avfc = r->stored.avfc;
+    const SeekIndexEntry *entry;
+
+    if (avfc->start_time != AV_NOPTS_VALUE)
+        time_sec += (double)avfc->start_time / AV_TIME_BASE;
+
+    entry = seek_index_lookup(r->stored.seek_index, time_sec);
+
+    /* the trick play starts from the keyframe found */
+    r->stored.trick_origin = time_sec;
+    r->stored.trick_entry = entry;
+
+    return avf_seek_entry(r, entry);
+}
+
+/**
+ * @brief Switch the trick play on or off
+ *
+ * Only available with a seek index of a video stream, whose
+ * keyframes are the only packets sent while the trick play is on.
+ */
+static int avf_set_scale(Resource *r, double scale)
+{
+    const int index = seek_index_stream(r->stored.seek_index);
+    const Track *tr = r->stored.tracks[index];
+
+    if ( scale == 1.0 ) {
+        r->stored.trick_scale = 0;
+        return 0;
+    }
+
+    if ( tr == NULL || tr->media_type != MP_video )
+        return -1;
+
+    r->stored.trick_scale = scale;
+
+    return 0;
+}
+
 static int avf_seek(Resource * r, double time_sec)
 {
     int flags = 0;
     int64_t time_msec = time_sec * AV_TIME_BASE;
 
     fnc_log(FNC_LOG_DEBUG, "Seeking to %f", time_sec);
+    if ( r->stored.seek_index != NULL &&
+         avf_seek_indexed(r, time_sec) >= 0 )
+        return 0;
+
     if (r->stored.avfc->start_time != AV_NOPTS_VALUE)
         time_msec += r->stored.avfc->start_time;
     if (time_msec < 0) flags = AVSEEK_FLAG_BACKWARD;
@@ -449,9 +637,19 @@ static int avf_seek(Resource * r, double time_sec)
 static void avf_uninit(gpointer rgen)
 {
     Resource *r = rgen;
+    unsigned int j;
+
+    /* the muxed tracks are not in the resource's list */
+    if ( r->stored.mp2t != NULL ) {
+        mp2t_free(r->stored.mp2t);
+        for ( j = 0; j < r->stored.avfc->nb_streams; j++ )
+            track_free(r->stored.tracks[j]);
+    }
 
     if ( r->stored.avfc != NULL )
         avformat_close_input(&r->stored.avfc);
 
+    avio_prefetch_close(r->stored.prefetch);
+    seek_index_free(r->stored.seek_index);
     g_free(r->stored.tracks);
 }
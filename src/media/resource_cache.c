@@ -0,0 +1,697 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @defgroup rtp_cache Pre-packetized RTP cache
+ * @ingroup resources
+ *
+ * @brief Serve stored resources without demuxing and parsing them
+ *
+ * When @ref cfg_options_t::rtp_cache_dir is set, the first time a
+ * stored file is played from the start to its end, the buffers
+ * produced by the tracks' parsers are recorded, in order, into a cache
+ * file, together with the tracks' description. Further opens of the
+ * same file (as long as it's not modified) are served straight out
+ * of the cache, which is mapped in memory and read sequentially,
+ * without going through libavformat or the parsers at all.
+ *
+ * The cache file is laid out as:
+ *
+ * - one @ref RTPCacheHeader;
+ * - one @ref RTPCacheTrack per track, each followed by the track's
+ *   name, encoding name and SDP description;
+ * - the packets, each one an @ref RTPCachePacket followed by the
+ *   payload, in the order they were produced;
+ * - an array of @ref RTPCacheIndex entries, used for seeking.
+ *
+ * Each element is padded to 8 bytes. All the values are in host byte
+ * order; a cache written by a host with different byte order or
+ * format version is ignored, and written anew.
+ *
+ * A recording is abandoned if the resource is seeked before reaching
+ * the end, or if it's closed earlier. It's written to a temporary
+ * file, renamed only once complete.
+ *
+ * @{
+ */
+
+#define RTP_CACHE_MAGIC "FENGRTPC"
+#define RTP_CACHE_VERSION 1
+#define RTP_CACHE_BYTE_ORDER 0x01020304
+
+/** Interval between index entries, for resources without video */
+#define RTP_CACHE_INDEX_INTERVAL 1.0
+
+/**
+ * @brief Time after which a temporary cache file is considered stale
+ */
+#define RTP_CACHE_STALE_TIME 3600
+
+#define RTP_CACHE_PAD(x) (((x) + 7) & ~((size_t)7))
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int64_t source_mtime;
+    int64_t source_size;
+    double duration;
+    uint32_t tracks;
+    uint32_t index_count;
+    /** Offset of the first packet */
+    uint64_t packets_offset;
+    /** Offset past the last packet, where the index starts */
+    uint64_t packets_end;
+} RTPCacheHeader;
+
+typedef struct {
+    int32_t payload_type;
+    uint32_t clock_rate;
+    int32_t media_type;
+    int32_t audio_channels;
+    double frame_duration;
+    uint32_t name_len;
+    uint32_t encoding_len;
+    uint32_t sdp_len;
+    uint32_t bitrate;
+} RTPCacheTrack;
+
+typedef struct {
+    double timestamp;
+    double delivery;
+    double duration;
+    uint32_t track;
+    uint32_t size;
+    uint8_t marker;
+    uint8_t keyframe;
+    uint8_t padding[6];
+} RTPCachePacket;
+
+typedef struct {
+    double delivery;
+    uint64_t offset;
+} RTPCacheIndex;
+
+/**
+ * @brief State of a resource served from a cache file
+ */
+struct RTPCache {
+    uint8_t *map;
+    size_t map_size;
+
+    Track **tracks;
+    uint32_t tracks_count;
+
+    const RTPCacheIndex *index;
+    uint32_t index_count;
+
+    uint64_t packets_offset;
+    uint64_t packets_end;
+
+    /** Offset of the next packet to read */
+    uint64_t offset;
+};
+
+/**
+ * @brief State of a cache file being recorded
+ */
+struct RTPCacheWriter {
+    FILE *out;
+    gchar *path;
+    gchar *tmp_path;
+
+    RTPCacheHeader header;
+    uint64_t offset;
+
+    /** Timestamp of the last keyframe indexed, per track */
+    double *last_keyframe;
+    gboolean has_video;
+
+    /** @ref RTPCacheIndex entries */
+    GArray *index;
+
+    gulong packets;
+    gboolean failed;
+};
+
+/* The packets depend on the packetization settings, so does the cache */
+static gchar *cache_path(const char *url, const MParserSettings *settings)
+{
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_MD5, url, -1);
+    gchar *name = g_strdup_printf("%s-%" G_GSIZE_FORMAT "-%u%s.rtpc", hash,
+                                  settings->mtu, settings->bundle_time,
+                                  settings->mp2t ? "-ts" : "");
+    gchar *path = g_build_filename(feng_srv.rtp_cache_dir, name, NULL);
+
+    g_free(hash);
+    g_free(name);
+
+    return path;
+}
+
+static void cache_write(struct RTPCacheWriter *w,
+                        const void *data, size_t len)
+{
+    static const uint8_t zeros[8];
+    const size_t padded = RTP_CACHE_PAD(len);
+
+    if ( w->failed )
+        return;
+
+    if ( fwrite(data, 1, len, w->out) != len ||
+         fwrite(zeros, 1, padded - len, w->out) != padded - len ) {
+        fnc_perror("fwrite");
+        w->failed = true;
+        return;
+    }
+
+    w->offset += padded;
+}
+
+static int cache_read_packet(Resource *r)
+{
+    struct RTPCache *cache = r->stored.cache;
+    const RTPCachePacket *packet;
+    struct MParserBuffer *buffer;
+    Track *tr;
+
+    if ( cache->offset >= cache->packets_end )
+        return RESOURCE_EOF;
+
+    packet = (const RTPCachePacket*)(cache->map + cache->offset);
+
+    if ( cache->offset + sizeof(RTPCachePacket) + packet->size > cache->packets_end ||
+         packet->track >= cache->tracks_count ) {
+        fnc_log(FNC_LOG_ERR, "[cache] %s: corrupted packet at offset %llu",
+                r->mrl, (unsigned long long)cache->offset);
+        return RESOURCE_ERR;
+    }
+
+    tr = cache->tracks[packet->track];
+
+    trace_ingest(tr);
+    buffer = mparser_buffer_alloc(tr, packet->size);
+    memcpy(buffer->data, packet + 1, packet->size);
+    buffer->timestamp = packet->timestamp;
+    buffer->delivery = packet->delivery;
+    buffer->duration = packet->duration;
+    buffer->marker = packet->marker;
+    buffer->keyframe = packet->keyframe;
+
+    cache->offset += sizeof(RTPCachePacket) + RTP_CACHE_PAD(packet->size);
+
+    track_write(tr, buffer);
+
+    return RESOURCE_OK;
+}
+
+static int cache_seek(Resource *r, double time_sec)
+{
+    struct RTPCache *cache = r->stored.cache;
+    uint32_t low = 0, high = cache->index_count;
+
+    fnc_log(FNC_LOG_DEBUG, "[cache] Seeking to %f", time_sec);
+
+    /* find the last entry not past the requested time */
+    while ( low < high ) {
+        const uint32_t mid = low + (high - low)/2;
+
+        if ( cache->index[mid].delivery <= time_sec )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    cache->offset = low == 0 ? cache->packets_offset :
+        cache->index[low - 1].offset;
+
+    return 0;
+}
+
+static void cache_uninit(gpointer rgen)
+{
+    Resource *r = rgen;
+    struct RTPCache *cache = r->stored.cache;
+
+    munmap(cache->map, cache->map_size);
+    g_free(cache->tracks);
+    g_slice_free(struct RTPCache, cache);
+}
+
+/**
+ * @brief Open a stored resource from its cache file
+ *
+ * @param url The resolved URL of the resource within the vhost.
+ * @param settings The settings the packets have to be produced with
+ *
+ * @return A new resource, or NULL if there is no valid cache for the
+ *         current version of the file.
+ */
+Resource *rtp_cache_open(const char *url, const MParserSettings *settings)
+{
+    gchar *path = cache_path(url, settings);
+    gchar *mrl = g_strjoin("/", feng_default_vhost->document_root,
+                           url, NULL);
+    struct stat filestat, cachestat;
+    struct RTPCache *cache = NULL;
+    const RTPCacheHeader *header;
+    Resource *r;
+    uint64_t offset;
+    uint32_t i;
+    int fd = -1;
+    void *map;
+
+    if ( stat(mrl, &filestat) < 0 ||
+         (fd = open(path, O_RDONLY)) < 0 ||
+         fstat(fd, &cachestat) < 0 ||
+         (size_t)cachestat.st_size < sizeof(RTPCacheHeader) )
+        goto error;
+
+    if ( (map = mmap(NULL, cachestat.st_size, PROT_READ,
+                     MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+        fnc_perror("mmap");
+        goto error;
+    }
+
+    close(fd);
+    fd = -1;
+
+    madvise(map, cachestat.st_size, MADV_SEQUENTIAL);
+
+    cache = g_slice_new0(struct RTPCache);
+    cache->map = map;
+    cache->map_size = cachestat.st_size;
+
+    header = map;
+
+    if ( memcmp(header->magic, RTP_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != RTP_CACHE_VERSION ||
+         header->byte_order != RTP_CACHE_BYTE_ORDER ||
+         header->packets_end > cache->map_size ||
+         header->packets_offset > header->packets_end ||
+         header->packets_end +
+         (uint64_t)header->index_count * sizeof(RTPCacheIndex) > cache->map_size ) {
+        fnc_log(FNC_LOG_DEBUG, "[cache] %s: invalid cache file", path);
+        goto error;
+    }
+
+    if ( header->source_mtime != filestat.st_mtime ||
+         header->source_size != filestat.st_size ) {
+        fnc_log(FNC_LOG_DEBUG, "[cache] %s: outdated cache file", path);
+        goto error;
+    }
+
+    cache->packets_offset = header->packets_offset;
+    cache->packets_end = header->packets_end;
+    cache->offset = cache->packets_offset;
+    cache->index = (const RTPCacheIndex*)(cache->map + header->packets_end);
+    cache->index_count = header->index_count;
+
+    r = g_slice_new0(Resource);
+    r->stored.cache = cache;
+
+    cache->tracks = g_new0(Track*, header->tracks);
+    cache->tracks_count = header->tracks;
+
+    offset = RTP_CACHE_PAD(sizeof(RTPCacheHeader));
+    for ( i = 0; i < header->tracks; i++ ) {
+        const RTPCacheTrack *record = (const RTPCacheTrack*)(cache->map + offset);
+        const char *strings = (const char*)(record + 1);
+        Track *track;
+
+        if ( offset + sizeof(RTPCacheTrack) > header->packets_offset ||
+             offset + sizeof(RTPCacheTrack) + record->name_len +
+             record->encoding_len + record->sdp_len > header->packets_offset ) {
+            fnc_log(FNC_LOG_DEBUG, "[cache] %s: corrupted track %u", path, i);
+            goto track_error;
+        }
+
+        track = track_new(g_strndup(strings, record->name_len));
+        strings += record->name_len;
+
+        track->encoding_name = g_strndup(strings, record->encoding_len);
+        strings += record->encoding_len;
+
+        /* the stored description already has the a=control line
+         * that track_new() adds */
+        g_string_truncate(track->sdp_description, 0);
+        g_string_append_len(track->sdp_description, strings, record->sdp_len);
+
+        track->payload_type = record->payload_type;
+        track->clock_rate = record->clock_rate;
+        track->bitrate = record->bitrate;
+        track->media_type = record->media_type;
+        track->audio_channels = record->audio_channels;
+        track->frame_duration = record->frame_duration;
+        track->parent = r;
+
+        cache->tracks[i] = track;
+        r->tracks = g_list_append(r->tracks, track);
+
+        offset += RTP_CACHE_PAD(sizeof(RTPCacheTrack) + record->name_len +
+                                record->encoding_len + record->sdp_len);
+    }
+
+    r->mrl = mrl;
+    r->lock = g_mutex_new();
+    r->mtime = filestat.st_mtime;
+    r->duration = header->duration;
+
+    r->read_packet = cache_read_packet;
+    r->seek = cache_seek;
+    r->uninit = cache_uninit;
+
+    fnc_log(FNC_LOG_DEBUG, "[cache] serving %s from %s", url, path);
+    g_free(path);
+
+    return r;
+
+ track_error:
+    g_list_foreach(r->tracks, (GFunc)track_free, NULL);
+    g_list_free(r->tracks);
+    g_slice_free(Resource, r);
+    g_free(cache->tracks);
+
+ error:
+    if ( cache != NULL ) {
+        munmap(cache->map, cache->map_size);
+        g_slice_free(struct RTPCache, cache);
+    }
+    if ( fd >= 0 )
+        close(fd);
+    g_free(path);
+    g_free(mrl);
+    return NULL;
+}
+
+/**
+ * @brief Open the temporary file for a new recording
+ *
+ * @return A new stream, or NULL if the file couldn't be created or
+ *         another recording is in progress already.
+ */
+static FILE *cache_create(const char *tmp_path)
+{
+    struct stat tmpstat;
+    int fd;
+
+    if ( (fd = open(tmp_path, O_WRONLY|O_CREAT|O_EXCL, 0644)) < 0 &&
+         errno == EEXIST &&
+         stat(tmp_path, &tmpstat) == 0 &&
+         time(NULL) - tmpstat.st_mtime > RTP_CACHE_STALE_TIME ) {
+        /* left behind by a recording that never completed */
+        unlink(tmp_path);
+        fd = open(tmp_path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    }
+
+    if ( fd < 0 ) {
+        if ( errno != EEXIST )
+            fnc_perror("open");
+        return NULL;
+    }
+
+    return fdopen(fd, "wb");
+}
+
+static void cache_write_track(gpointer element, gpointer user_data)
+{
+    Track *track = element;
+    struct RTPCacheWriter *w = user_data;
+    const RTPCacheTrack record = {
+        .payload_type = track->payload_type,
+        .clock_rate = track->clock_rate,
+        .bitrate = track->bitrate,
+        .media_type = track->media_type,
+        .audio_channels = track->audio_channels,
+        .frame_duration = track->frame_duration,
+        .name_len = strlen(track->name),
+        .encoding_len = strlen(track->encoding_name),
+        .sdp_len = track->sdp_description->len
+    };
+    GString *data = g_string_sized_new(sizeof(record) + record.name_len +
+                                       record.encoding_len + record.sdp_len);
+
+    g_string_append_len(data, (const gchar*)&record, sizeof(record));
+    g_string_append(data, track->name);
+    g_string_append(data, track->encoding_name);
+    g_string_append_len(data, track->sdp_description->str,
+                        track->sdp_description->len);
+
+    cache_write(w, data->str, data->len);
+
+    g_string_free(data, true);
+
+    if ( track->media_type == MP_video )
+        w->has_video = true;
+}
+
+static void cache_writer_free(struct RTPCacheWriter *w)
+{
+    g_free(w->path);
+    g_free(w->tmp_path);
+    g_free(w->last_keyframe);
+    g_array_free(w->index, true);
+    g_slice_free(struct RTPCacheWriter, w);
+}
+
+/**
+ * @brief Start recording a resource into its cache
+ *
+ * @param r The resource just opened through libavformat
+ * @param url The URL the resource was opened with
+ *
+ * Nothing happens if another recording of the same resource is in
+ * progress already.
+ */
+void rtp_cache_record_start(Resource *r, const char *url)
+{
+    struct RTPCacheWriter *w;
+    struct stat filestat;
+    const guint tracks = g_list_length(r->tracks);
+    FILE *out;
+    gchar *path = cache_path(url, &r->settings);
+    gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+
+    if ( stat(r->mrl, &filestat) < 0 ||
+         (out = cache_create(tmp_path)) == NULL ) {
+        g_free(path);
+        g_free(tmp_path);
+        return;
+    }
+
+    w = g_slice_new0(struct RTPCacheWriter);
+    w->out = out;
+    w->path = path;
+    w->tmp_path = tmp_path;
+    w->last_keyframe = g_new0(double, tracks);
+    w->index = g_array_new(false, false, sizeof(RTPCacheIndex));
+
+    memcpy(w->header.magic, RTP_CACHE_MAGIC, sizeof(w->header.magic));
+    w->header.version = RTP_CACHE_VERSION;
+    w->header.byte_order = RTP_CACHE_BYTE_ORDER;
+    w->header.source_mtime = filestat.st_mtime;
+    w->header.source_size = filestat.st_size;
+    w->header.duration = r->duration;
+    w->header.tracks = tracks;
+
+    /* the header is written again once complete */
+    cache_write(w, &w->header, sizeof(w->header));
+    g_list_foreach(r->tracks, cache_write_track, w);
+    w->header.packets_offset = w->offset;
+
+    fnc_log(FNC_LOG_DEBUG, "[cache] recording %s into %s", url, path);
+
+    r->stored.cache_writer = w;
+}
+
+/**
+ * @brief Record a buffer produced by a track's parser
+ *
+ * @param tr The track producing the buffer
+ * @param buffer The buffer to record
+ *
+ * This is called for each buffer written to any track, and is a no-op
+ * unless the track's resource is being recorded.
+ *
+ * @note This function has to be called with the @ref Resource::lock
+ *       of the track's resource held, as it's done while reading.
+ */
+void rtp_cache_record(Track *tr, struct MParserBuffer *buffer)
+{
+    Resource *r = tr->parent;
+    struct RTPCacheWriter *w;
+    RTPCachePacket packet;
+    gint track;
+
+    if ( r == NULL || r->source == LIVE_SOURCE ||
+         (w = r->stored.cache_writer) == NULL || w->failed )
+        return;
+
+    track = g_list_index(r->tracks, tr);
+    g_assert(track >= 0);
+
+    /* seek points are at the start of the video keyframes, or at
+       regular intervals if there is no video */
+    if ( w->has_video ?
+         ( tr->media_type == MP_video && buffer->keyframe &&
+           ( w->packets == 0 || buffer->timestamp != w->last_keyframe[track] ) ) :
+         ( w->index->len == 0 ||
+           buffer->delivery >= g_array_index(w->index, RTPCacheIndex,
+                                             w->index->len - 1).delivery +
+           RTP_CACHE_INDEX_INTERVAL ) ) {
+        const RTPCacheIndex entry = {
+            .delivery = buffer->delivery,
+            .offset = w->offset
+        };
+
+        g_array_append_val(w->index, entry);
+        w->last_keyframe[track] = buffer->timestamp;
+    }
+
+    memset(&packet, 0, sizeof(packet));
+    packet.timestamp = buffer->timestamp;
+    packet.delivery = buffer->delivery;
+    packet.duration = buffer->duration;
+    packet.track = track;
+    packet.size = buffer->data_size;
+    packet.marker = buffer->marker;
+    packet.keyframe = buffer->keyframe;
+
+    /* the packet header is a multiple of 8 bytes, so the payload can
+       follow it right away */
+    if ( !w->failed &&
+         fwrite(&packet, 1, sizeof(packet), w->out) != sizeof(packet) ) {
+        fnc_perror("fwrite");
+        w->failed = true;
+    }
+    w->offset += sizeof(packet);
+    cache_write(w, buffer->data, buffer->data_size);
+
+    w->packets++;
+}
+
+/**
+ * @brief Give up the recording of a resource, if any
+ *
+ * @param r The resource being recorded
+ */
+void rtp_cache_record_abort(Resource *r)
+{
+    struct RTPCacheWriter *w;
+
+    if ( r->source == LIVE_SOURCE ||
+         (w = r->stored.cache_writer) == NULL )
+        return;
+
+    fnc_log(FNC_LOG_DEBUG, "[cache] abandoning %s", w->tmp_path);
+
+    fclose(w->out);
+    unlink(w->tmp_path);
+    cache_writer_free(w);
+
+    r->stored.cache_writer = NULL;
+}
+
+/**
+ * @brief Notify the recording of a seek in the resource
+ *
+ * @param r The resource being seeked
+ * @param time_sec The time it's seeked to
+ *
+ * Only seeking to the start before anything was read keeps the
+ * recording going.
+ */
+void rtp_cache_record_seek(Resource *r, double time_sec)
+{
+    struct RTPCacheWriter *w;
+
+    if ( r->source == LIVE_SOURCE ||
+         (w = r->stored.cache_writer) == NULL )
+        return;
+
+    if ( w->packets > 0 || time_sec != 0 )
+        rtp_cache_record_abort(r);
+}
+
+/**
+ * @brief Complete the recording of a resource that reached its end
+ *
+ * @param r The resource being recorded
+ */
+void rtp_cache_record_finish(Resource *r)
+{
+    struct RTPCacheWriter *w;
+
+    if ( r->source == LIVE_SOURCE ||
+         (w = r->stored.cache_writer) == NULL )
+        return;
+
+    w->header.packets_end = w->offset;
+    w->header.index_count = w->index->len;
+
+    cache_write(w, w->index->data, w->index->len * sizeof(RTPCacheIndex));
+
+    if ( !w->failed &&
+         ( fseek(w->out, 0, SEEK_SET) != 0 ||
+           fwrite(&w->header, 1, sizeof(w->header), w->out) != sizeof(w->header) ||
+           fflush(w->out) != 0 ||
+           fsync(fileno(w->out)) != 0 ) ) {
+        fnc_perror("cache");
+        w->failed = true;
+    }
+
+    if ( w->failed ) {
+        rtp_cache_record_abort(r);
+        return;
+    }
+
+    fclose(w->out);
+
+    if ( rename(w->tmp_path, w->path) < 0 ) {
+        fnc_perror("rename");
+        unlink(w->tmp_path);
+    } else
+        fnc_log(FNC_LOG_INFO, "[cache] recorded %lu packets into %s",
+                w->packets, w->path);
+
+    cache_writer_free(w);
+    r->stored.cache_writer = NULL;
+}
+
+/**
+ * @}
+ */
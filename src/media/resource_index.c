@@ -0,0 +1,368 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+
+#include "media/media.h"
+
+#include <libavformat/avformat.h>
+
+/**
+ * @defgroup seek_index Keyframe seek index
+ * @ingroup resources
+ *
+ * @brief Seek stored files straight to a keyframe
+ *
+ * When @ref cfg_options_t::seek_index_dir is set, the first open of a
+ * stored file starts a background scan of the whole file, recording
+ * the position of each keyframe of its first video stream (or one
+ * packet per second of its first stream, for audio-only files) into
+ * an index file in that directory. Following opens load the index,
+ * as long as the file is not modified, and @ref avf_seek looks up
+ * the last keyframe before the requested time with a binary search.
+ *
+ * The index file is a @ref SeekIndexHeader followed by the sorted
+ * @ref SeekIndexEntry array, in host byte order.
+ *
+ * @{
+ */
+
+#define SEEK_INDEX_MAGIC "FENGSIDX"
+#define SEEK_INDEX_VERSION 1
+#define SEEK_INDEX_BYTE_ORDER 0x01020304
+
+/** Interval between index entries when there is no video stream */
+#define SEEK_INDEX_INTERVAL 1.0
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int64_t source_mtime;
+    int64_t source_size;
+    uint32_t stream;
+    uint32_t count;
+} SeekIndexHeader;
+
+struct SeekIndex {
+    /** The file's contents, entries start after the header */
+    gchar *data;
+    const SeekIndexEntry *entries;
+    uint32_t count;
+    int stream;
+};
+
+/** Index files being built, so that each is scanned once at a time */
+static GHashTable *seek_index_building;
+static GStaticMutex seek_index_lock = G_STATIC_MUTEX_INIT;
+
+static gchar *seek_index_path(const char *mrl)
+{
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_MD5, mrl, -1);
+    gchar *name = g_strconcat(hash, ".fidx", NULL);
+    gchar *path = g_build_filename(feng_srv.seek_index_dir, name, NULL);
+
+    g_free(hash);
+    g_free(name);
+
+    return path;
+}
+
+static gint seek_index_compare(gconstpointer a, gconstpointer b)
+{
+    const SeekIndexEntry *ea = a, *eb = b;
+
+    return ea->time < eb->time ? -1 : ea->time > eb->time;
+}
+
+typedef struct {
+    gchar *mrl;
+    gchar *path;
+    struct stat source;
+} SeekIndexJob;
+
+/**
+ * @brief Scan a file and write its index
+ *
+ * Runs in its own thread, with its own demuxer, so that the resource
+ * being played is not touched.
+ */
+static gpointer seek_index_build(gpointer ptr)
+{
+    SeekIndexJob *job = ptr;
+    AVFormatContext *avfc = NULL;
+    GArray *entries = g_array_new(false, false, sizeof(SeekIndexEntry));
+    SeekIndexHeader header;
+    GString *out;
+    AVPacket pkt;
+    double last = -HUGE_VAL;
+    int stream = 0;
+    gboolean video = false;
+    unsigned int i;
+
+    if ( avformat_open_input(&avfc, job->mrl, NULL, NULL) != 0 ||
+         avformat_find_stream_info(avfc, NULL) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[index] unable to scan '%s'", job->mrl);
+        goto end;
+    }
+
+    for ( i = 0; i < avfc->nb_streams && !video; i++ )
+        if ( avfc->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO ) {
+            stream = i;
+            video = true;
+        }
+
+    while ( av_read_frame(avfc, &pkt) >= 0 ) {
+        const AVStream *st = avfc->streams[pkt.stream_index];
+        const int64_t ts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+        SeekIndexEntry entry;
+
+        if ( pkt.stream_index != stream || ts == AV_NOPTS_VALUE ||
+             ( video && !(pkt.flags & AV_PKT_FLAG_KEY) ) ) {
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        entry.time = ts * av_q2d(st->time_base);
+        entry.timestamp = ts;
+        entry.pos = pkt.pos;
+
+        av_free_packet(&pkt);
+
+        if ( !video && entry.time < last + SEEK_INDEX_INTERVAL )
+            continue;
+
+        last = entry.time;
+        g_array_append_val(entries, entry);
+    }
+
+    /* B-frames make the presentation order differ from the packets' */
+    g_array_sort(entries, seek_index_compare);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEEK_INDEX_MAGIC, sizeof(header.magic));
+    header.version = SEEK_INDEX_VERSION;
+    header.byte_order = SEEK_INDEX_BYTE_ORDER;
+    header.source_mtime = job->source.st_mtime;
+    header.source_size = job->source.st_size;
+    header.stream = stream;
+    header.count = entries->len;
+
+    out = g_string_sized_new(sizeof(header) + entries->len * sizeof(SeekIndexEntry));
+    g_string_append_len(out, (const gchar*)&header, sizeof(header));
+    g_string_append_len(out, entries->data, entries->len * sizeof(SeekIndexEntry));
+
+    if ( g_file_set_contents(job->path, out->str, out->len, NULL) )
+        fnc_log(FNC_LOG_DEBUG, "[index] '%s': %u entries",
+                job->mrl, entries->len);
+    else
+        fnc_log(FNC_LOG_ERR, "[index] unable to write '%s'", job->path);
+
+    g_string_free(out, true);
+
+ end:
+    if ( avfc != NULL )
+        avformat_close_input(&avfc);
+    g_array_free(entries, true);
+
+    g_static_mutex_lock(&seek_index_lock);
+    g_hash_table_remove(seek_index_building, job->path);
+    g_static_mutex_unlock(&seek_index_lock);
+
+    g_free(job->mrl);
+    g_free(job->path);
+    g_slice_free(SeekIndexJob, job);
+
+    return NULL;
+}
+
+/**
+ * @brief Start building the index of a file, unless already doing so
+ */
+static void seek_index_start(const char *mrl, gchar *path,
+                             const struct stat *source)
+{
+    SeekIndexJob *job;
+
+    g_static_mutex_lock(&seek_index_lock);
+
+    if ( seek_index_building == NULL )
+        seek_index_building = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ( g_hash_table_lookup(seek_index_building, path) != NULL ) {
+        g_static_mutex_unlock(&seek_index_lock);
+        g_free(path);
+        return;
+    }
+
+    job = g_slice_new0(SeekIndexJob);
+    job->mrl = g_strdup(mrl);
+    job->path = path;
+    job->source = *source;
+
+    g_hash_table_insert(seek_index_building, job->path, job);
+
+    g_static_mutex_unlock(&seek_index_lock);
+
+    g_thread_create(seek_index_build, job, false, NULL);
+}
+
+/**
+ * @brief Load the seek index of a stored file
+ *
+ * @param mrl The path of the file
+ * @param source The file's stat(2) information
+ *
+ * @return The index, or NULL if the index is disabled, or not built
+ *         yet, in which case its build is started in background for
+ *         the next opens.
+ */
+SeekIndex *seek_index_load(const char *mrl, const struct stat *source)
+{
+    SeekIndex *index;
+    const SeekIndexHeader *header;
+    gchar *path, *data = NULL;
+    gsize len;
+
+    if ( feng_srv.seek_index_dir == NULL )
+        return NULL;
+
+    path = seek_index_path(mrl);
+
+    if ( !g_file_get_contents(path, &data, &len, NULL) ||
+         len < sizeof(SeekIndexHeader) )
+        goto rebuild;
+
+    header = (const SeekIndexHeader*)data;
+
+    if ( memcmp(header->magic, SEEK_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+         header->version != SEEK_INDEX_VERSION ||
+         header->byte_order != SEEK_INDEX_BYTE_ORDER ||
+         header->source_mtime != source->st_mtime ||
+         header->source_size != source->st_size ||
+         len != sizeof(SeekIndexHeader) + (gsize)header->count * sizeof(SeekIndexEntry) )
+        goto rebuild;
+
+    g_free(path);
+
+    if ( header->count == 0 ) {
+        g_free(data);
+        return NULL;
+    }
+
+    index = g_slice_new(SeekIndex);
+    index->data = data;
+    index->entries = (const SeekIndexEntry*)(data + sizeof(SeekIndexHeader));
+    index->count = header->count;
+    index->stream = header->stream;
+
+    return index;
+
+ rebuild:
+    g_free(data);
+    seek_index_start(mrl, path, source);
+    return NULL;
+}
+
+/**
+ * @brief Find the last indexed keyframe at or before a time
+ *
+ * @param index The index to look into
+ * @param time The time, in seconds in the indexed stream's timebase
+ *
+ * @return The entry found, or the first one if @p time comes before
+ *         all of them.
+ */
+const SeekIndexEntry *seek_index_lookup(const SeekIndex *index, double time)
+{
+    uint32_t low = 0, high = index->count;
+
+    /* first entry past time */
+    while ( low < high ) {
+        const uint32_t mid = low + (high - low) / 2;
+
+        if ( index->entries[mid].time <= time )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return &index->entries[low > 0 ? low - 1 : 0];
+}
+
+/**
+ * @brief Find the indexed keyframe to show next in trick play
+ *
+ * @param index The index to look into
+ * @param entry The keyframe shown last, from the same index
+ * @param distance The stream time to skip, negative to go backward
+ *
+ * @return The first keyframe at least @p distance after @p entry (or
+ *         the last one at least as far before it, going backward),
+ *         never @p entry itself; NULL past the ends of the index.
+ */
+const SeekIndexEntry *seek_index_step(const SeekIndex *index,
+                                      const SeekIndexEntry *entry,
+                                      double distance)
+{
+    const double target = entry->time + distance;
+    const SeekIndexEntry *found = seek_index_lookup(index, target);
+
+    if ( distance >= 0 ) {
+        if ( found->time < target || found <= entry )
+            found = MAX(found + 1, entry + 1);
+        return found < index->entries + index->count ? found : NULL;
+    }
+
+    if ( found < entry )
+        return found;
+    return entry > index->entries ? entry - 1 : NULL;
+}
+
+/**
+ * @brief Stream the index refers to
+ */
+int seek_index_stream(const SeekIndex *index)
+{
+    return index->stream;
+}
+
+void seek_index_free(SeekIndex *index)
+{
+    if ( index == NULL )
+        return;
+
+    g_free(index->data);
+    g_slice_free(SeekIndex, index);
+}
+
+/**
+ * @}
+ */
@@ -35,6 +35,7 @@
 #include "fnc_log.h"
 
 #include "media/media.h"
+#include "network/rtp.h"
 
 #define REQUIRED_FLUX_PROTOCOL_VERSION 4
 
@@ -64,7 +65,11 @@ static gpointer flux_read_messages(gpointer ptr);
  * mqd_t object.
  */
 static void live_track_uninit(Track *tr) {
+#ifdef LIVE_SHM
+    flux_shm_free(tr->live.shm);
+#endif
     g_free(tr->live.mq_path);
+    rtp_multicast_free(tr->live.multicast);
 }
 
 /**
@@ -86,10 +91,20 @@ static const char SD2_KEY_MEDIA_TYPE     [] = "media_type";
 static const char SD2_KEY_AUDIO_CHANNELS [] = "audio_channels";
 static const char SD2_KEY_FMTP           [] = "fmtp";
 
+static const char SD2_KEY_MULTICAST_GROUP[] = "multicast_group";
+static const char SD2_KEY_MULTICAST_PORT [] = "multicast_port";
+static const char SD2_KEY_MULTICAST_TTL  [] = "multicast_ttl";
+
 static const char SD2_KEY_LICENSE        [] = "license";
 static const char SD2_KEY_RDF_PAGE       [] = "rdf_page";
 static const char SD2_KEY_TITLE          [] = "title";
 static const char SD2_KEY_CREATOR        [] = "creator";
+
+static const char SD2_RELAY_GROUP        [] = "relay";
+static const char SD2_KEY_RELAY_UPSTREAM [] = "upstream";
+
+static const char SD2_TIMESHIFT_GROUP    [] = "timeshift";
+static const char SD2_KEY_TIMESHIFT_WINDOW[] = "window";
 /**
  * @}
  */
@@ -150,12 +165,29 @@ static void set_encoding_defaults(Track *track)
     }
 }
 
+/**
+ * @brief Start recording the resource, if the sd2 file asks for it
+ */
+static void sd2_timeshift(Resource *r, GKeyFile *file)
+{
+    int window;
+
+    if ( r == NULL || feng_srv.timeshift_dir == NULL ||
+         (window = g_key_file_get_integer(file, SD2_TIMESHIFT_GROUP,
+                                          SD2_KEY_TIMESHIFT_WINDOW,
+                                          NULL)) <= 0 )
+        return;
+
+    r->live.timeshift = timeshift_new(r, window);
+}
+
 Resource *sd2_open(const char *url)
 {
     Resource *r = NULL;
     char *mrl;
     GKeyFile *file = g_key_file_new();
     gchar **tracknames = NULL, **trackgroups = NULL, *currtrack = NULL;
+    gchar *upstream;
     int next_dynamic_payload = 96;
     TrackList tracks = NULL;
 
@@ -170,6 +202,18 @@ Resource *sd2_open(const char *url)
     if ( !g_key_file_load_from_file(file, mrl, G_KEY_FILE_NONE, NULL) )
         goto error;
 
+    /* the tracks of a relayed resource are the upstream ones */
+    if ( (upstream = g_key_file_get_string(file, SD2_RELAY_GROUP,
+                                           SD2_KEY_RELAY_UPSTREAM,
+                                           NULL)) != NULL ) {
+        r = relay_open(mrl, upstream);
+        sd2_timeshift(r, file);
+        g_free(upstream);
+        g_key_file_free(file);
+        g_free(mrl);
+        return r;
+    }
+
     if ( (tracknames = g_key_file_get_groups(file, NULL)) == NULL )
         goto error;
 
@@ -180,6 +224,9 @@ Resource *sd2_open(const char *url)
 
         gchar *track_mrl, *media_type, *tmpstr;
 
+        if ( strcmp(currtrack, SD2_TIMESHIFT_GROUP) == 0 )
+            continue;
+
         if ( !feng_str_is_unreserved(currtrack) ) {
             fnc_log(FNC_LOG_ERR, "[sd2] invalid track name '%s' for '%s'",
                     currtrack, mrl);
@@ -190,20 +237,29 @@ Resource *sd2_open(const char *url)
 
         track->uninit = live_track_uninit;
 
+        if ( feng_srv.live_gop_cache )
+            track->gop = g_queue_new();
+
         track_mrl = g_key_file_get_string(file, currtrack,
                                           SD2_KEY_MRL,
                                           NULL);
 
-        /* This section might have to be changed if we end up
-           supporting multiple source protocoles. */
-        if ( track_mrl == NULL || !g_str_has_prefix(track_mrl, "mq://") ) {
+        /* The path is kept in mq_path for both protocols; for shm://
+           it's the name of the shared memory object */
+        if ( track_mrl != NULL && g_str_has_prefix(track_mrl, "mq://") )
+            track->live.mq_path = strdup(track_mrl + strlen("mq://"));
+#ifdef LIVE_SHM
+        else if ( track_mrl != NULL && g_str_has_prefix(track_mrl, "shm://") ) {
+            track->live.mq_path = strdup(track_mrl + strlen("shm://"));
+            track->live.shm = flux_shm_new(track);
+        }
+#endif
+        else {
             fnc_log(FNC_LOG_ERR, "[sd2] invalid mrl '%s' for '%s'",
                     track_mrl, mrl);
             goto corrupted_track;
         }
 
-        track->live.mq_path = strdup(track_mrl + strlen("mq://"));
-
         if ( (track->encoding_name = g_strdup(g_key_file_get_string(file, currtrack,
                                                                     SD2_KEY_ENCODING_NAME,
                                                                     NULL))) == NULL ) {
@@ -298,6 +354,31 @@ Resource *sd2_open(const char *url)
                                     SDP_F_AUTHOR,
                                     tmpstr);
 
+        if ( (tmpstr = g_key_file_get_string(file, currtrack,
+                                             SD2_KEY_MULTICAST_GROUP,
+                                             NULL)) ) {
+            int ttl = 16;
+
+            if ( g_key_file_has_key(file, currtrack, SD2_KEY_MULTICAST_TTL, NULL) )
+                ttl = g_key_file_get_integer(file, currtrack,
+                                             SD2_KEY_MULTICAST_TTL,
+                                             NULL);
+
+            track->live.multicast =
+                rtp_multicast_new(tmpstr,
+                                  g_key_file_get_integer(file, currtrack,
+                                                         SD2_KEY_MULTICAST_PORT,
+                                                         NULL),
+                                  ttl);
+            g_free(tmpstr);
+
+            if ( track->live.multicast == NULL ) {
+                fnc_log(FNC_LOG_ERR, "[sd2] invalid multicast setup for '%s'",
+                        mrl);
+                goto corrupted_track;
+            }
+        }
+
         if (track->payload_type >= 96)
             sdp_descr_append_rtpmap(track);
 
@@ -331,10 +412,18 @@ Resource *sd2_open(const char *url)
     r->duration = HUGE_VAL;
     r->tracks = tracks;
 
+    sd2_timeshift(r, file);
+
     for (tracks = g_list_first(r->tracks); tracks != NULL; tracks = g_list_next(tracks)) {
         Track *track = tracks->data;
 
         track->parent = r;
+#ifdef LIVE_SHM
+        if ( track->live.shm != NULL ) {
+            flux_shm_start(track->live.shm);
+            continue;
+        }
+#endif
         g_thread_create(flux_read_messages, track, false, NULL);
     }
 
@@ -348,6 +437,158 @@ Resource *sd2_open(const char *url)
     return NULL;
 }
 
+/**
+ * @brief Tells whether anybody is going to see the track's packets
+ *
+ * Don't bother queuing buffers if there are no clients connected;
+ * the producer is still read though.
+ *
+ * Note that we don't need to use atomic operations because, even if
+ * there are no consumers but we did keep the loop running, we'd just
+ * be creating extra objects.
+ *
+ * Tracks with a GOP cache always want their packets, to have the
+ * cache ready for the first viewer, and so do the tracks recorded
+ * for time-shift.
+ */
+gboolean flux_track_wanted(Track *tr)
+{
+    return tr->consumers > 0 || tr->gop != NULL ||
+        tr->parent->live.timeshift != NULL ||
+        ( tr->live.multicast != NULL &&
+          rtp_multicast_has_viewers(tr->live.multicast) );
+}
+
+/**
+ * @brief Tell whether a live packet belongs to a keyframe
+ *
+ * @param tr The track the packet belongs to
+ * @param buffer The buffer holding the RTP payload
+ *
+ * The producer sends packets already formatted as RTP payloads, so
+ * this looks at the payload headers of the encodings that have them:
+ * the NAL unit type for H.264 (RFC 6184), counting parameter sets as
+ * part of the keyframe they precede, and the picture type for MPEG
+ * video (RFC 2250). Any other packet is considered a keyframe, as
+ * for the stored sources that can't tell them apart.
+ */
+gboolean flux_packet_keyframe(Track *tr, const struct MParserBuffer *buffer)
+{
+    const uint8_t *data = buffer->data;
+    const size_t len = buffer->data_size;
+
+    if ( tr->media_type != MP_video )
+        return true;
+
+    if ( g_ascii_strcasecmp(tr->encoding_name, "H264") == 0 && len >= 1 ) {
+        uint8_t type = data[0] & 0x1f;
+
+        if ( type == 28 && len >= 2 )      /* FU-A */
+            type = data[1] & 0x1f;
+        else if ( type == 24 && len >= 4 ) /* STAP-A, first NAL */
+            type = data[3] & 0x1f;
+
+        return type == 5 || type == 7 || type == 8;
+    }
+
+    if ( strcmp(tr->encoding_name, "MPV") == 0 && len >= 4 )
+        return (data[2] & 0x07) == 1;
+
+    return true;
+}
+
+/**
+ * @brief Set a new buffer's timing from the fields sent by the producer
+ *
+ * @return false if the packet is too late to be sent, in which case
+ *         the buffer is to be discarded.
+ *
+ * The fields are the same for the message queue and shared memory
+ * protocols; they are given here in host byte order. The buffer's
+ * data has to be filled in already, to find out whether it's part of
+ * a keyframe.
+ */
+gboolean flux_buffer_fill(Track *tr, struct MParserBuffer *buffer,
+                          double insertion_time, double start_time,
+                          uint32_t dts, uint32_t start_dts, double duration,
+                          gboolean marker, uint16_t seq_no, uint32_t package_timestamp)
+{
+    double timestamp;
+    double delivery;
+    double delta;
+
+    delta = ev_time() - insertion_time;
+
+#if 0
+    fprintf(stderr, "[%s] read (%5.4f) BEGIN:%5.4f START_DTS:%u DTS:%u\n",
+            tr->live.mq_path, delta, start_time, start_dts, dts);
+#endif
+
+    if (delta > 0.5f) {
+        fnc_log(FNC_LOG_INFO, "[%s] late packet %f/%f, discarding..",
+                tr->live.mq_path, insertion_time, delta);
+        return false;
+    }
+
+    delivery = (dts - start_dts)/((double)tr->clock_rate);
+
+    tr->frame_duration = duration/((double)tr->clock_rate);
+    timestamp = package_timestamp/((double)tr->clock_rate);
+
+    // calculate the duration while consuming stale packets.
+    // This is an HACK that must be moved to Flux, here just to quick fix live problems
+    if (!tr->frame_duration) {
+        if (tr->dts) {
+            tr->frame_duration = (timestamp - tr->dts);
+        } else {
+            tr->dts = timestamp;
+        }
+    }
+
+    buffer->timestamp = timestamp;
+    buffer->delivery = start_time + delivery;
+    buffer->duration = tr->frame_duration * 3;
+
+    buffer->marker = marker;
+    buffer->seq_no = seq_no;
+    buffer->rtp_timestamp = package_timestamp;
+    buffer->keyframe = flux_packet_keyframe(tr, buffer);
+
+#if 0
+    fprintf(stderr, "[%s] packet TS:%5.4f DELIVERY:%5.4f -> %5.4f (%5.4f)\n",
+            tr->live.mq_path,
+            timestamp,
+            delivery,
+            buffer->delivery,
+            ev_time() - buffer->delivery);
+#endif
+
+    return true;
+}
+
+/**
+ * @brief Hand a buffer read from the producer over to the viewers
+ *
+ * @param tr The track the buffer belongs to
+ * @param buffer The buffer to send; the reference is consumed.
+ */
+void flux_track_deliver(Track *tr, struct MParserBuffer *buffer)
+{
+    /* multicast viewers get the packet right away, there is
+       no pacing to do on live data */
+    if ( tr->live.multicast != NULL &&
+         rtp_multicast_has_viewers(tr->live.multicast) )
+        rtp_multicast_send(tr->live.multicast, tr, buffer);
+
+    if ( tr->parent->live.timeshift != NULL )
+        timeshift_record(tr->parent->live.timeshift, tr, buffer);
+
+    if ( tr->consumers > 0 || tr->gop != NULL )
+        track_write(tr, buffer);
+    else
+        mparser_buffer_unref(buffer);
+}
+
 static gpointer flux_read_messages(gpointer ptr) {
     Track *tr = ptr;
     struct flux_msg *message = NULL;
@@ -371,14 +612,7 @@ static gpointer flux_read_messages(gpointer ptr) {
         message = g_realloc(message, attr.mq_msgsize);
 
         while ( 1 ) {
-            uint32_t package_timestamp;
-            double timestamp;
-            double delivery;
-            double delta;
-
             ssize_t msg_len;
-            int marker;
-            uint16_t seq_no;
 
             if ( (msg_len = mq_receive(queue, (char*)message,
                                        attr.mq_msgsize, NULL)) < 0 ) {
@@ -394,71 +628,24 @@ static gpointer flux_read_messages(gpointer ptr) {
                 break;
             }
 
-            /* Don't bother queuing buffers if there are no clients
-             * connected, keep reading the messages from the queue
-             * though.
-             *
-             * Note that we don't need to use atomic operations
-             * because, even if there are no consumers but we did keep
-             * the loop running, we'd just be creating extra objects.
-             */
-            if ( tr->consumers == 0 )
+            if ( !flux_track_wanted(tr) )
                 continue;
 
-            delta = ev_time() - message->insertion_time;
-
-#if 0
-            fprintf(stderr, "[%s] read (%5.4f) BEGIN:%5.4f START_DTS:%u DTS:%u\n",
-                    tr->live.mq_path, delta, message->start_time, message->start_dts, message->dts);
-#endif
-
-            if (delta > 0.5f) {
-                fnc_log(FNC_LOG_INFO, "[%s] late mq packet %f/%f, discarding..",
-                        tr->live.mq_path, message->insertion_time, delta);
+            affinity_follow(tr);
+            trace_ingest(tr);
+            buffer = mparser_buffer_alloc(tr, msg_len - sizeof(struct flux_msg));
+            memcpy(buffer->data, message->data, buffer->data_size);
+
+            if ( !flux_buffer_fill(tr, buffer,
+                                   message->insertion_time, message->start_time,
+                                   message->dts, message->start_dts,
+                                   message->duration, message->marker >> 7,
+                                   ntohs(message->seq_no), ntohl(message->timestamp)) ) {
+                mparser_buffer_unref(buffer);
                 continue;
             }
 
-            package_timestamp = ntohl(message->timestamp);
-            delivery = (message->dts - message->start_dts)/((double)tr->clock_rate);
-
-            tr->frame_duration = message->duration/((double)tr->clock_rate);
-            timestamp = package_timestamp/((double)tr->clock_rate);
-            marker = message->marker >> 7;
-            seq_no = ntohs(message->seq_no);
-
-            // calculate the duration while consuming stale packets.
-            // This is an HACK that must be moved to Flux, here just to quick fix live problems
-            if (!tr->frame_duration) {
-                if (tr->dts) {
-                    tr->frame_duration = (timestamp - tr->dts);
-                } else {
-                    tr->dts = timestamp;
-                }
-            }
-
-            buffer = g_slice_new0(struct MParserBuffer);
-
-            buffer->timestamp = timestamp;
-            buffer->delivery = message->start_time + delivery;
-            buffer->duration = tr->frame_duration * 3;
-
-            buffer->marker = marker;
-            buffer->seq_no = seq_no;
-            buffer->rtp_timestamp = package_timestamp;
-
-            buffer->data_size = msg_len - sizeof(struct flux_msg);;
-            buffer->data = g_memdup(message->data, buffer->data_size);
-
-#if 0
-            fprintf(stderr, "[%s] packet TS:%5.4f DELIVERY:%5.4f -> %5.4f (%5.4f)\n",
-                    tr->live.mq_path,
-                    timestamp,
-                    delivery,
-                    buffer->delivery,
-                    ev_time() - buffer->delivery);
-#endif
-
-            track_write(tr, buffer);
+            flux_track_deliver(tr, buffer);
         }
 
     error:
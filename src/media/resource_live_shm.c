@@ -0,0 +1,567 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+
+#include "media/media.h"
+
+/**
+ * @defgroup live_shm Shared memory live ingest
+ * @ingroup resources
+ *
+ * @brief Read live tracks from a ring in shared memory (shm:// mrls)
+ *
+ * Version 5 of the flux protocol replaces the message queue with a
+ * ring of fixed-size slots in a POSIX shared memory object, created
+ * by the producer. The producer writes each packet in place in the
+ * slot at the head of the ring, and feng hands the slot's data over
+ * to the RTP sessions without copying it (see @ref
+ * mparser_buffer_wrap); the slot is given back to the producer once
+ * the last session has sent it.
+ *
+ * The object starts with a @ref flux_shm_header page, followed by
+ * flux_shm_header::slots_count slots of flux_shm_header::slot_size
+ * bytes each. All fields are in host byte order, and the positions
+ * are free-running counters, to be masked into slot indexes:
+ *
+ * - the producer only writes a slot if it's not between the tail and
+ *   the head, then increments the head;
+ * - feng increments the tail once all the slots behind it have been
+ *   sent; a producer finding the ring full drops the packet.
+ *
+ * Before sleeping, feng sets flux_shm_header::waiting; after moving
+ * the head, or finding the ring full, the producer checks it and, if
+ * set, increments flux_shm_header::doorbell and wakes it with
+ * FUTEX_WAKE. Both sides have to use sequentially consistent atomic
+ * operations for the positions and the flags.
+ *
+ * A single ingest thread waits on the doorbells of up to @ref
+ * FLUX_SHM_RINGS_PER_THREAD rings at once, with futex_waitv(2); on
+ * kernels or headers without it, the rings are polled instead.
+ *
+ * @note A producer restarting has to reuse the existing object, and
+ *       carry on from its head, rather than creating a new one: feng
+ *       maps each ring only once.
+ *
+ * @{
+ */
+
+#define FLUX_SHM_PROTOCOL_VERSION 5
+
+/**
+ * @brief Size of the header page, the slots start right after it
+ */
+#define FLUX_SHM_HEADER_SIZE 4096
+
+/**
+ * @brief Most rings served by a single ingest thread
+ *
+ * Has to be lower than the 128 futexes futex_waitv(2) can wait on,
+ * since one of them is used to wake the thread up for new rings.
+ */
+#define FLUX_SHM_RINGS_PER_THREAD 64
+
+/**
+ * @brief Seconds between attempts to open a ring not created yet
+ */
+#define FLUX_SHM_RETRY_INTERVAL 1.0
+
+/**
+ * @brief Microseconds between checks of the rings, when polling
+ */
+#define FLUX_SHM_POLL_INTERVAL 1000
+
+#if defined(SYS_futex_waitv) && defined(FUTEX_32)
+# define HAVE_FUTEX_WAITV 1
+#endif
+
+/**
+ * @brief Header of the shared memory ring
+ *
+ * The fields written by the producer and by feng are kept on
+ * different cache lines.
+ */
+struct flux_shm_header {
+    uint32_t proto_version;     /*!< @ref FLUX_SHM_PROTOCOL_VERSION */
+    uint32_t slots_count;       /*!< power of two */
+    uint32_t slot_size;         /*!< multiple of 8, header included */
+    uint32_t reserved1[13];
+
+    /* written by the producer */
+    uint32_t head;
+    uint32_t doorbell;
+    uint32_t reserved2[14];
+
+    /* written by feng */
+    uint32_t tail;
+    uint32_t waiting;
+};
+
+/**
+ * @brief The producer tells which packets belong to keyframes
+ *
+ * Otherwise feng finds them out from the payload, when it knows the
+ * encoding.
+ */
+#define FLUX_SHM_FLAG_KEYFRAMES 0x01
+/**
+ * @brief The packet belongs to a keyframe
+ */
+#define FLUX_SHM_FLAG_KEYFRAME  0x02
+
+/**
+ * @brief One packet in the ring, same fields as version 4's message
+ */
+struct flux_shm_slot {
+    double start_time;
+    double duration;
+    double insertion_time;
+    uint32_t dts;
+    uint32_t start_dts;
+    uint32_t timestamp;
+    uint32_t size;              /*!< bytes used in data */
+    uint16_t seq_no;
+    uint8_t marker;             /*!< 1 on the last packet of a frame */
+    uint8_t flags;              /*!< FLUX_SHM_FLAG_* */
+    uint8_t reserved[4];
+
+    uint8_t data[];
+};
+
+typedef struct FluxShmIngest FluxShmIngest;
+
+struct FluxShmRing {
+    Track *track;
+    FluxShmIngest *ingest;
+
+    /** The mapped object, NULL until the producer creates it */
+    struct flux_shm_header *header;
+    uint8_t *slots;
+    size_t map_size;
+    guint mask;
+    guint slot_size;
+
+    /** Next slot to read */
+    guint seen;
+    /** Oldest slot not given back to the producer yet */
+    guint tail;
+    /** Buffers referring to each slot, released by any thread */
+    gint *pinned;
+
+    double next_open;
+};
+
+/**
+ * @brief A thread reading from a set of rings
+ */
+struct FluxShmIngest {
+    /** Rings to add to the thread's set, see @ref flux_shm_start */
+    GAsyncQueue *incoming;
+    /** Futex bumped after pushing to @ref incoming */
+    gint control;
+    /** Rings assigned to the thread, counted under @ref ingest_lock */
+    guint assigned;
+};
+
+static GStaticMutex ingest_lock = G_STATIC_MUTEX_INIT;
+static GPtrArray *ingest_threads;
+
+static inline guint shm_load(uint32_t *position)
+{
+    return (guint)g_atomic_int_get((volatile gint *)position);
+}
+
+static inline void shm_store(uint32_t *position, guint value)
+{
+    g_atomic_int_set((volatile gint *)position, (gint)value);
+}
+
+/**
+ * @brief Map the producer's ring
+ *
+ * @retval false The object doesn't exist yet, or is not a valid ring.
+ */
+static gboolean flux_shm_ring_open(struct FluxShmRing *ring)
+{
+    const char *name = ring->track->live.mq_path;
+    struct flux_shm_header header;
+    struct stat st;
+    guint64 size;
+    void *map;
+    int fd;
+
+    if ( (fd = shm_open(name, O_RDWR, 0)) < 0 ) {
+        fnc_log(errno == ENOENT ? FNC_LOG_DEBUG : FNC_LOG_ERR,
+                "[shm] unable to open '%s': %s", name, strerror(errno));
+        return false;
+    }
+
+    if ( fstat(fd, &st) < 0 ||
+         pread(fd, &header, sizeof(header), 0) != sizeof(header) ) {
+        fnc_log(FNC_LOG_DEBUG, "[shm] '%s' not ready yet", name);
+        goto error;
+    }
+
+    if ( header.proto_version != FLUX_SHM_PROTOCOL_VERSION ) {
+        fnc_log(FNC_LOG_ERR, "[%s] Invalid Flux Protocol Version, expecting %d got %d",
+                name, FLUX_SHM_PROTOCOL_VERSION, header.proto_version);
+        goto error;
+    }
+
+    size = FLUX_SHM_HEADER_SIZE + (guint64)header.slots_count * header.slot_size;
+
+    if ( header.slots_count == 0 ||
+         (header.slots_count & (header.slots_count - 1)) != 0 ||
+         header.slot_size < sizeof(struct flux_shm_slot) ||
+         header.slot_size % 8 != 0 ||
+         size > (guint64)st.st_size ) {
+        fnc_log(FNC_LOG_ERR, "[shm] '%s': invalid ring of %u slots of %u bytes",
+                name, header.slots_count, header.slot_size);
+        goto error;
+    }
+
+    if ( (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0)) == MAP_FAILED ) {
+        fnc_perror("mmap");
+        goto error;
+    }
+
+    close(fd);
+
+    ring->header = map;
+    ring->slots = (uint8_t*)map + FLUX_SHM_HEADER_SIZE;
+    ring->map_size = size;
+    ring->mask = header.slots_count - 1;
+    ring->slot_size = header.slot_size;
+    ring->pinned = g_new0(gint, header.slots_count);
+
+    /* live data: start from the packet being written right now */
+    ring->seen = ring->tail = shm_load(&ring->header->head);
+    shm_store(&ring->header->tail, ring->tail);
+
+    fnc_log(FNC_LOG_INFO, "[shm] reading '%s': %u slots of %u bytes",
+            name, header.slots_count, header.slot_size);
+
+    return true;
+
+ error:
+    close(fd);
+    return false;
+}
+
+/**
+ * @brief Give a slot back once the last packet referring to it is sent
+ *
+ * Used as @ref MParserBuffer::release for the wrapped slots; this can
+ * run in any thread, the tail is only moved by the ingest thread.
+ */
+static void flux_shm_release(struct MParserBuffer *buffer)
+{
+    struct FluxShmRing *ring = buffer->release_data;
+    const guint index = (buffer->data - ring->slots) / ring->slot_size;
+
+    g_atomic_int_add(&ring->pinned[index], -1);
+}
+
+/**
+ * @brief Move the ring's tail past the slots already sent
+ */
+static void flux_shm_ring_reclaim(struct FluxShmRing *ring)
+{
+    guint tail = ring->tail;
+
+    while ( tail != ring->seen &&
+            g_atomic_int_get(&ring->pinned[tail & ring->mask]) == 0 )
+        tail++;
+
+    if ( tail != ring->tail ) {
+        ring->tail = tail;
+        shm_store(&ring->header->tail, tail);
+    }
+}
+
+/**
+ * @brief Hand over the packets written since the last read
+ *
+ * @return The amount of packets read.
+ */
+static guint flux_shm_ring_read(struct FluxShmRing *ring)
+{
+    Track *tr = ring->track;
+    const guint head = shm_load(&ring->header->head);
+    guint count = 0;
+
+    if ( head - ring->tail > ring->mask + 1 ) {
+        fnc_log(FNC_LOG_ERR, "[shm] '%s': producer overran the ring, skipping",
+                tr->live.mq_path);
+
+        /* slots still pinned stay counted, and hold the tail back
+           again once they come around */
+        ring->seen = ring->tail = head;
+        shm_store(&ring->header->tail, head);
+        return 0;
+    }
+
+    for ( ; ring->seen != head; ring->seen++, count++ ) {
+        const guint index = ring->seen & ring->mask;
+        struct flux_shm_slot *slot =
+            (struct flux_shm_slot*)(ring->slots + index * ring->slot_size);
+        struct MParserBuffer *buffer;
+
+        if ( slot->size > ring->slot_size - sizeof(struct flux_shm_slot) ) {
+            fnc_log(FNC_LOG_ERR, "[shm] '%s': corrupted slot %u",
+                    tr->live.mq_path, index);
+            continue;
+        }
+
+        if ( !flux_track_wanted(tr) )
+            continue;
+
+        g_atomic_int_inc(&ring->pinned[index]);
+        trace_ingest(tr);
+        buffer = mparser_buffer_wrap(tr, slot->data, slot->size,
+                                     flux_shm_release, ring);
+
+        if ( !flux_buffer_fill(tr, buffer,
+                               slot->insertion_time, slot->start_time,
+                               slot->dts, slot->start_dts,
+                               slot->duration, slot->marker,
+                               slot->seq_no, slot->timestamp) ) {
+            mparser_buffer_unref(buffer);
+            continue;
+        }
+
+        if ( slot->flags & FLUX_SHM_FLAG_KEYFRAMES )
+            buffer->keyframe = !!(slot->flags & FLUX_SHM_FLAG_KEYFRAME);
+
+        flux_track_deliver(tr, buffer);
+    }
+
+    flux_shm_ring_reclaim(ring);
+
+    return count;
+}
+
+/**
+ * @brief Sleep until a producer or @ref flux_shm_start rings
+ *
+ * @param ingest The thread going to sleep
+ * @param rings The rings served by the thread
+ * @param control The value of FluxShmIngest::control the thread last
+ *                acted upon
+ */
+static void flux_shm_wait(FluxShmIngest *ingest, GPtrArray *rings,
+                          gint control)
+{
+#ifdef HAVE_FUTEX_WAITV
+    static gboolean waitv_missing = false;
+    struct futex_waitv waiters[FLUX_SHM_RINGS_PER_THREAD + 1];
+    struct timespec timeout;
+    guint i, count = 0;
+    gboolean ready = false;
+
+    if ( waitv_missing ) {
+        g_usleep(FLUX_SHM_POLL_INTERVAL);
+        return;
+    }
+
+    memset(waiters, 0, sizeof(waiters));
+
+    waiters[count].uaddr = (uintptr_t)&ingest->control;
+    waiters[count].val = control;
+    waiters[count].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+    count++;
+
+    for ( i = 0; i < rings->len; i++ ) {
+        struct FluxShmRing *ring = g_ptr_array_index(rings, i);
+
+        if ( ring->header == NULL )
+            continue;
+
+        shm_store(&ring->header->waiting, 1);
+
+        /* the producer's doorbell is shared, no private flag */
+        waiters[count].uaddr = (uintptr_t)&ring->header->doorbell;
+        waiters[count].val = shm_load(&ring->header->doorbell);
+        waiters[count].flags = FUTEX_32;
+        count++;
+
+        /* check again, the producer might have missed the flag */
+        if ( shm_load(&ring->header->head) != ring->seen )
+            ready = true;
+    }
+
+    if ( !ready ) {
+        clock_gettime(CLOCK_MONOTONIC, &timeout);
+        timeout.tv_sec += (time_t)FLUX_SHM_RETRY_INTERVAL;
+
+        if ( syscall(SYS_futex_waitv, waiters, count, 0,
+                     &timeout, CLOCK_MONOTONIC) < 0 && errno == ENOSYS ) {
+            fnc_log(FNC_LOG_WARN, "[shm] futex_waitv not available, polling");
+            waitv_missing = true;
+        }
+    }
+
+    for ( i = 0; i < rings->len; i++ ) {
+        struct FluxShmRing *ring = g_ptr_array_index(rings, i);
+
+        if ( ring->header != NULL )
+            shm_store(&ring->header->waiting, 0);
+    }
+#else
+    g_usleep(FLUX_SHM_POLL_INTERVAL);
+#endif
+}
+
+static gpointer flux_shm_ingest(gpointer ptr)
+{
+    FluxShmIngest *ingest = ptr;
+    GPtrArray *rings = g_ptr_array_new();
+
+    while ( 1 ) {
+        const gint control = g_atomic_int_get(&ingest->control);
+        struct FluxShmRing *ring;
+        gboolean idle = true;
+        double now = ev_time();
+        guint i;
+
+        while ( (ring = g_async_queue_try_pop(ingest->incoming)) != NULL )
+            g_ptr_array_add(rings, ring);
+
+        for ( i = 0; i < rings->len; i++ ) {
+            ring = g_ptr_array_index(rings, i);
+
+            if ( ring->header == NULL ) {
+                if ( now < ring->next_open )
+                    continue;
+
+                ring->next_open = now + FLUX_SHM_RETRY_INTERVAL;
+                if ( !flux_shm_ring_open(ring) )
+                    continue;
+            }
+
+            if ( flux_shm_ring_read(ring) > 0 )
+                idle = false;
+        }
+
+        if ( idle )
+            flux_shm_wait(ingest, rings, control);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Prepare reading a track from a shared memory ring
+ *
+ * @param tr The track to read; Track::live::mq_path has to be set to
+ *           the name of the shared memory object.
+ *
+ * @return A new ring, to be started with @ref flux_shm_start once the
+ *         track is part of its resource.
+ */
+struct FluxShmRing *flux_shm_new(Track *tr)
+{
+    struct FluxShmRing *ring = g_slice_new0(struct FluxShmRing);
+
+    ring->track = tr;
+
+    return ring;
+}
+
+/**
+ * @brief Start reading the ring
+ *
+ * @param ring The ring to read
+ *
+ * The ring is assigned to the first ingest thread with room for it,
+ * or to a new one. It's not an error for the producer to create the
+ * ring only afterwards.
+ */
+void flux_shm_start(struct FluxShmRing *ring)
+{
+    FluxShmIngest *ingest = NULL;
+    guint i;
+
+    g_static_mutex_lock(&ingest_lock);
+
+    if ( ingest_threads == NULL )
+        ingest_threads = g_ptr_array_new();
+
+    for ( i = 0; i < ingest_threads->len && ingest == NULL; i++ ) {
+        FluxShmIngest *candidate = g_ptr_array_index(ingest_threads, i);
+
+        if ( candidate->assigned < FLUX_SHM_RINGS_PER_THREAD )
+            ingest = candidate;
+    }
+
+    if ( ingest == NULL ) {
+        ingest = g_slice_new0(FluxShmIngest);
+        ingest->incoming = g_async_queue_new();
+        g_ptr_array_add(ingest_threads, ingest);
+        g_thread_create(flux_shm_ingest, ingest, false, NULL);
+    }
+
+    ingest->assigned++;
+    ring->ingest = ingest;
+
+    g_static_mutex_unlock(&ingest_lock);
+
+    g_async_queue_push(ingest->incoming, ring);
+
+    g_atomic_int_inc(&ingest->control);
+    syscall(SYS_futex, &ingest->control, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief Free a ring that was never started
+ *
+ * Once started, rings are read for the whole life of the process,
+ * like the live resources they belong to.
+ */
+void flux_shm_free(struct FluxShmRing *ring)
+{
+    if ( ring == NULL )
+        return;
+
+    g_assert(ring->ingest == NULL);
+
+    g_slice_free(struct FluxShmRing, ring);
+}
+
+/**
+ * @}
+ */
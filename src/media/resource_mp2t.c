@@ -0,0 +1,465 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+
+#include "media/media.h"
+
+#include <libavformat/avformat.h>
+
+/**
+ * @defgroup mp2t MPEG-TS output
+ * @ingroup resources
+ *
+ * @brief Send all the tracks of a stored file as one transport stream
+ *
+ * Set-top boxes expect a single RTP session carrying an MPEG
+ * transport stream (RFC 2250) rather than one session per elementary
+ * stream. For the files whose path is listed in the vhost's @c
+ * mp2t-paths, the packets read by libavformat are not handed to the
+ * tracks' parsers but muxed with the libavformat MPEG-TS muxer, and
+ * its output is cut into RTP payloads of up to seven 188-byte
+ * packets, as many as fit in the track's MTU.
+ *
+ * The resource then shows a single track, with the static payload
+ * type 33, whose buffers carry the decoding time of the packet that
+ * caused them to be written. Since the tracks are muxed once per
+ * resource, the clients sharing a stored file share the muxing as
+ * well, and the RTP cache records the transport stream like any
+ * other track.
+ *
+ * Only the codecs with an MPEG-TS mapping are muxed, the others are
+ * not sent; H.264 in MP4 form is turned into Annex B byte stream on
+ * the way.
+ *
+ * @{
+ */
+
+/** Size of an MPEG-TS packet */
+#define MP2T_PACKET_SIZE 188
+
+/** Most MPEG-TS packets in an RTP packet, the usual 1316 bytes */
+#define MP2T_PACKETS_MAX 7
+
+/** Static RTP payload type of MPEG-TS (RFC 3551) */
+#define MP2T_PAYLOAD_TYPE 33
+
+struct MP2TMux {
+    Resource *resource;
+
+    /** The track carrying the transport stream */
+    Track *track;
+
+    /** Muxer context, rebuilt at each flush */
+    AVFormatContext *ctx;
+
+    /** Whether the muxer header was written, and needs a trailer */
+    gboolean started;
+
+    /** Muxed stream of each stream of the file, -1 if not muxed */
+    int *streams;
+
+    /** Annex B conversion of each stream of the file, if needed */
+    AVBitStreamFilterContext **filters;
+
+    /** Muxer output not yet sent, less than one payload */
+    GByteArray *pending;
+
+    /** Output dropped, when closing the muxer */
+    gboolean discard;
+
+    /** @ref pending goes out at a discontinuity of the stream */
+    gboolean marker;
+
+    /** The packet being muxed is part of a video keyframe */
+    gboolean keyframe;
+
+    /** @ref delivery is set, since the last flush */
+    gboolean timed;
+
+    /** Time of the packet being muxed, never going backward */
+    double delivery;
+    double duration;
+};
+
+static gboolean mp2t_codec_supported(enum AVCodecID codec_id)
+{
+    switch ( codec_id ) {
+    case AV_CODEC_ID_MPEG1VIDEO:
+    case AV_CODEC_ID_MPEG2VIDEO:
+    case AV_CODEC_ID_MPEG4:
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_MP2:
+    case AV_CODEC_ID_MP3:
+    case AV_CODEC_ID_AAC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Send the muxer's output in payloads of whole MPEG-TS packets
+ *
+ * @param mux The muxer to send the output of
+ * @param all Send the last, shorter, payload as well
+ */
+static void mp2t_emit(MP2TMux *mux, gboolean all)
+{
+    Track *tr = mux->track;
+    const size_t packets = CLAMP(tr->mtu / MP2T_PACKET_SIZE, 1, MP2T_PACKETS_MAX);
+    const size_t payload = packets * MP2T_PACKET_SIZE;
+    size_t offset = 0;
+
+    while ( mux->pending->len - offset >= payload ||
+            ( all && offset < mux->pending->len ) ) {
+        const size_t size = MIN(payload, mux->pending->len - offset);
+        struct MParserBuffer *buffer = mparser_buffer_alloc(tr, size);
+
+        buffer->timestamp = mux->delivery;
+        buffer->delivery = mux->delivery;
+        buffer->duration = mux->duration;
+        buffer->marker = mux->marker;
+        buffer->keyframe = mux->keyframe;
+
+        memcpy(buffer->data, mux->pending->data + offset, size);
+
+        track_write(tr, buffer);
+
+        mux->marker = false;
+        offset += size;
+    }
+
+    g_byte_array_remove_range(mux->pending, 0, offset);
+}
+
+static int mp2t_output(void *mux_p, uint8_t *data, int size)
+{
+    MP2TMux *mux = mux_p;
+
+    if ( mux->discard )
+        return size;
+
+    /* the tables written with the header wait for the first packet's
+       time */
+    g_byte_array_append(mux->pending, data, size);
+    if ( mux->timed )
+        mp2t_emit(mux, false);
+
+    return size;
+}
+
+/**
+ * @brief Close the muxer
+ *
+ * @param mux The muxer to close
+ * @param emit Whether the data still held by the muxer is sent, or
+ *             dropped
+ */
+static void mp2t_stop(MP2TMux *mux, gboolean emit)
+{
+    if ( mux->ctx == NULL )
+        return;
+
+    mux->discard = !emit;
+    if ( mux->started )
+        av_write_trailer(mux->ctx);
+    mux->discard = false;
+
+    if ( mux->ctx->pb != NULL ) {
+        av_free(mux->ctx->pb->buffer);
+        av_free(mux->ctx->pb);
+    }
+
+    avformat_free_context(mux->ctx);
+    mux->ctx = NULL;
+    mux->started = false;
+}
+
+static gboolean mp2t_start(MP2TMux *mux)
+{
+    AVFormatContext *avfc = mux->resource->stored.avfc;
+    AVOutputFormat *format;
+    uint8_t *output;
+    unsigned int i;
+
+    if ( (format = av_guess_format("mpegts", NULL, NULL)) == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[mp2t] MPEG-TS muxer not available");
+        return false;
+    }
+
+    mux->ctx = avformat_alloc_context();
+    mux->ctx->oformat = format;
+
+    for ( i = 0; i < avfc->nb_streams; i++ ) {
+        AVStream *in = avfc->streams[i], *out;
+
+        if ( mux->streams[i] < 0 )
+            continue;
+
+        if ( (out = avformat_new_stream(mux->ctx, NULL)) == NULL ||
+             avcodec_copy_context(out->codec, in->codec) < 0 )
+            goto err;
+
+        out->codec->codec_tag = 0;
+        out->time_base = in->time_base;
+    }
+
+    /* the muxer writes whole packets, so the output comes in chunks
+       of the most packets sent at once */
+    output = av_malloc(MP2T_PACKET_SIZE * MP2T_PACKETS_MAX);
+    mux->ctx->pb = avio_alloc_context(output,
+                                      MP2T_PACKET_SIZE * MP2T_PACKETS_MAX,
+                                      1, mux, NULL, mp2t_output, NULL);
+
+    if ( avformat_write_header(mux->ctx, NULL) < 0 )
+        goto err;
+
+    mux->started = true;
+    mux->timed = false;
+
+    return true;
+
+ err:
+    fnc_log(FNC_LOG_ERR, "[mp2t] unable to start muxing %s",
+            avfc->filename);
+    mp2t_stop(mux, false);
+    return false;
+}
+
+/**
+ * @brief Send what the muxer holds back, and start it over
+ *
+ * Called at the end of the resource and before seeking it, so that
+ * the stream after a seek starts with its tables again and fresh
+ * timestamps; its first packet has the marker bit set, as RFC 2250
+ * asks for at the discontinuities.
+ */
+static void mp2t_flush(Track *tr)
+{
+    MP2TMux *mux = tr->parent->stored.mp2t;
+
+    mp2t_stop(mux, true);
+    mp2t_emit(mux, true);
+
+    mux->marker = true;
+    mp2t_start(mux);
+}
+
+/**
+ * @brief Set up the muxing of a stored file's tracks
+ *
+ * @param r The resource, with the tracks found by @ref avf_open in
+ *          @ref Resource::stored::tracks
+ *
+ * @return A new muxer, whose track (see @ref mp2t_track) is to be
+ *         the only one of the resource; NULL if none of the tracks
+ *         can be muxed, or the muxer can't be started.
+ */
+MP2TMux *mp2t_open(Resource *r)
+{
+    AVFormatContext *avfc = r->stored.avfc;
+    MP2TMux *mux = g_slice_new0(MP2TMux);
+    unsigned int bitrate = 0, i;
+    int muxed = 0;
+    Track *tr;
+
+    mux->resource = r;
+    mux->streams = g_new(int, avfc->nb_streams);
+    mux->filters = g_new0(AVBitStreamFilterContext*, avfc->nb_streams);
+    mux->pending = g_byte_array_new();
+
+    for ( i = 0; i < avfc->nb_streams; i++ ) {
+        AVCodecContext *codec = avfc->streams[i]->codec;
+        Track *es = r->stored.tracks[i];
+
+        mux->streams[i] = -1;
+
+        if ( es == NULL )
+            continue;
+
+        if ( !mp2t_codec_supported(codec->codec_id) ) {
+            fnc_log(FNC_LOG_INFO, "[mp2t] %s of %s can't be muxed, not sent",
+                    es->encoding_name, avfc->filename);
+            continue;
+        }
+
+        /* MP4 and Matroska store the NAL units with their length;
+           MPEG-TS wants them with start codes */
+        if ( codec->codec_id == AV_CODEC_ID_H264 &&
+             codec->extradata_size > 0 && codec->extradata[0] == 1 &&
+             (mux->filters[i] = av_bitstream_filter_init("h264_mp4toannexb")) == NULL )
+            goto err;
+
+        mux->streams[i] = muxed++;
+        bitrate += es->bitrate;
+    }
+
+    if ( muxed == 0 )
+        goto err;
+
+    tr = mux->track = track_new(g_strdup("mp2t"));
+
+    tr->payload_type = MP2T_PAYLOAD_TYPE;
+    tr->clock_rate = 90000;
+    tr->encoding_name = g_strdup("MP2T");
+    tr->media_type = MP_video;
+    tr->bitrate = bitrate;
+    tr->flush = mp2t_flush;
+
+    sdp_descr_append_rtpmap(tr);
+
+    if ( !mp2t_start(mux) )
+        goto err;
+
+    for ( i = 0; i < avfc->nb_streams; i++ )
+        if ( mux->streams[i] < 0 )
+            avfc->streams[i]->discard = AVDISCARD_ALL;
+
+    fnc_log(FNC_LOG_DEBUG, "[mp2t] muxing %d streams of %s",
+            muxed, avfc->filename);
+
+    return mux;
+
+ err:
+    track_free(mux->track);
+    mp2t_free(mux);
+    return NULL;
+}
+
+/**
+ * @brief Get the track carrying the transport stream of a muxer
+ */
+Track *mp2t_track(MP2TMux *mux)
+{
+    return mux->track;
+}
+
+/**
+ * @brief Mux a packet read from the file
+ *
+ * @param mux The muxer of the packet's resource
+ * @param tr The elementary track the packet belongs to, whose
+ *           timestamps are already set
+ * @param pkt The packet as read by libavformat
+ *
+ * @retval 0 The packet was muxed, or dropped because the muxer
+ *           refused it.
+ * @retval -1 The muxer could not be started over after a flush.
+ */
+int mp2t_write(MP2TMux *mux, Track *tr, AVPacket *pkt)
+{
+    const int index = mux->streams[pkt->stream_index];
+    AVStream *in = mux->resource->stored.avfc->streams[pkt->stream_index];
+    AVBitStreamFilterContext *filter = mux->filters[pkt->stream_index];
+    AVStream *out;
+    uint8_t *filtered = NULL;
+    AVPacket opkt;
+    int ret;
+
+    if ( index < 0 )
+        return 0;
+
+    if ( mux->ctx == NULL )
+        return -1;
+
+    out = mux->ctx->streams[index];
+
+    av_init_packet(&opkt);
+    opkt.stream_index = index;
+    opkt.flags = pkt->flags;
+    opkt.data = pkt->data;
+    opkt.size = pkt->size;
+
+    if ( pkt->pts != AV_NOPTS_VALUE )
+        opkt.pts = av_rescale_q(pkt->pts, in->time_base, out->time_base);
+    if ( pkt->dts != AV_NOPTS_VALUE )
+        opkt.dts = av_rescale_q(pkt->dts, in->time_base, out->time_base);
+    opkt.duration = av_rescale_q(pkt->duration, in->time_base, out->time_base);
+
+    if ( filter != NULL ) {
+        ret = av_bitstream_filter_filter(filter, out->codec, NULL,
+                                         &opkt.data, &opkt.size,
+                                         pkt->data, pkt->size,
+                                         pkt->flags & AV_PKT_FLAG_KEY);
+        if ( ret < 0 ) {
+            fnc_log(FNC_LOG_VERBOSE, "[mp2t] unable to convert a packet of %s",
+                    tr->name);
+            return 0;
+        }
+
+        if ( ret > 0 )
+            filtered = opkt.data;
+    }
+
+    /* the streams are interleaved by decoding time only roughly, the
+       payloads must not go back in time */
+    if ( !mux->timed || tr->dts > mux->delivery )
+        mux->delivery = tr->dts;
+    mux->timed = true;
+    mux->duration = tr->frame_duration;
+    mux->keyframe = tr->keyframe && tr->media_type == MP_video;
+
+    if ( av_write_frame(mux->ctx, &opkt) < 0 )
+        fnc_log(FNC_LOG_VERBOSE, "[mp2t] packet of %s dropped by the muxer",
+                tr->name);
+
+    av_free(filtered);
+
+    return 0;
+}
+
+/**
+ * @brief Free a muxer, dropping what it still holds
+ *
+ * The track carrying the transport stream belongs to the resource,
+ * and is freed along with its other tracks.
+ */
+void mp2t_free(MP2TMux *mux)
+{
+    unsigned int i;
+
+    if ( mux == NULL )
+        return;
+
+    mp2t_stop(mux, false);
+
+    for ( i = 0; i < mux->resource->stored.avfc->nb_streams; i++ )
+        if ( mux->filters[i] != NULL )
+            av_bitstream_filter_close(mux->filters[i]);
+
+    g_free(mux->filters);
+    g_free(mux->streams);
+    g_byte_array_free(mux->pending, true);
+
+    g_slice_free(MP2TMux, mux);
+}
+
+/**
+ * @}
+ */
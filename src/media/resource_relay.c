@@ -0,0 +1,784 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+
+#include "media/media.h"
+#include "network/uri.h"
+
+/**
+ * @defgroup relay Origin relay
+ * @ingroup resources
+ *
+ * @brief Republish a live resource pulled from an upstream server
+ *
+ * An sd2 file whose @c [relay] section has an @c upstream key doesn't
+ * describe its tracks: they are those of the upstream RTSP resource,
+ * described once when the resource is first opened. The resource is
+ * then a @ref LIVE_SOURCE like the others, shared by all the local
+ * viewers.
+ *
+ * The stream is only pulled, interleaved on a single TCP connection,
+ * while some local session is consuming one of the tracks; the
+ * upstream session is torn down once nobody used it for @ref
+ * cfg_options_t::relay_linger seconds, and set up again for the next
+ * viewer. The upstream server so sees a single session per edge,
+ * however many viewers it has.
+ *
+ * @{
+ */
+
+/** Seconds to wait for a reply or for data from the upstream server */
+#define RELAY_TIMEOUT 5
+/** Seconds between the keepalive requests on the upstream session */
+#define RELAY_KEEPALIVE 30
+/** Largest RTSP reply accepted from the upstream server */
+#define RELAY_MAX_REPLY (256*1024)
+
+typedef struct {
+    Resource *resource;
+
+    /** URL of the upstream resource */
+    gchar *url;
+    /** Base the relative control URLs of the tracks are resolved on */
+    gchar *base;
+
+    /** Tracks, by half their interleaved channel */
+    Track **tracks;
+    /** Upstream control URLs of the tracks */
+    gchar **controls;
+    /** Last RTP timestamp received on each track */
+    uint32_t *last_ts;
+    guint tracks_count;
+
+    int sd;
+    GByteArray *input;
+    guint cseq;
+    gchar *session;
+} LiveRelay;
+
+typedef struct {
+    int status;
+    gchar *headers;
+    gchar *body;
+} RelayReply;
+
+static void relay_reply_clear(RelayReply *reply)
+{
+    g_free(reply->headers);
+    g_free(reply->body);
+    memset(reply, 0, sizeof(*reply));
+}
+
+/**
+ * @brief Find a header in the header block of a reply
+ *
+ * @return A new string with the value of the header, or NULL.
+ */
+static gchar *relay_header(const RelayReply *reply, const char *name)
+{
+    const size_t name_len = strlen(name);
+    const char *line = reply->headers;
+
+    while ( line != NULL && *line != '\0' ) {
+        const char *end = strstr(line, "\r\n");
+
+        if ( end == NULL )
+            end = line + strlen(line);
+
+        if ( (size_t)(end - line) > name_len && line[name_len] == ':' &&
+             g_ascii_strncasecmp(line, name, name_len) == 0 ) {
+            gchar *value = g_strndup(line + name_len + 1,
+                                     end - line - name_len - 1);
+            return g_strstrip(value);
+        }
+
+        line = *end != '\0' ? end + 2 : NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Connect a socket, waiting at most @ref RELAY_TIMEOUT seconds
+ *
+ * The resource is described from the thread of the client asking
+ * for it, so an unreachable server must not keep it for the minutes
+ * the kernel would take to give up.
+ */
+static gboolean relay_connect_timeout(int sd, const struct sockaddr *sa,
+                                      socklen_t sa_len)
+{
+    const int flags = fcntl(sd, F_GETFL);
+    struct pollfd pfd = { sd, POLLOUT, 0 };
+    socklen_t error_len = sizeof(int);
+    int error = 0;
+
+    if ( fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0 )
+        return false;
+
+    if ( connect(sd, sa, sa_len) < 0 ) {
+        if ( errno != EINPROGRESS )
+            return false;
+
+        if ( poll(&pfd, 1, RELAY_TIMEOUT * 1000) <= 0 ||
+             getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+             error != 0 )
+            return false;
+    }
+
+    return fcntl(sd, F_SETFL, flags) == 0;
+}
+
+static gboolean relay_connect(LiveRelay *relay)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    struct timeval timeout = { 1, 0 };
+    URI *uri = uri_parse(relay->url);
+    int gai_error;
+
+    if ( uri == NULL || uri->host == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[relay] invalid upstream URL '%s'", relay->url);
+        uri_free(uri);
+        return false;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ( (gai_error = getaddrinfo(uri->host, uri->port ? uri->port : "554",
+                                  &hints, &res)) != 0 ) {
+        fnc_log(FNC_LOG_ERR, "[relay] unable to resolve '%s': %s",
+                uri->host, gai_strerror(gai_error));
+        uri_free(uri);
+        return false;
+    }
+
+    uri_free(uri);
+
+    for ( ai = res; ai != NULL; ai = ai->ai_next ) {
+        if ( (relay->sd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0 )
+            continue;
+
+        if ( relay_connect_timeout(relay->sd, ai->ai_addr, ai->ai_addrlen) )
+            break;
+
+        close(relay->sd);
+        relay->sd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if ( relay->sd < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[relay] unable to connect to %s", relay->url);
+        return false;
+    }
+
+    /* the reads time out every second, to check the local viewers */
+    setsockopt(relay->sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    g_byte_array_set_size(relay->input, 0);
+
+    return true;
+}
+
+static void relay_disconnect(LiveRelay *relay)
+{
+    if ( relay->sd >= 0 )
+        close(relay->sd);
+
+    relay->sd = -1;
+    g_free(relay->session);
+    relay->session = NULL;
+}
+
+/**
+ * @brief Read what the upstream server sent
+ *
+ * @retval true Data was read, or the read timed out.
+ * @retval false The connection was closed or failed.
+ */
+static gboolean relay_fill(LiveRelay *relay)
+{
+    uint8_t buffer[65536];
+    ssize_t n = recv(relay->sd, buffer, sizeof(buffer), 0);
+
+    if ( n > 0 ) {
+        g_byte_array_append(relay->input, buffer, n);
+        return true;
+    }
+
+    if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+        return true;
+
+    fnc_log(FNC_LOG_INFO, "[relay] connection to %s closed", relay->url);
+    return false;
+}
+
+/**
+ * @brief Republish an RTP packet received from the upstream server
+ */
+static void relay_packet(LiveRelay *relay, guint channel,
+                         const uint8_t *data, size_t len)
+{
+    const guint index = channel / 2;
+    struct MParserBuffer *buffer;
+    size_t offset, padding = 0;
+    uint32_t timestamp;
+    Track *tr;
+
+    /* RTCP is not forwarded, the local sessions send their own */
+    if ( channel % 2 != 0 || index >= relay->tracks_count || len < 12 ||
+         (data[0] >> 6) != 2 )
+        return;
+
+    tr = relay->tracks[index];
+
+    if ( tr->consumers == 0 && relay->resource->live.timeshift == NULL )
+        return;
+
+    offset = 12 + 4 * (data[0] & 0x0f);
+
+    if ( (data[0] & 0x10) && offset + 4 <= len )
+        offset += 4 + 4 * ((data[offset+2] << 8) | data[offset+3]);
+
+    if ( data[0] & 0x20 )
+        padding = data[len-1];
+
+    if ( offset + padding >= len )
+        return;
+
+    timestamp = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+
+    if ( relay->last_ts[index] != 0 && timestamp != relay->last_ts[index] )
+        tr->frame_duration =
+            (uint32_t)(timestamp - relay->last_ts[index]) / (double)tr->clock_rate;
+    relay->last_ts[index] = timestamp;
+
+    trace_ingest(tr);
+    buffer = mparser_buffer_alloc(tr, len - offset - padding);
+    memcpy(buffer->data, data + offset, buffer->data_size);
+
+    buffer->timestamp = timestamp / (double)tr->clock_rate;
+    buffer->delivery = ev_time();
+    buffer->duration = tr->frame_duration * 3;
+    buffer->marker = data[1] >> 7;
+    buffer->seq_no = (data[2] << 8) | data[3];
+    buffer->rtp_timestamp = timestamp;
+    buffer->keyframe = flux_packet_keyframe(tr, buffer);
+
+    flux_track_deliver(tr, buffer);
+}
+
+/**
+ * @brief Handle the interleaved packets and the replies read
+ *
+ * @param reply Where to store the first reply found; if NULL, the
+ *              replies are discarded.
+ *
+ * @retval 1 A reply was stored in @p reply.
+ * @retval 0 More data is needed.
+ * @retval -1 The upstream server sent something invalid.
+ */
+static int relay_process(LiveRelay *relay, RelayReply *reply)
+{
+    GByteArray *input = relay->input;
+    size_t offset = 0;
+    int res = 0;
+
+    /* the data handled is only dropped once, at the end */
+    while ( offset < input->len ) {
+        const char *data = (const char *)input->data + offset;
+        const size_t left = input->len - offset;
+        const char *headers_end;
+        gchar *length_str;
+        size_t headers_len, length = 0;
+        RelayReply parsed = { 0, NULL, NULL };
+
+        if ( data[0] == '$' ) {
+            const uint8_t *frame = input->data + offset;
+            size_t frame_len;
+
+            if ( left < 4 )
+                break;
+
+            frame_len = (frame[2] << 8) | frame[3];
+            if ( left < 4 + frame_len )
+                break;
+
+            relay_packet(relay, frame[1], frame + 4, frame_len);
+            offset += 4 + frame_len;
+            continue;
+        }
+
+        headers_end = g_strstr_len(data, left, "\r\n\r\n");
+        if ( headers_end == NULL ) {
+            if ( left > RELAY_MAX_REPLY )
+                res = -1;
+            break;
+        }
+
+        if ( sscanf(data, "RTSP/1.0 %d", &parsed.status) != 1 ) {
+            res = -1;
+            break;
+        }
+
+        headers_len = headers_end + 4 - data;
+        parsed.headers = g_strndup(data, headers_len);
+
+        if ( (length_str = relay_header(&parsed, "Content-Length")) != NULL )
+            length = strtoul(length_str, NULL, 10);
+        g_free(length_str);
+
+        if ( length > RELAY_MAX_REPLY ) {
+            relay_reply_clear(&parsed);
+            res = -1;
+            break;
+        }
+
+        if ( left < headers_len + length ) {
+            relay_reply_clear(&parsed);
+            break;
+        }
+
+        parsed.body = g_strndup(data + headers_len, length);
+        offset += headers_len + length;
+
+        if ( reply != NULL ) {
+            *reply = parsed;
+            res = 1;
+            break;
+        }
+
+        relay_reply_clear(&parsed);
+    }
+
+    g_byte_array_remove_range(input, 0, offset);
+
+    return res;
+}
+
+static gboolean relay_send(LiveRelay *relay, const char *method,
+                           const char *url, const char *headers)
+{
+    GString *request = g_string_new("");
+    const char *p;
+    size_t left;
+
+    g_string_printf(request, "%s %s RTSP/1.0\r\n"
+                    "CSeq: %u\r\n"
+                    "User-Agent: " PACKAGE "/" VERSION "\r\n",
+                    method, url, ++relay->cseq);
+
+    if ( relay->session != NULL )
+        g_string_append_printf(request, "Session: %s\r\n", relay->session);
+
+    g_string_append_printf(request, "%s\r\n", headers);
+
+    for ( p = request->str, left = request->len; left > 0; ) {
+        ssize_t n = send(relay->sd, p, left, MSG_NOSIGNAL);
+
+        if ( n < 0 && errno == EINTR )
+            continue;
+
+        if ( n <= 0 ) {
+            g_string_free(request, true);
+            return false;
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    g_string_free(request, true);
+    return true;
+}
+
+/**
+ * @brief Send a request to the upstream server and wait for the reply
+ *
+ * @return true if the server replied with a 200 status.
+ */
+static gboolean relay_request(LiveRelay *relay, const char *method,
+                              const char *url, const char *headers,
+                              RelayReply *reply)
+{
+    const ev_tstamp deadline = ev_time() + RELAY_TIMEOUT;
+    int res;
+
+    if ( !relay_send(relay, method, url, headers) )
+        return false;
+
+    while ( (res = relay_process(relay, reply)) == 0 ) {
+        if ( ev_time() > deadline || !relay_fill(relay) ) {
+            fnc_log(FNC_LOG_ERR, "[relay] no reply to %s from %s",
+                    method, relay->url);
+            return false;
+        }
+    }
+
+    if ( res < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[relay] invalid reply to %s from %s",
+                method, relay->url);
+        return false;
+    }
+
+    if ( reply->status != 200 ) {
+        fnc_log(FNC_LOG_ERR, "[relay] %s %s failed with status %d",
+                method, url, reply->status);
+        relay_reply_clear(reply);
+        return false;
+    }
+
+    return true;
+}
+
+static gchar *relay_control_url(LiveRelay *relay, const char *control)
+{
+    if ( strstr(control, "://") != NULL )
+        return g_strdup(control);
+
+    if ( strcmp(control, "*") == 0 )
+        return g_strdup(relay->base);
+
+    return g_str_has_suffix(relay->base, "/") ?
+        g_strconcat(relay->base, control, NULL) :
+        g_strconcat(relay->base, "/", control, NULL);
+}
+
+/**
+ * @brief Create a track out of a media description of the upstream SDP
+ *
+ * @param lines The lines of the media description, starting with the
+ *              m= line
+ * @param index Position of the media description in the SDP
+ */
+static Track *relay_track_new(LiveRelay *relay, gchar **lines, guint index,
+                              gchar **control)
+{
+    char media[16];
+    unsigned int payload;
+    Track *track;
+    gchar **line;
+
+    if ( sscanf(lines[0], "m=%15s %*u %*s %u", media, &payload) != 2 ||
+         payload > 127 )
+        return NULL;
+
+    track = track_new(g_strdup_printf("track%u", index));
+    track->payload_type = payload;
+
+    if ( strcmp(media, "audio") == 0 )
+        track->media_type = MP_audio;
+    else if ( strcmp(media, "video") == 0 )
+        track->media_type = MP_video;
+    else
+        track->media_type = MP_application;
+
+    for ( line = lines + 1; *line != NULL && !g_str_has_prefix(*line, "m="); line++ ) {
+        unsigned int pt, clock_rate, channels = 1;
+        char encoding[32];
+
+        if ( g_str_has_prefix(*line, "a=control:") ) {
+            *control = relay_control_url(relay, *line + strlen("a=control:"));
+            continue;
+        }
+
+        if ( sscanf(*line, "a=rtpmap:%u %31[^/]/%u/%u",
+                    &pt, encoding, &clock_rate, &channels) >= 3 &&
+             pt == payload ) {
+            track->encoding_name = g_strdup(encoding);
+            track->clock_rate = clock_rate;
+            track->audio_channels = channels;
+        }
+
+        /* the range and the control are the relay's own */
+        if ( g_str_has_prefix(*line, "a=") &&
+             !g_str_has_prefix(*line, "a=range:") )
+            g_string_append_printf(track->sdp_description, "%s\r\n", *line);
+    }
+
+    if ( track->clock_rate <= 0 && payload < 96 ) {
+        /* static payload types of RFC 3551 without an rtpmap */
+        track->clock_rate = track->media_type == MP_video ? 90000 : 8000;
+        if ( payload == 14 )
+            track->clock_rate = 90000;
+    }
+
+    if ( track->encoding_name == NULL )
+        track->encoding_name = g_strdup_printf("%u", payload);
+
+    if ( *control == NULL || track->clock_rate <= 0 ) {
+        fnc_log(FNC_LOG_ERR, "[relay] unusable media description '%s' in %s",
+                lines[0], relay->url);
+        track_free(track);
+        g_free(*control);
+        *control = NULL;
+        return NULL;
+    }
+
+    if ( feng_srv.live_gop_cache )
+        track->gop = g_queue_new();
+
+    return track;
+}
+
+/**
+ * @brief Describe the upstream resource and create its tracks
+ */
+static gboolean relay_describe(LiveRelay *relay)
+{
+    RelayReply reply = { 0, NULL, NULL };
+    GPtrArray *tracks = g_ptr_array_new(), *controls = g_ptr_array_new();
+    gchar **lines, **line;
+    guint i;
+
+    if ( !relay_connect(relay) )
+        goto error;
+
+    if ( !relay_request(relay, "DESCRIBE", relay->url,
+                        "Accept: application/sdp\r\n", &reply) )
+        goto error;
+
+    relay_disconnect(relay);
+
+    if ( (relay->base = relay_header(&reply, "Content-Base")) == NULL )
+        relay->base = g_strdup(relay->url);
+
+    lines = g_strsplit(reply.body, "\n", 0);
+    for ( line = lines; *line != NULL; line++ )
+        g_strchomp(*line);
+
+    for ( line = lines; *line != NULL; line++ ) {
+        gchar *control = NULL;
+        Track *track;
+
+        if ( !g_str_has_prefix(*line, "m=") )
+            continue;
+
+        if ( (track = relay_track_new(relay, line, tracks->len, &control)) != NULL ) {
+            g_ptr_array_add(tracks, track);
+            g_ptr_array_add(controls, control);
+        }
+    }
+
+    g_strfreev(lines);
+    relay_reply_clear(&reply);
+
+    if ( tracks->len == 0 )
+        goto error;
+
+    relay->tracks_count = tracks->len;
+    relay->tracks = (Track **)g_ptr_array_free(tracks, false);
+    relay->controls = (gchar **)g_ptr_array_free(controls, false);
+    relay->last_ts = g_new0(uint32_t, relay->tracks_count);
+
+    for ( i = 0; i < relay->tracks_count; i++ )
+        relay->resource->tracks =
+            g_list_append(relay->resource->tracks, relay->tracks[i]);
+
+    return true;
+
+ error:
+    relay_disconnect(relay);
+    relay_reply_clear(&reply);
+    g_ptr_array_foreach(tracks, (GFunc)track_free, NULL);
+    g_ptr_array_foreach(controls, (GFunc)g_free, NULL);
+    g_ptr_array_free(tracks, true);
+    g_ptr_array_free(controls, true);
+    return false;
+}
+
+/**
+ * @brief Set up and play all the tracks on a new upstream session
+ */
+static gboolean relay_play(LiveRelay *relay)
+{
+    RelayReply reply = { 0, NULL, NULL };
+    guint i;
+
+    if ( !relay_connect(relay) )
+        return false;
+
+    for ( i = 0; i < relay->tracks_count; i++ ) {
+        gchar *transport =
+            g_strdup_printf("Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u\r\n",
+                            2*i, 2*i + 1);
+        gboolean res = relay_request(relay, "SETUP", relay->controls[i],
+                                     transport, &reply);
+
+        g_free(transport);
+
+        if ( !res )
+            return false;
+
+        if ( relay->session == NULL ) {
+            gchar *session = relay_header(&reply, "Session");
+
+            if ( session != NULL )
+                relay->session = g_strdup(strtok(session, ";"));
+            g_free(session);
+        }
+
+        relay_reply_clear(&reply);
+    }
+
+    if ( !relay_request(relay, "PLAY", relay->base, "", &reply) )
+        return false;
+
+    relay_reply_clear(&reply);
+
+    return true;
+}
+
+static gboolean relay_wanted(LiveRelay *relay)
+{
+    guint i;
+
+    /* a recorded resource is pulled whether watched or not */
+    if ( relay->resource->live.timeshift != NULL )
+        return true;
+
+    for ( i = 0; i < relay->tracks_count; i++ )
+        if ( relay->tracks[i]->consumers > 0 )
+            return true;
+
+    return false;
+}
+
+/**
+ * @brief Pull the upstream resource for as long as it is watched
+ */
+static gpointer relay_thread(gpointer relay_p)
+{
+    LiveRelay *relay = relay_p;
+
+    while ( true ) {
+        ev_tstamp idle_since = 0, keepalive;
+
+        if ( !relay_wanted(relay) ) {
+            g_usleep(G_USEC_PER_SEC / 10);
+            continue;
+        }
+
+        if ( !relay_play(relay) ) {
+            relay_disconnect(relay);
+            g_usleep(G_USEC_PER_SEC);
+            continue;
+        }
+
+        fnc_log(FNC_LOG_INFO, "[relay] pulling %s", relay->url);
+        keepalive = ev_time() + RELAY_KEEPALIVE;
+
+        while ( relay_fill(relay) && relay_process(relay, NULL) == 0 ) {
+            const ev_tstamp now = ev_time();
+
+            if ( relay_wanted(relay) )
+                idle_since = 0;
+            else if ( idle_since == 0 )
+                idle_since = now;
+            else if ( now - idle_since >= feng_srv.relay_linger ) {
+                fnc_log(FNC_LOG_INFO, "[relay] no more viewers for %s",
+                        relay->url);
+                relay_send(relay, "TEARDOWN", relay->base, "");
+                break;
+            }
+
+            if ( now >= keepalive ) {
+                relay_send(relay, "OPTIONS", relay->base, "");
+                keepalive = now + RELAY_KEEPALIVE;
+            }
+        }
+
+        relay_disconnect(relay);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Open a live resource relayed from an upstream server
+ *
+ * @param mrl The path of the sd2 file describing the resource
+ * @param upstream The URL of the upstream resource
+ *
+ * @return The new resource, with the tracks of the upstream resource,
+ *         or NULL if it could not be described.
+ */
+Resource *relay_open(const char *mrl, const char *upstream)
+{
+    LiveRelay *relay = g_slice_new0(LiveRelay);
+    Resource *r = g_slice_new0(Resource);
+    guint i;
+
+    relay->resource = r;
+    relay->url = g_strdup(upstream);
+    relay->sd = -1;
+    relay->input = g_byte_array_new();
+
+    fnc_log(FNC_LOG_DEBUG, "[relay] describing %s for '%s'", upstream, mrl);
+
+    if ( !relay_describe(relay) ) {
+        fnc_log(FNC_LOG_ERR, "[relay] unable to describe %s for '%s'",
+                upstream, mrl);
+        g_byte_array_free(relay->input, true);
+        g_free(relay->base);
+        g_free(relay->url);
+        g_slice_free(LiveRelay, relay);
+        g_slice_free(Resource, r);
+        return NULL;
+    }
+
+    r->mrl = g_strdup(mrl);
+    r->lock = g_mutex_new();
+    r->source = LIVE_SOURCE;
+    r->duration = HUGE_VAL;
+
+    for ( i = 0; i < relay->tracks_count; i++ )
+        relay->tracks[i]->parent = r;
+
+    /* like the other live resources, it is never freed */
+    g_thread_create(relay_thread, relay, false, NULL);
+
+    return r;
+}
+
+/**
+ * @}
+ */
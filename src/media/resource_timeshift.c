@@ -0,0 +1,602 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @defgroup timeshift Time-shift of live resources
+ * @ingroup resources
+ *
+ * @brief Record a window of a live resource to play it back later
+ *
+ * A live resource whose sd2 file has a @c [timeshift] section, when
+ * @ref cfg_options_t::timeshift_dir is set, has its packets recorded,
+ * whether it is watched or not, as they come from the producer: they
+ * are appended to segment files in a directory of its own, each
+ * segment covering about @ref TIMESHIFT_SEGMENT_TIME seconds and
+ * starting with a keyframe. Segments older than the window are
+ * deleted.
+ *
+ * Each segment holds @ref TimeshiftPacket records, each followed by
+ * the packet's payload padded to 8 bytes; the start of the keyframes
+ * (or a packet every @ref TIMESHIFT_INDEX_INTERVAL seconds, for
+ * resources without video) is indexed in memory.
+ *
+ * A PLAY with a range not starting at zero switches the session from
+ * the live resource to a reader of the recording (see @ref
+ * timeshift_open), a stored resource whose time zero is the oldest
+ * moment still recorded: it is seeked and paced like any other
+ * stored resource, and keeps on reading the segments as they are
+ * written.
+ *
+ * @{
+ */
+
+/** Seconds of the live resource in each segment */
+#define TIMESHIFT_SEGMENT_TIME 60.0
+
+/** Interval between index entries, for resources without video */
+#define TIMESHIFT_INDEX_INTERVAL 1.0
+
+#define TIMESHIFT_PAD(x) (((x) + 7) & ~((size_t)7))
+
+typedef struct {
+    /** Time of arrival, on the wall clock */
+    double delivery;
+    /** Presentation time, on the same clock as @ref delivery */
+    double timestamp;
+    double duration;
+    uint32_t track;
+    uint32_t size;
+    uint8_t marker;
+    uint8_t keyframe;
+    uint8_t padding[6];
+} TimeshiftPacket;
+
+typedef struct {
+    double delivery;
+    uint64_t offset;
+} TimeshiftIndex;
+
+typedef struct {
+    gchar *path;
+    /** Appended to by the recorder, read with pread by the readers */
+    int fd;
+    /** Bytes of complete records, protected by @ref Timeshift::lock */
+    uint64_t size;
+    double start;
+    double end;
+    /** @ref TimeshiftIndex entries, protected by @ref Timeshift::lock */
+    GArray *index;
+    /** The recorder and each reader on the segment hold a reference */
+    gint refcount;
+} TimeshiftSegment;
+
+struct Timeshift {
+    GMutex *lock;
+    gchar *dir;
+    double window;
+
+    /** The segments, oldest first; the last one is being written */
+    GQueue *segments;
+    guint serial;
+
+    guint tracks_count;
+    gboolean has_video;
+
+    /** Offset from the tracks' timestamps to the wall clock */
+    double *ts_base;
+    /** Whether the last packet recorded for the track was a keyframe */
+    gboolean *in_keyframe;
+    double last_index;
+};
+
+/**
+ * @brief State of a resource reading the recording
+ */
+struct TimeshiftReader {
+    Timeshift *ts;
+
+    Track **tracks;
+    guint tracks_count;
+
+    /** Wall clock time of the reader's position zero */
+    double origin;
+
+    /** Segment being read, referenced */
+    TimeshiftSegment *segment;
+    /** Offset of the next record in @ref segment */
+    uint64_t offset;
+};
+
+static void segment_unref(TimeshiftSegment *seg)
+{
+    if ( !g_atomic_int_dec_and_test(&seg->refcount) )
+        return;
+
+    close(seg->fd);
+    g_array_free(seg->index, true);
+    g_free(seg->path);
+    g_slice_free(TimeshiftSegment, seg);
+}
+
+static TimeshiftSegment *segment_ref(TimeshiftSegment *seg)
+{
+    g_atomic_int_inc(&seg->refcount);
+    return seg;
+}
+
+/**
+ * @note Called with @ref Timeshift::lock held.
+ */
+static TimeshiftSegment *segment_new(Timeshift *ts, double now)
+{
+    TimeshiftSegment *seg;
+    gchar *name = g_strdup_printf("%08u.tss", ts->serial++);
+    gchar *path = g_build_filename(ts->dir, name, NULL);
+    int fd;
+
+    g_free(name);
+
+    if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0644)) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[timeshift] unable to create %s: %s",
+                path, strerror(errno));
+        g_free(path);
+        return NULL;
+    }
+
+    seg = g_slice_new0(TimeshiftSegment);
+    seg->path = path;
+    seg->fd = fd;
+    seg->start = seg->end = now;
+    seg->index = g_array_new(false, false, sizeof(TimeshiftIndex));
+    seg->refcount = 1;
+
+    g_queue_push_tail(ts->segments, seg);
+
+    return seg;
+}
+
+/**
+ * @brief Delete the segments that ended before the window
+ *
+ * The readers still on a deleted segment keep reading it through
+ * their reference, and move to the oldest segment left afterwards.
+ *
+ * @note Called with @ref Timeshift::lock held.
+ */
+static void timeshift_expire(Timeshift *ts, double now)
+{
+    TimeshiftSegment *seg;
+
+    while ( g_queue_get_length(ts->segments) > 1 &&
+            (seg = g_queue_peek_head(ts->segments))->end < now - ts->window ) {
+        g_queue_pop_head(ts->segments);
+        fnc_log(FNC_LOG_DEBUG, "[timeshift] expiring %s", seg->path);
+        unlink(seg->path);
+        segment_unref(seg);
+    }
+}
+
+/**
+ * @brief Start recording a live resource
+ *
+ * @param r The live resource, with its tracks already set
+ * @param window Seconds of the resource to keep
+ *
+ * @return The new recorder, or NULL if its directory could not be
+ *         created.
+ *
+ * Since the segments are not written again after a restart, any
+ * segment left in the directory is deleted.
+ */
+Timeshift *timeshift_new(Resource *r, double window)
+{
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_MD5, r->mrl, -1);
+    gchar *dir = g_build_filename(feng_srv.timeshift_dir, hash, NULL);
+    Timeshift *ts;
+    GDir *stale;
+    const gchar *name;
+    TrackList item;
+    guint i;
+
+    g_free(hash);
+
+    if ( g_mkdir_with_parents(dir, 0755) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "[timeshift] unable to create %s: %s",
+                dir, strerror(errno));
+        g_free(dir);
+        return NULL;
+    }
+
+    if ( (stale = g_dir_open(dir, 0, NULL)) != NULL ) {
+        while ( (name = g_dir_read_name(stale)) != NULL ) {
+            gchar *path;
+
+            if ( !g_str_has_suffix(name, ".tss") )
+                continue;
+
+            path = g_build_filename(dir, name, NULL);
+            unlink(path);
+            g_free(path);
+        }
+        g_dir_close(stale);
+    }
+
+    ts = g_slice_new0(Timeshift);
+    ts->lock = g_mutex_new();
+    ts->dir = dir;
+    ts->window = window;
+    ts->segments = g_queue_new();
+    ts->tracks_count = g_list_length(r->tracks);
+    ts->ts_base = g_new0(double, ts->tracks_count);
+    ts->in_keyframe = g_new0(gboolean, ts->tracks_count);
+
+    for ( item = r->tracks; item != NULL; item = item->next )
+        if ( ((Track*)item->data)->media_type == MP_video )
+            ts->has_video = true;
+
+    for ( i = 0; i < ts->tracks_count; i++ )
+        ts->ts_base[i] = NAN;
+
+    fnc_log(FNC_LOG_INFO, "[timeshift] recording %.0f seconds of '%s' into %s",
+            window, r->mrl, dir);
+
+    return ts;
+}
+
+/**
+ * @brief Record a packet of a live resource
+ *
+ * @param ts The recorder of the resource
+ * @param tr The track the packet belongs to
+ * @param buffer The packet; the reference is not consumed.
+ *
+ * Called for each packet read from the producer, by the thread
+ * reading the track.
+ */
+void timeshift_record(Timeshift *ts, Track *tr,
+                      const struct MParserBuffer *buffer)
+{
+    static const uint8_t zeros[8];
+    const double now = ev_time();
+    const gint index = g_list_index(tr->parent->tracks, tr);
+    const size_t padded = TIMESHIFT_PAD(buffer->data_size);
+    TimeshiftSegment *seg;
+    TimeshiftPacket packet;
+    gboolean index_point;
+    struct iovec iov[3];
+    ssize_t written;
+
+    if ( index < 0 || (guint)index >= ts->tracks_count )
+        return;
+
+    g_mutex_lock(ts->lock);
+
+    /* the producer's timestamps are on the track's clock, move them
+       on the wall clock at its first packet */
+    if ( isnan(ts->ts_base[index]) )
+        ts->ts_base[index] = now - buffer->timestamp;
+
+    if ( ts->has_video )
+        index_point = tr->media_type == MP_video && buffer->keyframe &&
+            !ts->in_keyframe[index];
+    else
+        index_point = now - ts->last_index >= TIMESHIFT_INDEX_INTERVAL;
+
+    if ( tr->media_type == MP_video || !ts->has_video )
+        ts->in_keyframe[index] = buffer->keyframe;
+
+    seg = g_queue_peek_tail(ts->segments);
+
+    /* segments start at an index point, so that they can be played
+       from their start */
+    if ( index_point &&
+         (seg == NULL || now - seg->start >= TIMESHIFT_SEGMENT_TIME) )
+        seg = segment_new(ts, now);
+
+    if ( seg == NULL )
+        goto end;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.delivery = now;
+    packet.timestamp = buffer->timestamp + ts->ts_base[index];
+    packet.duration = buffer->duration;
+    packet.track = index;
+    packet.size = buffer->data_size;
+    packet.marker = buffer->marker;
+    packet.keyframe = buffer->keyframe;
+
+    iov[0].iov_base = &packet;
+    iov[0].iov_len = sizeof(packet);
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = buffer->data_size;
+    iov[2].iov_base = (void*)zeros;
+    iov[2].iov_len = padded - buffer->data_size;
+
+    if ( (written = writev(seg->fd, iov, 3)) !=
+         (ssize_t)(sizeof(packet) + padded) ) {
+        fnc_log(FNC_LOG_ERR, "[timeshift] unable to write %s: %s",
+                seg->path, written < 0 ? strerror(errno) : "short write");
+        /* leave the partial record out of what the readers see */
+        if ( written > 0 && ftruncate(seg->fd, seg->size) < 0 )
+            fnc_perror("ftruncate");
+        goto end;
+    }
+
+    if ( index_point ) {
+        TimeshiftIndex entry = { now, seg->size };
+
+        g_array_append_val(seg->index, entry);
+        ts->last_index = now;
+    }
+
+    seg->size += sizeof(packet) + padded;
+    seg->end = now;
+
+    timeshift_expire(ts, now);
+
+ end:
+    g_mutex_unlock(ts->lock);
+}
+
+/**
+ * @brief Move a reader to a segment
+ *
+ * @note Called with @ref Timeshift::lock held.
+ */
+static void reader_move(struct TimeshiftReader *reader,
+                        TimeshiftSegment *seg, uint64_t offset)
+{
+    if ( reader->segment != NULL )
+        segment_unref(reader->segment);
+
+    reader->segment = segment_ref(seg);
+    reader->offset = offset;
+}
+
+static int timeshift_read_packet(Resource *r)
+{
+    struct TimeshiftReader *reader = r->stored.timeshift;
+    Timeshift *ts = reader->ts;
+    TimeshiftSegment *seg;
+    TimeshiftPacket packet;
+    struct MParserBuffer *buffer;
+    uint64_t size;
+    Track *tr;
+
+    g_mutex_lock(ts->lock);
+
+    if ( (seg = reader->segment) == NULL ) {
+        if ( g_queue_is_empty(ts->segments) ) {
+            g_mutex_unlock(ts->lock);
+            return RESOURCE_AGAIN;
+        }
+
+        reader_move(reader, g_queue_peek_head(ts->segments), 0);
+        seg = reader->segment;
+    }
+
+    if ( reader->offset >= seg->size ) {
+        GList *link = g_queue_find(ts->segments, seg);
+
+        /* still being written, wait for the recorder */
+        if ( link != NULL && link->next == NULL ) {
+            g_mutex_unlock(ts->lock);
+            return RESOURCE_AGAIN;
+        }
+
+        /* the next one, or the oldest left if this one expired */
+        reader_move(reader, link != NULL ? link->next->data :
+                    g_queue_peek_head(ts->segments), 0);
+        g_mutex_unlock(ts->lock);
+        return RESOURCE_OK;
+    }
+
+    size = seg->size;
+    g_mutex_unlock(ts->lock);
+
+    if ( pread(seg->fd, &packet, sizeof(packet), reader->offset) != sizeof(packet) ||
+         reader->offset + sizeof(packet) + packet.size > size ||
+         packet.track >= reader->tracks_count ) {
+        fnc_log(FNC_LOG_ERR, "[timeshift] %s: corrupted packet at offset %llu",
+                seg->path, (unsigned long long)reader->offset);
+        return RESOURCE_ERR;
+    }
+
+    tr = reader->tracks[packet.track];
+
+    trace_ingest(tr);
+    buffer = mparser_buffer_alloc(tr, packet.size);
+
+    if ( pread(seg->fd, buffer->data, packet.size,
+               reader->offset + sizeof(packet)) != (ssize_t)packet.size ) {
+        fnc_log(FNC_LOG_ERR, "[timeshift] unable to read %s: %s",
+                seg->path, strerror(errno));
+        mparser_buffer_unref(buffer);
+        return RESOURCE_ERR;
+    }
+
+    buffer->timestamp = packet.timestamp - reader->origin;
+    buffer->delivery = packet.delivery - reader->origin;
+    buffer->duration = packet.duration;
+    buffer->marker = packet.marker;
+    buffer->keyframe = packet.keyframe;
+
+    reader->offset += sizeof(packet) + TIMESHIFT_PAD(packet.size);
+
+    track_write(tr, buffer);
+
+    return RESOURCE_OK;
+}
+
+static int timeshift_seek(Resource *r, double time_sec)
+{
+    struct TimeshiftReader *reader = r->stored.timeshift;
+    Timeshift *ts = reader->ts;
+    const double target = reader->origin + time_sec;
+    TimeshiftSegment *seg = NULL;
+    GList *item;
+    guint low = 0, high;
+
+    fnc_log(FNC_LOG_DEBUG, "[timeshift] Seeking to %f", time_sec);
+
+    g_mutex_lock(ts->lock);
+
+    /* the last segment started before the requested time, or the
+       oldest one if the time is not recorded anymore */
+    for ( item = ts->segments->tail; item != NULL; item = item->prev ) {
+        seg = item->data;
+        if ( seg->start <= target )
+            break;
+    }
+
+    if ( seg == NULL ) {
+        g_mutex_unlock(ts->lock);
+        return -1;
+    }
+
+    /* find the last entry not past the requested time */
+    high = seg->index->len;
+    while ( low < high ) {
+        const guint mid = low + (high - low)/2;
+
+        if ( g_array_index(seg->index, TimeshiftIndex, mid).delivery <= target )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    reader_move(reader, seg, low == 0 ? 0 :
+                g_array_index(seg->index, TimeshiftIndex, low - 1).offset);
+
+    g_mutex_unlock(ts->lock);
+
+    return 0;
+}
+
+static void timeshift_uninit(gpointer rgen)
+{
+    Resource *r = rgen;
+    struct TimeshiftReader *reader = r->stored.timeshift;
+
+    if ( reader->segment != NULL )
+        segment_unref(reader->segment);
+
+    g_free(reader->tracks);
+    g_slice_free(struct TimeshiftReader, reader);
+}
+
+/**
+ * @brief Open a reader of the recording of a live resource
+ *
+ * @param live The live resource, recorded by @ref timeshift_new
+ *
+ * @return A new stored resource, with the same tracks as @p live, or
+ *         NULL if nothing is recorded yet.
+ *
+ * The position zero of the reader is the oldest moment recorded when
+ * it is opened; its duration is unbounded, as the recording goes on.
+ */
+Resource *timeshift_open(Resource *live)
+{
+    Timeshift *ts = live->live.timeshift;
+    struct TimeshiftReader *reader;
+    Resource *r;
+    TrackList item;
+    guint i;
+
+    g_mutex_lock(ts->lock);
+    if ( g_queue_is_empty(ts->segments) ) {
+        g_mutex_unlock(ts->lock);
+        return NULL;
+    }
+    reader = g_slice_new0(struct TimeshiftReader);
+    reader->origin = ((TimeshiftSegment*)g_queue_peek_head(ts->segments))->start;
+    g_mutex_unlock(ts->lock);
+
+    reader->ts = ts;
+    reader->tracks_count = ts->tracks_count;
+    reader->tracks = g_new0(Track*, reader->tracks_count);
+
+    r = g_slice_new0(Resource);
+    r->mrl = g_strdup(live->mrl);
+    r->lock = g_mutex_new();
+    r->source = STORED_SOURCE;
+    r->duration = HUGE_VAL;
+    r->stored.timeshift = reader;
+
+    for ( item = live->tracks, i = 0; item != NULL; item = item->next, i++ ) {
+        const Track *orig = item->data;
+        Track *tr = track_new(g_strdup(orig->name));
+
+        tr->parent = r;
+        tr->payload_type = orig->payload_type;
+        tr->clock_rate = orig->clock_rate;
+        tr->media_type = orig->media_type;
+        tr->audio_channels = orig->audio_channels;
+        tr->frame_duration = orig->frame_duration;
+        tr->bitrate = orig->bitrate;
+        tr->encoding_name = g_strdup(orig->encoding_name);
+        g_string_assign(tr->sdp_description, orig->sdp_description->str);
+
+        reader->tracks[i] = tr;
+        r->tracks = g_list_append(r->tracks, tr);
+    }
+
+    r->read_packet = timeshift_read_packet;
+    r->seek = timeshift_seek;
+    r->uninit = timeshift_uninit;
+
+    return r;
+}
+
+/**
+ * @brief Get the position of a reader at a moment of the recording
+ *
+ * @param r The reader, opened by @ref timeshift_open
+ * @param wallclock The time the moment was live at, on the wall clock
+ *
+ * @return The position to seek the reader to, in seconds; zero if the
+ *         moment is not recorded anymore.
+ */
+double timeshift_position(Resource *r, double wallclock)
+{
+    return MAX(wallclock - r->stored.timeshift->origin, 0);
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,300 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include "media/media.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(SUPPORT_ATTRIBUTE_TARGET_AVX2)
+# include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+/**
+ * @defgroup startcode Start code scanner
+ * @ingroup parsers
+ *
+ * @brief Find the 0x000001 start codes of Annex-B style bitstreams
+ *
+ * H.264 byte streams and MPEG-1/2 video elementary streams are both
+ * split by a three bytes 0x000001 prefix; finding it is the only
+ * part of their parsers that touches each byte of the frame.
+ *
+ * Besides the portable scanner, vector versions are built for the
+ * instruction sets the compiler supports; SSE2 and NEON are used
+ * whenever they are part of the target's baseline, while the AVX2
+ * version is only selected at runtime, if the CPU supports it.
+ *
+ * All of them first look for a zero byte in a whole vector at once,
+ * which is enough to skip most of the coded data, and only check the
+ * complete prefix when one is found.
+ *
+ * @{
+ */
+
+/**
+ * @brief Check for a start code by looking at each byte
+ *
+ * Used for the bytes the vector scanners can't load as a whole.
+ */
+static const uint8_t *startcode_bytewise(const uint8_t *p,
+                                         const uint8_t *end)
+{
+    for ( ; end - p >= 3; p++ )
+        if ( p[0] == 0 && p[1] == 0 && p[2] == 1 )
+            return p;
+
+    return end;
+}
+
+/**
+ * @brief Portable scanner, ripped from ffmpeg
+ *
+ * Checks four bytes at a time for a zero byte with the usual bit
+ * trick, once the pointer is aligned.
+ */
+static const uint8_t *startcode_scalar(const uint8_t *p,
+                                       const uint8_t *end)
+{
+    const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+
+    for ( ; p < a && end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+
+    /* the prefix at the last position reads two bytes past the word */
+    for ( ; end - p >= 4 + 2; p += 4) {
+        uint32_t x = *(const uint32_t*)p;
+        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
+            if (p[1] == 0) {
+                if (p[0] == 0 && p[2] == 1)
+                    return p;
+                if (p[2] == 0 && p[3] == 1)
+                    return p+1;
+            }
+            if (p[3] == 0) {
+                if (p[2] == 0 && p[4] == 1)
+                    return p+2;
+                if (p[4] == 0 && p[5] == 1)
+                    return p+3;
+            }
+        }
+    }
+
+    return startcode_bytewise(p, end);
+}
+
+#if defined(__SSE2__)
+static const uint8_t *startcode_sse2(const uint8_t *p,
+                                     const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    /* the prefix at the last position reads two bytes past the vector */
+    for ( ; end - p >= 16 + 2; p += 16 ) {
+        const __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i v1, v2;
+        unsigned int mask;
+
+        if ( _mm_movemask_epi8(_mm_cmpeq_epi8(v0, zero)) == 0 )
+            continue;
+
+        v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        v2 = _mm_loadu_si128((const __m128i *)(p + 2));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, zero),
+                                                             _mm_cmpeq_epi8(v1, zero)),
+                                               _mm_cmpeq_epi8(v2, one)));
+        if ( mask )
+            return p + __builtin_ctz(mask);
+    }
+
+    return startcode_bytewise(p, end);
+}
+#endif
+
+#if defined(SUPPORT_ATTRIBUTE_TARGET_AVX2)
+__attribute__((target("avx2")))
+static const uint8_t *startcode_avx2(const uint8_t *p,
+                                     const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for ( ; end - p >= 32 + 2; p += 32 ) {
+        const __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1, v2;
+        unsigned int mask;
+
+        if ( _mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero)) == 0 )
+            continue;
+
+        v1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        v2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v0, zero),
+                                                                      _mm256_cmpeq_epi8(v1, zero)),
+                                                     _mm256_cmpeq_epi8(v2, one)));
+        if ( mask )
+            return p + __builtin_ctz(mask);
+    }
+
+    return startcode_bytewise(p, end);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static const uint8_t *startcode_neon(const uint8_t *p,
+                                     const uint8_t *end)
+{
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    for ( ; end - p >= 16 + 2; p += 16 ) {
+        const uint8x16_t v0 = vld1q_u8(p);
+        uint8x16_t match;
+
+        if ( vminvq_u8(v0) != 0 )
+            continue;
+
+        match = vandq_u8(vandq_u8(vceqzq_u8(v0), vceqzq_u8(vld1q_u8(p + 1))),
+                         vceqq_u8(vld1q_u8(p + 2), one));
+
+        /* there is no movemask, let the bytewise check find the offset */
+        if ( vmaxvq_u8(match) != 0 )
+            return startcode_bytewise(p, p + 16 + 2);
+    }
+
+    return startcode_bytewise(p, end);
+}
+#endif
+
+/**
+ * @brief Table of the scanners usable on the running CPU
+ *
+ * Sorted from the slowest to the fastest; the portable scanner is
+ * always the first one.
+ */
+static MParserStartcodeScanner startcode_scanners[5];
+
+static const uint8_t *startcode_resolve(const uint8_t *p,
+                                        const uint8_t *end);
+
+static const uint8_t *(*startcode_find)(const uint8_t *p,
+                                        const uint8_t *end) = startcode_resolve;
+
+/**
+ * @brief Fill the table of the scanners usable on the running CPU
+ *
+ * Runs only once, whoever comes first between the parsers and the
+ * users of @ref mparser_startcode_scanners.
+ */
+static void startcode_scanners_init(void)
+{
+    static gsize initialized = 0;
+
+    if ( g_once_init_enter(&initialized) ) {
+        MParserStartcodeScanner *scanner = startcode_scanners;
+
+        scanner->name = "scalar";
+        scanner->find = startcode_scalar;
+        scanner++;
+
+#if defined(__SSE2__)
+        scanner->name = "sse2";
+        scanner->find = startcode_sse2;
+        scanner++;
+#endif
+
+#if defined(SUPPORT_ATTRIBUTE_TARGET_AVX2)
+        __builtin_cpu_init();
+        if ( __builtin_cpu_supports("avx2") ) {
+            scanner->name = "avx2";
+            scanner->find = startcode_avx2;
+            scanner++;
+        }
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        scanner->name = "neon";
+        scanner->find = startcode_neon;
+        scanner++;
+#endif
+
+        startcode_find = scanner[-1].find;
+
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+/**
+ * @brief Select the scanner the first time one is needed
+ */
+static const uint8_t *startcode_resolve(const uint8_t *p,
+                                        const uint8_t *end)
+{
+    startcode_scanners_init();
+
+    return startcode_find(p, end);
+}
+
+/**
+ * @brief Find the first start code of a buffer
+ *
+ * @param p The first byte to look at
+ * @param end The end of the buffer
+ *
+ * @return A pointer to the first byte of the first 0x000001 prefix
+ *         found between @p p and @p end, or @p end if there is none.
+ *
+ * When the start code is preceded by more zero bytes, as in the four
+ * bytes long prefix of H.264, the pointer is to the last two zero
+ * bytes.
+ */
+const uint8_t *mparser_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+    return startcode_find(p, end);
+}
+
+/**
+ * @brief Get the scanners usable on the running CPU
+ *
+ * @return A NULL-terminated array of scanners, the portable one
+ *         first and the one used by @ref mparser_find_startcode last.
+ *
+ * This is only meant for the test suite and the benchmarks, that
+ * have to check each version against the others.
+ */
+const MParserStartcodeScanner *mparser_startcode_scanners(void)
+{
+    startcode_scanners_init();
+
+    return startcode_scanners;
+}
+
+/**
+ * @}
+ */
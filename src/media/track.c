@@ -24,6 +24,9 @@
 
 #include <config.h>
 
+#include "feng.h"
+#include "fnc_log.h"
+#include "metrics.h"
 #include "media/media.h"
 #include "network/rtp.h"
 
@@ -61,6 +64,488 @@
  * @{
  */
 
+/**
+ * @brief Maximum amount of idle slots kept by each pool
+ *
+ * Slots released while the pool is already holding this many are
+ * given back to the allocator, so that a burst doesn't pin memory
+ * for the whole life of the track.
+ */
+#define MPARSER_POOL_MAX_IDLE 512
+
+/**
+ * @brief Pool of fixed-size buffers for a track
+ *
+ * Each slot is a single allocation holding the MParserBuffer
+ * structure immediately followed by enough data for a payload of the
+ * track's MTU (see @ref Track::mtu). Slots are taken by the producer, and can be released by
+ * any thread holding the last reference; the pool is protected by its
+ * own mutex rather than the track's, so that releasing a buffer never
+ * contends with the queue.
+ *
+ * The pool is referenced by the track and by each slot currently in
+ * use, so that buffers still in flight in the transports can outlive
+ * the track.
+ */
+struct MParserBufferPool {
+    GMutex *lock;
+    GTrashStack *idle;
+    guint idle_count;
+    gint refcount;
+    gboolean closed;
+
+    /** Size of the data area of each slot */
+    size_t data_size;
+};
+
+static MParserBufferPoolStats pool_stats;
+
+#define MPARSER_POOL_SLOT_SIZE(pool) \
+    (sizeof(struct MParserBuffer) + (pool)->data_size)
+
+static struct MParserBufferPool *mparser_pool_new(size_t data_size)
+{
+    struct MParserBufferPool *pool = g_slice_new0(struct MParserBufferPool);
+
+    pool->lock = g_mutex_new();
+    pool->refcount = 1;
+    pool->data_size = data_size;
+
+    return pool;
+}
+
+static void mparser_pool_drain(struct MParserBufferPool *pool)
+{
+    gpointer slot;
+
+    while ( (slot = g_trash_stack_pop(&pool->idle)) != NULL ) {
+        g_slice_free1(MPARSER_POOL_SLOT_SIZE(pool), slot);
+        g_atomic_int_inc((gint*)&pool_stats.trimmed);
+    }
+
+    pool->idle_count = 0;
+}
+
+static void mparser_pool_unref(struct MParserBufferPool *pool)
+{
+    if ( !g_atomic_int_dec_and_test(&pool->refcount) )
+        return;
+
+    mparser_pool_drain(pool);
+    g_mutex_free(pool->lock);
+    g_slice_free(struct MParserBufferPool, pool);
+}
+
+/**
+ * @brief Detach the pool from its track
+ *
+ * @param pool The pool to close
+ *
+ * Idle slots are freed right away; the slots still in use are freed
+ * as they are released, and the last one frees the pool itself.
+ */
+static void mparser_pool_close(struct MParserBufferPool *pool)
+{
+    g_mutex_lock(pool->lock);
+    pool->closed = true;
+    mparser_pool_drain(pool);
+    g_mutex_unlock(pool->lock);
+
+    mparser_pool_unref(pool);
+}
+
+/**
+ * @brief Allocate a new parser buffer
+ *
+ * @param tr The track the buffer is going to be written to
+ * @param size Size of the data area to allocate
+ *
+ * @return A new MParserBuffer with a single reference, to be handed
+ *         over to @ref track_write. Its MParserBuffer::data pointer
+ *         refers to @p size bytes allocated together with the
+ *         structure, and MParserBuffer::data_size is set to @p size;
+ *         callers can lower it if they end up using less data.
+ *
+ * Buffers up to the track's MTU are taken from the track's pool,
+ * recycling the slots of buffers already sent.
+ */
+struct MParserBuffer *mparser_buffer_alloc(Track *tr, size_t size)
+{
+    struct MParserBufferPool *pool = tr->buffer_pool;
+    struct MParserBuffer *buffer = NULL;
+
+    if ( size > pool->data_size ) {
+        g_atomic_int_inc((gint*)&pool_stats.oversize);
+        buffer = g_malloc(sizeof(struct MParserBuffer) + size);
+        pool = NULL;
+    } else {
+        g_mutex_lock(pool->lock);
+        if ( (buffer = g_trash_stack_pop(&pool->idle)) != NULL )
+            pool->idle_count--;
+        g_mutex_unlock(pool->lock);
+
+        if ( buffer != NULL )
+            g_atomic_int_inc((gint*)&pool_stats.hits);
+        else {
+            g_atomic_int_inc((gint*)&pool_stats.misses);
+            buffer = g_slice_alloc(MPARSER_POOL_SLOT_SIZE(pool));
+        }
+
+        g_atomic_int_inc(&pool->refcount);
+    }
+
+    memset(buffer, 0, sizeof(struct MParserBuffer));
+
+    buffer->refcount = 1;
+    buffer->pool = pool;
+    buffer->data = (uint8_t*)(buffer + 1);
+    buffer->data_size = size;
+    buffer->keyframe = tr->keyframe;
+    trace_buffer_init(tr, buffer);
+
+    return buffer;
+}
+
+/**
+ * @brief Create a parser buffer referring to existing data
+ *
+ * @param tr The track the buffer is going to be written to
+ * @param data The payload of the buffer
+ * @param size Size of @p data
+ * @param release Function called once the last reference to the
+ *                buffer is gone, to give @p data back to its owner
+ * @param release_data Opaque pointer for @p release, saved in
+ *                     MParserBuffer::release_data
+ *
+ * @return A new MParserBuffer with a single reference, as for @ref
+ *         mparser_buffer_alloc, but without copying @p data.
+ *
+ * This is used by the live ingest to hand over the packets written by
+ * the producer in shared memory.
+ */
+struct MParserBuffer *mparser_buffer_wrap(Track *tr, uint8_t *data, size_t size,
+                                          void (*release)(struct MParserBuffer *buffer),
+                                          gpointer release_data)
+{
+    struct MParserBuffer *buffer = g_new0(struct MParserBuffer, 1);
+
+    buffer->refcount = 1;
+    buffer->data = data;
+    buffer->data_size = size;
+    buffer->keyframe = tr->keyframe;
+    buffer->release = release;
+    buffer->release_data = release_data;
+    trace_buffer_init(tr, buffer);
+
+    return buffer;
+}
+
+/**
+ * @brief Acquire a new reference to a parser buffer
+ *
+ * @param buffer The buffer to reference
+ *
+ * @return The same @p buffer, for convenience.
+ */
+struct MParserBuffer *mparser_buffer_ref(struct MParserBuffer *buffer)
+{
+    g_atomic_int_inc(&buffer->refcount);
+
+    return buffer;
+}
+
+/**
+ * @brief Release a reference to a parser buffer
+ *
+ * @param buffer The buffer to release; once the last reference is
+ *               gone, it is given back to its pool, or freed.
+ */
+void mparser_buffer_unref(struct MParserBuffer *buffer)
+{
+    struct MParserBufferPool *pool = buffer->pool;
+
+    if ( !g_atomic_int_dec_and_test(&buffer->refcount) )
+        return;
+
+    bq_debug("Free object %p %lu",
+             buffer,
+             buffer->seen);
+
+    if ( pool == NULL ) {
+        if ( buffer->release != NULL )
+            buffer->release(buffer);
+        g_free(buffer);
+        return;
+    }
+
+    g_mutex_lock(pool->lock);
+    if ( !pool->closed && pool->idle_count < MPARSER_POOL_MAX_IDLE ) {
+        g_trash_stack_push(&pool->idle, buffer);
+        pool->idle_count++;
+        buffer = NULL;
+    }
+    g_mutex_unlock(pool->lock);
+
+    if ( buffer == NULL )
+        g_atomic_int_inc((gint*)&pool_stats.recycled);
+    else {
+        g_slice_free1(MPARSER_POOL_SLOT_SIZE(pool), buffer);
+        g_atomic_int_inc((gint*)&pool_stats.trimmed);
+    }
+
+    mparser_pool_unref(pool);
+}
+
+/**
+ * @brief Get a snapshot of the buffer pools' counters
+ *
+ * @param stats Structure to fill in with the counters
+ */
+void mparser_buffer_pool_stats(MParserBufferPoolStats *stats)
+{
+    stats->hits     = g_atomic_int_get((gint*)&pool_stats.hits);
+    stats->misses   = g_atomic_int_get((gint*)&pool_stats.misses);
+    stats->oversize = g_atomic_int_get((gint*)&pool_stats.oversize);
+    stats->recycled = g_atomic_int_get((gint*)&pool_stats.recycled);
+    stats->trimmed  = g_atomic_int_get((gint*)&pool_stats.trimmed);
+}
+
+/**
+ * @brief Bytes of buffers in all the tracks' queues
+ *
+ * Buffers are accounted for as long as their queue holds them, not
+ * for as long as they are allocated; packets in flight to a client
+ * are bounded by @ref cfg_options_t::output_queue_limit instead.
+ */
+static volatile gsize bq_memory_used;
+
+/** Tracks with at least a buffer queued */
+static volatile gint bq_memory_tracks;
+
+/**
+ * @brief Account for a buffer entering or leaving a track's queue
+ *
+ * @note Has to be called with @ref Track::lock held.
+ *
+ * @internal Only meant for the queue backends.
+ */
+void bq_memory_account(Track *producer, struct MParserBuffer *buffer,
+                       gboolean queued)
+{
+    const gsize bytes = sizeof(struct MParserBuffer) + buffer->data_size;
+
+    if ( queued ) {
+        if ( producer->queue_bytes == 0 )
+            __sync_add_and_fetch(&bq_memory_tracks, 1);
+        producer->queue_bytes += bytes;
+        __sync_add_and_fetch(&bq_memory_used, bytes);
+    } else {
+        producer->queue_bytes -= bytes;
+        if ( producer->queue_bytes == 0 )
+            __sync_sub_and_fetch(&bq_memory_tracks, 1);
+        __sync_sub_and_fetch(&bq_memory_used, bytes);
+    }
+}
+
+/**
+ * @brief Get the bytes of buffers queued by all tracks
+ */
+gsize bq_memory_usage(void)
+{
+    return __sync_add_and_fetch(&bq_memory_used, 0);
+}
+
+/**
+ * @brief Tell whether the queues passed @ref cfg_options_t::queue_memory_limit
+ *
+ * New sessions are refused while this is the case.
+ */
+gboolean bq_memory_exhausted(void)
+{
+    return feng_srv.queue_memory_limit != 0 &&
+        bq_memory_usage() > (gsize)feng_srv.queue_memory_limit << 20;
+}
+
+/**
+ * @brief Tell whether a track holds more than its share of the queues
+ *
+ * @param producer The track to check
+ *
+ * While the queues are over @ref cfg_options_t::queue_memory_limit,
+ * the tracks holding more than the average of the tracks with
+ * buffers queued are the ones kept back by lagging consumers; the
+ * others can go on queueing.
+ *
+ * @note Has to be called with @ref Track::lock held.
+ */
+gboolean bq_memory_share_exceeded(Track *producer)
+{
+    const gint tracks = __sync_add_and_fetch(&bq_memory_tracks, 0);
+
+    return bq_memory_exhausted() &&
+        producer->queue_bytes > bq_memory_usage() / MAX(tracks, 1);
+}
+
+/**
+ * @brief Get the bytes of buffers queued by a resource's tracks
+ *
+ * The counters are read without locking the tracks, this is only
+ * meant for statistics.
+ */
+gsize r_queue_bytes(Resource *resource)
+{
+    gsize bytes = 0;
+    GList *item;
+
+    for ( item = resource->tracks; item != NULL; item = item->next )
+        bytes += ((Track*)item->data)->queue_bytes;
+
+    return bytes;
+}
+
+/**
+ * @brief Most packets kept in a track's GOP cache
+ *
+ * A keyframe interval longer than this is not cached at all, rather
+ * than sending a GOP without its keyframe.
+ */
+#define BQ_GOP_MAX_PACKETS 8192
+
+static void bq_gop_unref(gpointer elem, ATTR_UNUSED gpointer unused)
+{
+    mparser_buffer_unref((struct MParserBuffer*)elem);
+}
+
+static void bq_gop_clear(GQueue *gop)
+{
+    g_queue_foreach(gop, bq_gop_unref, NULL);
+    g_queue_clear(gop);
+}
+
+/**
+ * @brief Tell whether a buffer starts a keyframe
+ *
+ * @param buffer The buffer to check
+ * @param previous The buffer queued before it, or NULL
+ *
+ * A keyframe buffer following a non-keyframe one, or with a new
+ * timestamp, is the first of its keyframe.
+ *
+ * @internal Only meant for the queue backends.
+ */
+gboolean bq_keyframe_start(struct MParserBuffer *buffer,
+                           struct MParserBuffer *previous)
+{
+    return buffer->keyframe &&
+        ( previous == NULL || !previous->keyframe ||
+          previous->timestamp != buffer->timestamp );
+}
+
+/**
+ * @brief Update the GOP cache of a live track with a new buffer
+ *
+ * @param producer The track the buffer is being written to
+ * @param buffer The buffer being written
+ *
+ * @note This function has to be called with @ref Track::lock held,
+ *       by the track_write implementations.
+ *
+ * The first buffer of a keyframe, see @ref bq_keyframe_start,
+ * starts a new GOP and drops the old one; buffers coming before the
+ * first keyframe are not cached.
+ */
+void bq_producer_gop_write(Track *producer, struct MParserBuffer *buffer)
+{
+    struct MParserBuffer *last;
+
+    if ( producer->gop == NULL )
+        return;
+
+    last = g_queue_peek_tail(producer->gop);
+
+    if ( bq_keyframe_start(buffer, last) )
+        bq_gop_clear(producer->gop);
+    else if ( last == NULL )
+        return;
+
+    if ( g_queue_get_length(producer->gop) >= BQ_GOP_MAX_PACKETS ) {
+        fnc_log(FNC_LOG_DEBUG, "[%s] GOP too long to be cached", producer->name);
+        bq_gop_clear(producer->gop);
+        return;
+    }
+
+    g_queue_push_tail(producer->gop, mparser_buffer_ref(buffer));
+}
+
+/**
+ * @brief Give a joining consumer a copy of the track's GOP cache
+ *
+ * @param consumer The consumer being registered
+ *
+ * @retval true The consumer is going to send the cached GOP first;
+ *              the backend has to start it right after the last
+ *              buffer written.
+ *
+ * @note This function has to be called with @ref Track::lock held,
+ *       by the bq_consumer_new implementations.
+ */
+gboolean bq_consumer_gop_start(RTP_session *consumer)
+{
+    Track *producer = consumer->track;
+    GList *elem;
+
+    consumer->gop_burst = NULL;
+    consumer->catching_up = false;
+
+    if ( producer->gop == NULL || g_queue_is_empty(producer->gop) )
+        return false;
+
+    consumer->gop_burst = g_queue_copy(producer->gop);
+    for ( elem = consumer->gop_burst->head; elem != NULL; elem = elem->next )
+        mparser_buffer_ref(elem->data);
+
+    consumer->catching_up = true;
+
+    return true;
+}
+
+/**
+ * @brief Move to the next buffer of the consumer's GOP burst
+ *
+ * @param consumer The consumer to move; @ref RTP_session::gop_burst
+ *                 has to be set.
+ *
+ * @return The same as @ref bq_consumer_move; once the burst is over,
+ *         the consumer goes on with the track's queue.
+ */
+gboolean bq_consumer_gop_move(RTP_session *consumer)
+{
+    mparser_buffer_unref(g_queue_pop_head(consumer->gop_burst));
+
+    if ( !g_queue_is_empty(consumer->gop_burst) )
+        return true;
+
+    g_queue_free(consumer->gop_burst);
+    consumer->gop_burst = NULL;
+
+    return bq_consumer_get(consumer) != NULL;
+}
+
+/**
+ * @brief Drop what's left of the consumer's GOP burst
+ */
+void bq_consumer_gop_free(RTP_session *consumer)
+{
+    if ( consumer->gop_burst == NULL )
+        return;
+
+    bq_gop_clear(consumer->gop_burst);
+    g_queue_free(consumer->gop_burst);
+    consumer->gop_burst = NULL;
+}
+
+#ifndef FENG_BQ_RING
+
 static inline struct MParserBuffer *GLIST_TO_BQELEM(GList *pointer)
 {
     return (struct MParserBuffer*)pointer->data;
@@ -112,16 +597,6 @@ static inline struct MParserBuffer *BQ_OBJECT(RTP_session *consumer)
 }
 
 
-static void mparser_buffer_free(struct MParserBuffer *buffer)
-{
-    bq_debug("Free object %p %lu",
-             buffer,
-             buffer->seen);
-
-    g_free(buffer->data);
-    g_slice_free(struct MParserBuffer, buffer);
-}
-
 /**
  * @brief Destroy one by one the elements in
  *        Track::queue.
@@ -131,8 +606,9 @@ static void mparser_buffer_free(struct MParserBuffer *buffer)
  *                          elements' payload.
  */
 static void bq_element_free_internal(gpointer elem_generic,
-                                     ATTR_UNUSED gpointer unused) {
-    mparser_buffer_free((struct MParserBuffer*)elem_generic);
+                                     gpointer producer_generic) {
+    bq_memory_account(producer_generic, elem_generic, false);
+    mparser_buffer_unref((struct MParserBuffer*)elem_generic);
 }
 
 /**
@@ -158,7 +634,7 @@ static void bq_producer_reset_queue_internal(Track *producer) {
     if ( producer->queue ) {
         g_queue_foreach(producer->queue,
                         bq_element_free_internal,
-                        NULL);
+                        producer);
         g_queue_clear(producer->queue);
         g_queue_free(producer->queue);
     }
@@ -219,7 +695,8 @@ static void bq_producer_destroy_head(Track *producer) {
     if ( g_queue_get_length(producer->queue) == 0 )
         producer->queue_serial++;
 
-    mparser_buffer_free(elem);
+    bq_memory_account(producer, elem, false);
+    mparser_buffer_unref(elem);
 }
 
 /**
@@ -278,9 +755,10 @@ static gboolean bq_consumer_move_internal(RTP_session *consumer) {
             producer->queue->head,
             c_cep);
 
-    if (c_cep)
+    if (c_cep) {
+        GLIST_TO_BQELEM(c_cep)->held--;
         next = bq_consumer_elem_unref(producer, c_cep);
-    else
+    } else
         next = producer->queue->head;
 
     if ( next != NULL )
@@ -296,6 +774,7 @@ static gboolean bq_consumer_move_internal(RTP_session *consumer) {
     if ( (consumer->current_element_pointer = next) == NULL )
         return false;
 
+    GLIST_TO_BQELEM(next)->held++;
     consumer->last_element_serial =
         GLIST_TO_BQELEM(consumer->current_element_pointer)->seq_no;
     consumer->queue_serial = producer->queue_serial;
@@ -327,6 +806,8 @@ void bq_consumer_free(RTP_session *consumer) {
 
     producer = consumer->track;
 
+    bq_consumer_gop_free(consumer);
+
     /* Ensure we have the exclusive access */
     g_mutex_lock(producer->lock);
 
@@ -378,12 +859,58 @@ gulong bq_consumer_unseen(RTP_session *consumer) {
     else if ( producer->queue->head != NULL )
         unseen = producer->next_serial - consumer->last_element_serial;
 
+    if ( consumer->gop_burst != NULL )
+        unseen += g_queue_get_length(consumer->gop_burst);
+
     /* Leave the exclusive access */
     g_mutex_unlock(producer->lock);
 
     return unseen;
 }
 
+/**
+ * @brief Tells how much media is queued to be seen
+ *
+ * @param consumer The consumer object to check
+ *
+ * @return The seconds of delivery time between the consumer's
+ *         current buffer and the end of the last buffer queued.
+ *
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
+ */
+double bq_consumer_buffered(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    struct MParserBuffer *first, *last;
+    double buffered = 0;
+    GList *c_cep;
+
+    if (bq_consumer_stopped(consumer))
+        return buffered;
+
+    /* Ensure we have the exclusive access */
+    g_mutex_lock(producer->lock);
+
+    if ( consumer->gop_burst != NULL )
+        first = g_queue_peek_head(consumer->gop_burst);
+    else if ( (c_cep = bq_consumer_confirm_pointer(consumer)) != NULL )
+        first = GLIST_TO_BQELEM(c_cep);
+    else
+        first = g_queue_peek_head(producer->queue);
+
+    if ( (last = g_queue_peek_tail(producer->queue)) == NULL &&
+         consumer->gop_burst != NULL )
+        last = g_queue_peek_tail(consumer->gop_burst);
+
+    if ( first != NULL && last != NULL )
+        buffered = last->delivery + last->duration - first->delivery;
+
+    /* Leave the exclusive access */
+    g_mutex_unlock(producer->lock);
+
+    return MAX(buffered, 0);
+}
+
 /**
  * @brief Move to the next element in a consumer
  *
@@ -409,6 +936,9 @@ gboolean bq_consumer_move(RTP_session *consumer) {
     if ( bq_consumer_stopped(consumer) )
         return false;
 
+    if ( consumer->gop_burst != NULL )
+        return bq_consumer_gop_move(consumer);
+
     /* Ensure we have the exclusive access */
     g_mutex_lock(producer->lock);
     ret = bq_consumer_move_internal(consumer);
@@ -423,6 +953,54 @@ gboolean bq_consumer_move(RTP_session *consumer) {
     return ret;
 }
 
+/**
+ * @brief Move a consumer to the newest keyframe queued
+ *
+ * @param consumer The consumer object to move
+ *
+ * @retval true The consumer moved to the first buffer of the newest
+ *              keyframe, dropping its GOP burst if it had one.
+ * @retval false There is no keyframe past the current element.
+ *
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
+ *
+ * This is meant for live consumers lagging too far behind; the
+ * buffers skipped are marked as seen as by @ref bq_consumer_move.
+ */
+gboolean bq_consumer_skip(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    GList *c_cep, *target = NULL, *item;
+
+    if ( bq_consumer_stopped(consumer) )
+        return false;
+
+    /* Ensure we have the exclusive access */
+    g_mutex_lock(producer->lock);
+
+    c_cep = bq_consumer_confirm_pointer(consumer);
+
+    for ( item = producer->queue->tail; item != NULL && item != c_cep; item = item->prev )
+        if ( bq_keyframe_start(item->data, item->prev ? item->prev->data : NULL) &&
+             GLIST_TO_BQELEM(item)->seq_no > consumer->last_element_serial ) {
+            target = item;
+            break;
+        }
+
+    if ( target != NULL ) {
+        /* the burst is not part of the queue, nothing to mark */
+        bq_consumer_gop_free(consumer);
+
+        while ( consumer->current_element_pointer != target &&
+                bq_consumer_move_internal(consumer) );
+    }
+
+    /* Leave the exclusive access */
+    g_mutex_unlock(producer->lock);
+
+    return target != NULL;
+}
+
 /**
  * @brief Get the next element from the consumer list
  *
@@ -450,6 +1028,9 @@ struct MParserBuffer *bq_consumer_get(RTP_session *consumer) {
     if ( bq_consumer_stopped(consumer) )
         return NULL;
 
+    if ( consumer->gop_burst != NULL )
+        return g_queue_peek_head(consumer->gop_burst);
+
     /* Ensure we have the exclusive access */
     g_mutex_lock(producer->lock);
     bq_debug("C:%p LES:%lu:%u PQHS:%lu:%u PQH:%p pointer %p",
@@ -482,6 +1063,161 @@ struct MParserBuffer *bq_consumer_get(RTP_session *consumer) {
     return element;
 }
 
+/**
+ * @brief Initialise the buffer queue of a new track
+ *
+ * @param producer The track to initialise the queue of
+ *
+ * @internal This function should only be used by @ref track_new.
+ */
+void bq_producer_init(Track *producer)
+{
+    bq_producer_reset_queue_internal(producer);
+}
+
+/**
+ * @brief Destroy the buffer queue of a track
+ *
+ * @param producer The track to destroy the queue of
+ *
+ * @internal This function should only be used by @ref track_free.
+ */
+void bq_producer_destroy(Track *producer)
+{
+    if ( producer->queue ) {
+        /* Destroy elements and the queue */
+        g_queue_foreach(producer->queue,
+                        bq_element_free_internal,
+                        producer);
+        g_queue_free(producer->queue);
+    }
+}
+
+/**
+ * @brief Register a new consumer for a track
+ *
+ * @param consumer The consumer to register; its @ref
+ *                 RTP_session::track pointer has to be set already.
+ */
+void bq_consumer_new(RTP_session *consumer)
+{
+    Track *producer = consumer->track;
+
+    /* the consumer might have been reading a different track before */
+    consumer->queue_serial = 0;
+    consumer->current_element_pointer = NULL;
+    consumer->last_element_serial = 0;
+
+    g_mutex_lock(producer->lock);
+
+    /* the GOP ends with the last buffer written; skip what's queued */
+    if ( bq_consumer_gop_start(consumer) ) {
+        consumer->queue_serial = producer->queue_serial;
+        consumer->last_element_serial = producer->next_serial - 1;
+    }
+
+    /* Make sure we don't overflow the consumers count; while this
+     * case is most likely just hypothetical, it doesn't hurt to be
+     * safe.
+     */
+    g_assert_cmpuint(producer->consumers, <, G_MAXULONG);
+    g_atomic_int_add(&producer->consumers, 1);
+
+    g_mutex_unlock(producer->lock);
+}
+
+/**
+ * @brief Drop the backlog of the slowest consumers
+ *
+ * @param producer The track to drop buffers from
+ *
+ * Called once the queues use more than @ref
+ * cfg_options_t::queue_memory_limit; drops the oldest buffers of the
+ * queue that none of the consumers is currently at, so that the
+ * consumers behind skip ahead at their next move, until the usage is
+ * an eighth under the limit. The newest buffer is always kept.
+ *
+ * @note Has to be called with @ref Track::lock held.
+ */
+static void bq_producer_evict(Track *producer)
+{
+    const gsize limit = (gsize)feng_srv.queue_memory_limit << 20;
+    GList *item = producer->queue->head;
+    guint dropped = 0;
+
+    while ( item != producer->queue->tail &&
+            bq_memory_usage() > limit - limit / 8 ) {
+        GList *next = item->next;
+        struct MParserBuffer *elem = item->data;
+
+        if ( elem->held == 0 ) {
+            g_queue_delete_link(producer->queue, item);
+            bq_memory_account(producer, elem, false);
+            mparser_buffer_unref(elem);
+            dropped++;
+        }
+
+        item = next;
+    }
+
+    if ( dropped )
+        fnc_log(FNC_LOG_WARN,
+                "[%s] queue memory limit reached, dropped %u buffers",
+                producer->name, dropped);
+}
+
+/**
+ * @brief Queue a new RTP buffer into the track's queue
+ *
+ * @param tr The track to queue the buffer onto
+ * @param buffer The RTP buffer to queue
+ *
+ * If this brings the queues over the memory limit, the lagging
+ * consumers' backlog is dropped, see @ref bq_producer_evict.
+ */
+void track_write(Track *tr, struct MParserBuffer *buffer)
+{
+    /* Make sure the producer is not stopped */
+    g_assert(g_atomic_int_get(&tr->stopped) == 0);
+
+    rtp_cache_record(tr, buffer);
+
+    /* Ensure we have the exclusive access */
+    g_mutex_lock(tr->lock);
+
+    /* do this inside the lock so that next_serial does not change */
+    if ( ! buffer->seq_no )
+        buffer->seq_no = tr->next_serial;
+
+    tr->next_serial = buffer->seq_no + 1;
+
+    trace_queue(tr, buffer);
+
+    bq_producer_gop_write(tr, buffer);
+
+    /* live tracks are written without consumers only for the GOP
+       cache, nobody would ever free the buffers in the queue */
+    if ( tr->gop != NULL && tr->consumers == 0 ) {
+        g_mutex_unlock(tr->lock);
+        mparser_buffer_unref(buffer);
+        return;
+    }
+
+    bq_debug("P:%p PQH:%p elem: %p (%hu)",
+             tr, tr->queue->head, buffer, buffer->seq_no);
+
+    g_queue_push_tail(tr->queue, buffer);
+    bq_memory_account(tr, buffer, true);
+
+    if ( bq_memory_exhausted() )
+        bq_producer_evict(tr);
+
+    /* Leave the exclusive access */
+    g_mutex_unlock(tr->lock);
+}
+
+#endif /* !FENG_BQ_RING */
+
 /**
  * @brief Checks if a consumer is tied to a stopped producer
  *
@@ -531,16 +1267,48 @@ Track *track_new(char *name)
     t->payload_type = -1;
     t->clock_rate = -1;
     t->media_type = MP_undef;
+    t->ingest_node = -1;
+
+    /* sources that can't tell keyframes apart have them all */
+    t->keyframe = true;
+
+    t->buffer_low = DEFAULT_BUFFER_LOW / 1000.0;
+    t->buffer_high = DEFAULT_BUFFER_HIGH / 1000.0;
 
     g_string_append_printf(t->sdp_description,
                            "a=control:%s\r\n",
                            name);
 
-    bq_producer_reset_queue_internal(t);
+    t->mtu             = DEFAULT_MTU;
+    t->buffer_pool     = mparser_pool_new(t->mtu);
+
+    bq_producer_init(t);
+
+    metrics_track_register(t);
 
     return t;
 }
 
+/**
+ * @brief Set the size of the payloads produced for a track
+ *
+ * @param track The track to change the MTU of
+ * @param mtu The biggest payload the parser has to produce
+ *
+ * @note This has to be called before anything is written to the
+ *       track, as the pool sized for the old MTU is replaced.
+ */
+void track_set_mtu(Track *track, size_t mtu)
+{
+    if ( track->mtu == mtu )
+        return;
+
+    track->mtu = mtu;
+
+    mparser_pool_close(track->buffer_pool);
+    track->buffer_pool = mparser_pool_new(mtu);
+}
+
 /**
  * @brief Frees the resources of a Track object
  *
@@ -551,6 +1319,8 @@ void track_free(Track *track)
     if (!track)
         return;
 
+    metrics_track_unregister(track);
+
     g_mutex_free(track->lock);
 
     g_free(track->name);
@@ -560,14 +1330,15 @@ void track_free(Track *track)
 
     g_cond_free(track->last_consumer);
 
-    if ( track->queue ) {
-        /* Destroy elements and the queue */
-        g_queue_foreach(track->queue,
-                        bq_element_free_internal,
-                        NULL);
-        g_queue_free(track->queue);
+    bq_producer_destroy(track);
+
+    if ( track->gop != NULL ) {
+        bq_gop_clear(track->gop);
+        g_queue_free(track->gop);
     }
 
+    mparser_pool_close(track->buffer_pool);
+
     if ( track->sdp_description )
         g_string_free(track->sdp_description, true);
 
@@ -576,32 +1347,3 @@ void track_free(Track *track)
 
     g_slice_free(Track, track);
 }
-
-/**
- * @brief Queue a new RTP buffer into the track's queue
- *
- * @param tr The track to queue the buffer onto
- * @param buffer The RTP buffer to queue
- */
-void track_write(Track *tr, struct MParserBuffer *buffer)
-{
-    /* Make sure the producer is not stopped */
-    g_assert(g_atomic_int_get(&tr->stopped) == 0);
-
-    /* Ensure we have the exclusive access */
-    g_mutex_lock(tr->lock);
-
-    /* do this inside the lock so that next_serial does not change */
-    if ( ! buffer->seq_no )
-        buffer->seq_no = tr->next_serial;
-
-    tr->next_serial = buffer->seq_no + 1;
-
-    bq_debug("P:%p PQH:%p elem: %p (%hu)",
-             tr, tr->queue->head, buffer, buffer->seq_no);
-
-    g_queue_push_tail(tr->queue, buffer);
-
-    /* Leave the exclusive access */
-    g_mutex_unlock(tr->lock);
-}
@@ -0,0 +1,496 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#define G_LOG_DOMAIN "bufferqueue"
+
+#include <config.h>
+
+#include "fnc_log.h"
+#include "media/media.h"
+#include "network/rtp.h"
+
+#include <stdbool.h>
+
+/* We don't enable this with !NDEBUG because it's _massive_! */
+#ifdef FENG_BQ_DEBUG
+# define bq_debug(fmt, ...) g_debug("[%s] " fmt, __PRETTY_FUNCTION__, __VA_ARGS__)
+#else
+# define bq_debug(...) {}
+#endif
+
+/**
+ * @addtogroup bufferqueue
+ *
+ * @section bq_ring Ring buffer backend
+ *
+ * When feng is configured with --enable-ring-bufferqueue, the queue
+ * of each track is a fixed-size ring of buffer pointers instead of a
+ * GQueue shared under the track's mutex.
+ *
+ * The ring is indexed by free-running positions: the producer owns
+ * the head position, and publishes it atomically after filling a
+ * slot; each consumer owns its own cursor, and reads the slots
+ * between it and the head without taking any lock.
+ *
+ * Slots are reclaimed by the producer only: before writing a new
+ * buffer it drops the references to all the slots behind the
+ * slowest consumer's cursor. This means that a consumer that stops
+ * reading (for instance a paused session) bounds the reclamation;
+ * once the ring is full, or the track has more than its share of
+ * the queue memory, further buffers of that track are dropped until
+ * the consumer moves on.
+ *
+ * The track's mutex is only used by the producer side and to
+ * register or unregister a consumer.
+ *
+ * @{
+ */
+
+/**
+ * @brief Amount of slots in each track's ring
+ *
+ * Has to be a power of two, so that positions can be masked into
+ * slot indexes, and wrap around safely.
+ */
+#define BQ_RING_SIZE 4096
+#define BQ_RING_MASK (BQ_RING_SIZE - 1)
+
+static inline guint ring_load(guint *position)
+{
+    return (guint)g_atomic_int_get((volatile gint *)position);
+}
+
+static inline void ring_store(guint *position, guint value)
+{
+    g_atomic_int_set((volatile gint *)position, (gint)value);
+}
+
+/**
+ * @brief Tells whether a position comes before another one
+ *
+ * Works across the wrap-around of the free-running positions.
+ */
+static inline gboolean ring_before(guint a, guint b)
+{
+    return (gint)(a - b) < 0;
+}
+
+/**
+ * @brief Resynchronise a consumer's cursor after a reset
+ *
+ * @param consumer The consumer to check the cursor of
+ *
+ * @return The current position of the consumer's cursor.
+ *
+ * If the producer reset its queue since the last time the consumer
+ * looked at it, move the cursor past the buffers that were queued
+ * before the reset. The cursor only ever moves forward, so this is
+ * safe even when racing against more resets.
+ */
+static guint bq_consumer_sync(RTP_session *consumer)
+{
+    Track *producer = consumer->track;
+    guint serial = ring_load(&producer->ring.serial);
+    guint cursor = consumer->ring_cursor;
+
+    if ( consumer->ring_serial != serial ) {
+        guint reset = ring_load(&producer->ring.reset);
+
+        bq_debug("C:%p cursor %u reset to %u (serial %u -> %u)",
+                 consumer, cursor, reset,
+                 consumer->ring_serial, serial);
+
+        consumer->ring_serial = serial;
+        if ( ring_before(cursor, reset) ) {
+            cursor = reset;
+            ring_store(&consumer->ring_cursor, cursor);
+        }
+    }
+
+    return cursor;
+}
+
+/**
+ * @brief Drop the slots no consumer can reach anymore
+ *
+ * @param producer The producer to reclaim the slots of
+ *
+ * @note This function has to be called with @ref Track::lock held.
+ */
+static void bq_producer_reclaim(Track *producer)
+{
+    guint limit = producer->ring.head;
+    guint i;
+
+    for ( i = 0; i < producer->ring.consumers->len; i++ ) {
+        RTP_session *consumer = g_ptr_array_index(producer->ring.consumers, i);
+        guint cursor = ring_load(&consumer->ring_cursor);
+
+        if ( ring_before(cursor, limit) )
+            limit = cursor;
+    }
+
+    while ( producer->ring.tail != limit ) {
+        struct MParserBuffer **slot =
+            &producer->ring.slots[producer->ring.tail & BQ_RING_MASK];
+
+        bq_memory_account(producer, *slot, false);
+        mparser_buffer_unref(*slot);
+        *slot = NULL;
+        producer->ring.tail++;
+    }
+}
+
+/**
+ * @brief Initialise the buffer queue of a new track
+ *
+ * @param producer The track to initialise the queue of
+ *
+ * @internal This function should only be used by @ref track_new.
+ */
+void bq_producer_init(Track *producer)
+{
+    producer->ring.slots = g_new0(struct MParserBuffer *, BQ_RING_SIZE);
+    producer->ring.consumers = g_ptr_array_new();
+}
+
+/**
+ * @brief Destroy the buffer queue of a track
+ *
+ * @param producer The track to destroy the queue of
+ *
+ * @internal This function should only be used by @ref track_free.
+ */
+void bq_producer_destroy(Track *producer)
+{
+    g_assert_cmpuint(producer->ring.consumers->len, ==, 0);
+
+    bq_producer_reclaim(producer);
+
+    g_ptr_array_free(producer->ring.consumers, true);
+    g_free(producer->ring.slots);
+}
+
+/**
+ * @brief Resets a producer's queue
+ *
+ * @param producer Producer to reset the queue of
+ *
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
+ *
+ * The buffers already queued are not freed right away, since the
+ * consumers might be reading them; they are skipped by the consumers
+ * at their next access, and reclaimed as usual afterwards.
+ */
+void track_reset_queue(Track *producer) {
+    g_mutex_lock(producer->lock);
+
+    g_assert(!producer->stopped);
+
+    bq_debug("Producer %p head %u serial %u",
+             producer, producer->ring.head, producer->ring.serial);
+
+    ring_store(&producer->ring.reset, producer->ring.head);
+    ring_store(&producer->ring.serial, producer->ring.serial + 1);
+
+    g_mutex_unlock(producer->lock);
+}
+
+/**
+ * @brief Queue a new RTP buffer into the track's queue
+ *
+ * @param tr The track to queue the buffer onto
+ * @param buffer The RTP buffer to queue
+ *
+ * If the ring is full because of a consumer lagging behind, or the
+ * queues are over @ref cfg_options_t::queue_memory_limit and the
+ * track holds more than its share of them (see @ref
+ * bq_memory_share_exceeded), the buffer is dropped: the consumers'
+ * cursors can only be moved by the consumers themselves. The tracks
+ * whose consumers keep up go on receiving their buffers.
+ */
+void track_write(Track *tr, struct MParserBuffer *buffer)
+{
+    /* Make sure the producer is not stopped */
+    g_assert(g_atomic_int_get(&tr->stopped) == 0);
+
+    rtp_cache_record(tr, buffer);
+
+    g_mutex_lock(tr->lock);
+
+    bq_producer_reclaim(tr);
+
+    if ( tr->ring.head - tr->ring.tail >= BQ_RING_SIZE ||
+         bq_memory_share_exceeded(tr) ) {
+        fnc_log(FNC_LOG_DEBUG,
+                "[%s] ring full or memory limit reached, dropping buffer",
+                tr->name);
+        g_mutex_unlock(tr->lock);
+        mparser_buffer_unref(buffer);
+        return;
+    }
+
+    if ( ! buffer->seq_no )
+        buffer->seq_no = tr->next_serial;
+
+    tr->next_serial = buffer->seq_no + 1;
+
+    trace_queue(tr, buffer);
+
+    bq_producer_gop_write(tr, buffer);
+
+    bq_debug("P:%p head %u elem: %p (%hu)",
+             tr, tr->ring.head, buffer, buffer->seq_no);
+
+    tr->ring.slots[tr->ring.head & BQ_RING_MASK] = buffer;
+    bq_memory_account(tr, buffer, true);
+
+    /* Publish the slot only once it's filled */
+    ring_store(&tr->ring.head, tr->ring.head + 1);
+
+    g_mutex_unlock(tr->lock);
+}
+
+/**
+ * @brief Register a new consumer for a track
+ *
+ * @param consumer The consumer to register; its @ref
+ *                 RTP_session::track pointer has to be set already.
+ *
+ * The consumer starts reading from the oldest buffer still queued,
+ * or from the track's GOP cache if it has one.
+ */
+void bq_consumer_new(RTP_session *consumer)
+{
+    Track *producer = consumer->track;
+
+    g_mutex_lock(producer->lock);
+
+    consumer->ring_serial = producer->ring.serial;
+    consumer->ring_cursor = producer->ring.tail;
+    if ( ring_before(consumer->ring_cursor, producer->ring.reset) )
+        consumer->ring_cursor = producer->ring.reset;
+
+    /* the GOP ends with the last buffer written */
+    if ( bq_consumer_gop_start(consumer) )
+        consumer->ring_cursor = producer->ring.head;
+
+    g_ptr_array_add(producer->ring.consumers, consumer);
+    g_atomic_int_add(&producer->consumers, 1);
+
+    g_mutex_unlock(producer->lock);
+}
+
+/**
+ * @brief Destroy a consumer
+ *
+ * @param consumer The consumer object to destroy
+ *
+ * @note This function will require exclusive access to the producer,
+ *       and will thus lock its mutex.
+ */
+void bq_consumer_free(RTP_session *consumer) {
+    Track *producer;
+
+    /* Compatibility with free(3) */
+    if ( consumer == NULL )
+        return;
+
+    producer = consumer->track;
+
+    bq_consumer_gop_free(consumer);
+
+    g_mutex_lock(producer->lock);
+
+    g_assert_cmpuint(producer->consumers, >,  0);
+
+    g_ptr_array_remove_fast(producer->ring.consumers, consumer);
+    g_atomic_int_add(&producer->consumers, -1);
+
+    g_mutex_unlock(producer->lock);
+}
+
+/**
+ * @brief Tells how many buffers are queued to be seen
+ *
+ * @param consumer The consumer object to check
+ *
+ * @return The number of buffers queued in the producer that have not
+ *         been seen.
+ */
+gulong bq_consumer_unseen(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    guint cursor;
+
+    if (bq_consumer_stopped(consumer))
+        return 0;
+
+    cursor = bq_consumer_sync(consumer);
+
+    return ring_load(&producer->ring.head) - cursor +
+        ( consumer->gop_burst != NULL ? g_queue_get_length(consumer->gop_burst) : 0 );
+}
+
+/**
+ * @brief Tells how much media is queued to be seen
+ *
+ * @param consumer The consumer object to check
+ *
+ * @return The seconds of delivery time between the consumer's
+ *         current buffer and the end of the last buffer queued.
+ *
+ * Both slots are at or past the consumer's cursor, so they cannot be
+ * reclaimed while looking at them.
+ */
+double bq_consumer_buffered(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    struct MParserBuffer *first = NULL, *last = NULL;
+    guint cursor, head;
+    double buffered;
+
+    if (bq_consumer_stopped(consumer))
+        return 0;
+
+    cursor = bq_consumer_sync(consumer);
+    head = ring_load(&producer->ring.head);
+
+    if ( cursor != head ) {
+        first = producer->ring.slots[cursor & BQ_RING_MASK];
+        last = producer->ring.slots[(head - 1) & BQ_RING_MASK];
+    }
+
+    if ( consumer->gop_burst != NULL ) {
+        first = g_queue_peek_head(consumer->gop_burst);
+        if ( last == NULL )
+            last = g_queue_peek_tail(consumer->gop_burst);
+    }
+
+    if ( first == NULL || last == NULL )
+        return 0;
+
+    buffered = last->delivery + last->duration - first->delivery;
+
+    return MAX(buffered, 0);
+}
+
+/**
+ * @brief Move to the next element in a consumer
+ *
+ * @param consumer The consumer object to move
+ *
+ * @retval true The move was successful
+ * @retval false The move wasn't successful, the producer may be stopped.
+ */
+gboolean bq_consumer_move(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    guint cursor, head;
+
+    if ( bq_consumer_stopped(consumer) )
+        return false;
+
+    if ( consumer->gop_burst != NULL )
+        return bq_consumer_gop_move(consumer);
+
+    cursor = bq_consumer_sync(consumer);
+    head = ring_load(&producer->ring.head);
+
+    if ( cursor == head )
+        return false;
+
+    ring_store(&consumer->ring_cursor, ++cursor);
+
+    bq_debug("C:%p cursor %u head %u", consumer, cursor, head);
+
+    return cursor != head;
+}
+
+/**
+ * @brief Move a consumer to the newest keyframe queued
+ *
+ * @param consumer The consumer object to move
+ *
+ * @retval true The consumer moved to the first buffer of the newest
+ *              keyframe, dropping its GOP burst if it had one.
+ * @retval false There is no keyframe past the current element.
+ *
+ * The slots between the cursor and the head can't be reclaimed, so
+ * they are looked at without locking, as in @ref bq_consumer_get.
+ */
+gboolean bq_consumer_skip(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    guint cursor, head, pos;
+
+    if ( bq_consumer_stopped(consumer) )
+        return false;
+
+    cursor = bq_consumer_sync(consumer);
+    head = ring_load(&producer->ring.head);
+
+    for ( pos = head - 1; ring_before(cursor, pos); pos-- ) {
+        struct MParserBuffer *buffer = producer->ring.slots[pos & BQ_RING_MASK];
+        struct MParserBuffer *previous = producer->ring.slots[(pos - 1) & BQ_RING_MASK];
+
+        if ( bq_keyframe_start(buffer, previous) ) {
+            bq_consumer_gop_free(consumer);
+            ring_store(&consumer->ring_cursor, pos);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Get the current element from the consumer's cursor
+ *
+ * @param consumer The consumer object to get the data from
+ *
+ * @return A pointer to the selected element
+ *
+ * @retval NULL No element can be read; this might be due to no data
+ *              present in the producer, or if the producer was
+ *              stopped. To know which one of the two conditions
+ *              happened, @ref bq_consumer_stopped should be called.
+ *
+ * The element is not reclaimed until the cursor is moved or the
+ * consumer is deleted.
+ */
+struct MParserBuffer *bq_consumer_get(RTP_session *consumer) {
+    Track *producer = consumer->track;
+    guint cursor;
+
+    if ( bq_consumer_stopped(consumer) )
+        return NULL;
+
+    if ( consumer->gop_burst != NULL )
+        return g_queue_peek_head(consumer->gop_burst);
+
+    cursor = bq_consumer_sync(consumer);
+
+    if ( cursor == ring_load(&producer->ring.head) )
+        return NULL;
+
+    return producer->ring.slots[cursor & BQ_RING_MASK];
+}
+
+/**@}*/
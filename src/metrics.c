@@ -0,0 +1,417 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "feng.h"
+#include "metrics.h"
+#include "network/rtsp.h"
+#include "media/media.h"
+
+/**
+ * @defgroup metrics Metrics
+ *
+ * @brief Counters and histograms that never block the data path
+ *
+ * Counters and histograms are split in @ref METRICS_SHARDS shards,
+ * each on its own cache lines; each thread is assigned a shard the
+ * first time it records something, so that the client loops and the
+ * demuxer threads don't bounce the same lines among them. The shards
+ * are summed when the metrics are read, so a reading is not an
+ * atomic snapshot, but each value in it is exact.
+ *
+ * When @ref cfg_options_t::metrics_path is set, the metrics are
+ * served in the Prometheus text format to a HTTP GET of that path.
+ *
+ * @{
+ */
+
+/** Number of shards, shared by the threads when there are more */
+#define METRICS_SHARDS 32
+
+#define METRICS_CACHE_LINE 64
+
+/** Upper bounds of the histogram buckets, in seconds */
+static const double metrics_buckets[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+#define METRICS_BUCKETS G_N_ELEMENTS(metrics_buckets)
+
+typedef struct {
+    guint64 counters[_METRIC_COUNTER_MAX];
+    /** Per bucket, not cumulative; the last one is +Inf */
+    guint64 buckets[_METRIC_HISTOGRAM_MAX][METRICS_BUCKETS + 1];
+    /** Sum of the observations, in microseconds */
+    guint64 sums[_METRIC_HISTOGRAM_MAX];
+} MetricsShardData;
+
+typedef union {
+    MetricsShardData data;
+    char padding[(sizeof(MetricsShardData) / METRICS_CACHE_LINE + 1) *
+                 METRICS_CACHE_LINE];
+} MetricsShard;
+
+static MetricsShard metrics_shards[METRICS_SHARDS]
+    __attribute__((aligned(METRICS_CACHE_LINE)));
+
+/** Shard of the current thread, plus one so that zero means unset */
+static GStaticPrivate metrics_shard_key = G_STATIC_PRIVATE_INIT;
+static gint metrics_next_shard;
+
+static gint metrics_gauges[_METRIC_GAUGE_MAX];
+
+/** Tracks whose queues are reported, see @ref metrics_track_register */
+static GPtrArray *metrics_tracks;
+static GStaticMutex metrics_tracks_lock = G_STATIC_MUTEX_INIT;
+
+static const struct {
+    const char *name;
+    const char *help;
+} metrics_counter_info[_METRIC_COUNTER_MAX] = {
+    [METRIC_BYTES_SENT] = { "feng_bytes_sent_total",
+                            "Bytes sent to the clients" },
+    [METRIC_BYTES_READ] = { "feng_bytes_read_total",
+                            "Bytes received from the clients" },
+    [METRIC_RTP_PACKETS] = { "feng_rtp_packets_total",
+                             "RTP packets sent" },
+    [METRIC_RTP_PACKETS_FAILED] = { "feng_rtp_packets_failed_total",
+                                    "RTP packets the transport failed to send" },
+    [METRIC_RTSP_REQUESTS] = { "feng_rtsp_requests_total",
+                               "RTSP requests handled" },
+    [METRIC_CONNECTIONS] = { "feng_connections_total",
+                             "Connections accepted" },
+    [METRIC_OUTPUT_POOL_HITS] = { "feng_output_pool_hits_total",
+                                  "Output buffers reused from the pools of the client loops" },
+    [METRIC_OUTPUT_POOL_MISSES] = { "feng_output_pool_misses_total",
+                                    "Output buffers the pools of the client loops had to allocate" }
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} metrics_gauge_info[_METRIC_GAUGE_MAX] = {
+    [METRIC_CLIENTS] = { "feng_clients", "Connected clients" },
+    [METRIC_SESSIONS] = { "feng_sessions", "Open RTSP sessions" },
+    [METRIC_COMMITTED_BANDWIDTH] = { "feng_committed_kbps",
+                                     "Bandwidth committed to the RTP sessions, in kbit/s" }
+};
+
+/* histograms sharing a name are reported together, and have to be
+ * listed next to each other */
+static const struct {
+    const char *name;
+    const char *help;
+    const char *labels;
+} metrics_histogram_info[_METRIC_HISTOGRAM_MAX] = {
+    [METRIC_SEND_LATENESS] = { "feng_rtp_send_lateness_seconds",
+                               "Delay of the RTP writer on the packets' delivery time",
+                               NULL },
+    [METRIC_DESCRIBE_LATENCY] = { "feng_rtsp_request_seconds",
+                                  "Time spent handling the RTSP requests",
+                                  "method=\"DESCRIBE\"" },
+    [METRIC_SETUP_LATENCY] = { "feng_rtsp_request_seconds",
+                               "Time spent handling the RTSP requests",
+                               "method=\"SETUP\"" },
+    [METRIC_PLAY_LATENCY] = { "feng_rtsp_request_seconds",
+                              "Time spent handling the RTSP requests",
+                              "method=\"PLAY\"" },
+    [METRIC_FILL_DURATION] = { "feng_resource_fill_seconds",
+                               "Time spent reading a stored resource ahead",
+                               NULL }
+};
+
+static MetricsShardData *metrics_shard(void)
+{
+    gint index = GPOINTER_TO_INT(g_static_private_get(&metrics_shard_key));
+
+    if ( index == 0 ) {
+        index = g_atomic_int_exchange_and_add(&metrics_next_shard, 1) %
+            METRICS_SHARDS + 1;
+        g_static_private_set(&metrics_shard_key, GINT_TO_POINTER(index), NULL);
+    }
+
+    return &metrics_shards[index - 1].data;
+}
+
+/**
+ * @brief Add to a counter
+ *
+ * @param counter The counter to add to
+ * @param value The amount to add
+ */
+void metrics_count(MetricCounter counter, guint64 value)
+{
+    __sync_add_and_fetch(&metrics_shard()->counters[counter], value);
+}
+
+/**
+ * @brief Read a counter, summed over all the shards
+ */
+guint64 metrics_counter_get(MetricCounter counter)
+{
+    guint64 value = 0;
+    guint i;
+
+    for ( i = 0; i < METRICS_SHARDS; i++ )
+        value += __sync_add_and_fetch(&metrics_shards[i].data.counters[counter], 0);
+
+    return value;
+}
+
+/**
+ * @brief Change a gauge
+ *
+ * @param gauge The gauge to change
+ * @param value The amount to add, negative to subtract
+ */
+void metrics_gauge_add(MetricGauge gauge, gint value)
+{
+    g_atomic_int_add(&metrics_gauges[gauge], value);
+}
+
+/**
+ * @brief Record an observation in a histogram
+ *
+ * @param histogram The histogram to record into
+ * @param value The value observed, in seconds; negative values are
+ *              counted as zero
+ */
+void metrics_observe(MetricHistogram histogram, double value)
+{
+    MetricsShardData *shard = metrics_shard();
+    guint bucket = 0;
+
+    if ( value < 0 )
+        value = 0;
+
+    while ( bucket < METRICS_BUCKETS && value > metrics_buckets[bucket] )
+        bucket++;
+
+    __sync_add_and_fetch(&shard->buckets[histogram][bucket], 1);
+    __sync_add_and_fetch(&shard->sums[histogram], (guint64)(value * 1000000));
+}
+
+/**
+ * @brief Report the queue of a track in the metrics
+ *
+ * @note The track has to be unregistered, with @ref
+ *       metrics_track_unregister, before it or its parent's mrl are
+ *       freed.
+ */
+void metrics_track_register(Track *tr)
+{
+    g_static_mutex_lock(&metrics_tracks_lock);
+
+    if ( metrics_tracks == NULL )
+        metrics_tracks = g_ptr_array_new();
+
+    g_ptr_array_add(metrics_tracks, tr);
+
+    g_static_mutex_unlock(&metrics_tracks_lock);
+}
+
+void metrics_track_unregister(Track *tr)
+{
+    g_static_mutex_lock(&metrics_tracks_lock);
+
+    if ( metrics_tracks != NULL )
+        g_ptr_array_remove_fast(metrics_tracks, tr);
+
+    g_static_mutex_unlock(&metrics_tracks_lock);
+}
+
+/**
+ * @brief Append a label value, escaped as the text format requires
+ */
+static void metrics_append_label(GString *out, const char *value)
+{
+    for ( ; *value != '\0'; value++ )
+        switch ( *value ) {
+        case '\\':
+            g_string_append(out, "\\\\");
+            break;
+        case '"':
+            g_string_append(out, "\\\"");
+            break;
+        case '\n':
+            g_string_append(out, "\\n");
+            break;
+        default:
+            g_string_append_c(out, *value);
+        }
+}
+
+static void metrics_append_header(GString *out, const char *name,
+                                  const char *help, const char *type)
+{
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                           name, help, name, type);
+}
+
+static void metrics_append_histogram(GString *out, MetricHistogram histogram)
+{
+    const char *name = metrics_histogram_info[histogram].name;
+    const char *labels = metrics_histogram_info[histogram].labels;
+    const char *sep = labels ? "," : "";
+    guint64 buckets[METRICS_BUCKETS + 1] = { 0 };
+    guint64 sum = 0, count = 0;
+    guint i, j;
+
+    if ( labels == NULL )
+        labels = "";
+
+    for ( i = 0; i < METRICS_SHARDS; i++ ) {
+        MetricsShardData *shard = &metrics_shards[i].data;
+
+        for ( j = 0; j <= METRICS_BUCKETS; j++ )
+            buckets[j] += __sync_add_and_fetch(&shard->buckets[histogram][j], 0);
+        sum += __sync_add_and_fetch(&shard->sums[histogram], 0);
+    }
+
+    for ( j = 0; j < METRICS_BUCKETS; j++ ) {
+        count += buckets[j];
+        g_string_append_printf(out, "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                               name, labels, sep, metrics_buckets[j], count);
+    }
+    count += buckets[METRICS_BUCKETS];
+
+    g_string_append_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                           name, labels, sep, count);
+    g_string_append_printf(out, "%s_sum%s%s%s %f\n", name,
+                           *labels ? "{" : "", labels, *labels ? "}" : "",
+                           sum / 1000000.0);
+    g_string_append_printf(out, "%s_count%s%s%s %" G_GUINT64_FORMAT "\n", name,
+                           *labels ? "{" : "", labels, *labels ? "}" : "",
+                           count);
+}
+
+static void metrics_append_tracks(GString *out)
+{
+    GString *labels = g_string_new("");
+#ifdef FENG_TRACE
+    GString *trace = g_string_new("");
+#endif
+    guint i;
+
+    metrics_append_header(out, "feng_track_queue_bytes",
+                          "Bytes of buffers queued by a track", "gauge");
+
+    g_static_mutex_lock(&metrics_tracks_lock);
+
+    for ( i = 0; metrics_tracks != NULL && i < metrics_tracks->len; i++ ) {
+        Track *tr = g_ptr_array_index(metrics_tracks, i);
+
+        if ( tr->parent == NULL )
+            continue;
+
+        g_string_assign(labels, "resource=\"");
+        metrics_append_label(labels, tr->parent->mrl);
+        g_string_append(labels, "\",track=\"");
+        metrics_append_label(labels, tr->name);
+        g_string_append_c(labels, '"');
+
+        g_string_append_printf(out, "feng_track_queue_bytes{%s} %" G_GSIZE_FORMAT "\n",
+                               labels->str, tr->queue_bytes);
+#ifdef FENG_TRACE
+        trace_append_metrics(trace, tr, labels->str);
+#endif
+    }
+
+    g_static_mutex_unlock(&metrics_tracks_lock);
+
+#ifdef FENG_TRACE
+    metrics_append_header(out, "feng_pipeline_seconds",
+                          "Delays of the packets through the pipeline", "histogram");
+    g_string_append_len(out, trace->str, trace->len);
+    g_string_free(trace, true);
+#endif
+    g_string_free(labels, true);
+}
+
+/**
+ * @brief Serve the metrics in Prometheus text format
+ *
+ * @param rtsp The client requesting them
+ */
+void feng_send_metrics(RTSP_Client *rtsp)
+{
+    RFC822_Response *response =
+        rfc822_response_new(rtsp->pending_request, RTSP_Ok);
+    GString *out = g_string_sized_new(4096);
+    MParserBufferPoolStats pool;
+    guint i;
+
+    for ( i = 0; i < _METRIC_COUNTER_MAX; i++ ) {
+        metrics_append_header(out, metrics_counter_info[i].name,
+                              metrics_counter_info[i].help, "counter");
+        g_string_append_printf(out, "%s %" G_GUINT64_FORMAT "\n",
+                               metrics_counter_info[i].name,
+                               metrics_counter_get(i));
+    }
+
+    for ( i = 0; i < _METRIC_GAUGE_MAX; i++ ) {
+        metrics_append_header(out, metrics_gauge_info[i].name,
+                              metrics_gauge_info[i].help, "gauge");
+        g_string_append_printf(out, "%s %d\n", metrics_gauge_info[i].name,
+                               g_atomic_int_get(&metrics_gauges[i]));
+    }
+
+    metrics_append_header(out, "feng_queue_memory_bytes",
+                          "Bytes of buffers queued by all the tracks", "gauge");
+    g_string_append_printf(out, "feng_queue_memory_bytes %" G_GSIZE_FORMAT "\n",
+                           bq_memory_usage());
+
+    mparser_buffer_pool_stats(&pool);
+    metrics_append_header(out, "feng_buffer_pool_hits_total",
+                          "Buffer allocations served by a recycled slot", "counter");
+    g_string_append_printf(out, "feng_buffer_pool_hits_total %u\n", pool.hits);
+    metrics_append_header(out, "feng_buffer_pool_misses_total",
+                          "Buffer allocations that required a new slot", "counter");
+    g_string_append_printf(out, "feng_buffer_pool_misses_total %u\n", pool.misses);
+
+    metrics_append_tracks(out);
+
+    for ( i = 0; i < _METRIC_HISTOGRAM_MAX; i++ ) {
+        if ( i == 0 || strcmp(metrics_histogram_info[i].name,
+                              metrics_histogram_info[i-1].name) != 0 )
+            metrics_append_header(out, metrics_histogram_info[i].name,
+                                  metrics_histogram_info[i].help, "histogram");
+        metrics_append_histogram(out, i);
+    }
+
+    response->body = out;
+
+    rfc822_headers_set(response->headers,
+                       RTSP_Header_Content_Type,
+                       g_strdup("text/plain; version=0.0.4"));
+    rfc822_response_send(rtsp, response);
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,88 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+
+/**
+ * @file metrics.h
+ * Process-wide counters, gauges and histograms
+ */
+
+#ifndef FN_METRICS_H
+#define FN_METRICS_H
+
+#include <glib.h>
+
+/**
+ * @addtogroup metrics
+ * @{
+ */
+
+typedef enum {
+    METRIC_BYTES_SENT,
+    METRIC_BYTES_READ,
+    METRIC_RTP_PACKETS,
+    METRIC_RTP_PACKETS_FAILED,
+    METRIC_RTSP_REQUESTS,
+    METRIC_CONNECTIONS,
+    METRIC_OUTPUT_POOL_HITS,
+    METRIC_OUTPUT_POOL_MISSES,
+    _METRIC_COUNTER_MAX
+} MetricCounter;
+
+typedef enum {
+    METRIC_CLIENTS,
+    METRIC_SESSIONS,
+    /** Bandwidth committed to the RTP sessions, in kbit/s */
+    METRIC_COMMITTED_BANDWIDTH,
+    _METRIC_GAUGE_MAX
+} MetricGauge;
+
+/** All the histograms are in seconds, and share the same buckets */
+typedef enum {
+    /** How late the RTP writer ran, against the packets' delivery time */
+    METRIC_SEND_LATENESS,
+    METRIC_DESCRIBE_LATENCY,
+    METRIC_SETUP_LATENCY,
+    METRIC_PLAY_LATENCY,
+    /** Time spent by a demuxer thread filling a resource's queues */
+    METRIC_FILL_DURATION,
+    _METRIC_HISTOGRAM_MAX
+} MetricHistogram;
+
+struct Track;
+struct RTSP_Client;
+
+void metrics_count(MetricCounter counter, guint64 value);
+guint64 metrics_counter_get(MetricCounter counter);
+void metrics_gauge_add(MetricGauge gauge, gint value);
+void metrics_observe(MetricHistogram histogram, double value);
+
+void metrics_track_register(struct Track *tr);
+void metrics_track_unregister(struct Track *tr);
+
+void feng_send_metrics(struct RTSP_Client *rtsp);
+
+/**
+ * @}
+ */
+
+#endif // FN_METRICS_H
@@ -24,6 +24,7 @@
 
 #include "feng.h"
 #include "network/rtsp.h"
+#include "network/rtp.h"
 
 static GHashTable *http_tunnel_pairs;
 
@@ -48,8 +49,20 @@ static void CLEANUP_DESTRUCTOR http_tunnel_cleanup()
  */
 static void rtsp_write_data_http(RTSP_Client *client, GByteArray *data)
 {
-    g_queue_push_head(client->pair->http_client->out_queue, data);
-    ev_io_start(client->loop, &client->pair->http_client->ev_io_write);
+    rtsp_out_queue_push(client->pair->http_client, data, NULL);
+}
+
+/**
+ * @brief Queue an interleaved RTP packet on the hidden HTTP socket
+ *
+ * @param client The client to write the packet to
+ * @param buffer The RTP packet to queue for sending
+ *
+ * @see rtsp_write_data_http
+ */
+static void rtsp_write_rtp_http(RTSP_Client *client, RTP_Buffer *buffer)
+{
+    rtsp_out_queue_push(client->pair->http_client, NULL, buffer);
 }
 
 static gboolean http_tunnel_create_pair(RTSP_Client *client, RFC822_Request *req)
@@ -111,6 +124,9 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
     size_t parsed_headers;
     int headers_res;
 
+    if ( !rtsp_input_complete(rtsp, true) )
+        return false;
+
     if ( rtsp->pending_request->headers == NULL )
         rtsp->pending_request->headers = rfc822_headers_new();
 
@@ -132,6 +148,23 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
     if (!rtsp_connection_limit(rtsp, rtsp->pending_request))
         return false;
 
+    if ( feng_srv.metrics_path != NULL &&
+         rtsp->pending_request->method_id == HTTP_Method_GET &&
+         strcmp(rtsp->pending_request->object, feng_srv.metrics_path) == 0 ) {
+
+        feng_send_metrics(rtsp);
+        return false;
+    }
+
+    if ( feng_srv.prewarm_path != NULL &&
+         rtsp->pending_request->method_id == HTTP_Method_GET &&
+         g_str_has_prefix(rtsp->pending_request->object, feng_srv.prewarm_path) &&
+         strchr("?", rtsp->pending_request->object[strlen(feng_srv.prewarm_path)]) ) {
+
+        feng_send_prewarm(rtsp);
+        return false;
+    }
+
 #ifdef HAVE_JSON
     if ( rtsp->pending_request->method_id == HTTP_Method_GET &&
          strstr(rtsp->pending_request->object, "stats") ) {
@@ -142,7 +175,6 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
 #endif
     if ( rtsp->pending_request->method_id == HTTP_Method_POST ) {
         const char *http_session = rfc822_headers_lookup(rtsp->pending_request->headers, HTTP_Header_x_sessioncookie);
-        gpointer tmpptr;
 
         if ( http_session == NULL ) {
             rfc822_quick_response(rtsp, rtsp->pending_request, RFC822_Protocol_HTTP10, HTTP_BadRequest);
@@ -171,23 +203,24 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
         }
 
         /* re-use the current object to be used for the HTTP tunnel;
-           we change the callback and set the tunnel, and switch the
-           input buffers around for convenience */
+           we change the callback and set the tunnel; what's left in
+           the input is the start of the encoded RTSP stream */
         rtsp->pair->rtsp_client = rtsp;
         rtsp->write_data = rtsp_write_data_http;
+        rtsp->write_rtp = rtsp_write_rtp_http;
 
         /* this will start from scratch */
         rtsp->status = RFC822_State_Begin;
 
-        tmpptr = rtsp->input;
-        rtsp->input = rtsp->pair->http_client->input;
-        rtsp->pair->http_client->input = tmpptr;
-
-        /* get the http_client ready to read the data */
+        /* the GET connection only carries the output from now on */
         rtsp->pair->http_client->status = RFC822_State_HTTP_Content;
 
-        /* we run it here so that it starts getting some data at least */
-        RTSP_handler(rtsp->pair->http_client);
+        /* the two connections have to be served by the same loop; if
+           they are not, move this one, and let the other loop start
+           processing the data. */
+        if ( !rtsp_client_join_loop(rtsp, rtsp->pair->http_client) )
+            /* we run it here so that it starts getting some data at least */
+            http_tunnel_receive(rtsp, 0);
 
         return false;
     } else {
@@ -199,39 +232,59 @@ gboolean HTTP_handle_headers(RTSP_Client *rtsp)
     return true;
 }
 
-gboolean HTTP_handle_content(RTSP_Client *rtsp)
+/**
+ * @brief Decode the data received on the POST connection of a tunnel
+ *
+ * @param rtsp The client of the POST connection
+ * @param offset Where the newly received, still encoded, data starts
+ *               in the client's input
+ *
+ * The data is read right at the end of the (decoded) input of the
+ * client, and replaced there by its decoding; then the RTSP requests
+ * and interleaved packets are processed as for any other client.
+ *
+ * The decoding can't be done in place: the characters of a quad
+ * left incomplete by the previous read are carried in the decoder's
+ * state, and completing it writes three bytes after reading as few
+ * as one, over the input still to be read.
+ */
+void http_tunnel_receive(RTSP_Client *rtsp, size_t offset)
 {
-    gsize decoded_length = (rtsp->input->len / 4) * 3 + 6, actual_decoded_length;
-    GByteArray *decoded_input = rtsp->pair->rtsp_client->input;
-    gsize prev_size = decoded_input->len;
-    guint8 *outbuf;
-
-    g_byte_array_set_size(decoded_input, decoded_input->len + decoded_length);
-
-    /* This way if it's empty it'll be allocated */
-    outbuf = decoded_input->data + prev_size;
-
-    actual_decoded_length = g_base64_decode_step((gchar*)rtsp->input->data,
-                                                 rtsp->input->len,
-                                                 outbuf,
-                                                 &rtsp->pair->base64_state,
-                                                 &rtsp->pair->base64_save);
+    const gsize encoded_len = rtsp->input->len - offset;
+    /* the carried quad can add up to three bytes */
+    guint8 *decoded = g_malloc(encoded_len / 4 * 3 + 3);
+    const gsize decoded_len = g_base64_decode_step((gchar*)rtsp->input->data + offset,
+                                                   encoded_len,
+                                                   decoded,
+                                                   &rtsp->pair->base64_state,
+                                                   &rtsp->pair->base64_save);
+
+    g_byte_array_set_size(rtsp->input, offset);
+    g_byte_array_append(rtsp->input, decoded, decoded_len);
+    g_free(decoded);
+
+    RTSP_handler(rtsp);
+}
 
-    decoded_input->len -= (decoded_length - actual_decoded_length);
+gboolean HTTP_handle_content(RTSP_Client *rtsp)
+{
+    /* the GET connection of a tunnel only carries the output, what
+       the client sends on it is ignored */
     g_byte_array_set_size(rtsp->input, 0);
 
-    RTSP_handler(rtsp->pair->rtsp_client);
-
     return false;
 }
 
-gboolean HTTP_handle_idle(ATTR_UNUSED RTSP_Client *rtsp)
+gboolean HTTP_handle_idle(RTSP_Client *rtsp)
 {
-    /* make sure to send the one queued answer we have */
-    while ( g_queue_get_length(rtsp->out_queue) > 0 )
-        ev_run(rtsp->loop, EVRUN_ONCE);
+    /* make sure to send the one queued answer we have; the loop is
+       shared with other clients so we cannot spin it here, let the
+       write callback disconnect us once the queue is empty. */
+    if ( g_queue_get_length(rtsp->out_queue) > 0 )
+        rtsp->close_on_flush = true;
+    else
+        rtsp_client_disconnect(rtsp);
 
-    ev_unloop(rtsp->loop, EVUNLOOP_ONE);
     return false;
 }
 
@@ -0,0 +1,287 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "metrics.h"
+
+/**
+ * @defgroup output_pool Output buffer pools
+ *
+ * @brief Recycle the buffers the transports send from
+ *
+ * Every packet and response sent to a client goes through a buffer
+ * allocated for it and freed once the transport has written it out:
+ * the RTP packet descriptors, the contiguous copies made by the
+ * transports that can't scatter, the framed RTCP reports and the
+ * response messages.
+ *
+ * Each client loop keeps a pool of such buffers, private to its
+ * thread so that no locking is needed: the transports give them back
+ * to the pool instead of freeing them, and the next packets are built
+ * in them, so that once the loop has warmed up sending allocates
+ * nothing.
+ *
+ * The pool only holds a bounded amount of buffers, and drops the ones
+ * grown past @ref OUTPUT_POOL_MAX_SIZE, so a burst doesn't pin its
+ * memory forever. Threads without a pool (the main loop, the
+ * multicast senders) allocate and free as usual, so buffers can be
+ * freed from any thread.
+ *
+ * @{
+ */
+
+/** Maximum amount of buffers of each kind held by a pool */
+#define OUTPUT_POOL_MAX_BUFFERS 256
+
+/** Size past which a buffer is freed rather than kept */
+#define OUTPUT_POOL_MAX_SIZE (64*1024)
+
+/** Amount of requests between two updates of the metrics */
+#define OUTPUT_POOL_FLUSH 1024
+
+typedef struct {
+    /** Empty GByteArray objects */
+    GPtrArray *arrays;
+    /** Unused RTP_Buffer objects */
+    GPtrArray *packets;
+    /** Single scratch string for the responses */
+    GString *string;
+
+    /** Requests served from and outside the pool, not yet counted
+        in the metrics */
+    unsigned int hits, misses;
+} OutputPool;
+
+static GPrivate *output_pool_key;
+
+static OutputPool *output_pool_get()
+{
+    return output_pool_key ? g_private_get(output_pool_key) : NULL;
+}
+
+static void output_pool_flush(OutputPool *pool)
+{
+    metrics_count(METRIC_OUTPUT_POOL_HITS, pool->hits);
+    metrics_count(METRIC_OUTPUT_POOL_MISSES, pool->misses);
+    pool->hits = pool->misses = 0;
+}
+
+static void output_pool_count(OutputPool *pool, gboolean hit)
+{
+    if ( hit )
+        pool->hits++;
+    else
+        pool->misses++;
+
+    if ( pool->hits + pool->misses >= OUTPUT_POOL_FLUSH )
+        output_pool_flush(pool);
+}
+
+static void output_pool_destroy(gpointer pool_p)
+{
+    OutputPool *pool = pool_p;
+    guint i;
+
+    output_pool_flush(pool);
+
+    for ( i = 0; i < pool->arrays->len; i++ )
+        g_byte_array_free(g_ptr_array_index(pool->arrays, i), true);
+    g_ptr_array_free(pool->arrays, true);
+
+    for ( i = 0; i < pool->packets->len; i++ )
+        g_slice_free(RTP_Buffer, g_ptr_array_index(pool->packets, i));
+    g_ptr_array_free(pool->packets, true);
+
+    if ( pool->string )
+        g_string_free(pool->string, true);
+
+    g_slice_free(OutputPool, pool);
+}
+
+/**
+ * @brief Prepare the thread-private storage of the pools
+ *
+ * @note This function has to be called before any client loop is
+ *       started.
+ */
+void output_pool_init()
+{
+    output_pool_key = g_private_new(output_pool_destroy);
+}
+
+/**
+ * @brief Give the calling thread its own pool
+ *
+ * Called by each client loop as it starts; the pool is freed when the
+ * thread terminates.
+ */
+void output_pool_attach()
+{
+    OutputPool *pool = g_slice_new0(OutputPool);
+
+    pool->arrays = g_ptr_array_sized_new(OUTPUT_POOL_MAX_BUFFERS);
+    pool->packets = g_ptr_array_sized_new(OUTPUT_POOL_MAX_BUFFERS);
+
+    g_private_set(output_pool_key, pool);
+}
+
+/**
+ * @brief Get an empty byte array to build an outgoing message into
+ *
+ * @param reserve The amount of bytes the array has to be able to
+ *                hold without growing.
+ *
+ * @return An empty GByteArray, to be released with @ref
+ *         output_pool_array_free.
+ */
+GByteArray *output_pool_array(guint reserve)
+{
+    OutputPool *pool = output_pool_get();
+    GByteArray *array;
+
+    if ( pool == NULL )
+        return g_byte_array_sized_new(reserve);
+
+    if ( pool->arrays->len == 0 ) {
+        output_pool_count(pool, false);
+        return g_byte_array_sized_new(reserve);
+    }
+
+    output_pool_count(pool, true);
+    array = g_ptr_array_remove_index_fast(pool->arrays, pool->arrays->len - 1);
+
+    /* grows the allocation, if needed, and leaves it empty */
+    g_byte_array_set_size(array, reserve);
+    g_byte_array_set_size(array, 0);
+
+    return array;
+}
+
+/**
+ * @brief Give back a byte array once its content has been sent
+ *
+ * @param array The array to release, from @ref output_pool_array or
+ *              not.
+ */
+void output_pool_array_free(GByteArray *array)
+{
+    OutputPool *pool = output_pool_get();
+
+    if ( pool == NULL || array->len > OUTPUT_POOL_MAX_SIZE ||
+         pool->arrays->len >= OUTPUT_POOL_MAX_BUFFERS ) {
+        g_byte_array_free(array, true);
+        return;
+    }
+
+    g_ptr_array_add(pool->arrays, array);
+}
+
+/**
+ * @brief Get an RTP packet descriptor
+ *
+ * @return An uninitialised RTP_Buffer, to be released with @ref
+ *         rtp_buffer_free.
+ */
+RTP_Buffer *output_pool_rtp()
+{
+    OutputPool *pool = output_pool_get();
+
+    if ( pool == NULL )
+        return g_slice_new(RTP_Buffer);
+
+    if ( pool->packets->len == 0 ) {
+        output_pool_count(pool, false);
+        return g_slice_new(RTP_Buffer);
+    }
+
+    output_pool_count(pool, true);
+    return g_ptr_array_remove_index_fast(pool->packets, pool->packets->len - 1);
+}
+
+/**
+ * @brief Give back an RTP packet descriptor, whose payload has
+ *        already been released
+ */
+void output_pool_rtp_free(RTP_Buffer *buffer)
+{
+    OutputPool *pool = output_pool_get();
+
+    if ( pool == NULL || pool->packets->len >= OUTPUT_POOL_MAX_BUFFERS ) {
+        g_slice_free(RTP_Buffer, buffer);
+        return;
+    }
+
+    g_ptr_array_add(pool->packets, buffer);
+}
+
+/**
+ * @brief Get an empty string to compose a response into
+ *
+ * @param reserve The expected length of the response
+ *
+ * @return An empty GString, to be released with @ref
+ *         output_pool_string_free.
+ */
+GString *output_pool_string(gsize reserve)
+{
+    OutputPool *pool = output_pool_get();
+    GString *string;
+
+    if ( pool == NULL )
+        return g_string_sized_new(reserve);
+
+    if ( pool->string == NULL ) {
+        output_pool_count(pool, false);
+        return g_string_sized_new(reserve);
+    }
+
+    output_pool_count(pool, true);
+    string = pool->string;
+    pool->string = NULL;
+
+    return g_string_truncate(string, 0);
+}
+
+/**
+ * @brief Give back a string, from @ref output_pool_string or not
+ */
+void output_pool_string_free(GString *string)
+{
+    OutputPool *pool = output_pool_get();
+
+    if ( pool == NULL || pool->string != NULL ||
+         string->allocated_len > OUTPUT_POOL_MAX_SIZE ) {
+        g_string_free(string, true);
+        return;
+    }
+
+    pool->string = string;
+}
+
+/**
+ * @}
+ */
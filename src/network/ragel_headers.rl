@@ -23,12 +23,61 @@
 
 #include "rtsp.h"
 
-int ragel_read_rtsp_headers(GHashTable *headers, const char *msg,
+/**
+ * @brief Header value found by the parser, still in the message
+ */
+typedef struct {
+    const char *str;
+    size_t len;
+} HeaderSlice;
+
+/**
+ * @brief Store the values found by the parser
+ *
+ * All the values are copied at once, one after the other, in a single
+ * block owned by the headers, so that parsing a request takes a single
+ * allocation however many headers it has.
+ */
+static void headers_store(RFC822_Headers *headers, const HeaderSlice *slices)
+{
+    size_t total = 0;
+    char *block;
+    unsigned int i;
+
+    for ( i = 0; i < RFC822_Header__Count; i++ )
+        if ( slices[i].str != NULL )
+            total += slices[i].len + 1;
+
+    if ( total == 0 )
+        return;
+
+    block = g_malloc(total);
+    headers->blocks = g_slist_prepend(headers->blocks, block);
+
+    for ( i = 0; i < RFC822_Header__Count; i++ ) {
+        if ( slices[i].str == NULL )
+            continue;
+
+        if ( headers->owned[i] )
+            g_free(headers->values[i]);
+
+        memcpy(block, slices[i].str, slices[i].len);
+        block[slices[i].len] = '\0';
+
+        headers->values[i] = block;
+        headers->owned[i] = 0;
+
+        block += slices[i].len + 1;
+    }
+}
+
+int ragel_read_rtsp_headers(RFC822_Headers *headers, const char *msg,
                             size_t length, size_t *read_size)
 {
     int cs;
     const char *p = msg, *pe = p + length;
     RTSP_Header header_code = RTSP_Header__Invalid;
+    HeaderSlice slices[RFC822_Header__Count] = { { NULL, 0 }, };
 
     const char *header_str = NULL;
     size_t header_len = 0;
@@ -48,9 +97,10 @@ int ragel_read_rtsp_headers(GHashTable *headers, const char *msg,
 
         action save_header {
             if ( header_code != RTSP_Header__Invalid &&
-                 header_code != RTSP_Header__Unsupported )
-                rfc822_headers_set(headers, header_code,
-                                   g_strndup(header_str, header_len));
+                 header_code != RTSP_Header__Unsupported ) {
+                slices[header_code].str = header_str;
+                slices[header_code].len = header_len;
+            }
 
             header_code = RTSP_Header__Invalid;
             header_str = NULL;
@@ -71,18 +121,21 @@ int ragel_read_rtsp_headers(GHashTable *headers, const char *msg,
         write exec noend;
     }%%
 
+    headers_store(headers, slices);
+
     if ( cs < rtsp_headers_first_final )
         return ( p == pe ) ? 0 : -1;
 
     return 1;
 }
 
-int ragel_read_http_headers(GHashTable *headers, const char *msg,
+int ragel_read_http_headers(RFC822_Headers *headers, const char *msg,
                             size_t length, size_t *read_size)
 {
     int cs;
     const char *p = msg, *pe = p + length;
     HTTP_Header header_code = HTTP_Header__Invalid;
+    HeaderSlice slices[RFC822_Header__Count] = { { NULL, 0 }, };
 
     const char *header_str = NULL;
     size_t header_len = 0;
@@ -102,9 +155,10 @@ int ragel_read_http_headers(GHashTable *headers, const char *msg,
 
         action save_header {
             if ( header_code != HTTP_Header__Invalid &&
-                 header_code != HTTP_Header__Unsupported )
-                rfc822_headers_set(headers, header_code,
-                                   g_strndup(header_str, header_len));
+                 header_code != HTTP_Header__Unsupported ) {
+                slices[header_code].str = header_str;
+                slices[header_code].len = header_len;
+            }
 
             header_code = HTTP_Header__Invalid;
             header_str = NULL;
@@ -125,6 +179,8 @@ int ragel_read_http_headers(GHashTable *headers, const char *msg,
         write exec noend;
     }%%
 
+    headers_store(headers, slices);
+
     if ( cs < http_headers_first_final )
         return ( p == pe ) ? 0 : -1;
 
@@ -24,8 +24,11 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "rfc822proto.h"
 #include "rtsp.h"
+#include "rtp.h"
 #include "feng.h"
 
 #define ENDLINE "\r\n"
@@ -51,6 +54,16 @@
  * @{
  */
 
+/**
+ * @brief Timestamp of the current second, for each thread
+ */
+typedef struct {
+    time_t second;
+    char value[32];
+} HTTPTimestamp;
+
+static GStaticPrivate http_timestamp_cache = G_STATIC_PRIVATE_INIT;
+
 /**
  * @brief Return a timestamp using HTTP Time specification
  *
@@ -60,16 +73,29 @@
  * is actually used for more than just the Date header.
  *
  * RTSP uses this value in the Date header (RFC 2326; Section 12.18).
+ *
+ * The string is only formatted once per second by each thread, and
+ * is valid until the next call from the same thread.
  */
-static char *http_timestamp() {
-  char buffer[31] = { 0, };
+static const char *http_timestamp() {
+    HTTPTimestamp *cache = g_static_private_get(&http_timestamp_cache);
+    const time_t now = time(NULL);
 
-  time_t now = time(NULL);
-  struct tm *t = gmtime(&now);
+    if ( cache == NULL ) {
+        cache = g_new0(HTTPTimestamp, 1);
+        g_static_private_set(&http_timestamp_cache, cache, g_free);
+    }
+
+    if ( cache->second != now || cache->value[0] == '\0' ) {
+        struct tm t;
 
-  strftime(buffer, 30, "%a, %d %b %Y %H:%M:%S GMT", t);
+        gmtime_r(&now, &t);
+        strftime(cache->value, sizeof(cache->value),
+                 "%a, %d %b %Y %H:%M:%S GMT", &t);
+        cache->second = now;
+    }
 
-  return g_strdup(buffer);
+    return cache->value;
 }
 
 /**
@@ -90,7 +116,7 @@ static char *http_timestamp() {
  * @li Timestamp (if present) (Sec. 12.38)
  *
  * The headers CSeq and Timestamp that are just copied over from the request are
- * taken through its headers hash table. Session is copied over if present, but
+ * taken through its headers. Session is copied over if present, but
  * it might be added by the SETUP method function too.
  */
 RFC822_Response *rfc822_response_new(const RFC822_Request *req, int status_code)
@@ -107,7 +133,7 @@ RFC822_Response *rfc822_response_new(const RFC822_Request *req, int status_code)
     rfc822_headers_set(response->headers,
                        RFC822_Header_Server, g_strdup(feng_signature));
     rfc822_headers_set(response->headers,
-                       RFC822_Header_Date, http_timestamp());
+                       RFC822_Header_Date, g_strdup(http_timestamp()));
 
     if ( (hdr = rfc822_headers_lookup(req->headers, RTSP_Header_CSeq)) )
         rfc822_headers_set(response->headers,
@@ -138,25 +164,35 @@ static void rfc822_response_free(RFC822_Response *response)
 }
 
 /**
- * @brief Iterating function used by rfc822_response_send
+ * @brief Serialize the status line and the headers of a response
  *
- * @param hdr_name_p Pointer to the header name string
- * @param hdr_value_p Pointer to the header value string
- * @param response_str_p Pointer to the response GString
+ * @param str The string to append to
+ * @param proto The protocol of the response
+ * @param status The status code of the response
+ * @param headers The headers to append
  *
- * This function is used by g_hash_table_foreach to append the various headers
- * to the final response string.
+ * The empty line ending the headers is not appended.
  */
-static void rfc822_response_append_headers(gpointer hdr_code_p,
-                                           gpointer hdr_value_p,
-                                           gpointer response_str_p)
+static void rfc822_response_head(GString *str, RFC822_Protocol proto,
+                                 int status, const RFC822_Headers *headers)
 {
-    int hdr_code = GPOINTER_TO_INT(hdr_code_p);
-    const char *const hdr_value = hdr_value_p;
-    GString *response_str = response_str_p;
+    unsigned int i;
+
+    /* Generate the status line, see RFC 2326 Sec. 7.1 */
+    g_string_append_printf(str, "%s %d %s" ENDLINE,
+                           rfc822_proto_to_string(proto), status,
+                           rfc822_response_reason(proto, status));
 
-    g_string_append_printf(response_str, "%s: %s" ENDLINE,
-                           rfc822_header_to_string(hdr_code), hdr_value);
+    /* Append the headers */
+    for ( i = 0; i < RFC822_Header__Count; i++ ) {
+        if ( headers->values[i] == NULL )
+            continue;
+
+        g_string_append(str, rfc822_header_to_string(i));
+        g_string_append(str, ": ");
+        g_string_append(str, headers->values[i]);
+        g_string_append(str, ENDLINE);
+    }
 }
 
 /**
@@ -166,21 +202,32 @@ static void rfc822_response_append_headers(gpointer hdr_code_p,
  *
  * This method generates an RTSP response message, following the indication of
  * RFC 2326 Section 7.
+ *
+ * The size of the message is computed first, so that it's written
+ * into a single buffer, taken from the @ref output_pool.
  */
 void rfc822_response_send(RTSP_Client *client, RFC822_Response *response)
 {
-    GString *str = g_string_new("");
+    const char *const proto = rfc822_proto_to_string(response->proto);
+    const char *const reason = rfc822_response_reason(response->proto, response->status);
+    /* status code, spaces, content length and CRLFs are covered by
+       the slack */
+    size_t size = strlen(proto) + strlen(reason) + 64;
+    GString *str;
+    unsigned int i;
 
-    /* Generate the status line, see RFC 2326 Sec. 7.1 */
-    g_string_printf(str, "%s %d %s" ENDLINE,
-                    rfc822_proto_to_string(response->proto),
-                    response->status,
-                    rfc822_response_reason(response->proto, response->status));
+    for ( i = 0; i < RFC822_Header__Count; i++ )
+        if ( response->headers->values[i] != NULL )
+            size += strlen(rfc822_header_to_string(i)) +
+                strlen(response->headers->values[i]) + 4;
 
-    /* Append the headers */
-    g_hash_table_foreach(response->headers,
-                         rfc822_response_append_headers,
-                         str);
+    if ( response->body )
+        size += response->body->len;
+
+    str = output_pool_string(size);
+
+    rfc822_response_head(str, response->proto, response->status,
+                         response->headers);
 
     /* If there is a body we need to calculate its length and append that to the
      * headers, see RFC 2326 Sec. 12.14. */
@@ -209,6 +256,163 @@ void rfc822_response_send(RTSP_Client *client, RFC822_Response *response)
     rfc822_response_free(response);
 }
 
+/**
+ * @defgroup rfc822_template Pre-serialized responses
+ *
+ * @brief Answer the most frequent requests without building a
+ *        response object
+ *
+ * Some responses differ among requests only by the headers copied
+ * from the request (CSeq, Session and Timestamp), by their Date, and
+ * possibly by a few headers and a body of their own; OPTIONS, that
+ * some clients send as a keep-alive every few seconds, is the same
+ * for everybody.
+ *
+ * For these, the status line and the invariant headers are
+ * serialized once in a template. Each response is then written by
+ * copying the template in a buffer of the @ref output_pool and
+ * appending the variable headers and the body, without allocating an
+ * @ref RFC822_Response, its headers or its values.
+ *
+ * @{
+ */
+
+/**
+ * @brief Serialize the invariant part of a response
+ *
+ * @param proto The protocol of the responses
+ * @param status The status code of the responses
+ * @param headers The headers that are the same for all the
+ *                responses; the Server header is added to them. The
+ *                caller keeps ownership.
+ *
+ * @return A new template, meant to be kept for the lifetime of the
+ *         process.
+ */
+RFC822_Template *rfc822_template_new(RFC822_Protocol proto, int status,
+                                     RFC822_Headers *headers)
+{
+    RFC822_Template *template = g_slice_new(RFC822_Template);
+
+    rfc822_headers_set(headers, RFC822_Header_Server, g_strdup(feng_signature));
+
+    template->proto = proto;
+    template->status = status;
+    template->head = g_string_new("");
+
+    rfc822_response_head(template->head, proto, status, headers);
+
+    return template;
+}
+
+/**
+ * @brief Append a header line to a response being written
+ *
+ * @param message The response, as returned by @ref
+ *                rfc822_template_begin
+ * @param hdr The header to append
+ * @param value The value of the header
+ */
+void rfc822_template_header(GByteArray *message, RFC822_Header hdr,
+                            const char *value)
+{
+    const char *const name = rfc822_header_to_string(hdr);
+
+    g_byte_array_append(message, (const guint8*)name, strlen(name));
+    g_byte_array_append(message, (const guint8*)": ", 2);
+    g_byte_array_append(message, (const guint8*)value, strlen(value));
+    g_byte_array_append(message, (const guint8*)ENDLINE, 2);
+}
+
+/**
+ * @brief Start writing a response from a template
+ *
+ * @param template The template of the response
+ * @param req The request being answered
+ *
+ * @return A buffer holding the template and the headers common to all
+ *         the responses (see @ref rfc822_response_new); more headers
+ *         can be appended with @ref rfc822_template_header, before
+ *         sending it with @ref rfc822_template_send.
+ */
+GByteArray *rfc822_template_begin(const RFC822_Template *template,
+                                  const RFC822_Request *req)
+{
+    static const RFC822_Header copied[] = {
+        RTSP_Header_CSeq,
+        RTSP_Header_Session,
+        RTSP_Header_Timestamp
+    };
+    GByteArray *message = output_pool_array(template->head->len + 256);
+    unsigned int i;
+
+    g_byte_array_append(message, (const guint8*)template->head->str,
+                        template->head->len);
+
+    rfc822_template_header(message, RFC822_Header_Date, http_timestamp());
+
+    for ( i = 0; i < G_N_ELEMENTS(copied); i++ ) {
+        const char *value = rfc822_headers_lookup(req->headers, copied[i]);
+
+        if ( value != NULL )
+            rfc822_template_header(message, copied[i], value);
+    }
+
+    return message;
+}
+
+/**
+ * @brief Complete and send a response written from a template
+ *
+ * @param client The client to send the response to
+ * @param template The template the response was written from
+ * @param req The request being answered
+ * @param message The response, as returned by @ref
+ *                rfc822_template_begin
+ * @param body The body of the response, if any; it is copied, the
+ *             caller keeps ownership.
+ */
+void rfc822_template_send(RTSP_Client *client,
+                          const RFC822_Template *template,
+                          const RFC822_Request *req,
+                          GByteArray *message, GString *body)
+{
+    RFC822_Headers logged_headers;
+    RFC822_Response logged;
+
+    if ( body ) {
+        char length[24];
+
+        g_snprintf(length, sizeof(length), "%zu", body->len + 2);
+        rfc822_template_header(message, RFC822_Header_Content_Length, length);
+    }
+
+    g_byte_array_append(message, (const guint8*)ENDLINE, 2);
+
+    if ( body ) {
+        g_byte_array_append(message, (const guint8*)body->str, body->len);
+        g_byte_array_append(message, (const guint8*)ENDLINE, 2);
+    }
+
+    client->write_data(client, message);
+
+    /* the access log only needs the date of the headers */
+    memset(&logged_headers, 0, sizeof(logged_headers));
+    logged_headers.values[RFC822_Header_Date] = (char*)http_timestamp();
+
+    logged.proto = template->proto;
+    logged.status = template->status;
+    logged.headers = &logged_headers;
+    logged.body = body;
+    logged.request = req;
+
+    accesslog_log(client, &logged);
+}
+
+/**
+ * @}
+ */
+
 /**
  * @}
  */
@@ -51,6 +51,7 @@ typedef enum RFC822_Header {
     </xsl:for-each>
 
     <xsl:text><![CDATA[
+    RFC822_Header__Count
 } RFC822_Header;
 
 ]]></xsl:text>
@@ -51,6 +51,27 @@ typedef enum RFC822_Parser_State {
     RFC822_State_HTTP_Idle
 } RFC822_Parser_State;
 
+/**
+ * @brief Known/supported headers of a request or response
+ *
+ * The set of headers feng knows about is fixed, so they are stored
+ * in an array indexed by their @ref RFC822_Header code, rather than
+ * in a hash table.
+ */
+typedef struct RFC822_Headers {
+    /** Values of the headers, NULL for the headers not present */
+    char *values[RFC822_Header__Count];
+
+    /** Whether each value was allocated on its own by the caller
+     *  of @ref rfc822_headers_set, rather than stored in @ref
+     *  RFC822_Headers::blocks */
+    guint8 owned[RFC822_Header__Count];
+
+    /** Blocks holding, one after the other, the values parsed at
+     *  once from a request */
+    GSList *blocks;
+} RFC822_Headers;
+
 typedef struct RFC822_Request {
     /** State of the current request parsing */
     RFC822_Parser_State state;
@@ -80,13 +101,13 @@ typedef struct RFC822_Request {
     char *protocol_str;
 
     /**
-     * @brief Hash table of the known/supported headers in the request.
+     * @brief The known/supported headers in the request.
      *
-     * This hash table contains all the headers read from the request
-     * that feng will use. Unsupported, unknown headers will not be
-     * read into this hash table!
+     * This contains all the headers read from the request that feng
+     * will use. Unsupported, unknown headers will not be read into
+     * it!
      */
-    GHashTable *headers;
+    RFC822_Headers *headers;
 } RFC822_Request;
 
 gboolean rfc822_request_check_url(struct RTSP_Client *client, RFC822_Request *req);
@@ -104,8 +125,8 @@ typedef struct RFC822_Response {
      */
     int status;
 
-    /** Hash table of headers to add to the response */
-    GHashTable *headers;
+    /** Headers to add to the response */
+    RFC822_Headers *headers;
 
     /** Eventual body for the response */
     GString *body;
@@ -119,21 +140,45 @@ RFC822_Response *rfc822_response_new(const RFC822_Request *request,
 void rfc822_response_send(struct RTSP_Client *client, RFC822_Response *response);
 
 /**
- * @brief Creates a new hash table for handling RFC822 headers.
+ * @brief Pre-serialized part of a response
+ * @ingroup rfc822_template
+ */
+typedef struct RFC822_Template {
+    /** Protocol of the responses */
+    RFC822_Protocol proto;
+
+    /** Status code of the responses */
+    int status;
+
+    /** Status line and invariant headers */
+    GString *head;
+} RFC822_Template;
+
+RFC822_Template *rfc822_template_new(RFC822_Protocol proto, int status,
+                                     RFC822_Headers *headers);
+GByteArray *rfc822_template_begin(const RFC822_Template *template,
+                                  const RFC822_Request *req);
+void rfc822_template_header(GByteArray *message, RFC822_Header hdr,
+                            const char *value);
+void rfc822_template_send(struct RTSP_Client *client,
+                          const RFC822_Template *template,
+                          const RFC822_Request *req,
+                          GByteArray *message, GString *body);
+
+/**
+ * @brief Creates a new, empty, set of RFC822 headers.
  *
- * @return A new GHashTable object with direct hash and g_free as
- *         value cleanup function.
+ * @return A new RFC822_Headers object
  */
-static inline GHashTable *rfc822_headers_new()
+static inline RFC822_Headers *rfc822_headers_new()
 {
-    return g_hash_table_new_full(g_direct_hash, g_direct_equal,
-                                 NULL, g_free);
+    return g_slice_new0(RFC822_Headers);
 }
 
 /**
- * @brief Sets an header in the hash table to a given value
+ * @brief Sets an header to a given value
  *
- * @param headers The hash table (as returned by @ref rfc822_headers_new)
+ * @param headers The headers (as returned by @ref rfc822_headers_new)
  * @param hdr The constant code of the header
  * @param value A g_malloc'd value to set the header to
  *
@@ -141,49 +186,73 @@ static inline GHashTable *rfc822_headers_new()
  *       autogenerated enumeration constant will have to be used
  *       depending on the request.
  *
- * @note The value given will be freed with g_free() when removing it
- *       from the hash table (or with @ref rfc822_headers_destroy.
+ * @note The value given will be freed with g_free() when replaced,
+ *       or by @ref rfc822_headers_destroy.
  */
-static inline void rfc822_headers_set(GHashTable *headers, RFC822_Header hdr, char *value)
+static inline void rfc822_headers_set(RFC822_Headers *headers, RFC822_Header hdr, char *value)
 {
-    return g_hash_table_insert(headers,
-                               GINT_TO_POINTER(hdr),
-                               value);
+    if ( headers->owned[hdr] )
+        g_free(headers->values[hdr]);
+
+    headers->values[hdr] = value;
+    headers->owned[hdr] = 1;
 }
 
 /**
- * @brief Gets the value of an header in the hash table
+ * @brief Gets the value of an header
  *
- * @param headers The hash table (as returned by @ref rfc822_headers_new)
+ * @param headers The headers (as returned by @ref rfc822_headers_new)
  * @param hdr The constant code of the header
  *
- * @return The raw content string straight from the hash table
+ * @return The raw content string of the header
  *
  * @note The hdr parameter is a generic integer because the proper
  *       autogenerated enumeration constant will have to be used
  *       depending on the request.
  */
-static inline const char *rfc822_headers_lookup(GHashTable *headers, RFC822_Header hdr)
+static inline const char *rfc822_headers_lookup(const RFC822_Headers *headers, RFC822_Header hdr)
 {
     if ( headers == NULL )
         return NULL;
 
-    return g_hash_table_lookup(headers,
-                               GINT_TO_POINTER(hdr));
+    return headers->values[hdr];
 }
 
 /**
- * @brief Destroys headers hash tables created by @ref rfc822_headers_new
+ * @brief Count the headers present
+ */
+static inline unsigned int rfc822_headers_count(const RFC822_Headers *headers)
+{
+    unsigned int i, count = 0;
+
+    for ( i = 0; i < RFC822_Header__Count; i++ )
+        count += headers->values[i] != NULL;
+
+    return count;
+}
+
+/**
+ * @brief Destroys headers created by @ref rfc822_headers_new
  *
- * @param headers The hash table to destroy (may be NULL)
+ * @param headers The headers to destroy (may be NULL)
  *
- * This is a simple wrapper around g_hash_table_destroy(), but it
- * checks for NULL values, to be compatible with free() and g_free().
+ * It checks for NULL values, to be compatible with free() and g_free().
  */
-static inline void rfc822_headers_destroy(GHashTable *headers)
+static inline void rfc822_headers_destroy(RFC822_Headers *headers)
 {
-    if ( headers )
-        g_hash_table_destroy(headers);
+    unsigned int i;
+
+    if ( headers == NULL )
+        return;
+
+    for ( i = 0; i < RFC822_Header__Count; i++ )
+        if ( headers->owned[i] )
+            g_free(headers->values[i]);
+
+    g_slist_foreach(headers->blocks, (GFunc)g_free, NULL);
+    g_slist_free(headers->blocks);
+
+    g_slice_free(RFC822_Headers, headers);
 }
 
 /**
@@ -39,6 +39,18 @@
 #include "fnc_log.h"
 #include "media/media.h"
 
+/** Fraction of the session bandwidth given to RTCP (RFC 3550 Section 6.2) */
+#define RTCP_BANDWIDTH_FRACTION 0.05
+
+/** Minimum interval between reports, in seconds (RFC 3550 Section 6.2) */
+#define RTCP_MIN_INTERVAL 5.0
+
+/** Divisor of the randomised interval, e - 3/2 (RFC 3550 Section 6.3.1) */
+#define RTCP_COMPENSATION 1.21828
+
+/** IPv4 and UDP headers, counted in the average size of the reports */
+#define RTCP_LOWER_HEADERS 28
+
 /**
  * @defgroup rtcp RTCP Handling
  * @brief Data structures and functions to handle RTCP
@@ -185,14 +197,33 @@ static void rtcp_set_sr(RTP_session *session, RTCP_SR_Compound *outpkt)
 }
 
 /**
- * @brief Create a new compound sender report for SDES packets
+ * @brief Size the session's compound buffer, and clear it
+ */
+static RTCP_SR_Compound *rtcp_pkt_prepare(RTP_session *session, size_t size)
+{
+    GByteArray *buffer = session->rtcp.buffer;
+
+    if ( buffer == NULL )
+        buffer = session->rtcp.buffer = g_byte_array_sized_new(size);
+
+    g_byte_array_set_size(buffer, size);
+    memset(buffer->data, 0, size);
+
+    return (RTCP_SR_Compound*)buffer->data;
+}
+
+/**
+ * @brief Prepare the compound sender report for SDES packets
  *
  * @param session The session to create the report for
+ *
+ * The SDES part doesn't change for the whole session, so it's only
+ * written the first time, and the following reports just refresh the
+ * SR preamble in the same buffer.
  */
-static GByteArray *rtcp_pkt_sr_sdes(RTP_session *session)
+static void rtcp_pkt_sr_sdes(RTP_session *session)
 {
     RTCP_SR_Compound *outpkt;
-    GByteArray *outpkt_buffer;
 
     const char *name = session->client->local_host;
     const size_t name_len = strlen(name);
@@ -201,6 +232,11 @@ static GByteArray *rtcp_pkt_sr_sdes(RTP_session *session)
     size_t outpkt_size = sizeof(RTCP_header) + sizeof(RTCP_header_SR) +
         sdes_size;
 
+    if ( session->rtcp.sdes_ready ) {
+        rtcp_set_sr(session, (RTCP_SR_Compound*)session->rtcp.buffer->data);
+        return;
+    }
+
     /* Pad to 32-bit */
     if ( outpkt_size%4 != 0 ) {
         const size_t padding = 4-(outpkt_size%4);
@@ -208,11 +244,7 @@ static GByteArray *rtcp_pkt_sr_sdes(RTP_session *session)
         outpkt_size += padding;
     }
 
-    outpkt_buffer = g_byte_array_sized_new(outpkt_size);
-    g_byte_array_set_size(outpkt_buffer, outpkt_size);
-    memset(outpkt_buffer->data, 0, outpkt_size);
-
-    outpkt = (RTCP_SR_Compound*)outpkt_buffer->data;
+    outpkt = rtcp_pkt_prepare(session, outpkt_size);
 
     rtcp_set_sr(session, outpkt);
 
@@ -229,22 +261,21 @@ static GByteArray *rtcp_pkt_sr_sdes(RTP_session *session)
 
     memcpy(&outpkt->payload.sdes.name, name, name_len);
 
-    return outpkt_buffer;
+    session->rtcp.sdes_ready = true;
 }
 
 /**
- * @brief Create a new compound sender report for BYE packets
+ * @brief Prepare the compound sender report for BYE packets
  *
  * @param session The session to create the report for
  *
  * @todo The reason should probably be a parameter
  */
-static GByteArray *rtcp_pkt_sr_bye(RTP_session *session)
+static void rtcp_pkt_sr_bye(RTP_session *session)
 {
     static const char reason[] = "The medium is over.";
 
     RTCP_SR_Compound *outpkt;
-    GByteArray *outpkt_buffer;
     size_t bye_size = sizeof(RTCP_header) + sizeof(RTCP_header_BYE) +
         sizeof(reason);
     size_t outpkt_size = sizeof(RTCP_header) + sizeof(RTCP_header_SR) +
@@ -257,11 +288,8 @@ static GByteArray *rtcp_pkt_sr_bye(RTP_session *session)
         outpkt_size += padding;
     }
 
-    outpkt_buffer = g_byte_array_sized_new(outpkt_size);
-    g_byte_array_set_size(outpkt_buffer, outpkt_size);
-    memset(outpkt_buffer->data, 0, outpkt_size);
-
-    outpkt = (RTCP_SR_Compound*)outpkt_buffer->data;
+    outpkt = rtcp_pkt_prepare(session, outpkt_size);
+    session->rtcp.sdes_ready = false;
 
     rtcp_set_sr(session, outpkt);
 
@@ -275,8 +303,6 @@ static GByteArray *rtcp_pkt_sr_bye(RTP_session *session)
     outpkt->payload.bye.length = htonl(sizeof(reason)-1);
 
     memcpy(&outpkt->payload.bye.reason, &reason, sizeof(reason));
-
-    return outpkt_buffer;
 }
 
 /**
@@ -290,28 +316,128 @@ static GByteArray *rtcp_pkt_sr_bye(RTP_session *session)
  * one requested with the @p type parameter.
  *
  * Since the two packets are sent with a single message, only one call
- * is needed.
+ * is needed. Sending a BYE also stops the scheduled reports.
  */
 gboolean rtcp_send_sr(RTP_session *session, rtcp_pkt_type type)
 {
-    GByteArray *outpkt = NULL;
+    gboolean sent;
 
     switch(type) {
     case SDES:
-        outpkt = rtcp_pkt_sr_sdes(session);
+        rtcp_pkt_sr_sdes(session);
         break;
     case BYE:
-        outpkt = rtcp_pkt_sr_bye(session);
+        rtcp_unschedule(session);
+        rtcp_pkt_sr_bye(session);
         break;
     default:
         g_assert_not_reached();
     }
 
-    g_assert(outpkt != NULL);
+    sent = session->send_rtcp(session, session->rtcp.buffer);
+
+    /* RFC 3550 Section 6.3.3: the average includes the lower layers */
+    if ( session->rtcp.avg_size == 0 )
+        session->rtcp.avg_size = session->rtcp.buffer->len + RTCP_LOWER_HEADERS;
+    else
+        session->rtcp.avg_size +=
+            (session->rtcp.buffer->len + RTCP_LOWER_HEADERS -
+             session->rtcp.avg_size) / 16;
 
-    return session->send_rtcp(session, outpkt);
+    return sent;
 }
 
+/**
+ * @brief Compute the interval to the next report
+ *
+ * @param session The session to compute the interval for
+ * @param now The current time of the session's loop
+ *
+ * RFC 3550 Section 6.3.1, for a session with a single sender (us)
+ * and a single receiver: since the sender is more than a quarter of
+ * the members, the whole RTCP bandwidth is shared among the two. The
+ * session bandwidth is the one sent since the previous report; until
+ * that is known, the minimum interval is used.
+ */
+static double rtcp_interval(RTP_session *session, double now)
+{
+    const double elapsed = now - session->rtcp.last_time;
+    const int members = 2;
+    double interval = 0;
+    double minimum = RTCP_MIN_INTERVAL;
+
+    if ( session->rtcp.last_time > 0 && elapsed > 0 &&
+         session->octet_count != session->rtcp.last_octets ) {
+        const double bandwidth =
+            (uint32_t)(session->octet_count - session->rtcp.last_octets) / elapsed;
+
+        interval = members * session->rtcp.avg_size /
+            (bandwidth * RTCP_BANDWIDTH_FRACTION);
+
+        rtp_admission_measure(session, bandwidth);
+    }
+
+    if ( session->rtcp.initial )
+        minimum /= 2;
+
+    session->rtcp.initial = false;
+    session->rtcp.last_time = now;
+    session->rtcp.last_octets = session->octet_count;
+
+    interval = MAX(interval, minimum);
+
+    /* randomised to avoid synchronisation, compensated for the
+     * reconsideration algorithm (Section 6.3.1) */
+    return interval * g_random_double_range(0.5, 1.5) / RTCP_COMPENSATION;
+}
+
+static void rtcp_timer_cb(struct ev_loop *loop, ev_timer *w,
+                          ATTR_UNUSED int revents)
+{
+    RTP_session *session = w->data;
+
+    rtcp_send_sr(session, SDES);
+
+    w->repeat = rtcp_interval(session, ev_now(loop));
+    ev_timer_again(loop, w);
+}
+
+/**
+ * @brief Start sending the sender reports of a session
+ *
+ * @param session The session to report about
+ *
+ * Called once the first packet of a play has been sent: the first
+ * report goes out right away, so that the client can synchronise the
+ * tracks, and the following ones as RFC 3550 Section 6.2 says.
+ */
+void rtcp_schedule(RTP_session *session)
+{
+    struct ev_loop *loop = session->client->loop;
+
+    if ( session->rtcp.avg_size == 0 )
+        session->rtcp.initial = true;
+
+    /* the bandwidth is unknown until the next report, and has to
+     * skip the time spent paused */
+    session->rtcp.last_time = 0;
+
+    rtcp_send_sr(session, SDES);
+
+    ev_init(&session->rtcp.timer, rtcp_timer_cb);
+    session->rtcp.timer.data = session;
+    session->rtcp.timer.repeat = rtcp_interval(session, ev_now(loop));
+    ev_timer_again(loop, &session->rtcp.timer);
+}
+
+/**
+ * @brief Stop sending the sender reports of a session
+ */
+void rtcp_unschedule(RTP_session *session)
+{
+    if ( session->client != NULL && session->client->loop )
+        ev_timer_stop(session->client->loop, &session->rtcp.timer);
+}
 
 #define rtcp_pt_to_string(pt)\
     ((pt == SR) ?  "Sender Report" : \
@@ -321,28 +447,92 @@ gboolean rtcp_send_sr(RTP_session *session, rtcp_pkt_type type)
      (pt == APP) ? "Application" : \
                    "Unknown")
 /**
- * @brief parse Receiver Reports and update the statistics accordingly
+ * @brief Middle 32 bits of the current NTP time
+ *
+ * The format of the LSR and DLSR fields of the report blocks, in
+ * 1/65536 of second.
  */
+static uint32_t ntp_middle_now(void)
+{
+    struct timespec now;
+
+    gettimeinseconds(&now);
 
-static void parse_receiver_report(uint8_t *packet, int count)
+    return (((uint32_t) now.tv_sec + 2208988800u) << 16) |
+        (uint32_t) ((((uint64_t) now.tv_nsec) << 16) / 1000000000u);
+}
+
+/**
+ * @brief Parse the report blocks of a SR or RR packet
+ *
+ * @param session The session the packet was received for
+ * @param packet The packet, past its @ref RTCP_header
+ * @param len The size of the packet, past its header
+ * @param count The number of report blocks in the packet
+ * @param offset Where the report blocks start, from @p packet
+ *
+ * The blocks about the session's SSRC update @ref
+ * RTP_session::receiver, and are then passed to @ref
+ * RTP_session::on_report.
+ */
+static void parse_receiver_report(RTP_session *session,
+                                  uint8_t *packet, size_t len,
+                                  int count, size_t offset)
 {
-    int ssrc = ntohl(((RTCP_header_RR*)packet)->ssrc);
-    fnc_log(FNC_LOG_VERBOSE, "[RTCP] Receiver report for %u", ssrc);
-    packet+=4;
-    while(count--) {
+    RTP_ReceiverStats *stats = &session->receiver;
+    uint32_t ssrc;
+
+    if ( len < offset )
+        return;
+
+    ssrc = ntohl(((RTCP_header_RR*)packet)->ssrc);
+    fnc_log(FNC_LOG_VERBOSE, "[RTCP] Receiver report from %u", ssrc);
+
+    for ( packet += offset, len -= offset;
+          count-- > 0 && len >= sizeof(RTCP_report_block);
+          packet += sizeof(RTCP_report_block),
+              len -= sizeof(RTCP_report_block) ) {
         RTCP_report_block *report = (RTCP_report_block *)packet;
+        const uint32_t lsr = ntohl(report->last_sr);
+        const uint32_t dlsr = ntohl(report->delay_last_sr);
+        int32_t lost = report->packet_lost[0]<<16 |
+            report->packet_lost[1]<<8 |
+            report->packet_lost[2];
+
+        /* 24-bit signed */
+        if ( lost & 0x800000 )
+            lost -= 0x1000000;
+
         fnc_log(FNC_LOG_VERBOSE,
                 "[RTCP] ssrc %u, fraction %d, lost %d, "
                 "sequence %u, jitter %u, "
                 "last Sender Report %u, delay %u",
-                report->ssrc, report->fract_lost,
-                report->packet_lost[0]<<3|
-                report->packet_lost[1]<<2|
-                report->packet_lost[2],
+                ntohl(report->ssrc), report->fract_lost, lost,
                 ntohl(report->h_seq_no),
-                ntohl(report->last_sr),
-                ntohl(report->delay_last_sr));
-        packet+=sizeof(RTCP_report_block);
+                ntohl(report->jitter),
+                lsr, dlsr);
+
+        if ( ntohl(report->ssrc) != session->ssrc )
+            continue;
+
+        stats->reports++;
+        stats->fraction_lost = report->fract_lost / 256.0;
+        stats->cumulative_lost = lost;
+        stats->highest_seq = ntohl(report->h_seq_no);
+        if ( session->track->clock_rate > 0 )
+            stats->jitter = (double)ntohl(report->jitter) /
+                session->track->clock_rate;
+
+        /* RFC 3550 Section 6.4.1: no SR received yet if LSR is zero */
+        if ( lsr != 0 ) {
+            const int32_t rtt = (int32_t)(ntp_middle_now() - lsr - dlsr);
+
+            if ( rtt >= 0 )
+                stats->rtt = rtt / 65536.0;
+        }
+
+        if ( session->on_report )
+            session->on_report(session, stats);
     }
 }
 
@@ -369,8 +559,17 @@ void rtcp_handle(RTP_session *session, uint8_t *packet, size_t len)
 
         switch (rtcp->pt) {
             case SR:
+                parse_receiver_report(session, packet + sizeof(RTCP_header),
+                                      rtcp_size - sizeof(RTCP_header),
+                                      rtcp->count,
+                                      sizeof(RTCP_header_SR));
+                break;
             case RR:
-                parse_receiver_report(packet+4, rtcp->count);
+                parse_receiver_report(session, packet + sizeof(RTCP_header),
+                                      rtcp_size - sizeof(RTCP_header),
+                                      rtcp->count,
+                                      sizeof(RTCP_header_RR));
+                break;
             case SDES:
             default:
                 break;
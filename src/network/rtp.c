@@ -51,17 +51,27 @@ static void rtp_session_free(gpointer session_gen,
      * to ensure that we're paused before doing this but doesn't
      * matter now.
      */
-    if (client->loop)
+    /* parked sessions have no client, see rtsp_session_park */
+    if (client != NULL && client->loop)
         ev_periodic_stop(client->loop, &session->rtp_writer);
+    rtcp_unschedule(session);
 
     session->close_transport(session);
 
-    r_pause(session->track->parent);
+    r_detach(session->track->parent, session);
+
+    if ( client != NULL )
+        rtp_admission_release(client->vhost, session->admitted_kbps);
 
     /* Remove the consumer */
-    bq_consumer_free(session);
+    if ( session->multicast == NULL ) {
+        affinity_track_consumer(session->track, session->node, -1);
+        bq_consumer_free(session);
+    }
 
     /* Deallocate memory */
+    if ( session->rtcp.buffer != NULL )
+        g_byte_array_free(session->rtcp.buffer, true);
     g_free(session->uri);
     g_slice_free(RTP_session, session);
 }
@@ -78,6 +88,66 @@ void rtp_session_gslist_free(GSList *sessions_list) {
     g_slist_foreach(sessions_list, rtp_session_free, NULL);
 }
 
+/**
+ * @brief Set up the fast start of a session being resumed
+ *
+ * The speed is bounded by @ref cfg_vhost_t::fast_start_rate over the
+ * bitrate of the track; without a known bitrate, no bound can be
+ * enforced, so the session starts at realtime.
+ */
+static void rtp_fast_start(RTP_session *session)
+{
+    const struct cfg_vhost_t *vhost = session->client->vhost;
+    Track *tr = session->track;
+    Resource *resource = tr->parent;
+    double speed = vhost->fast_start_speed;
+
+    memset(&session->fast_start, 0, sizeof(session->fast_start));
+
+    if ( vhost->fast_start == 0 ||
+         resource->source == LIVE_SOURCE ||
+         resource->stored.shared_url != NULL ||
+         session->range->scale != 1.0 )
+        return;
+
+    if ( vhost->fast_start_rate != 0 ) {
+        const int measured = g_atomic_int_get(&tr->measured_kbps);
+        const double kbps = measured > 0 ? measured : tr->bitrate / 1000.0;
+
+        if ( kbps <= 0 )
+            return;
+
+        speed = MIN(speed, vhost->fast_start_rate / kbps);
+    }
+
+    if ( speed <= 1 )
+        return;
+
+    session->fast_start.window = vhost->fast_start / 1000.0;
+    session->fast_start.speed = speed;
+    session->fast_start.lead = session->fast_start.window * (1 - 1 / speed);
+}
+
+/**
+ * @brief Time gained by the fast start when a packet is due
+ *
+ * @param session The session sending the packet
+ * @param delivery The delivery time of the packet
+ */
+static double rtp_fast_start_gained(const RTP_session *session,
+                                    double delivery)
+{
+    const double elapsed = delivery - session->range->begin_time;
+
+    if ( session->fast_start.window == 0 || elapsed <= 0 )
+        return 0;
+
+    if ( elapsed >= session->fast_start.window )
+        return session->fast_start.lead;
+
+    return elapsed * (1 - 1 / session->fast_start.speed);
+}
+
 /**
  * @brief Resume (or start) an RTP session
  *
@@ -113,6 +183,14 @@ static void rtp_session_resume(gpointer session_gen, gpointer range_gen) {
     session->last_packet_send_time = cur_time;
 
     r_resume(resource);
+
+    /* multicast viewers are served by the track's sender */
+    if ( session->multicast != NULL )
+        return;
+
+    /* set before filling, so that the fast start window is read
+       right away */
+    rtp_fast_start(session);
     r_fill(resource, session);
 
     ev_periodic_set(&session->rtp_writer,
@@ -157,6 +235,7 @@ static void rtp_session_pause(gpointer session_gen,
     r_pause(resource);
 
     ev_periodic_stop(client->loop, &session->rtp_writer);
+    rtcp_unschedule(session);
 }
 
 /**
@@ -171,6 +250,49 @@ void rtp_session_gslist_pause(GSList *sessions_list) {
     g_slist_foreach(sessions_list, rtp_session_pause, NULL);
 }
 
+/**
+ * @brief Move a session to the same track of a different resource
+ *
+ * @param session_gen The session to move
+ * @param resource_gen The resource to move the session to
+ *
+ * @internal This function should only be called from g_slist_foreach.
+ */
+static void rtp_session_rebind(gpointer session_gen, gpointer resource_gen)
+{
+    RTP_session *session = (RTP_session*)session_gen;
+    Resource *resource = (Resource*)resource_gen;
+    Track *tr = r_find_track(resource, session->track->name);
+
+    if ( tr == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[rtp] track %s missing after reopening",
+                session->track->name);
+        return;
+    }
+
+    r_detach(session->track->parent, session);
+    affinity_track_consumer(session->track, session->node, -1);
+    bq_consumer_free(session);
+
+    session->track = tr;
+    bq_consumer_new(session);
+    affinity_track_consumer(tr, session->node, 1);
+}
+
+/**
+ * @brief Move a GSList of RTP_sessions to a different resource
+ *
+ * @param sessions_list GSList of sessions to move
+ * @param resource The resource to move them to, opened from the same
+ *                 file as the current one.
+ *
+ * Used to split a client off a shared resource (see @ref
+ * r_unshare); the sessions have to be paused or about to be resumed.
+ */
+void rtp_session_gslist_rebind(GSList *sessions_list, Resource *resource) {
+    g_slist_foreach(sessions_list, rtp_session_rebind, resource);
+}
+
 /**
  * Calculate RTP time from media timestamp or using pregenerated timestamp
  * depending on what is available
@@ -187,6 +309,12 @@ uint32_t rtptime(RTP_session *session, int clock_rate, struct MParserBuffer *buf
     return session->start_rtptime + calc_rtptime;
 }
 
+/**
+ * @brief Layout of the fixed RTP header
+ *
+ * @note The size of this structure has to be kept equal to @ref
+ *       RTP_HEADER_SIZE.
+ */
 typedef struct {
     /* byte 0 */
 #if (G_BYTE_ORDER == G_LITTLE_ENDIAN)
@@ -221,23 +349,70 @@ typedef struct {
 } RTP_packet;
 
 /**
- * @brief Send the actual buffer as an RTP packet to the client
+ * @brief Total size of an RTP packet, header included
  *
- * @param session The RTP session to send the packet for
- * @param buffer The data for the packet to be sent
+ * @param buffer The packet to get the size of
+ */
+size_t rtp_buffer_len(const RTP_Buffer *buffer)
+{
+    return RTP_HEADER_SIZE + buffer->payload->data_size;
+}
+
+/**
+ * @brief Release an RTP packet and its reference to the payload
  *
- * @return The number of frames sent to the client.
- * @retval -1 Error during writing.
+ * @param buffer The packet to free
  */
-static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer)
+void rtp_buffer_free(RTP_Buffer *buffer)
 {
-    const size_t packet_size = sizeof(RTP_packet) + buffer->data_size;
-    GByteArray *outbuf = g_byte_array_sized_new(packet_size);
-    RTP_packet *packet = (RTP_packet*)(outbuf->data);
-    Track *tr = session->track;
-    uint32_t timestamp = rtptime(session, tr->clock_rate, buffer);
+    mparser_buffer_unref(buffer->payload);
+    output_pool_rtp_free(buffer);
+}
+
+/**
+ * @brief Copy an RTP packet in a contiguous buffer
+ *
+ * @param buffer The packet to copy; it is freed by this function.
+ * @param headroom Amount of bytes to leave uninitialised at the start
+ *                 of the returned buffer, for the transport framing.
+ *
+ * @return A GByteArray from the @ref output_pool containing the
+ *         framing space, the header and the payload of the packet.
+ *
+ * This is used by the transports that cannot send the header and the
+ * payload with a single scatter/gather call.
+ */
+GByteArray *rtp_buffer_flatten(RTP_Buffer *buffer, size_t headroom)
+{
+    const size_t packet_size = rtp_buffer_len(buffer);
+    GByteArray *outbuf = output_pool_array(headroom + packet_size);
+
+    outbuf->len = headroom + packet_size;
+
+    memcpy(outbuf->data + headroom, buffer->header, RTP_HEADER_SIZE);
+    memcpy(outbuf->data + headroom + RTP_HEADER_SIZE,
+           buffer->payload->data, buffer->payload->data_size);
+
+    rtp_buffer_free(buffer);
+
+    return outbuf;
+}
 
-    outbuf->len = packet_size;
+/**
+ * @brief Fill in the fixed RTP header for a buffer
+ *
+ * @param header The area to write the header to, @ref RTP_HEADER_SIZE
+ *               bytes long
+ * @param tr The track the buffer comes from
+ * @param buffer The buffer to send
+ * @param timestamp The RTP timestamp to use (in local endianess)
+ * @param ssrc The synchronisation source identifier to use
+ */
+void rtp_header_fill(uint8_t *header, Track *tr,
+                     struct MParserBuffer *buffer,
+                     uint32_t timestamp, uint32_t ssrc)
+{
+    RTP_packet *packet = (RTP_packet*)header;
 
     packet->version = 2;
     packet->padding = 0;
@@ -247,20 +422,88 @@ static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer)
     packet->payload = tr->payload_type & 0x7f;
     packet->seq_no = htons(buffer->seq_no);
     packet->timestamp = htonl(timestamp);
-    packet->ssrc = htonl(session->ssrc);
+    packet->ssrc = htonl(ssrc);
+
+    fnc_log(FNC_LOG_VERBOSE, "[RTP] Timestamp: %u", timestamp);
+}
+
+/**
+ * @brief Send the actual buffer as an RTP packet to the client
+ *
+ * @param session The RTP session to send the packet for
+ * @param buffer The data for the packet to be sent
+ * @param scheduled The time the packet is due, on the clock of the
+ *                  client's loop
+ *
+ * The payload is not copied: the packet only references @p buffer,
+ * and the transport will send it together with the header.
+ */
+static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer,
+                            double scheduled)
+{
+    RTP_Buffer *outbuf = output_pool_rtp();
+    Track *tr = session->track;
+    uint32_t timestamp = rtptime(session, tr->clock_rate, buffer);
 
-    fnc_log(FNC_LOG_VERBOSE, "[RTP] Timestamp: %u", ntohl(timestamp));
+    rtp_header_fill(outbuf->header, tr, buffer, timestamp, session->ssrc);
+    ((RTP_packet*)outbuf->header)->seq_no =
+        htons((uint16_t)(buffer->seq_no - session->thinned));
 
-    memcpy(packet->data, buffer->data, buffer->data_size);
+    outbuf->payload = mparser_buffer_ref(buffer);
+    outbuf->scheduled = scheduled;
 
     if (session->send_rtp(session, outbuf)) {
         session->last_timestamp = buffer->timestamp;
         session->pkt_count++;
         session->octet_count += buffer->data_size;
 
-        session->last_packet_send_time = time(NULL);
+        session->last_packet_send_time = scheduled;
+        metrics_count(METRIC_RTP_PACKETS, 1);
+        trace_send(session, buffer, scheduled);
     } else {
         fnc_log(FNC_LOG_DEBUG, "RTP Packet Lost");
+        metrics_count(METRIC_RTP_PACKETS_FAILED, 1);
+    }
+}
+
+/**
+ * @brief Tell whether a packet can be left out while thinning
+ *
+ * Only H.264 says so, with the NRI field of the NAL header (or of the
+ * FU or STAP indicator, which carries the highest NRI of its NALs):
+ * zero means no other frame refers to this one.
+ */
+static gboolean rtp_packet_droppable(RTP_session *session,
+                                     struct MParserBuffer *buffer)
+{
+    Track *tr = session->track;
+
+    return tr->media_type == MP_video &&
+        buffer->data_size >= 1 &&
+        g_ascii_strcasecmp(tr->encoding_name, "H264") == 0 &&
+        (buffer->data[0] & 0x60) == 0;
+}
+
+/**
+ * @brief Default rate adaptation hook
+ *
+ * Starts thinning the stream when the reported loss goes past the
+ * session's threshold, and stops once it falls below half of it, so
+ * that it does not flip at each report.
+ */
+static void rtp_adapt_loss(RTP_session *session,
+                           const RTP_ReceiverStats *stats)
+{
+    if ( !session->thinning &&
+         stats->fraction_lost > session->loss_threshold ) {
+        session->thinning = true;
+        fnc_log(FNC_LOG_INFO, "[%s] %.1f%% loss, thinning the stream",
+                session->track->encoding_name, stats->fraction_lost * 100);
+    } else if ( session->thinning &&
+                stats->fraction_lost < session->loss_threshold / 2 ) {
+        session->thinning = false;
+        fnc_log(FNC_LOG_INFO, "[%s] %.1f%% loss, no more thinning",
+                session->track->encoding_name, stats->fraction_lost * 100);
     }
 }
 
@@ -270,6 +513,15 @@ static void rtp_packet_send(RTP_session *session, struct MParserBuffer *buffer)
  * @param loop eventloop
  * @param w contains the session the RTP session for which to send the packets
  * @todo implement a saner ratecontrol
+ *
+ * All the packets whose delivery time has already come are sent in a
+ * single run, up to @ref cfg_options_t::rtp_burst of them, so that
+ * the fragments of a frame don't cost one wakeup each; the transport
+ * is flushed once at the end of the run.
+ *
+ * When the transport paces the packets itself, those due within the
+ * session's @ref RTP_session::pacing_lookahead are handed to it as
+ * well, carrying their delivery time.
  */
 static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
                          ATTR_UNUSED int revents)
@@ -278,20 +530,11 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
     Resource *resource = session->track->parent;
     struct MParserBuffer *buffer = NULL;
     ev_tstamp next_time = w->offset;
+    const ev_tstamp now = ev_now(loop);
+    guint sent = 0;
 
-    /* If there is no buffer, it means that either the producer
-     * has been stopped (as we reached the end of stream) or that
-     * there is no data for the consumer to read. If that's the
-     * case we just give control back to the main loop for now.
-     */
-    if ( bq_consumer_stopped(session) ) {
-        /* If the producer has been stopped, we send the
-         * finishing packets and go away.
-         */
-        fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
-        rtcp_send_sr(session, BYE);
-        return;
-    }
+    /* the writer is scheduled at the delivery time of its next packet */
+    metrics_observe(METRIC_SEND_LATENESS, now - w->offset);
 
     /* Check whether we have enough extra frames to send. If we have
      * no extra frames we have a problem, since we're going to send
@@ -303,66 +546,116 @@ static void rtp_write_cb(struct ev_loop *loop, ev_periodic *w,
             session->track->encoding_name,
             bq_consumer_unseen(session));
 
-    /* Get the current buffer, if there is enough data */
-    if ( !(buffer = bq_consumer_get(session)) ) {
-        /* We wait a bit of time to get the data but before it is
-         * expired.
-         */
-        double sleep_for = 0.1;
+    /* A live session too far behind jumps to the newest keyframe
+     * rather than sending stale packets. */
+    if ( session->max_lag > 0 &&
+         resource->source == LIVE_SOURCE &&
+         bq_consumer_buffered(session) > session->max_lag &&
+         bq_consumer_skip(session) ) {
+        session->lag_skips++;
+        session->catching_up = false;
+        next_time = now;
+        fnc_log(FNC_LOG_INFO,
+                "[%s] more than %.1fs behind, skipped to keyframe (%u skips)",
+                session->track->encoding_name, session->max_lag,
+                session->lag_skips);
+    }
 
-        if (resource->eor) {
+    do {
+        /* If there is no buffer, it means that either the producer
+         * has been stopped (as we reached the end of stream) or that
+         * there is no data for the consumer to read. If that's the
+         * case we just give control back to the main loop for now.
+         */
+        if ( bq_consumer_stopped(session) ) {
+            /* If the producer has been stopped, we send the
+             * finishing packets and go away.
+             */
             fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
             rtcp_send_sr(session, BYE);
             return;
         }
 
-        if (session->track->frame_duration > 0)
-            sleep_for = session->track->frame_duration; // assumed to be enough
-
-        next_time += sleep_for;
-        fnc_log(FNC_LOG_INFO, "[%s] nothing to read, waiting %f...",
-                session->track->encoding_name, sleep_for);
-    } else {
-        struct MParserBuffer *next;
-        double delivery  = buffer->delivery;
-        double timestamp = buffer->timestamp;
-        double duration  = buffer->duration;
-        gboolean marker  = buffer->marker;
-
-        rtp_packet_send(session, buffer);
-
-        if (session->pkt_count % 29 == 1)
-            rtcp_send_sr(session, SDES);
-
-        if (bq_consumer_move(session)) {
-            next = bq_consumer_get(session);
-            if(delivery != next->delivery) {
-                if (session->track->parent->source == LIVE_SOURCE)
-                    next_time += next->delivery - delivery;
-                else
-                    next_time = session->range->playback_time -
-                                session->range->begin_time +
-                                next->delivery;
+        /* Get the current buffer, if there is enough data */
+        if ( !(buffer = bq_consumer_get(session)) ) {
+            /* We wait a bit of time to get the data but before it is
+             * expired.
+             */
+            double sleep_for = 0.1;
+
+            if (resource->eor) {
+                fnc_log(FNC_LOG_INFO, "[rtp] Stream Finished");
+                rtcp_send_sr(session, BYE);
+                return;
             }
-        } else {
-            /* Wait a bit of time to recover from buffer underrun */
-            double sleep_for = duration ? duration : 0.1;
+
+            if (session->track->frame_duration > 0)
+                sleep_for = session->track->frame_duration; // assumed to be enough
 
             next_time += sleep_for;
-            fnc_log(FNC_LOG_INFO, "[%s] next packet not available, waiting %f...",
+            fnc_log(FNC_LOG_INFO, "[%s] nothing to read, waiting %f...",
                     session->track->encoding_name, sleep_for);
+            break;
+        } else {
+            struct MParserBuffer *next;
+            double delivery  = buffer->delivery;
+            double timestamp = buffer->timestamp;
+            double duration  = buffer->duration;
+            gboolean marker  = buffer->marker;
+
+            if ( session->thinning &&
+                 rtp_packet_droppable(session, buffer) )
+                session->thinned++;
+            else {
+                rtp_packet_send(session, buffer, next_time);
+                sent++;
+
+                if ( !ev_is_active(&session->rtcp.timer) )
+                    rtcp_schedule(session);
+            }
+
+            if (bq_consumer_move(session)) {
+                next = bq_consumer_get(session);
+                if(delivery != next->delivery) {
+                    if (session->track->parent->source == LIVE_SOURCE)
+                        next_time += (next->delivery - delivery) /
+                            (session->catching_up ? LIVE_CATCHUP_SPEED : 1);
+                    else
+                        next_time = session->range->playback_time -
+                                    session->range->begin_time +
+                                    next->delivery -
+                                    rtp_fast_start_gained(session, next->delivery);
+                }
+            } else {
+                /* Wait a bit of time to recover from buffer underrun */
+                double sleep_for = duration ? duration : 0.1;
+
+                /* reached the live edge */
+                session->catching_up = false;
+
+                next_time += sleep_for;
+                fnc_log(FNC_LOG_INFO, "[%s] next packet not available, waiting %f...",
+                        session->track->encoding_name, sleep_for);
+                buffer = NULL;
+            }
+
+            fnc_log(FNC_LOG_VERBOSE,
+                "[%s] Now: %5.4f, cur %5.4f[%5.4f][%5.4f], next %5.4f %s\n",
+                session->track->encoding_name,
+                now - session->range->playback_time,
+                delivery,
+                timestamp,
+                duration,
+                next_time - session->range->playback_time,
+                marker? "M" : " ");
         }
+    } while ( buffer != NULL &&
+              next_time <= now + session->pacing_lookahead &&
+              sent < feng_srv.rtp_burst );
+
+    if ( session->flush_transport )
+        session->flush_transport(session);
 
-        fnc_log(FNC_LOG_VERBOSE,
-            "[%s] Now: %5.4f, cur %5.4f[%5.4f][%5.4f], next %5.4f %s\n",
-            session->track->encoding_name,
-            ev_now(loop) - session->range->playback_time,
-            delivery,
-            timestamp,
-            duration,
-            next_time - session->range->playback_time,
-            marker? "M" : " ");
-    }
     ev_periodic_set(w, next_time, 0, NULL);
     ev_periodic_again(loop, w);
 
@@ -399,6 +692,14 @@ RTP_session *rtp_session_new(RTSP_Client *rtsp,
     periodic = &rtp_s->rtp_writer;
 
     rtp_s->ssrc = g_random_int();
+    rtp_s->track = tr;
+    rtp_s->client = rtsp;
+    rtp_s->node = rtsp_client_node(rtsp);
+    rtp_s->max_lag = rtsp->vhost->live_max_lag / 1000.0;
+    rtp_s->receiver.rtt = -1;
+    rtp_s->loss_threshold = rtsp->vhost->loss_thinning_threshold / 100.0;
+    if ( rtp_s->loss_threshold > 0 )
+        rtp_s->on_report = rtp_adapt_loss;
 
     do {
         struct ParsedTransport *transport = transports->data;
@@ -424,15 +725,12 @@ RTP_session *rtp_session_new(RTSP_Client *rtsp,
 
     rtp_s->uri = g_strdup(uri);
     rtp_s->start_rtptime = g_random_int();
-    rtp_s->track = tr;
-    rtp_s->client = rtsp;
 
-    /* Make sure we don't overflow the consumers count; while this
-     * case is most likely just hypothetical, it doesn't hurt to be
-     * safe.
-     */
-    g_assert_cmpuint(tr->consumers, <, G_MAXULONG);
-    g_atomic_int_add(&tr->consumers, 1);
+    /* multicast sessions don't read from the track themselves */
+    if ( rtp_s->multicast == NULL ) {
+        bq_consumer_new(rtp_s);
+        affinity_track_consumer(tr, rtp_s->node, 1);
+    }
 
     periodic->data = rtp_s;
     ev_periodic_init(periodic, rtp_write_cb, 0, 0, NULL);
@@ -45,11 +45,114 @@ struct RTSP_session;
 struct RTP_session;
 
 #define RTP_DEFAULT_PORT 5004
-#define BUFFERED_FRAMES_DEFAULT 16
+#define BUFFERED_FRAMES_DEFAULT 4096
 #define RTP_DEFAULT_MTU 1500
 
-typedef gboolean (*rtp_send_cb)(struct RTP_session *client, GByteArray *data);
+/**
+ * @brief Size of the fixed RTP header (no CSRC, no extensions)
+ */
+#define RTP_HEADER_SIZE 12
+
+/**
+ * @brief Size of the space reserved for the transport's framing
+ *
+ * This is the size of the '$'-prefixed preamble of RTSP interleaved
+ * packets (RFC 2326 Section 10.12).
+ */
+#define RTP_PREAMBLE_SIZE 4
+
+/**
+ * @brief How much faster than realtime a live session catches up
+ *
+ * Used while a session joining a live track sends the GOP cache (see
+ * @ref Track::gop), until it reaches the live edge.
+ */
+#define LIVE_CATCHUP_SPEED 4
+
+struct MParserBuffer;
+
+/**
+ * @brief RTP packet ready to be sent by a transport
+ *
+ * The payload is never copied into the packet: the packet holds a
+ * reference to the parser's buffer, so that the same payload can be
+ * shared among all the sessions reading from the same track, while
+ * each of them only writes its own header. Transports are expected
+ * to send the two parts with a single scatter/gather call, or
+ * flatten them with @ref rtp_buffer_flatten if they can't.
+ */
+typedef struct RTP_Buffer {
+    /**
+     * @brief Framing of the transport, right before the header
+     *
+     * Since the two are contiguous, transports that need framing
+     * (interleaved) can send preamble and header as a single iovec
+     * entry, starting from here rather than from @ref
+     * RTP_Buffer::header.
+     */
+    uint8_t preamble[RTP_PREAMBLE_SIZE];
+    uint8_t header[RTP_HEADER_SIZE];
+    struct MParserBuffer *payload;
+    /** Time the packet is due, on the clock of the client's loop */
+    double scheduled;
+} RTP_Buffer;
+
+size_t rtp_buffer_len(const RTP_Buffer *buffer);
+GByteArray *rtp_buffer_flatten(RTP_Buffer *buffer, size_t headroom);
+void rtp_buffer_free(RTP_Buffer *buffer);
+
+/**
+ * @addtogroup output_pool
+ * @{
+ */
+void output_pool_init();
+void output_pool_attach();
+GByteArray *output_pool_array(guint reserve);
+void output_pool_array_free(GByteArray *array);
+RTP_Buffer *output_pool_rtp();
+void output_pool_rtp_free(RTP_Buffer *buffer);
+GString *output_pool_string(gsize reserve);
+void output_pool_string_free(GString *string);
+/**
+ * @}
+ */
+
+typedef gboolean (*rtp_send_buffer_cb)(struct RTP_session *client, RTP_Buffer *buffer);
+/** The data is only borrowed for the duration of the call */
+typedef gboolean (*rtp_send_cb)(struct RTP_session *client, const GByteArray *data);
 typedef void (*rtp_close_cb)(struct RTP_session *rtp);
+typedef void (*rtp_flush_cb)(struct RTP_session *rtp);
+typedef gboolean (*rtp_move_cb)(struct RTP_session *rtp, struct RTSP_Client *client);
+
+/**
+ * @brief Reception statistics of a session, from its RTCP reports
+ *
+ * Updated by @ref rtcp_handle with each report block the client
+ * sends about the session's SSRC (RFC 3550 Section 6.4.1).
+ */
+typedef struct RTP_ReceiverStats {
+    /** Number of report blocks received */
+    guint reports;
+    /** Fraction of packets lost since the previous report, 0 to 1 */
+    double fraction_lost;
+    /** Packets lost since the beginning of the reception */
+    int32_t cumulative_lost;
+    /** Extended highest sequence number received */
+    uint32_t highest_seq;
+    /** Interarrival jitter, in seconds */
+    double jitter;
+    /** Round-trip time, in seconds; negative until known */
+    double rtt;
+} RTP_ReceiverStats;
+
+/**
+ * @brief Called after each report block updates @ref RTP_session::receiver
+ *
+ * This is where the session's sending can be adapted to the
+ * conditions of the path, see @ref RTP_session::thinning.
+ */
+typedef void (*rtp_report_cb)(struct RTP_session *rtp,
+                              const RTP_ReceiverStats *stats);
 
 typedef struct RTP_session {
     uint32_t start_rtptime;
@@ -98,17 +201,178 @@ typedef struct RTP_session {
      */
     uint16_t last_element_serial;
 
+    /**
+     * @brief Buffers of the live GOP cache still to be sent
+     *
+     * Taken from @ref Track::gop when the consumer joins the track,
+     * and served before the track's queue; NULL once sent.
+     */
+    GQueue *gop_burst;
+
+    /**
+     * @brief The session is behind the live edge
+     *
+     * Set while the session sends the GOP cache, and the packets
+     * queued meanwhile, faster than realtime; reset once it reaches
+     * the last packet written.
+     */
+    gboolean catching_up;
+
+    /**
+     * @brief Most seconds a live session can be behind the track
+     *
+     * Past this, the session skips to the newest keyframe queued; see
+     * @ref bq_consumer_skip. Zero for no limit.
+     */
+    double max_lag;
+
+    /** @brief Times the session skipped ahead because of @ref max_lag */
+    guint lag_skips;
+
+    /**
+     * @brief Fast start of a stored resource
+     *
+     * The first @c window seconds after PLAY are sent @c speed times
+     * faster than realtime, so that the client's buffer fills up
+     * right away; the session then stays @c lead seconds ahead of the
+     * realtime schedule, and the demuxer keeps as much more queued
+     * for it. All zero when the session starts at realtime.
+     *
+     * @see cfg_vhost_t::fast_start
+     */
+    struct {
+        double window;
+        double speed;
+        double lead;
+    } fast_start;
+
+    /**
+     * @brief Bandwidth the session is charged with, in kbit/s
+     *
+     * See @ref rtp_admission_reserve; updated with the rate measured
+     * at each sender report.
+     */
+    int admitted_kbps;
+
+    /**
+     * @brief NUMA node of the loop the session was set up on, or -1
+     *
+     * The session is counted there among the track's consumers, see
+     * @ref affinity_track_consumer.
+     */
+    int node;
+
+    /** @brief Statistics reported by the client's RTCP */
+    RTP_ReceiverStats receiver;
+
+    /** @brief Rate adaptation hook, may be NULL */
+    rtp_report_cb on_report;
+
+    /**
+     * @brief Fraction of lost packets past which to thin the stream
+     *
+     * Zero to never thin; see @ref thinning.
+     */
+    double loss_threshold;
+
+    /**
+     * @brief Non-reference frames are not being sent
+     *
+     * Set by the default @ref on_report hook while the reported loss
+     * is above @ref loss_threshold, reset once it falls below half of
+     * it. Only H.264 tracks, whose NAL headers state whether other
+     * frames refer to them, are thinned.
+     */
+    gboolean thinning;
+
+    /**
+     * @brief Packets not sent because of @ref thinning
+     *
+     * Subtracted from the sequence numbers, so that the client does
+     * not report the packets left out as lost.
+     */
+    uint16_t thinned;
+
+#ifdef FENG_BQ_RING
+    /**
+     * @brief Position of the current element in the track's ring
+     *
+     * Written only by the consumer, read atomically by the producer
+     * to find out which slots can be reclaimed.
+     */
+    guint ring_cursor;
+
+    /**
+     * @brief Serial of the ring the cursor refers to
+     */
+    guint ring_serial;
+#endif
+
     struct RTSP_Client *client;
 
     uint32_t octet_count;
     uint32_t pkt_count;
 
-    rtp_send_cb send_rtp;
+    rtp_send_buffer_cb send_rtp;
     rtp_send_cb send_rtcp;
+
+    /**
+     * @brief Send out the packets queued by @ref RTP_session::send_rtp
+     *
+     * Transports that batch their output set this; it's called at the
+     * end of each tick of the RTP writer. May be NULL.
+     */
+    rtp_flush_cb flush_transport;
     rtp_close_cb close_transport;
 
+    /**
+     * @brief Move the transport to a different client
+     *
+     * Called with a NULL client when the session is parked (see @ref
+     * rtsp_session_park), to stop using the old client, then with the
+     * client taking the session back. NULL for transports that can't
+     * outlive their connection.
+     */
+    rtp_move_cb move_transport;
+
     ev_periodic rtp_writer;
 
+    /**
+     * @brief Scheduling of the RTCP sender reports
+     *
+     * See @ref rtcp_schedule.
+     */
+    struct {
+        /** Fires at each report, with the RFC 3550 interval */
+        ev_timer timer;
+        /**
+         * @brief Compound packet, reused for each report
+         *
+         * Transports don't take ownership of it, they copy it if
+         * they have to keep it past the send call.
+         */
+        GByteArray *buffer;
+        /** @ref buffer holds the SDES compound, only the SR is to refresh */
+        gboolean sdes_ready;
+        /** No report has been scheduled yet */
+        gboolean initial;
+        /** Average size of the reports, with UDP/IP headers */
+        double avg_size;
+        /** Time and @ref octet_count at the previous report */
+        double last_time;
+        uint32_t last_octets;
+    } rtcp;
+
+    /**
+     * @brief Multicast sender the session is attached to
+     *
+     * Sessions set up with a multicast transport don't read the
+     * track's queue nor have a writer of their own: the packets are
+     * sent to the group by the track's sender. NULL for unicast
+     * sessions.
+     */
+    struct RTP_multicast *multicast;
+
     /**
      * @brief String representing the Transport header to report
      *
@@ -123,6 +387,16 @@ typedef struct RTP_session {
      */
     char *transport_string;
 
+    /**
+     * @brief How long before their delivery the packets are handed
+     *        to the transport
+     *
+     * Zero unless the transport paces the packets itself (see @ref
+     * cfg_options_t::udp_pacing), in which case the writer wakes up
+     * once for all the packets due within this interval.
+     */
+    double pacing_lookahead;
+
     /**
      * @brief Private data for the transport
      */
@@ -130,6 +404,10 @@ typedef struct RTP_session {
         struct {
             int rtp;
             int rtcp;
+            /** the last packet queued didn't complete its frame */
+            gboolean mid_frame;
+            /** frames are being dropped until the next keyframe */
+            gboolean skip_frames;
         } tcp;
 
         struct {
@@ -141,7 +419,15 @@ typedef struct RTP_session {
             struct sockaddr *rtp_sa;
             /** RTCP remote socket address */
             struct sockaddr *rtcp_sa;
+            /** Size of the two addresses */
+            socklen_t sa_len;
             ev_io rtcp_reader;
+            /** RTP packets waiting to be sent in a batch */
+            GPtrArray *rtp_pending;
+            /** Watcher started when the RTP socket buffer is full */
+            ev_io rtp_writable;
+            /** The packets carry their launch time (SO_TXTIME) */
+            gboolean txtime;
         } udp;
 
 #if ENABLE_SCTP
@@ -194,6 +480,26 @@ gboolean rtp_interleaved_transport(struct RTSP_Client *rtsp,
 gboolean rtp_sctp_transport(struct RTSP_Client *rtsp,
                             struct RTP_session *rtp_s,
                             struct ParsedTransport *parsed);
+gboolean rtp_multicast_transport(struct RTSP_Client *rtsp,
+                                 struct RTP_session *rtp_s,
+                                 struct ParsedTransport *parsed);
+
+/**
+ * @brief Sender of a track to a multicast group
+ *
+ * @see rtp_multicast.c
+ */
+typedef struct RTP_multicast RTP_multicast;
+
+RTP_multicast *rtp_multicast_new(const char *group, int port, int ttl);
+void rtp_multicast_free(RTP_multicast *sender);
+gboolean rtp_multicast_has_viewers(RTP_multicast *sender);
+void rtp_multicast_send(RTP_multicast *sender, struct Track *tr,
+                        struct MParserBuffer *buffer);
+
+void rtp_header_fill(uint8_t *header, struct Track *tr,
+                     struct MParserBuffer *buffer,
+                     uint32_t timestamp, uint32_t ssrc);
 
 void rtsp_interleaved_register(struct RTSP_Client *rtsp,
                                struct RTP_session *rtp_s,
@@ -206,9 +512,16 @@ RTP_session *rtp_session_new(struct RTSP_Client *,
 void rtp_session_gslist_resume(GSList *, struct RTSP_Range *range);
 void rtp_session_gslist_pause(GSList *);
 void rtp_session_gslist_free(GSList *);
+void rtp_session_gslist_rebind(GSList *, struct Resource *resource);
 
 void rtp_session_handle_sending(RTP_session *session);
 
+int rtp_admission_reserve(struct cfg_vhost_t *vhost, struct Track *tr);
+void rtp_admission_release(struct cfg_vhost_t *vhost, int kbps);
+void rtp_admission_measure(RTP_session *session, double bps);
+gboolean rtp_admission_exceeded(struct cfg_vhost_t *vhost);
+int rtp_admission_committed();
+
 /**
  * @}
  */
@@ -227,6 +540,8 @@ typedef enum {
 } rtcp_pkt_type;
 
 gboolean rtcp_send_sr(RTP_session *session, rtcp_pkt_type type);
+void rtcp_schedule(RTP_session *session);
+void rtcp_unschedule(RTP_session *session);
 void rtcp_handle(RTP_session *session, uint8_t *packet, size_t len);
 
 /**
@@ -0,0 +1,189 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @defgroup rtp_admission Bandwidth admission control
+ *
+ * @brief Refuse the sessions that would exceed the egress budget
+ *
+ * Each RTP session is charged, when set up, with the bitrate expected
+ * for its track: the one measured on the sessions already sending it,
+ * if any, or the one declared by the container. The charge is added
+ * to the bandwidth committed to the session's vhost and to the whole
+ * server; if either goes past its @c max-bandwidth the session is
+ * refused with a 453 (Not Enough Bandwidth) status.
+ *
+ * Once the session sends, the charge follows the rate measured at
+ * each RTCP report (see @ref rtcp_interval), so that tracks without
+ * a declared bitrate are accounted for too, and PLAY is refused while
+ * the budget is exceeded. The counters are updated under @ref
+ * admission_lock, since sessions of different client loops share
+ * them, and read atomically.
+ *
+ * @{
+ */
+
+/** Bandwidth committed to all the sessions of the server, in kbit/s */
+static gint admission_committed;
+
+/**
+ * @brief Lock on the committed counters
+ *
+ * Held across both the check and the charge of a new session, so
+ * that concurrent setups can't see each other's charge and all be
+ * refused, or all be admitted.
+ */
+static GStaticMutex admission_lock = G_STATIC_MUTEX_INIT;
+
+static int admission_estimate(Track *tr)
+{
+    const int measured = g_atomic_int_get(&tr->measured_kbps);
+
+    if ( measured > 0 )
+        return measured;
+
+    return (tr->bitrate + 999) / 1000;
+}
+
+/* to be called with admission_lock held */
+static void admission_charge(struct cfg_vhost_t *vhost, int kbps)
+{
+    g_atomic_int_add(&vhost->committed_kbps, kbps);
+    g_atomic_int_add(&admission_committed, kbps);
+    metrics_gauge_add(METRIC_COMMITTED_BANDWIDTH, kbps);
+}
+
+static void admission_add(struct cfg_vhost_t *vhost, int kbps)
+{
+    g_static_mutex_lock(&admission_lock);
+    admission_charge(vhost, kbps);
+    g_static_mutex_unlock(&admission_lock);
+}
+
+static gboolean admission_exceeded(int committed, unsigned int budget_mbps)
+{
+    return budget_mbps != 0 && committed > (gint64)budget_mbps * 1000;
+}
+
+/**
+ * @brief Charge a new session with the bitrate of its track
+ *
+ * @param vhost The vhost the session is set up on
+ * @param tr The track the session is going to send
+ *
+ * @return The bandwidth charged, in kbit/s, to be released with @ref
+ *         rtp_admission_release; -1 if the session would exceed the
+ *         budget of the vhost or of the server, in which case nothing
+ *         is charged.
+ */
+int rtp_admission_reserve(struct cfg_vhost_t *vhost, Track *tr)
+{
+    const int kbps = admission_estimate(tr);
+    int vhost_committed, committed;
+
+    g_static_mutex_lock(&admission_lock);
+
+    vhost_committed = g_atomic_int_get(&vhost->committed_kbps);
+    committed = g_atomic_int_get(&admission_committed);
+
+    if ( admission_exceeded(vhost_committed + kbps, vhost->max_bandwidth) ||
+         admission_exceeded(committed + kbps, feng_srv.max_bandwidth) ) {
+        g_static_mutex_unlock(&admission_lock);
+        fnc_log(FNC_LOG_INFO, "[admission] refusing %d kbit/s for %s: "
+                "%d kbit/s committed to the host, %d to the server",
+                kbps, tr->name, vhost_committed, committed);
+        return -1;
+    }
+
+    admission_charge(vhost, kbps);
+
+    g_static_mutex_unlock(&admission_lock);
+
+    return kbps;
+}
+
+/**
+ * @brief Give back the bandwidth charged by @ref rtp_admission_reserve
+ */
+void rtp_admission_release(struct cfg_vhost_t *vhost, int kbps)
+{
+    if ( kbps != 0 )
+        admission_add(vhost, -kbps);
+}
+
+/**
+ * @brief Update the charge of a session with its measured rate
+ *
+ * @param session The session that sent
+ * @param bps The payload rate sent since the previous report, in
+ *            bytes per second
+ *
+ * The rate also becomes the estimate for the next sessions of the
+ * same track.
+ */
+void rtp_admission_measure(RTP_session *session, double bps)
+{
+    const int kbps = (int)(((gint64)(bps * 8) + 999) / 1000);
+    const int delta = kbps - session->admitted_kbps;
+
+    g_atomic_int_set(&session->track->measured_kbps, kbps);
+
+    if ( delta != 0 ) {
+        admission_add(session->client->vhost, delta);
+        session->admitted_kbps = kbps;
+    }
+}
+
+/**
+ * @brief Check whether the bandwidth committed exceeds the budget
+ *
+ * @param vhost The vhost to check, along with the whole server
+ */
+gboolean rtp_admission_exceeded(struct cfg_vhost_t *vhost)
+{
+    return admission_exceeded(g_atomic_int_get(&vhost->committed_kbps),
+                              vhost->max_bandwidth) ||
+        admission_exceeded(g_atomic_int_get(&admission_committed),
+                           feng_srv.max_bandwidth);
+}
+
+/**
+ * @brief Get the bandwidth committed to all the sessions, in kbit/s
+ */
+int rtp_admission_committed()
+{
+    return g_atomic_int_get(&admission_committed);
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,297 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @defgroup rtp_multicast Multicast delivery
+ *
+ * @brief Send a live track once to a multicast group
+ *
+ * Live resources can have a multicast group configured for each of
+ * their tracks; in that case the track owns a single sender, fed
+ * directly by the thread reading the track from its producer, that
+ * sends each packet once to the group.
+ *
+ * Clients asking for a multicast transport in SETUP are simply
+ * attached to the sender and told the group to join; their RTP
+ * sessions have no writer of their own, so that the server's egress
+ * for the track doesn't depend on the amount of viewers.
+ *
+ * @{
+ */
+
+struct RTP_multicast {
+    /** Socket connected to the group's RTP port */
+    int sd;
+
+    uint32_t ssrc;
+    uint32_t start_rtptime;
+
+    /** Numeric address of the group, as reported to the clients */
+    char *group;
+    int port;
+    int ttl;
+
+    /** Amount of RTP sessions attached to the sender */
+    gint viewers;
+};
+
+/**
+ * @brief Create a new multicast sender
+ *
+ * @param group The numeric address of the multicast group
+ * @param port The RTP port to send to; RTCP is on the following one
+ * @param ttl The time-to-live (or hop limit) for the packets
+ *
+ * @return A new sender, or NULL if @p group is not a valid multicast
+ *         address or the socket couldn't be set up.
+ */
+RTP_multicast *rtp_multicast_new(const char *group, int port, int ttl)
+{
+    RTP_multicast *sender;
+    struct addrinfo hints, *res = NULL;
+    char port_str[8];
+    gboolean is_multicast = false;
+    int sd = -1;
+    int gai_error;
+
+    if ( port <= 0 || port >= 65535 || ttl <= 0 || ttl > 255 ) {
+        fnc_log(FNC_LOG_ERR, "[multicast] invalid port %d or ttl %d for %s",
+                port, ttl, group);
+        return NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    if ( (gai_error = getaddrinfo(group, port_str, &hints, &res)) != 0 ) {
+        fnc_log(FNC_LOG_ERR, "[multicast] invalid group '%s': %s",
+                group, gai_strerror(gai_error));
+        return NULL;
+    }
+
+    switch ( res->ai_family ) {
+    case AF_INET:
+        is_multicast =
+            IN_MULTICAST(ntohl(((struct sockaddr_in*)res->ai_addr)->sin_addr.s_addr));
+        break;
+    case AF_INET6:
+        is_multicast =
+            IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6*)res->ai_addr)->sin6_addr);
+        break;
+    }
+
+    if ( !is_multicast ) {
+        fnc_log(FNC_LOG_ERR, "[multicast] '%s' is not a multicast address",
+                group);
+        goto error;
+    }
+
+    if ( (sd = socket(res->ai_family, SOCK_DGRAM, 0)) < 0 ) {
+        fnc_perror("socket");
+        goto error;
+    }
+
+    if ( res->ai_family == AF_INET6 ) {
+        if ( setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+                        &ttl, sizeof(ttl)) < 0 ) {
+            fnc_perror("setsockopt IPV6_MULTICAST_HOPS");
+            goto error;
+        }
+    } else {
+        const unsigned char ttl_byte = ttl;
+        if ( setsockopt(sd, IPPROTO_IP, IP_MULTICAST_TTL,
+                        &ttl_byte, sizeof(ttl_byte)) < 0 ) {
+            fnc_perror("setsockopt IP_MULTICAST_TTL");
+            goto error;
+        }
+    }
+
+    /* never block the thread reading from the producer */
+    if ( fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0 ) {
+        fnc_perror("fcntl");
+        goto error;
+    }
+
+    if ( connect(sd, res->ai_addr, res->ai_addrlen) < 0 ) {
+        fnc_perror("connect");
+        goto error;
+    }
+
+    freeaddrinfo(res);
+
+    sender = g_slice_new0(RTP_multicast);
+    sender->sd = sd;
+    sender->ssrc = g_random_int();
+    sender->start_rtptime = g_random_int();
+    sender->group = g_strdup(group);
+    sender->port = port;
+    sender->ttl = ttl;
+
+    return sender;
+
+ error:
+    if ( sd >= 0 )
+        close(sd);
+    freeaddrinfo(res);
+    return NULL;
+}
+
+/**
+ * @brief Destroy a multicast sender
+ *
+ * @param sender The sender to destroy; no session should be attached
+ *               to it anymore.
+ */
+void rtp_multicast_free(RTP_multicast *sender)
+{
+    if ( sender == NULL )
+        return;
+
+    close(sender->sd);
+    g_free(sender->group);
+    g_slice_free(RTP_multicast, sender);
+}
+
+/**
+ * @brief Tells whether any session is attached to the sender
+ *
+ * Used by the producer to avoid sending to groups nobody asked for.
+ */
+gboolean rtp_multicast_has_viewers(RTP_multicast *sender)
+{
+    return g_atomic_int_get(&sender->viewers) > 0;
+}
+
+/**
+ * @brief Send a buffer to the multicast group
+ *
+ * @param sender The sender to use
+ * @param tr The track the buffer belongs to
+ * @param buffer The buffer to send; it's not consumed.
+ *
+ * @note This has to be called by the only thread producing @p tr.
+ */
+void rtp_multicast_send(RTP_multicast *sender, Track *tr,
+                        struct MParserBuffer *buffer)
+{
+    uint8_t header[RTP_HEADER_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    const uint32_t timestamp = sender->start_rtptime +
+        (uint32_t)(buffer->timestamp * tr->clock_rate);
+
+    rtp_header_fill(header, tr, buffer, timestamp, sender->ssrc);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = RTP_HEADER_SIZE;
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = buffer->data_size;
+
+    if ( sendmsg(sender->sd, &msg, 0) < 0 && errno != EAGAIN )
+        fnc_perror("sendmsg");
+}
+
+static gboolean rtp_multicast_send_rtcp(ATTR_UNUSED RTP_session *rtp,
+                                        ATTR_UNUSED const GByteArray *buffer)
+{
+    /* the viewers' RTCP is not sent on the group */
+    return false;
+}
+
+static void rtp_multicast_close_transport(RTP_session *rtp)
+{
+    g_atomic_int_add(&rtp->multicast->viewers, -1);
+}
+
+/** The group doesn't depend on the client's connection */
+static gboolean rtp_multicast_move_transport(ATTR_UNUSED RTP_session *rtp,
+                                             ATTR_UNUSED RTSP_Client *client)
+{
+    return true;
+}
+
+/**
+ * @brief Attach a new RTP session to the multicast sender of its track
+ *
+ * @param rtsp The client requesting the session
+ * @param rtp_s The session to attach
+ * @param parsed The transport requested by the client; its
+ *               parameters are ignored, the configured group is
+ *               always used.
+ *
+ * @retval false The track has no multicast sender.
+ */
+gboolean rtp_multicast_transport(ATTR_UNUSED RTSP_Client *rtsp,
+                                 RTP_session *rtp_s,
+                                 ATTR_UNUSED struct ParsedTransport *parsed)
+{
+    Track *tr = rtp_s->track;
+    RTP_multicast *sender;
+
+    if ( tr->parent->source != LIVE_SOURCE ||
+         (sender = tr->live.multicast) == NULL )
+        return false;
+
+    rtp_s->multicast = sender;
+    rtp_s->ssrc = sender->ssrc;
+
+    rtp_s->send_rtcp = rtp_multicast_send_rtcp;
+    rtp_s->close_transport = rtp_multicast_close_transport;
+    rtp_s->move_transport = rtp_multicast_move_transport;
+
+    g_atomic_int_inc(&sender->viewers);
+
+    rtp_s->transport_string = g_strdup_printf("RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d;ssrc=%08X",
+                                              sender->group,
+                                              sender->port,
+                                              sender->port + 1,
+                                              sender->ttl,
+                                              sender->ssrc);
+
+    return true;
+}
+
+/**
+ * @}
+ */
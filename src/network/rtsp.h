@@ -31,8 +31,10 @@
 #include <ev.h>
 
 #include "rfc822proto.h"
+#include "metrics.h"
 
 struct Resource;
+struct MParserSettings;
 struct cfg_socket_t;
 struct cfg_vhost_t;
 
@@ -44,6 +46,9 @@ struct cfg_vhost_t;
 #define RTSP_RESERVED 4096
 #define RTSP_BUFFERSIZE (65536 + RTSP_RESERVED)
 
+/** Most data read from an RTSP socket in a single call */
+#define RTSP_READ_SIZE 4096
+
 /**
  * @brief RTSP server states
  *
@@ -102,12 +107,40 @@ typedef struct RTSP_Range {
 
     /** Real-time timestamp when to start the playback */
     double playback_time;
+
+    /** Speed to play at, negative backward (see @ref r_set_scale) */
+    double scale;
+
+    /**
+     * @brief Wall clock time a live playback was paused at, 0 if none
+     *
+     * Converted to a position in the time-shift recording by the
+     * next PLAY, see @ref timeshift_position.
+     */
+    double paused_at;
 } RTSP_Range;
 
 struct RTSP_Client;
 struct HTTP_Tunnel_Pair;
+struct RTP_Buffer;
 
 typedef void (*rtsp_write_data)(struct RTSP_Client *client, GByteArray *data);
+typedef void (*rtsp_write_rtp)(struct RTSP_Client *client, struct RTP_Buffer *buffer);
+
+/**
+ * @brief Element of the output queue of a client
+ *
+ * Only one of the two pointers is set: RTSP responses and RTCP
+ * packets are queued as plain data, while interleaved RTP packets are
+ * queued as they are, so that their payload can be shared with all
+ * the other clients reading the same track.
+ */
+typedef struct RTSP_Outbuf {
+    /** Plain data to send */
+    GByteArray *data;
+    /** RTP packet, with the interleaved preamble already filled in */
+    struct RTP_Buffer *rtp;
+} RTSP_Outbuf;
 
 typedef struct RTSP_Client {
     /**
@@ -139,6 +172,15 @@ typedef struct RTSP_Client {
      */
     GByteArray *input;
 
+    /**
+     * @brief Bytes of @ref RTSP_Client::input already looked through
+     *
+     * The request line and the headers are only parsed once they are
+     * complete; this keeps where the search for their end stopped, so
+     * that the following reads only look through the new data.
+     */
+    size_t input_scanned;
+
     /**
      * @brief Current request being parsed
      *
@@ -149,6 +191,24 @@ typedef struct RTSP_Client {
 
     GQueue *out_queue;
 
+    /**
+     * @brief Amount of bytes waiting in @ref out_queue
+     */
+    size_t out_queue_bytes;
+
+    /**
+     * @brief Bytes of the oldest element of @ref out_queue already sent
+     */
+    size_t out_offset;
+
+    /**
+     * @brief Messages waiting to be sent on an SCTP association
+     *
+     * Used instead of @ref out_queue by SCTP clients, whose bytes are
+     * counted in @ref out_queue_bytes all the same.
+     */
+    GPtrArray *sctp_pending;
+
     /**
      * @brief Hash table for interleaved and SCTP channels
      */
@@ -160,15 +220,46 @@ typedef struct RTSP_Client {
 
     rtsp_write_data write_data;
 
+    /**
+     * @brief Queue an interleaved RTP packet for sending
+     *
+     * May be NULL, in which case the packet is copied and sent
+     * through @ref RTSP_Client::write_data.
+     */
+    rtsp_write_rtp write_rtp;
+
     struct HTTP_Tunnel_Pair *pair;
 
     //Events
+    /**
+     * @brief Worker loop the client is assigned to
+     *
+     * Set to NULL once the client has been detached from the server.
+     */
+    struct client_loop *worker;
+
+    /**
+     * @brief Event loop of @ref RTSP_Client::worker
+     */
     struct ev_loop *loop;
 
     ev_timer ev_timeout;
 
+    ev_io ev_io_read;
     ev_io ev_io_write;
 
+    /**
+     * @brief Signal used to request the disconnection of the client
+     *
+     * @see rtsp_client_disconnect()
+     */
+    ev_async ev_sig_disconnect;
+
+    /**
+     * @brief Disconnect the client as soon as the output queue is empty
+     */
+    gboolean close_on_flush;
+
     struct cfg_vhost_t *vhost;
 
     /**
@@ -185,6 +276,19 @@ typedef struct RTSP_Client {
     socklen_t sa_len;
     struct sockaddr *local_sa;
     struct sockaddr *peer_sa;
+
+    /**
+     * @brief Resource opened by the last DESCRIBE, kept for SETUP
+     *
+     * @see rtsp_described_take
+     */
+    struct Resource *described;
+
+    /** @brief Path @ref described was opened with */
+    gchar *described_path;
+
+    /** @brief Time after which @ref described is not used anymore */
+    ev_tstamp described_expiry;
 #ifdef HAVE_JSON //stats
     char *user_agent;
     size_t bytes_read;
@@ -205,6 +309,7 @@ void rtsp_client_incoming_cb(struct ev_loop *loop, ev_io *w, int revents);
 
 void RTSP_handler(RTSP_Client * rtsp);
 gboolean rtsp_process_complete(RTSP_Client *rtsp);
+gboolean rtsp_input_complete(RTSP_Client *rtsp, gboolean headers);
 
 /**
  * RTSP high level functions, mapping to the actual RTSP methods
@@ -248,25 +353,56 @@ gboolean rtsp_check_invalid_state(RTSP_Client *client,
                                   RTSP_Server_State invalid_state);
 
 gboolean rtsp_connection_limit(RTSP_Client *rtsp, RFC822_Request *req);
+void rtsp_redirect(RTSP_Client *rtsp, RFC822_Request *req, const char *host);
 
 #ifdef ENABLE_SCTP
 void rtsp_sctp_send_rtsp(RTSP_Client *client, GByteArray *data);
 void rtsp_sctp_read_cb(struct ev_loop *, ev_io *, int);
+void rtsp_sctp_write_cb(struct ev_loop *, ev_io *, int);
+void rtsp_sctp_free(RTSP_Client *client);
 #endif
 
 void rtsp_tcp_read_cb(struct ev_loop *, ev_io *, int);
 void rtsp_write_data_queue(RTSP_Client *client, GByteArray *data);
+void rtsp_write_rtp_queue(RTSP_Client *client, struct RTP_Buffer *buffer);
+void rtsp_out_queue_push(RTSP_Client *client, GByteArray *data, struct RTP_Buffer *rtp);
+void rtsp_outbuf_free(RTSP_Outbuf *outbuf);
+gboolean rtsp_out_queue_congested(RTSP_Client *client);
 void rtsp_tcp_write_cb(struct ev_loop *, ev_io *, int);
 
 void rtsp_interleaved_receive(RTSP_Client *rtsp, int channel, uint8_t *data, size_t len);
 
 RTSP_session *rtsp_session_new(RTSP_Client *rtsp);
 void rtsp_session_free(RTSP_session *session);
+gboolean rtsp_session_unshare(RTSP_session *session);
+gboolean rtsp_session_timeshift(RTSP_session *session);
 void rtsp_session_editlist_append(RTSP_session *session, RTSP_Range *range);
 void rtsp_session_editlist_free(RTSP_session *session);
 
+gboolean rtsp_session_park(RTSP_Client *client);
+gboolean rtsp_session_resume(RTSP_Client *client, const char *session_id);
+void rtsp_resume_init();
+void rtsp_resume_cleanup();
+
+gboolean rtsp_cluster_redirect(RTSP_Client *rtsp, RFC822_Request *req);
+void rtsp_cluster_toggle_drain();
+void rtsp_cluster_init();
+void rtsp_cluster_cleanup();
+
 void rtsp_do_pause(RTSP_Client *rtsp);
 
+struct Resource *rtsp_described_take(RTSP_Client *client, const char *path,
+                                      const struct MParserSettings *settings);
+void vhost_mparser_settings(struct cfg_vhost_t *vhost, const char *path,
+                            gboolean interleaved,
+                            struct MParserSettings *settings);
+void rtsp_mparser_settings(RTSP_Client *client, const char *path,
+                           gboolean interleaved,
+                           struct MParserSettings *settings);
+void rtsp_described_release(RTSP_Client *client);
+void sdp_cache_prewarm(struct cfg_vhost_t *vhost, const char *path,
+                       struct Resource *resource);
+
 /**
  * @defgroup ragel Ragel parsing
  *
@@ -308,9 +444,9 @@ gboolean ragel_parse_range_header(const char *header,
 
 size_t ragel_parse_request_line(const char *msg, const size_t length, RFC822_Request *req);
 
-int ragel_read_rtsp_headers(GHashTable *headers, const char *msg,
+int ragel_read_rtsp_headers(RFC822_Headers *headers, const char *msg,
                             size_t length, size_t *read_size);
-int ragel_read_http_headers(GHashTable *headers, const char *msg,
+int ragel_read_http_headers(RFC822_Headers *headers, const char *msg,
                             size_t length, size_t *read_size);
 /**
  *@}
@@ -318,6 +454,7 @@ int ragel_read_http_headers(GHashTable *headers, const char *msg,
 
 gboolean HTTP_handle_headers(RTSP_Client *rtsp);
 gboolean HTTP_handle_content(RTSP_Client *rtsp);
+void http_tunnel_receive(RTSP_Client *rtsp, size_t offset);
 gboolean HTTP_handle_idle(RTSP_Client *rtsp);
 void http_tunnel_initialise();
 
@@ -326,8 +463,8 @@ void stats_account_read(RTSP_Client *rtsp, size_t bytes);
 void stats_account_sent(RTSP_Client *rtsp, size_t bytes);
 void feng_send_statistics(RTSP_Client *rtsp);
 #else
-#define stats_account_read(a, b)
-#define stats_account_sent(a, b)
+#define stats_account_read(a, b) metrics_count(METRIC_BYTES_READ, b)
+#define stats_account_sent(a, b) metrics_count(METRIC_BYTES_SENT, b)
 #endif
 /**
  * @}
@@ -341,6 +478,10 @@ void feng_send_statistics(RTSP_Client *rtsp);
 void clients_init();
 void clients_cleanup();
 void clients_each(GFunc func, gpointer user_data);
+
+void rtsp_client_disconnect(RTSP_Client *client);
+int rtsp_client_node(RTSP_Client *client);
+gboolean rtsp_client_join_loop(RTSP_Client *client, RTSP_Client *peer);
 /**
  * @}
  */
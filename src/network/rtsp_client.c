@@ -62,85 +62,230 @@ static GPtrArray *clients_list;
 static GMutex *clients_list_lock;
 
 /**
- * @brief Threadpool to manage per-client threads
- */
-static GThreadPool *client_threads;
-
-#ifdef TLS
-/**
- * @brief Per-client-thread error status for libev
+ * @brief Event loop serving a subset of the connected clients
  *
- * Since libev does not support checking for error conditions, we've
- * got to work it around by providing our own "error flag" to turn on
- * if something goes wrong in the libev initialisation.
+ * Instead of creating a new thread and a new event loop for each
+ * accepted connection, a fixed number of these is created at
+ * startup (see @ref cfg_options_t::client_loops) and each new client
+ * is assigned to the one with the lowest number of clients.
  *
- * Something will go wrong if you try to accept more connections than
- * your file descriptors count will allow you to.
+ * All the watchers of a client (RTSP socket, RTP writers, RTCP
+ * readers, timeouts) are registered on the loop of the worker the
+ * client is assigned to, and are only ever touched by its thread.
  */
-static TLS int client_ev_init_errors;
-#else
+typedef struct client_loop {
+    struct ev_loop *loop;
+    GThread *thread;
 
-#include <pthread.h>
+    /** Position in @ref client_loops, to pick its CPU set */
+    guint index;
 
-pthread_key_t client_ev_init_errors_key;
+    /** NUMA node the loop is pinned to, or -1 */
+    int node;
 
-static int client_ev_init_errors_func()
-{
-    return GPOINTER_TO_INT(pthread_getspecific(client_ev_init_errors_key));
-}
+    /**
+     * @brief Clients accepted by the main loop, waiting to be started
+     *
+     * The main loop pushes the new clients here and then signals the
+     * worker through @ref client_loop::ev_sig_incoming.
+     */
+    GAsyncQueue *incoming;
+    ev_async ev_sig_incoming;
+    ev_async ev_sig_stop;
+
+    /**
+     * @brief Amount of clients currently assigned to the loop
+     *
+     * Only accessed atomically, as it's read by the main loop to
+     * find the least loaded worker.
+     */
+    gint clients;
+} client_loop;
 
-# define client_ev_init_errors client_ev_init_errors_func()
+/**
+ * @brief Array of worker loops
+ */
+static client_loop *client_loops;
 
-#endif
+/**
+ * @brief Number of elements in @ref client_loops
+ */
+static guint client_loops_count;
 
 static void libev_syserr(const char *msg)
 {
     fnc_perror(msg);
-#ifdef TLS
-    client_ev_init_errors = 1;
-#else
-    pthread_setspecific(client_ev_init_errors_key, GINT_TO_POINTER(1));
-#endif
 }
 
-static void client_loop(gpointer client_p,
-                        gpointer user_data);
 static void rtsp_client_free(RTSP_Client *client);
+static void client_start(RTSP_Client *client);
+static void client_stop(RTSP_Client *client);
+static void client_close(RTSP_Client *client);
 
 /**
- * @brief Initialise the clients-handling code
+ * @brief Start the new clients assigned to a worker
+ *
+ * @param loop The worker's event loop
+ * @param w The ev_async watcher signalled by the main loop
+ * @param revents Unused
  */
-void clients_init()
+static void client_loop_incoming_cb(ATTR_UNUSED struct ev_loop *loop,
+                                    ev_async *w,
+                                    ATTR_UNUSED int revents)
 {
-    clients_list = g_ptr_array_new();
+    client_loop *worker = w->data;
+    RTSP_Client *client;
 
-    clients_list_lock = g_mutex_new();
-    client_threads = g_thread_pool_new(client_loop, NULL,
-                                       -1, /** @TODO link it to the max number of clients */
-                                       false, NULL);
+    while ( (client = g_async_queue_try_pop(worker->incoming)) != NULL ) {
+        client_start(client);
 
-    ev_set_syserr_cb(libev_syserr);
+        /* A client moved over here from another loop to join its
+           HTTP tunnel peer, see rtsp_client_join_loop(); process the
+           data that was received on the other loop already. */
+        if ( client->pair != NULL && client->pair->rtsp_client == client )
+            http_tunnel_receive(client, 0);
+    }
+}
+
+/**
+ * @brief Disconnect all the clients of a worker and stop its loop
+ *
+ * @param loop The worker's event loop
+ * @param w The ev_async watcher signalled by @ref clients_cleanup
+ * @param revents Unused
+ *
+ * @note This function will lock the @ref clients_list_lock mutex.
+ */
+static void client_loop_stop_cb(struct ev_loop *loop, ev_async *w,
+                                ATTR_UNUSED int revents)
+{
+    client_loop *worker = w->data;
+
+    /* start the clients that are still waiting, so that they can be
+       closed properly as well. */
+    client_loop_incoming_cb(loop, &worker->ev_sig_incoming, 0);
 
-#ifndef TLS
-    if ( pthread_key_create(&client_ev_init_errors_key, NULL) ) {
-        perror("pthread_key_create");
-        exit(1);
+    /* Closing a client might close its HTTP tunnel peer as well, so
+       look up the list again after each of them. */
+    while(true) {
+        RTSP_Client *client = NULL;
+        guint i;
+
+        g_mutex_lock(clients_list_lock);
+        for(i = 0; i < clients_list->len; i++) {
+            RTSP_Client *candidate = g_ptr_array_index(clients_list, i);
+            if ( candidate->worker == worker ) {
+                client = candidate;
+                break;
+            }
+        }
+        g_mutex_unlock(clients_list_lock);
+
+        if ( client == NULL )
+            break;
+
+        client_close(client);
     }
-#endif
+
+    ev_unloop(loop, EVUNLOOP_ALL);
+}
+
+/**
+ * @brief Thread function running a worker loop
+ *
+ * @param worker_p The @ref client_loop object to run
+ */
+static gpointer client_loop_thread(gpointer worker_p)
+{
+    client_loop *worker = worker_p;
+
+    affinity_pin_loop(worker->index);
+    output_pool_attach();
+
+    ev_loop(worker->loop, 0);
+
+    return NULL;
+}
+
+/**
+ * @brief Start a per-worker listener on its loop
+ *
+ * @param element The feng_socket_listener to start
+ * @param user_data Unused
+ *
+ * @internal This function is used by @ref clients_init through
+ *           feng_listeners_each().
+ */
+static void client_listener_start(gpointer element,
+                                  ATTR_UNUSED gpointer user_data)
+{
+    feng_socket_listener *listener = element;
+
+    if ( listener->worker < 0 )
+        return;
+
+    ev_io_start(client_loops[listener->worker].loop, &listener->io);
 }
 
 /**
- * @brief Send the disconnection signal to a single client
+ * @brief Initialise the clients-handling code
  *
- * @param element The RTSP_Client object from @ref feng::clients
- * @brief user_data unused
+ * Creates and starts the pool of @ref cfg_options_t::client_loops
+ * event loops that will be serving the clients.
  */
-static void client_disconnect(gpointer element,
-                              ATTR_UNUSED gpointer user_data)
+void clients_init()
 {
-    RTSP_Client *client = (RTSP_Client*)element;
+    guint i;
+
+    clients_list = g_ptr_array_new();
+    clients_list_lock = g_mutex_new();
+
+    ev_set_syserr_cb(libev_syserr);
+    output_pool_init();
 
-    ev_unloop(client->loop, EVUNLOOP_ONE);
+    client_loops_count = feng_srv.client_loops;
+    client_loops = g_new0(client_loop, client_loops_count);
+
+    for(i = 0; i < client_loops_count; i++) {
+        client_loop *worker = &client_loops[i];
+
+        worker->index = i;
+        worker->node = affinity_loop_node(i);
+
+        if ( (worker->loop = ev_loop_new(EVFLAG_AUTO)) == NULL ) {
+            fnc_log(FNC_LOG_FATAL, "Unable to create event loop for clients");
+            exit(1);
+        }
+
+        worker->incoming = g_async_queue_new();
+
+        worker->ev_sig_incoming.data = worker;
+        ev_async_init(&worker->ev_sig_incoming, client_loop_incoming_cb);
+        ev_async_start(worker->loop, &worker->ev_sig_incoming);
+
+        worker->ev_sig_stop.data = worker;
+        ev_async_init(&worker->ev_sig_stop, client_loop_stop_cb);
+        ev_async_start(worker->loop, &worker->ev_sig_stop);
+    }
+
+    /* the listeners bound with SO_REUSEPORT have to be started before
+       the threads start running their loops */
+    feng_listeners_each(client_listener_start, NULL);
+
+    for(i = 0; i < client_loops_count; i++) {
+        client_loop *worker = &client_loops[i];
+        GError *err = NULL;
+
+        if ( (worker->thread = g_thread_create(client_loop_thread, worker,
+                                               true, &err)) == NULL ) {
+            fnc_log(FNC_LOG_FATAL, "Unable to start client thread: %s",
+                    err->message);
+            exit(1);
+        }
+    }
+
+    fnc_log(FNC_LOG_DEBUG, "Serving clients with %u event loops",
+            client_loops_count);
 }
 
 /**
@@ -153,11 +298,27 @@ static void client_disconnect(gpointer element,
  */
 void clients_cleanup()
 {
-    clients_each(client_disconnect, NULL);
+    guint i;
+
+    for(i = 0; i < client_loops_count; i++)
+        ev_async_send(client_loops[i].loop, &client_loops[i].ev_sig_stop);
+
+    for(i = 0; i < client_loops_count; i++) {
+        client_loop *worker = &client_loops[i];
 
+        g_thread_join(worker->thread);
+
+        ev_async_stop(worker->loop, &worker->ev_sig_incoming);
+        ev_async_stop(worker->loop, &worker->ev_sig_stop);
 #ifdef CLEANUP_DESTRUCTOR
+        ev_loop_destroy(worker->loop);
+        g_async_queue_unref(worker->incoming);
+#endif
+    }
+
+#ifdef CLEANUP_DESTRUCTOR
+    g_free(client_loops);
     g_ptr_array_free(clients_list, true);
-    g_thread_pool_free(client_threads, true, false);
     g_mutex_free(clients_list_lock);
 #endif
 }
@@ -180,12 +341,67 @@ void clients_each(GFunc func, gpointer user_data)
     g_mutex_unlock(clients_list_lock);
 }
 
+/**
+ * @brief Request the disconnection of a client
+ *
+ * @param client The client to disconnect
+ *
+ * The client is not closed right away, since this is usually called
+ * from within one of its own callbacks; the actual cleanup happens
+ * at the next iteration of its loop.
+ *
+ * @note This function is safe to call from any thread.
+ */
+void rtsp_client_disconnect(RTSP_Client *client)
+{
+    ev_async_send(client->loop, &client->ev_sig_disconnect);
+}
+
+/**
+ * @brief Move a client on the same loop as another one
+ *
+ * @param client The client to move
+ * @param peer The client whose loop @p client has to join
+ *
+ * @retval true The client was moved, and will be restarted
+ *              asynchronously by the other loop.
+ * @retval false The two clients were already sharing the same loop.
+ *
+ * This is used by the HTTP tunnel, as the two connections have to
+ * share the same loop to be able to access each other's watchers.
+ *
+ * @note This function has to be called from within @p client 's own
+ *       loop.
+ */
+gboolean rtsp_client_join_loop(RTSP_Client *client, RTSP_Client *peer)
+{
+    client_loop *target = peer->worker;
+
+    if ( client->worker == target )
+        return false;
+
+    client_stop(client);
+
+    client->worker = target;
+    client->loop = target->loop;
+    g_atomic_int_inc(&target->clients);
+
+    g_async_queue_push(target->incoming, client);
+    ev_async_send(target->loop, &target->ev_sig_incoming);
+
+    return true;
+}
+
 static void check_if_any_rtp_session_timedout(gpointer element,
                                               ATTR_UNUSED gpointer user_data)
 {
     RTP_session *session = (RTP_session *)element;
     time_t now = time(NULL);
 
+    /* multicast viewers don't get packets from us directly */
+    if ( session->multicast != NULL )
+        return;
+
     /* Check if we didn't send any data for more then STREAM_BYE_TIMEOUT seconds
      * this will happen if we are not receiving any more from live producer or
      * if the stored stream ended.
@@ -201,7 +417,7 @@ static void check_if_any_rtp_session_timedout(gpointer element,
      */
     if ((now - session->last_packet_send_time) >= STREAM_TIMEOUT) {
         fnc_log(FNC_LOG_INFO, "[client] Stream Timeout, client kicked off!");
-        ev_unloop(session->client->loop, EVUNLOOP_ONE);
+        rtsp_client_disconnect(session->client);
     }
 }
 
@@ -215,90 +431,145 @@ static void client_ev_timeout(struct ev_loop *loop, ev_timer *w,
     ev_timer_again (loop, w);
 }
 
+static void client_ev_disconnect(ATTR_UNUSED struct ev_loop *loop,
+                                 ev_async *w,
+                                 ATTR_UNUSED int revents)
+{
+    client_close(w->data);
+}
+
 /**
- * @brief Threadpool callback for each client
+ * @brief Register the client's watchers on its loop
  *
- * @brief client_p The client to execute the loop for
- * @brief user_data unused
+ * @param client The client to start
  *
- * @note This function will lock the @ref clients_list_lock mutex.
+ * @note This function has to be called from within the client's
+ *       loop.
  */
-static void client_loop(gpointer client_p,
-                        ATTR_UNUSED gpointer user_data)
+static void client_start(RTSP_Client *client)
 {
-    RTSP_Client *client = (RTSP_Client *)client_p;
-
     struct ev_loop *loop = client->loop;
-    ev_io *io_write_p = &client->ev_io_write, io_read = { .data = client };
+    ev_io *io_write_p = &client->ev_io_write, *io_read_p = &client->ev_io_read;
     ev_timer *timer;
 
+    io_read_p->data = client;
+
     switch(client->socktype) {
     case RTSP_TCP:
         /* to be started/stopped when necessary */
         io_write_p->data = client;
         ev_io_init(io_write_p, rtsp_tcp_write_cb, client->sd, EV_WRITE);
 
-        ev_io_init(&io_read, rtsp_tcp_read_cb, client->sd, EV_READ);
+        ev_io_init(io_read_p, rtsp_tcp_read_cb, client->sd, EV_READ);
         break;
 #if ENABLE_SCTP
     case RTSP_SCTP:
-        ev_io_init(&io_read, rtsp_sctp_read_cb, client->sd, EV_READ);
+        /* to be started when the socket buffer is full */
+        io_write_p->data = client;
+        ev_io_init(io_write_p, rtsp_sctp_write_cb, client->sd, EV_WRITE);
+
+        ev_io_init(io_read_p, rtsp_sctp_read_cb, client->sd, EV_READ);
         break;
 #endif
     }
 
-    ev_io_start(loop, &io_read);
+    ev_io_start(loop, io_read_p);
+
+    /* the output queue might have been filled while moving between
+       loops; make sure it's flushed. */
+    if ( ( client->out_queue && g_queue_get_length(client->out_queue) > 0 ) ||
+         ( client->sctp_pending && client->sctp_pending->len > 0 ) )
+        ev_io_start(loop, io_write_p);
 
     timer = &client->ev_timeout;
     timer->data = client;
     ev_init(timer, client_ev_timeout);
     timer->repeat = STREAM_TIMEOUT;
 
-    /* if there were no errors during libev initialisation, proceed to
-     * run the loop, otherwise, start cleaning up already. We could
-     * try to send something to the clients to let them know that we
-     * failed, but ... it's going to be difficult at this point. */
-    if ( client_ev_init_errors == 0 ) {
-        g_mutex_lock(clients_list_lock);
-        g_ptr_array_add(clients_list, client);
-        g_mutex_unlock(clients_list_lock);
+    client->ev_sig_disconnect.data = client;
+    ev_async_init(&client->ev_sig_disconnect, client_ev_disconnect);
+    ev_async_start(loop, &client->ev_sig_disconnect);
+}
 
-        ev_loop(loop, 0);
+/**
+ * @brief Unregister the client's socket watchers from its loop
+ *
+ * @param client The client to stop
+ *
+ * The watchers of the RTP sessions are left alone, they are stopped
+ * when the session itself is freed.
+ */
+static void client_stop(RTSP_Client *client)
+{
+    struct ev_loop *loop = client->loop;
 
-        ev_io_stop(loop, &io_read);
-        ev_io_stop(loop, io_write_p);
+    ev_io_stop(loop, &client->ev_io_read);
+    ev_io_stop(loop, &client->ev_io_write);
+    ev_timer_stop(loop, &client->ev_timeout);
+    ev_async_stop(loop, &client->ev_sig_disconnect);
 
-        ev_timer_stop(loop, &client->ev_timeout);
+    g_atomic_int_add(&client->worker->clients, -1);
+}
 
-        /* As soon as we're out of here, remove the client from the list! */
-        g_mutex_lock(clients_list_lock);
-        g_ptr_array_remove_fast(clients_list, client);
-        g_mutex_unlock(clients_list_lock);
-    }
+/**
+ * @brief Detach a client from the server
+ *
+ * @param client The client to detach
+ *
+ * @note This function will lock the @ref clients_list_lock mutex.
+ */
+static void client_detach(RTSP_Client *client)
+{
+    /* As soon as we're out of here, remove the client from the list! */
+    g_mutex_lock(clients_list_lock);
+    g_ptr_array_remove_fast(clients_list, client);
+    g_mutex_unlock(clients_list_lock);
+
+    client_stop(client);
 
-    client->vhost->connection_count--;
+    g_atomic_int_add(&client->vhost->connection_count, -1);
 
-    client->loop = NULL;
-    ev_loop_destroy(loop);
+    /* mark the client as detached */
+    client->worker = NULL;
+}
+
+/**
+ * @brief Close a client and release its resources
+ *
+ * @param client The client to close
+ *
+ * @note This function has to be called from within the client's
+ *       loop.
+ */
+static void client_close(RTSP_Client *client)
+{
+    client_detach(client);
 
     /* We have special handling of HTTP connection clients; we kill
        the two objects on disconnection of the POST request. */
     if ( client->pair == NULL ) {
         rtsp_client_free(client);
     } else if ( client->pair->rtsp_client == client ) {
-        rtsp_client_free(client->pair->http_client);
+        RTSP_Client *http_client = client->pair->http_client;
+
+        if ( http_client->worker != NULL )
+            client_detach(http_client);
+
+        rtsp_client_free(http_client);
         rtsp_client_free(client);
     }
 }
 
 static void rtsp_client_free(RTSP_Client *client)
 {
-    GString *outbuf = NULL;
+    RTSP_Outbuf *outbuf = NULL;
     close(client->sd);
     g_free(client->local_host);
     g_free(client->remote_host);
 
-    rtsp_session_free(client->session);
+    if ( !rtsp_session_park(client) )
+        rtsp_session_free(client->session);
+    rtsp_described_release(client);
 
     if ( client->channels )
         g_hash_table_destroy(client->channels);
@@ -306,11 +577,15 @@ static void rtsp_client_free(RTSP_Client *client)
     /* Remove the output queue */
     if ( client->out_queue ) {
         while( (outbuf = g_queue_pop_tail(client->out_queue)) )
-            g_string_free(outbuf, TRUE);
+            rtsp_outbuf_free(outbuf);
 
         g_queue_free(client->out_queue);
     }
 
+#if ENABLE_SCTP
+    rtsp_sctp_free(client);
+#endif
+
     if ( client->input ) /* not present on SCTP or HTTP transports */
         g_byte_array_free(client->input, true);
 
@@ -321,9 +596,36 @@ static void rtsp_client_free(RTSP_Client *client)
 
     g_slice_free(RTSP_Client, client);
 
+    metrics_gauge_add(METRIC_CLIENTS, -1);
     fnc_log(FNC_LOG_INFO, "[client] Client removed");
 }
 
+/**
+ * @brief Get the NUMA node of the loop serving a client
+ *
+ * @return The node, or -1 if the loop is not pinned to one.
+ */
+int rtsp_client_node(RTSP_Client *client)
+{
+    return client->worker != NULL ? client->worker->node : -1;
+}
+
+/**
+ * @brief Find the worker loop with the lowest number of clients
+ */
+static client_loop *client_loops_least_loaded()
+{
+    client_loop *best = &client_loops[0];
+    guint i;
+
+    for(i = 1; i < client_loops_count; i++)
+        if ( g_atomic_int_get(&client_loops[i].clients) <
+             g_atomic_int_get(&best->clients) )
+            best = &client_loops[i];
+
+    return best;
+}
+
 /**
  * @brief Handle an incoming RTSP connection
  *
@@ -339,10 +641,12 @@ static void rtsp_client_free(RTSP_Client *client)
  * @li checks that there is space for new connections for the current
  *     fork;
  *
- * @li creates and sets up the @ref RTSP_Client object.
+ * @li creates and sets up the @ref RTSP_Client object;
+ *
+ * @li assigns the client to the least loaded of the @ref client_loops.
  *
  * The newly created instance is deleted by @ref
- * client_loop at the end of the processing
+ * client_close at the end of the processing
  *
  * @internal This function should be used as callback for an ev_io
  *           listener.
@@ -357,6 +661,7 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
         bound_len = sizeof(struct sockaddr_storage);
 
     RTSP_Client *rtsp;
+    client_loop *worker;
 
     if ( (client_sd = accept(listen->fd, (struct sockaddr*)&peer, &peer_len)) < 0 ) {
         fnc_perror("accept failed");
@@ -387,17 +692,17 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
     rtsp->input = g_byte_array_new();
     rtsp->sd = client_sd;
 
-    rtsp->loop = ev_loop_new(EVFLAG_AUTO);
-
     switch (sock_proto) {
     case IPPROTO_TCP:
         rtsp->socktype = RTSP_TCP;
         rtsp->out_queue = g_queue_new();
         rtsp->write_data = rtsp_write_data_queue;
+        rtsp->write_rtp = rtsp_write_rtp_queue;
         break;
 #if ENABLE_SCTP
     case IPPROTO_SCTP:
         rtsp->socktype = RTSP_SCTP;
+        rtsp->sctp_pending = g_ptr_array_new();
         rtsp->write_data = rtsp_sctp_send_rtsp;
         break;
 #endif
@@ -414,9 +719,33 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
     rtsp->peer_sa = g_slice_copy(peer_len, &peer);
     rtsp->local_sa = g_slice_copy(peer_len, &bound);
 
-    rtsp->vhost->connection_count++;
+    g_atomic_int_inc(&rtsp->vhost->connection_count);
+    metrics_count(METRIC_CONNECTIONS, 1);
+    metrics_gauge_add(METRIC_CLIENTS, 1);
+
+    /* connections accepted by a per-worker listener are already
+       running on their loop; the others are handed over to the least
+       loaded one */
+    if ( listen->worker >= 0 )
+        worker = &client_loops[listen->worker];
+    else
+        worker = client_loops_least_loaded();
 
-    g_thread_pool_push(client_threads, rtsp, NULL);
+    rtsp->worker = worker;
+    rtsp->loop = worker->loop;
+    g_atomic_int_inc(&worker->clients);
+
+    g_mutex_lock(clients_list_lock);
+    g_ptr_array_add(clients_list, rtsp);
+    g_mutex_unlock(clients_list_lock);
+
+    if ( listen->worker >= 0 ) {
+        client_start(rtsp);
+        return;
+    }
+
+    g_async_queue_push(worker->incoming, rtsp);
+    ev_async_send(worker->loop, &worker->ev_sig_incoming);
 
     return;
 
@@ -435,16 +764,12 @@ void rtsp_client_incoming_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
  */
 void rtsp_write_string(RTSP_Client *client, GString *string)
 {
-    /* Copy the GString into a GByteArray; we can avoid copying the
-       data since both are transparent structures with a g_malloc'd
-       data pointer.
-     */
-    GByteArray *outpkt = g_byte_array_new();
-    outpkt->data = (guint8*)string->str;
-    outpkt->len = string->len;
+    /* The copy is cheap for messages this small, and lets both the
+       string and the array be recycled by the output pool. */
+    GByteArray *outpkt = output_pool_array(string->len);
+    g_byte_array_append(outpkt, (guint8*)string->str, string->len);
 
-    /* make sure you don't free the actual data pointer! */
-    g_string_free(string, false);
+    output_pool_string_free(string);
 
     client->write_data(client, outpkt);
 }
@@ -0,0 +1,465 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "feng.h"
+#include "rtsp.h"
+#include "rtp.h"
+#include "fnc_log.h"
+
+/**
+ * @defgroup rtsp_cluster Load-based redirection
+ * @ingroup rtsp_utils
+ *
+ * @brief Send the new clients to the least loaded node of a cluster
+ *
+ * When @ref cfg_options_t::cluster_port is set, every second the
+ * node sends a summary of its load to each of the @c cluster-peers,
+ * in a single UDP datagram on that port:
+ *
+ * @verbatim
+feng-load <sessions> <kbit/s> <cpu> <load> <draining>
+@endverbatim
+ *
+ * where @c cpu is the load average relative to the number of
+ * processors and @c load the biggest among the ratios of the
+ * connections, of the bandwidth committed (see @ref rtp_admission)
+ * and of the CPU to their limits, all as percentages.
+ *
+ * While the load of the node is at least @c cluster-threshold, or
+ * while it is draining (after a @c SIGUSR2), DESCRIBE and the SETUP
+ * requests opening a new session get a 302 (Found) status pointing
+ * to the least loaded peer that is under the threshold and that was
+ * heard of recently. With no such peer, the request is served
+ * locally and the usual limits apply.
+ *
+ * The address the clients are redirected to for each peer comes
+ * from its @c cluster-peers entry, never from the datagrams: those
+ * are only told apart by their source address, which is easy to
+ * forge, so all they can change is the choice among the configured
+ * peers.
+ *
+ * The nodes are expected to serve the same content, either from a
+ * shared storage or from replicated document roots.
+ *
+ * @{
+ */
+
+/** Summaries older than this are not used, in seconds */
+#define CLUSTER_PEER_TIMEOUT 3.0
+
+typedef struct {
+    /** Name of the peer the summaries are exchanged with */
+    gchar *name;
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+
+    /** Address the clients are redirected to, as configured */
+    gchar *address;
+    guint sessions;
+    guint kbps;
+    guint cpu;
+    guint load;
+    gboolean draining;
+    /** When the last summary was received, 0 if never */
+    ev_tstamp seen;
+} ClusterPeer;
+
+static ClusterPeer *cluster_peers;
+static guint cluster_peers_count;
+static GStaticMutex cluster_lock = G_STATIC_MUTEX_INIT;
+
+static int cluster_sd = -1;
+static ev_io cluster_receiver;
+static ev_timer cluster_announcer;
+
+/** Load of this node, as a percentage, updated by the announcer */
+static gint cluster_load;
+static gint cluster_draining;
+
+static gboolean cluster_sa_equal(const struct sockaddr_storage *a,
+                                 const struct sockaddr *b)
+{
+    if ( a->ss_family != b->sa_family )
+        return false;
+
+    switch ( b->sa_family ) {
+    case AF_INET:
+        return memcmp(&((const struct sockaddr_in*)a)->sin_addr,
+                      &((const struct sockaddr_in*)b)->sin_addr,
+                      sizeof(struct in_addr)) == 0;
+    case AF_INET6:
+        return memcmp(&((const struct sockaddr_in6*)a)->sin6_addr,
+                      &((const struct sockaddr_in6*)b)->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+    }
+
+    return false;
+}
+
+static void cluster_receive_cb(ATTR_UNUSED struct ev_loop *loop,
+                               ev_io *w,
+                               ATTR_UNUSED int revents)
+{
+    char datagram[512];
+    struct sockaddr_storage sa;
+    socklen_t sa_len = sizeof(sa);
+    guint sessions, kbps, cpu, load, draining, i;
+    ssize_t len;
+
+    if ( (len = recvfrom(w->fd, datagram, sizeof(datagram) - 1, 0,
+                         (struct sockaddr*)&sa, &sa_len)) <= 0 )
+        return;
+
+    datagram[len] = '\0';
+
+    if ( sscanf(datagram, "feng-load %u %u %u %u %u",
+                &sessions, &kbps, &cpu, &load, &draining) != 5 )
+        return;
+
+    g_static_mutex_lock(&cluster_lock);
+
+    /* only the configured peers are listened to */
+    for ( i = 0; i < cluster_peers_count; i++ ) {
+        ClusterPeer *peer = &cluster_peers[i];
+
+        if ( !cluster_sa_equal(&peer->sa, (struct sockaddr*)&sa) )
+            continue;
+
+        peer->sessions = sessions;
+        peer->kbps = kbps;
+        peer->cpu = cpu;
+        peer->load = load;
+        peer->draining = draining != 0;
+        peer->seen = ev_time();
+        break;
+    }
+
+    g_static_mutex_unlock(&cluster_lock);
+}
+
+static guint cluster_ratio(guint64 value, guint64 limit)
+{
+    return limit == 0 ? 0 : (guint)(value * 100 / limit);
+}
+
+static void cluster_announce_cb(ATTR_UNUSED struct ev_loop *loop,
+                                ATTR_UNUSED ev_timer *w,
+                                ATTR_UNUSED int revents)
+{
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    guint64 sessions = 0, max_sessions = 0;
+    const guint kbps = rtp_admission_committed();
+    guint cpu = 0, load;
+    double loadavg;
+    char datagram[512];
+    int len;
+    GList *item;
+    guint i;
+
+    for ( item = configured_vhosts; item != NULL; item = item->next ) {
+        cfg_vhost_t *vhost = item->data;
+
+        sessions += g_atomic_int_get(&vhost->connection_count);
+        max_sessions += vhost->max_connections;
+    }
+
+    if ( getloadavg(&loadavg, 1) == 1 )
+        cpu = (guint)(loadavg * 100 / (cpus > 0 ? cpus : 1));
+
+    load = MAX(cluster_ratio(sessions, max_sessions),
+               cluster_ratio(kbps, (guint64)feng_srv.max_bandwidth * 1000));
+    load = MAX(load, cpu);
+
+    g_atomic_int_set(&cluster_load, load);
+
+    len = snprintf(datagram, sizeof(datagram),
+                   "feng-load %" G_GUINT64_FORMAT " %u %u %u %d\n",
+                   sessions, kbps, cpu, load,
+                   g_atomic_int_get(&cluster_draining));
+
+    if ( len < 0 || (size_t)len >= sizeof(datagram) )
+        return;
+
+    for ( i = 0; i < cluster_peers_count; i++ )
+        sendto(cluster_sd, datagram, len, 0,
+               (struct sockaddr*)&cluster_peers[i].sa,
+               cluster_peers[i].sa_len);
+}
+
+/**
+ * @brief Choose the node to redirect a new client to
+ *
+ * @return The address of the least loaded peer, to be freed, or NULL
+ *         if the client is to be served locally.
+ */
+static gchar *cluster_redirect_target()
+{
+    const ev_tstamp now = ev_time();
+    ClusterPeer *best = NULL;
+    gchar *address = NULL;
+    guint i;
+
+    if ( !g_atomic_int_get(&cluster_draining) &&
+         (guint)g_atomic_int_get(&cluster_load) < feng_srv.cluster_threshold )
+        return NULL;
+
+    g_static_mutex_lock(&cluster_lock);
+
+    for ( i = 0; i < cluster_peers_count; i++ ) {
+        ClusterPeer *peer = &cluster_peers[i];
+
+        if ( peer->seen == 0 || peer->draining ||
+             now - peer->seen > CLUSTER_PEER_TIMEOUT ||
+             peer->load >= feng_srv.cluster_threshold )
+            continue;
+
+        if ( best == NULL || peer->load < best->load )
+            best = peer;
+    }
+
+    if ( best != NULL ) {
+        address = g_strdup(best->address);
+        /* count the client, until the next summary says otherwise */
+        best->load++;
+    }
+
+    g_static_mutex_unlock(&cluster_lock);
+
+    return address;
+}
+
+/**
+ * @brief Redirect a request to a peer if this node is overloaded
+ *
+ * @param rtsp The client sending the request
+ * @param req The request, only redirected if it would start a new
+ *            session
+ *
+ * @retval true The request has been answered with a redirection.
+ * @retval false The request is to be served locally.
+ */
+gboolean rtsp_cluster_redirect(RTSP_Client *rtsp, RFC822_Request *req)
+{
+    gchar *address;
+
+    if ( cluster_peers == NULL || req->proto != RFC822_Protocol_RTSP10 ||
+         req->uri == NULL )
+        return false;
+
+    if ( req->method_id != RTSP_Method_DESCRIBE &&
+         !(req->method_id == RTSP_Method_SETUP &&
+           rfc822_headers_lookup(req->headers, RTSP_Header_Session) == NULL) )
+        return false;
+
+    if ( (address = cluster_redirect_target()) == NULL )
+        return false;
+
+    rtsp_redirect(rtsp, req, address);
+    g_free(address);
+
+    return true;
+}
+
+/**
+ * @brief Start or stop draining the node
+ *
+ * A draining node redirects all the new sessions to its peers, so
+ * that it can be stopped once its clients are gone.
+ */
+void rtsp_cluster_toggle_drain()
+{
+    const gint draining = !g_atomic_int_get(&cluster_draining);
+
+    g_atomic_int_set(&cluster_draining, draining);
+
+    fnc_log(FNC_LOG_INFO, "[cluster] %s", draining ?
+            "draining, redirecting the new sessions" : "no longer draining");
+}
+
+/**
+ * @brief Set a peer up from its configuration entry
+ *
+ * @param peer The peer to set up
+ * @param entry The @c cluster-peers entry: the name of the peer,
+ *              optionally followed by the host and port the clients
+ *              are redirected to, which default to the same name.
+ * @param family The family of the socket the summaries are sent on
+ */
+static gboolean cluster_peer_resolve(ClusterPeer *peer, const char *entry,
+                                     int family)
+{
+    struct addrinfo hints, *res = NULL;
+    char port_str[8];
+    int gai_error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = family == AF_INET6 ? AI_V4MAPPED : 0;
+
+    snprintf(port_str, sizeof(port_str), "%u", feng_srv.cluster_port);
+
+    peer->name = g_strstrip(g_strdup(entry));
+    if ( (peer->address = strpbrk(peer->name, " \t")) != NULL ) {
+        *peer->address++ = '\0';
+        peer->address = g_strdup(g_strchug(peer->address));
+    } else
+        peer->address = g_strdup(peer->name);
+
+    if ( (gai_error = getaddrinfo(peer->name, port_str, &hints, &res)) != 0 ) {
+        fnc_log(FNC_LOG_ERR, "[cluster] unable to resolve peer '%s': %s",
+                peer->name, gai_strerror(gai_error));
+        g_free(peer->name);
+        g_free(peer->address);
+        return false;
+    }
+
+    memcpy(&peer->sa, res->ai_addr, res->ai_addrlen);
+    peer->sa_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return true;
+}
+
+static int cluster_socket(int *family)
+{
+    struct sockaddr_in6 sin6;
+    struct sockaddr_in sin;
+    const int off = 0;
+    int sd;
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr = in6addr_any;
+    sin6.sin6_port = htons(feng_srv.cluster_port);
+
+    if ( (sd = socket(AF_INET6, SOCK_DGRAM, 0)) >= 0 ) {
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+        if ( bind(sd, (struct sockaddr*)&sin6, sizeof(sin6)) == 0 ) {
+            *family = AF_INET6;
+            return sd;
+        }
+
+        close(sd);
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(feng_srv.cluster_port);
+
+    if ( (sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+        fnc_perror("socket");
+        return -1;
+    }
+
+    if ( bind(sd, (struct sockaddr*)&sin, sizeof(sin)) < 0 ) {
+        fnc_perror("bind");
+        close(sd);
+        return -1;
+    }
+
+    *family = AF_INET;
+    return sd;
+}
+
+/**
+ * @brief Start exchanging the load with the peers, if configured
+ */
+void rtsp_cluster_init()
+{
+    GList *item;
+    int family;
+
+    if ( feng_srv.cluster_port == 0 )
+        return;
+
+    if ( feng_srv.cluster_peers == NULL ) {
+        fnc_log(FNC_LOG_ERR, "[cluster] cluster-peers not set, "
+                "not joining the cluster");
+        return;
+    }
+
+    if ( (cluster_sd = cluster_socket(&family)) < 0 )
+        return;
+
+    fcntl(cluster_sd, F_SETFL, O_NONBLOCK);
+
+    cluster_peers = g_new0(ClusterPeer, g_list_length(feng_srv.cluster_peers));
+
+    for ( item = feng_srv.cluster_peers; item != NULL; item = item->next ) {
+        ClusterPeer *peer = &cluster_peers[cluster_peers_count];
+
+        if ( cluster_peer_resolve(peer, item->data, family) )
+            cluster_peers_count++;
+    }
+
+    ev_io_init(&cluster_receiver, cluster_receive_cb, cluster_sd, EV_READ);
+    ev_io_start(feng_loop, &cluster_receiver);
+
+    ev_timer_init(&cluster_announcer, cluster_announce_cb, 0, 1.0);
+    ev_timer_start(feng_loop, &cluster_announcer);
+
+    fnc_log(FNC_LOG_INFO, "[cluster] exchanging the load with %u peers",
+            cluster_peers_count);
+}
+
+/**
+ * @brief Stop exchanging the load with the peers
+ */
+void rtsp_cluster_cleanup()
+{
+    guint i;
+
+    if ( cluster_peers == NULL )
+        return;
+
+    ev_io_stop(feng_loop, &cluster_receiver);
+    ev_timer_stop(feng_loop, &cluster_announcer);
+    close(cluster_sd);
+    cluster_sd = -1;
+
+    for ( i = 0; i < cluster_peers_count; i++ ) {
+        g_free(cluster_peers[i].name);
+        g_free(cluster_peers[i].address);
+    }
+
+    g_free(cluster_peers);
+    cluster_peers = NULL;
+    cluster_peers_count = 0;
+}
+
+/**
+ * @}
+ */
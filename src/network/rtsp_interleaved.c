@@ -25,6 +25,7 @@
 #include "rtsp.h"
 #include "rtp.h"
 #include "fnc_log.h"
+#include "media/media.h"
 
 void rtsp_interleaved_register(RTSP_Client *rtsp, RTP_session *rtp_s,
                                ATTR_UNUSED int rtp_channel, int rtcp_channel)
@@ -56,16 +57,23 @@ void rtsp_interleaved_receive(RTSP_Client *rtsp, int channel, uint8_t *data, siz
         rtcp_handle(rtp, data, len);
 }
 
-static gboolean rtp_interleaved_send_pkt(RTSP_Client *rtsp, GByteArray *buffer, int channel)
+#define INTERLEAVED_PREAMBLE_SIZE RTP_PREAMBLE_SIZE
+
+/**
+ * @brief Send a packet with the interleaved preamble already reserved
+ *
+ * @param rtsp The client to send the packet to
+ * @param buffer The packet to send, with the first @ref
+ *               INTERLEAVED_PREAMBLE_SIZE bytes reserved for the
+ *               preamble
+ * @param channel The interleaved channel to send the packet on
+ */
+static gboolean rtp_interleaved_send_framed(RTSP_Client *rtsp, GByteArray *buffer, int channel)
 {
-    const uint16_t ne_n = htons((uint16_t)buffer->len);
-    const uint8_t interleaved_preamble[4] = { '$', channel, 0, 0 };
+    const uint16_t ne_n = htons((uint16_t)(buffer->len - INTERLEAVED_PREAMBLE_SIZE));
 
-    /* This might not be the best choice here, to be honest… a
-     * scatter-gather approach might work best, but for now, let's
-     * stick with this…
-     */
-    g_byte_array_prepend(buffer, interleaved_preamble, 4);
+    buffer->data[0] = '$';
+    buffer->data[1] = channel;
     memcpy(&buffer->data[2], &ne_n, sizeof(uint16_t));
 
     /* pass the bucket down; it might be direct RTSP or HTTP-tunnelled */
@@ -75,20 +83,112 @@ static gboolean rtp_interleaved_send_pkt(RTSP_Client *rtsp, GByteArray *buffer,
     return TRUE;
 }
 
-static gboolean rtp_interleaved_send_rtp(RTP_session *rtp, GByteArray *buffer)
+/**
+ * @brief Decide whether a video packet has to be dropped
+ *
+ * @param rtp The session the packet belongs to
+ * @param payload The payload of the packet
+ *
+ * @retval true The packet has to be dropped
+ * @retval false The packet can be queued
+ *
+ * When the client's output queue grows over its limit, frames that
+ * haven't started being queued yet are dropped, up to the first
+ * keyframe found once the queue is back under its limit; frames
+ * already started are always completed, and other media are never
+ * dropped.
+ */
+static gboolean rtp_interleaved_skip(RTP_session *rtp,
+                                     struct MParserBuffer *payload)
+{
+    const gboolean frame_start = !rtp->tcp.mid_frame;
+
+    if ( rtp->track->media_type != MP_video )
+        return false;
+
+    rtp->tcp.mid_frame = !payload->marker;
+
+    if ( !frame_start )
+        return rtp->tcp.skip_frames;
+
+    if ( rtsp_out_queue_congested(rtp->client) ) {
+        if ( !rtp->tcp.skip_frames )
+            fnc_log(FNC_LOG_DEBUG,
+                    "[%s] output queue full, dropping frames until the next keyframe",
+                    rtp->track->name);
+        rtp->tcp.skip_frames = true;
+    } else if ( payload->keyframe )
+        rtp->tcp.skip_frames = false;
+
+    return rtp->tcp.skip_frames;
+}
+
+static gboolean rtp_interleaved_send_rtp(RTP_session *rtp, RTP_Buffer *buffer)
 {
-    return rtp_interleaved_send_pkt(rtp->client, buffer, rtp->tcp.rtp);
+    RTSP_Client *rtsp = rtp->client;
+    const uint16_t ne_n = htons((uint16_t)rtp_buffer_len(buffer));
+
+    if ( rtp_interleaved_skip(rtp, buffer->payload) ) {
+        rtp_buffer_free(buffer);
+        return FALSE;
+    }
+
+    /* fall back to copying the packet if the client can't queue it
+       as it is. Leave room for the preamble rather than moving it
+       around afterwards. */
+    if ( rtsp->write_rtp == NULL )
+        return rtp_interleaved_send_framed(rtsp,
+                                           rtp_buffer_flatten(buffer, INTERLEAVED_PREAMBLE_SIZE),
+                                           rtp->tcp.rtp);
+
+    buffer->preamble[0] = '$';
+    buffer->preamble[1] = rtp->tcp.rtp;
+    memcpy(&buffer->preamble[2], &ne_n, sizeof(uint16_t));
+
+    /* the payload is shared, only the preamble and header are our
+       own; no stats accounting, it's done when writing out */
+    rtsp->write_rtp(rtsp, buffer);
+
+    return TRUE;
 }
 
-static gboolean rtp_interleaved_send_rtcp(RTP_session *rtp, GByteArray *buffer)
+static gboolean rtp_interleaved_send_rtcp(RTP_session *rtp, const GByteArray *buffer)
 {
-    return rtp_interleaved_send_pkt(rtp->client, buffer, rtp->tcp.rtcp);
+    /* the client's output queue keeps it, so it needs its own copy */
+    GByteArray *framed = output_pool_array(INTERLEAVED_PREAMBLE_SIZE + buffer->len);
+
+    g_byte_array_set_size(framed, INTERLEAVED_PREAMBLE_SIZE);
+    g_byte_array_append(framed, buffer->data, buffer->len);
+
+    return rtp_interleaved_send_framed(rtp->client, framed, rtp->tcp.rtcp);
 }
 
 static void rtp_interleaved_close_transport(ATTR_UNUSED RTP_session *rtp)
 {
 }
 
+/**
+ * @brief Register the session's channels on a new client
+ *
+ * The packets queued on the old connection are lost with it, so the
+ * video tracks resume from their next keyframe.
+ */
+static gboolean rtp_interleaved_move_transport(RTP_session *rtp,
+                                               RTSP_Client *rtsp)
+{
+    if ( rtsp == NULL ) {
+        rtp->tcp.mid_frame = false;
+        rtp->tcp.skip_frames = true;
+        return true;
+    }
+
+    rtsp_interleaved_register(rtsp, rtp, rtp->tcp.rtp, rtp->tcp.rtcp);
+    rtsp->first_free_channel = MAX(rtsp->first_free_channel,
+                                   MAX(rtp->tcp.rtp, rtp->tcp.rtcp));
+
+    return true;
+}
+
 gboolean rtp_interleaved_transport(RTSP_Client *rtsp,
                                    RTP_session *rtp_s,
                                    struct ParsedTransport *parsed)
@@ -114,6 +214,7 @@ gboolean rtp_interleaved_transport(RTSP_Client *rtsp,
     rtp_s->send_rtp = rtp_interleaved_send_rtp;
     rtp_s->send_rtcp = rtp_interleaved_send_rtcp;
     rtp_s->close_transport = rtp_interleaved_close_transport;
+    rtp_s->move_transport = rtp_interleaved_move_transport;
 
     rtp_s->transport_string = g_strdup_printf("RTP/AVP/TCP;interleaved=%d-%d;ssrc=%08X",
                                               parsed->rtp_channel,
@@ -27,50 +27,385 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
-#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+# include <linux/net_tstamp.h>
+#endif
 
 #include "feng.h"
 #include "rtsp.h"
 #include "rtp.h"
 #include "fnc_log.h"
 #include "netembryo.h"
+#include "media/media.h"
 
-static gboolean rtp_udp_send_pkt(int sd, struct sockaddr *sa, GByteArray *buffer, RTSP_Client *rtsp)
-{
-    int written = -1;
-    struct pollfd p = { sd, POLLOUT, 0};
+/**
+ * @brief Amount of RTP packets sent with a single sendmmsg() call
+ *
+ * Once this many packets are queued the batch is flushed right away,
+ * without waiting for the end of the writer's tick.
+ */
+#define RTP_UDP_BATCH_SIZE 32
 
-    if (poll(&p, 1, 1) < 0) {
-        fnc_perror("poll");
-        goto end;
-    }
+/**
+ * @brief Maximum amount of RTP packets waiting for the socket
+ *
+ * When the socket buffer is full the packets are kept queued until
+ * the socket is writable again; past this amount new packets are
+ * dropped instead.
+ */
+#define RTP_UDP_MAX_PENDING 512
+
+/**
+ * @brief Maximum amount of iovecs gathered by a single TCP write
+ *
+ * Each element of the output queue takes at most two of them.
+ */
+#define RTSP_TCP_WRITE_IOVECS 64
+
+#ifdef UDP_SEGMENT
+/**
+ * @brief Maximum amount of segments to coalesce in a single GSO send
+ */
+# define RTP_UDP_GSO_MAX_SEGMENTS 64
+
+/**
+ * @brief Maximum size of a single GSO send, as for an UDP datagram
+ */
+# define RTP_UDP_GSO_MAX_SIZE 65000
+
+/**
+ * @brief Whether the kernel accepts UDP_SEGMENT messages
+ *
+ * Turned off the first time the kernel refuses a segmented message;
+ * only ever accessed atomically since all the client loops share it.
+ */
+static gint rtp_udp_gso_enabled = 1;
+#endif
+
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(SO_TXTIME) && defined(HAVE_CLOCK_GETTIME)
+# define RTP_UDP_TXTIME 1
+#endif
+
+#if defined(UDP_SEGMENT) || defined(RTP_UDP_TXTIME)
+/**
+ * @brief Space for the ancillary data of a single message
+ */
+# define RTP_UDP_CONTROL_SIZE (CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t)))
+#endif
+
+/**
+ * @brief Pacing rate allowed to a session, relative to its bitrate
+ *
+ * Used with @ref cfg_options_t::udp_pacing set to @c rate; the
+ * headroom lets the keyframes through without falling behind.
+ */
+#define RTP_UDP_PACING_HEADROOM 2
 
-    if (p.revents & POLLOUT) {
-        written = sendto(sd, buffer->data, buffer->len,
+static gboolean rtp_udp_send_pkt(int sd, struct sockaddr *sa, const GByteArray *buffer, RTSP_Client *rtsp)
+{
+    int written = sendto(sd, buffer->data, buffer->len,
                          MSG_EOR | MSG_DONTWAIT,
                          sa, sizeof(struct sockaddr_storage));
-        if (written >= 0 ) {
-            stats_account_sent(rtsp, written);
-        } else {
-            fnc_perror("sendto");
+
+    if (written >= 0 ) {
+        stats_account_sent(rtsp, written);
+    } else {
+        fnc_perror("sendto");
+    }
+
+    return written >= 0;
+}
+
+#ifndef HAVE_SENDMMSG
+struct rtp_udp_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+# define mmsghdr rtp_udp_mmsghdr
+
+/**
+ * @brief Fallback for systems lacking sendmmsg()
+ *
+ * Sends the messages one by one, stopping at the first failure; the
+ * semantics of the return value are the same as sendmmsg().
+ */
+static int rtp_udp_sendmmsg(int sd, struct mmsghdr *msgs, unsigned int vlen,
+                            int flags)
+{
+    unsigned int i;
+
+    for(i = 0; i < vlen; i++) {
+        ssize_t written = sendmsg(sd, &msgs[i].msg_hdr, flags);
+        if ( written < 0 )
+            return i > 0 ? (int)i : -1;
+        msgs[i].msg_len = written;
+    }
+
+    return vlen;
+}
+#else
+# define rtp_udp_sendmmsg sendmmsg
+#endif
+
+/**
+ * @brief Drop all the RTP packets queued for a session
+ */
+static void rtp_udp_drop_pending(RTP_session *rtp)
+{
+    GPtrArray *pending = rtp->udp.rtp_pending;
+    guint i;
+
+    for(i = 0; i < pending->len; i++)
+        rtp_buffer_free(g_ptr_array_index(pending, i));
+
+    g_ptr_array_set_size(pending, 0);
+}
+
+#ifdef RTP_UDP_CONTROL_SIZE
+/**
+ * @brief Append a control message to those of a message header
+ *
+ * @return The data area of the new control message, @p len bytes
+ *         long.
+ */
+static unsigned char *rtp_udp_cmsg(struct msghdr *hdr, int level, int type,
+                                   size_t len)
+{
+    struct cmsghdr *cm = (struct cmsghdr*)((char*)hdr->msg_control +
+                                           hdr->msg_controllen);
+
+    cm->cmsg_level = level;
+    cm->cmsg_type = type;
+    cm->cmsg_len = CMSG_LEN(len);
+
+    hdr->msg_controllen += CMSG_SPACE(len);
+
+    return CMSG_DATA(cm);
+}
+#endif
+
+#ifdef RTP_UDP_TXTIME
+/**
+ * @brief Get the offset from the loop's clock to the one of SO_TXTIME
+ */
+static double rtp_udp_txtime_offset()
+{
+    struct timespec mono;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+
+    return mono.tv_sec + mono.tv_nsec / 1e9 - ev_time();
+}
+#endif
+
+/**
+ * @brief Send out the RTP packets queued for a session
+ *
+ * @param rtp The session to flush the packets of
+ *
+ * The packets are sent in batches of @ref RTP_UDP_BATCH_SIZE with
+ * sendmmsg(); header and payload of each packet are passed as two
+ * separate iovec entries so that the payload is never copied. When
+ * the kernel supports UDP segmentation offload, consecutive packets
+ * of the same size are coalesced in a single message as well.
+ *
+ * With SO_TXTIME, each message carries the time its first packet is
+ * due, and the fq or etf queueing discipline holds it until then;
+ * only the packets due at the same time are coalesced.
+ *
+ * If the socket buffer is full, the remaining packets are kept
+ * queued, and sent once the socket is reported writable.
+ */
+static void rtp_udp_flush(RTP_session *rtp)
+{
+    GPtrArray *pending = rtp->udp.rtp_pending;
+
+    /* we're waiting for the socket to be writable already */
+    if ( ev_is_active(&rtp->udp.rtp_writable) )
+        return;
+
+    while ( pending->len > 0 ) {
+        struct mmsghdr msgs[RTP_UDP_BATCH_SIZE];
+        struct iovec iovs[RTP_UDP_BATCH_SIZE*2];
+#ifdef RTP_UDP_CONTROL_SIZE
+        char control[RTP_UDP_BATCH_SIZE][RTP_UDP_CONTROL_SIZE];
+#endif
+#ifdef UDP_SEGMENT
+        const gboolean gso = g_atomic_int_get(&rtp_udp_gso_enabled);
+#endif
+#ifdef RTP_UDP_TXTIME
+        const double txtime_offset = rtp->udp.txtime ? rtp_udp_txtime_offset() : 0;
+#endif
+        const guint npkts = MIN(pending->len, RTP_UDP_BATCH_SIZE);
+        guint i, nmsgs = 0, consumed = 0;
+        int sent;
+
+        memset(msgs, 0, sizeof(msgs));
+
+        for(i = 0; i < npkts; i++) {
+            RTP_Buffer *pkt = g_ptr_array_index(pending, i);
+
+            iovs[i*2].iov_base = pkt->header;
+            iovs[i*2].iov_len = RTP_HEADER_SIZE;
+            iovs[i*2+1].iov_base = pkt->payload->data;
+            iovs[i*2+1].iov_len = pkt->payload->data_size;
+        }
+
+        for(i = 0; i < npkts; nmsgs++) {
+            const RTP_Buffer *first = g_ptr_array_index(pending, i);
+            const size_t pkt_len = rtp_buffer_len(first);
+            struct msghdr *hdr = &msgs[nmsgs].msg_hdr;
+            guint segments = 1;
+
+#ifdef RTP_UDP_CONTROL_SIZE
+            hdr->msg_control = control[nmsgs];
+            hdr->msg_controllen = 0;
+#endif
+
+#ifdef UDP_SEGMENT
+            /* coalesce the following packets of the same size; the
+               last segment is allowed to be shorter. */
+            while ( gso &&
+                    i + segments < npkts &&
+                    segments < RTP_UDP_GSO_MAX_SEGMENTS &&
+                    (segments + 1) * pkt_len <= RTP_UDP_GSO_MAX_SIZE ) {
+                const RTP_Buffer *next = g_ptr_array_index(pending, i + segments);
+                const size_t next_len = rtp_buffer_len(next);
+
+                if ( next_len > pkt_len )
+                    break;
+
+                /* the segments share the launch time of the first */
+                if ( rtp->udp.txtime && next->scheduled != first->scheduled )
+                    break;
+
+                segments++;
+
+                if ( next_len < pkt_len )
+                    break;
+            }
+
+            if ( segments > 1 ) {
+                const uint16_t segment_size = pkt_len;
+
+                memcpy(rtp_udp_cmsg(hdr, SOL_UDP, UDP_SEGMENT, sizeof(uint16_t)),
+                       &segment_size, sizeof(uint16_t));
+            }
+#endif
+
+#ifdef RTP_UDP_TXTIME
+            if ( rtp->udp.txtime ) {
+                const uint64_t launch = (first->scheduled + txtime_offset) * 1e9;
+
+                memcpy(rtp_udp_cmsg(hdr, SOL_SOCKET, SCM_TXTIME, sizeof(uint64_t)),
+                       &launch, sizeof(uint64_t));
+            }
+#endif
+
+#ifdef RTP_UDP_CONTROL_SIZE
+            if ( hdr->msg_controllen == 0 )
+                hdr->msg_control = NULL;
+#endif
+
+            hdr->msg_iov = &iovs[i*2];
+            hdr->msg_iovlen = segments*2;
+
+            i += segments;
+        }
+
+        sent = rtp_udp_sendmmsg(rtp->udp.rtp_sd, msgs, nmsgs, MSG_DONTWAIT);
+
+        if ( sent < 0 ) {
+            switch ( errno ) {
+            case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+                ev_io_start(rtp->client->loop, &rtp->udp.rtp_writable);
+                return;
+#ifdef UDP_SEGMENT
+            case EIO:
+            case EINVAL:
+                if ( gso && nmsgs < npkts ) {
+                    fnc_log(FNC_LOG_WARN, "UDP segmentation offload not available");
+                    g_atomic_int_set(&rtp_udp_gso_enabled, 0);
+                    continue;
+                }
+                /* fall through */
+#endif
+            default:
+                fnc_perror("sendmmsg");
+                rtp_udp_drop_pending(rtp);
+                return;
+            }
+        }
+
+        for(i = 0; i < (guint)sent; i++) {
+            stats_account_sent(rtp->client, msgs[i].msg_len);
+            consumed += msgs[i].msg_hdr.msg_iovlen/2;
+        }
+
+        for(i = 0; i < consumed; i++)
+            rtp_buffer_free(g_ptr_array_index(pending, i));
+
+        g_ptr_array_remove_range(pending, 0, consumed);
+
+        /* the socket buffer is full, wait for it to drain */
+        if ( (guint)sent < nmsgs ) {
+            ev_io_start(rtp->client->loop, &rtp->udp.rtp_writable);
+            return;
         }
     }
+}
 
- end:
-    g_byte_array_free(buffer, true);
+/**
+ * @brief Resume flushing the RTP packets once the socket is writable
+ */
+static void rtp_udp_writable_cb(struct ev_loop *loop, ev_io *w,
+                                ATTR_UNUSED int revents)
+{
+    RTP_session *rtp = w->data;
 
-    return written >= 0;
+    ev_io_stop(loop, w);
+    rtp_udp_flush(rtp);
 }
 
-static gboolean rtp_udp_send_rtp(RTP_session *rtp, GByteArray *buffer)
+/**
+ * @brief Queue an RTP packet to be sent with the next batch
+ *
+ * The packets are sent when @ref RTP_session::flush_transport is
+ * called at the end of the writer's tick, or as soon as a full batch
+ * is ready.
+ */
+static gboolean rtp_udp_send_rtp(RTP_session *rtp, RTP_Buffer *buffer)
 {
-    return rtp_udp_send_pkt(rtp->udp.rtp_sd,
-                            rtp->udp.rtp_sa,
-                            buffer, rtp->client);
+    GPtrArray *pending = rtp->udp.rtp_pending;
+
+    if ( pending->len >= RTP_UDP_MAX_PENDING ) {
+        rtp_buffer_free(buffer);
+        return false;
+    }
+
+    g_ptr_array_add(pending, buffer);
+
+    if ( pending->len >= RTP_UDP_BATCH_SIZE )
+        rtp_udp_flush(rtp);
+
+    return true;
 }
 
-static gboolean rtp_udp_send_rtcp(RTP_session *rtp, GByteArray *buffer)
+static gboolean rtp_udp_send_rtcp(RTP_session *rtp, const GByteArray *buffer)
 {
+    /* make sure that the reports don't overtake the packets they
+       refer to */
+    rtp_udp_flush(rtp);
+
     return rtp_udp_send_pkt(rtp->udp.rtcp_sd,
                             rtp->udp.rtcp_sa,
                             buffer, rtp->client);
@@ -80,13 +415,67 @@ static void rtp_udp_close_transport(RTP_session *rtp)
 {
     RTSP_Client *client = rtp->client;
 
-    ev_io_stop(client->loop, &rtp->udp.rtcp_reader);
+    /* parked sessions have no client, nor active watchers */
+    if ( client != NULL ) {
+        ev_io_stop(client->loop, &rtp->udp.rtcp_reader);
+        ev_io_stop(client->loop, &rtp->udp.rtp_writable);
+    }
+
+    rtp_udp_drop_pending(rtp);
+    g_ptr_array_free(rtp->udp.rtp_pending, true);
 
     close(rtp->udp.rtp_sd);
     close(rtp->udp.rtcp_sd);
 
-    g_slice_free1(client->sa_len, rtp->udp.rtp_sa);
-    g_slice_free1(client->sa_len, rtp->udp.rtcp_sa);
+    g_slice_free1(rtp->udp.sa_len, rtp->udp.rtp_sa);
+    g_slice_free1(rtp->udp.sa_len, rtp->udp.rtcp_sa);
+}
+
+/**
+ * @brief Connect a socket to a new peer address, keeping the port
+ */
+static gboolean rtp_udp_reconnect(int sd, struct sockaddr *sa,
+                                  const RTSP_Client *client)
+{
+    const in_port_t port = neb_sa_get_port(sa);
+
+    memcpy(sa, client->peer_sa, client->sa_len);
+    neb_sa_set_port(sa, port);
+
+    if ( connect(sd, sa, client->sa_len) < 0 ) {
+        fnc_perror("connect");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Move the session's sockets to a new client
+ *
+ * The client's ports are expected not to change; its address can,
+ * as long as the family stays the same.
+ */
+static gboolean rtp_udp_move_transport(RTP_session *rtp, RTSP_Client *client)
+{
+    if ( client == NULL ) {
+        ev_io_stop(rtp->client->loop, &rtp->udp.rtcp_reader);
+        ev_io_stop(rtp->client->loop, &rtp->udp.rtp_writable);
+        rtp_udp_drop_pending(rtp);
+        return true;
+    }
+
+    if ( client->sa_len != rtp->udp.sa_len )
+        return false;
+
+    if ( !rtp_udp_reconnect(rtp->udp.rtp_sd, rtp->udp.rtp_sa, client) ||
+         !rtp_udp_reconnect(rtp->udp.rtcp_sd, rtp->udp.rtcp_sa, client) )
+        return false;
+
+    /* the receiver reports now come from the new peer */
+    ev_io_start(client->loop, &rtp->udp.rtcp_reader);
+
+    return true;
 }
 
 /**
@@ -107,6 +496,70 @@ static void rtcp_udp_read_cb(ATTR_UNUSED struct ev_loop *loop,
         rtcp_handle(rtp, buffer, n);
 }
 
+/**
+ * @brief Let the kernel pace the RTP packets of a session
+ *
+ * @param rtp_s The session, whose RTP socket is already connected
+ *
+ * Depending on @ref cfg_options_t::udp_pacing, the packets either
+ * carry their launch time (SO_TXTIME), or are spread at a rate
+ * proportional to the track's bitrate (SO_MAX_PACING_RATE); both
+ * need the fq queueing discipline (or etf, for SO_TXTIME) on the
+ * outgoing interface. The session keeps being paced by its timer if
+ * the mode is not supported.
+ */
+static void rtp_udp_pacing(RTP_session *rtp_s)
+{
+    const char *const mode = feng_srv.udp_pacing;
+
+    if ( mode == NULL || strcmp(mode, "timer") == 0 )
+        return;
+
+    if ( strcmp(mode, "txtime") == 0 ) {
+#ifdef RTP_UDP_TXTIME
+        const struct sock_txtime txtime = { .clockid = CLOCK_MONOTONIC,
+                                            .flags = 0 };
+
+        if ( setsockopt(rtp_s->udp.rtp_sd, SOL_SOCKET, SO_TXTIME,
+                        &txtime, sizeof(txtime)) == 0 ) {
+            rtp_s->udp.txtime = true;
+            rtp_s->pacing_lookahead = feng_srv.udp_pacing_lookahead / 1000.0;
+            return;
+        }
+
+        fnc_perror("setsockopt(SO_TXTIME)");
+#else
+        fnc_log(FNC_LOG_WARN, "[rtp] SO_TXTIME not supported, pacing with timers");
+#endif
+        return;
+    }
+
+#ifdef SO_MAX_PACING_RATE
+    {
+        const int measured = g_atomic_int_get(&rtp_s->track->measured_kbps);
+        const guint64 bps = measured > 0 ?
+            (guint64)measured * 1000 : rtp_s->track->bitrate;
+        const unsigned int rate = MIN(bps / 8 * RTP_UDP_PACING_HEADROOM, G_MAXUINT);
+
+        if ( rate == 0 ) {
+            fnc_log(FNC_LOG_DEBUG, "[rtp] unknown bitrate for %s, pacing with timers",
+                    rtp_s->track->name);
+            return;
+        }
+
+        if ( setsockopt(rtp_s->udp.rtp_sd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                        &rate, sizeof(rate)) == 0 ) {
+            rtp_s->pacing_lookahead = feng_srv.udp_pacing_lookahead / 1000.0;
+            return;
+        }
+
+        fnc_perror("setsockopt(SO_MAX_PACING_RATE)");
+    }
+#else
+    fnc_log(FNC_LOG_WARN, "[rtp] SO_MAX_PACING_RATE not supported, pacing with timers");
+#endif
+}
+
 /**
  * @brief Setup unicast UDP transport sockets for an RTP session
  */
@@ -122,6 +575,9 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
     int firstsd;
     in_port_t firstport, rtp_port, rtcp_port;
 
+    if ( parsed->mode == TransportMulticast )
+        return rtp_multicast_transport(rtsp, rtp_s, parsed);
+
     memcpy(sa_p, rtsp->local_sa, sa_len);
 
     /* The client will not provide ports for us, obviously, let's
@@ -211,6 +667,7 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
         break;
     }
 
+    rtp_s->udp.sa_len = sa_len;
     rtp_s->udp.rtp_sa = g_slice_copy(sa_len, rtsp->peer_sa);
     neb_sa_set_port(rtp_s->udp.rtp_sa, parsed->rtp_channel);
 
@@ -234,10 +691,21 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
     io->data = rtp_s;
     ev_io_init(io, rtcp_udp_read_cb,
                rtp_s->udp.rtcp_sd, EV_READ);
+    ev_io_start(rtsp->loop, io);
+
+    rtp_s->udp.rtp_writable.data = rtp_s;
+    ev_io_init(&rtp_s->udp.rtp_writable, rtp_udp_writable_cb,
+               rtp_s->udp.rtp_sd, EV_WRITE);
+
+    rtp_s->udp.rtp_pending = g_ptr_array_sized_new(RTP_UDP_BATCH_SIZE);
+
+    rtp_udp_pacing(rtp_s);
 
     rtp_s->send_rtp = rtp_udp_send_rtp;
     rtp_s->send_rtcp = rtp_udp_send_rtcp;
+    rtp_s->flush_transport = rtp_udp_flush;
     rtp_s->close_transport = rtp_udp_close_transport;
+    rtp_s->move_transport = rtp_udp_move_transport;
 
     source = neb_sa_get_host((struct sockaddr*) &sa);
 
@@ -267,6 +735,58 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
     return false;
 }
 
+/**
+ * @brief Size of the data held by an element of the output queue
+ */
+static size_t rtsp_outbuf_len(RTSP_Outbuf *outbuf)
+{
+    if ( outbuf->rtp )
+        return RTP_PREAMBLE_SIZE + RTP_HEADER_SIZE +
+            outbuf->rtp->payload->data_size;
+
+    return outbuf->data->len;
+}
+
+/**
+ * @brief Fill the iovecs to write an element of the output queue
+ *
+ * @param outbuf The element to write
+ * @param offset Bytes of @p outbuf already written
+ * @param iov Array of (at least) two iovecs to fill
+ *
+ * @return The amount of iovecs filled.
+ */
+static int rtsp_outbuf_iov(RTSP_Outbuf *outbuf, size_t offset,
+                           struct iovec *iov)
+{
+    int count;
+
+    if ( outbuf->rtp ) {
+        /* preamble and header are contiguous */
+        iov[0].iov_base = outbuf->rtp->preamble;
+        iov[0].iov_len = RTP_PREAMBLE_SIZE + RTP_HEADER_SIZE;
+        iov[1].iov_base = outbuf->rtp->payload->data;
+        iov[1].iov_len = outbuf->rtp->payload->data_size;
+        count = 2;
+    } else {
+        iov[0].iov_base = outbuf->data->data;
+        iov[0].iov_len = outbuf->data->len;
+        count = 1;
+    }
+
+    /* skip what was already written by a previous partial write */
+    if ( offset >= iov[0].iov_len ) {
+        offset -= iov[0].iov_len;
+        iov[0] = iov[1];
+        count--;
+    }
+
+    iov[0].iov_base = (uint8_t*)iov[0].iov_base + offset;
+    iov[0].iov_len -= offset;
+
+    return count;
+}
+
 /**
  * @brief Queue data for write in the client's output queue
  *
@@ -278,40 +798,108 @@ gboolean rtp_udp_transport(RTSP_Client *rtsp,
  */
 void rtsp_write_data_queue(RTSP_Client *client, GByteArray *data)
 {
-    g_queue_push_head(client->out_queue, data);
+    rtsp_out_queue_push(client, data, NULL);
+}
+
+/**
+ * @brief Queue an interleaved RTP packet in the client's output queue
+ *
+ * @param client The client to write the packet to
+ * @param buffer The RTP packet, with the preamble already set
+ *
+ * @note after calling this function, the @p buffer object should no
+ * longer be referenced by the code path.
+ */
+void rtsp_write_rtp_queue(RTSP_Client *client, RTP_Buffer *buffer)
+{
+    rtsp_out_queue_push(client, NULL, buffer);
+}
+
+/**
+ * @brief Push data or an RTP packet in the client's output queue
+ *
+ * @param client The client owning the output queue
+ * @param data Plain data to queue, or NULL
+ * @param rtp RTP packet to queue, or NULL
+ */
+void rtsp_out_queue_push(RTSP_Client *client, GByteArray *data, RTP_Buffer *rtp)
+{
+    RTSP_Outbuf *outbuf = g_slice_new(RTSP_Outbuf);
+
+    outbuf->data = data;
+    outbuf->rtp = rtp;
+
+    client->out_queue_bytes += rtsp_outbuf_len(outbuf);
+
+    g_queue_push_head(client->out_queue, outbuf);
     ev_io_start(client->loop, &client->ev_io_write);
 }
 
-void rtsp_tcp_read_cb(struct ev_loop *loop, ev_io *w,
-                      ATTR_UNUSED int revents)
+/**
+ * @brief Tells whether the output queue of a client is over its limit
+ *
+ * @param client The client to check; for HTTP-tunnelled clients the
+ *               queue checked is the one of the hidden HTTP socket.
+ *
+ * @see cfg_options_t::output_queue_limit
+ */
+gboolean rtsp_out_queue_congested(RTSP_Client *client)
 {
-    guint8 buffer[RTSP_BUFFERSIZE + 1] = { 0, };    /* +1 to control the final '\0' */
-    int read_size;
-    RTSP_Client *rtsp = w->data;
-    int sd = rtsp->sd;
+    if ( client->pair != NULL && client->pair->http_client != NULL )
+        client = client->pair->http_client;
 
-    /* if we're receiving data for an HTTP tunnel, we have to run it
-       through the HTTP client's buffer. */
-    if ( rtsp->pair != NULL )
-        rtsp = rtsp->pair->http_client;
+    return client->out_queue_bytes > feng_srv.output_queue_limit;
+}
 
-    if ( (read_size = recv(sd,
-                           buffer,
-                           sizeof(buffer),
-                           0) ) <= 0 )
-        goto client_close;
+/**
+ * @brief Free an element of the output queue and its content
+ */
+void rtsp_outbuf_free(RTSP_Outbuf *outbuf)
+{
+    if ( outbuf->data )
+        output_pool_array_free(outbuf->data);
+    if ( outbuf->rtp )
+        rtp_buffer_free(outbuf->rtp);
 
-    stats_account_read(rtsp, read_size);
+    g_slice_free(RTSP_Outbuf, outbuf);
+}
+
+void rtsp_tcp_read_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
+                      ATTR_UNUSED int revents)
+{
+    ssize_t read_size;
+    size_t available, prev_len;
+    RTSP_Client *rtsp = w->data;
+    int sd = rtsp->sd;
 
-    if (rtsp->input->len + read_size > RTSP_BUFFERSIZE) {
+    if ( (available = RTSP_BUFFERSIZE - rtsp->input->len) == 0 ) {
         fnc_log(FNC_LOG_DEBUG,
                 "RTSP buffer overflow (input RTSP message is most likely invalid).\n");
         goto server_close;
     }
 
-    g_byte_array_append(rtsp->input, (guint8*)buffer, read_size);
+    /* read straight at the end of the input buffer, the array keeps
+       its allocation when shrunk, so this only reallocates when the
+       input grows past it */
+    available = MIN(available, RTSP_READ_SIZE);
+    prev_len = rtsp->input->len;
+    g_byte_array_set_size(rtsp->input, prev_len + available);
+
+    read_size = recv(sd, rtsp->input->data + prev_len, available, 0);
 
-    RTSP_handler(rtsp);
+    g_byte_array_set_size(rtsp->input, prev_len + MAX(read_size, 0));
+
+    if ( read_size <= 0 )
+        goto client_close;
+
+    stats_account_read(rtsp, read_size);
+
+    /* the POST connection of an HTTP tunnel carries the RTSP stream
+       base64-encoded */
+    if ( rtsp->pair != NULL && rtsp->pair->rtsp_client == rtsp )
+        http_tunnel_receive(rtsp, prev_len);
+    else
+        RTSP_handler(rtsp);
 
     return;
 
@@ -324,30 +912,74 @@ void rtsp_tcp_read_cb(struct ev_loop *loop, ev_io *w,
     goto disconnect;
 
  disconnect:
-    ev_unloop(loop, EVUNLOOP_ONE);
+    rtsp_client_disconnect(w->data);
 }
 
+/**
+ * @brief Write out the client's output queue
+ *
+ * As many queued elements as possible are gathered into a single
+ * sendmsg() call; partially-written elements are kept at the tail of
+ * the queue, with @ref RTSP_Client::out_offset recording how much of
+ * them has been sent already.
+ */
 void rtsp_tcp_write_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
                        ATTR_UNUSED int revents)
 {
     RTSP_Client *rtsp = w->data;
-    GByteArray *outpkt = (GByteArray *)g_queue_pop_tail(rtsp->out_queue);
-    size_t written = 0;
+    struct iovec iov[RTSP_TCP_WRITE_IOVECS];
+    struct msghdr msg = { .msg_iov = iov };
+    size_t offset = rtsp->out_offset;
+    ssize_t written;
+    GList *elem;
 
-    if (outpkt == NULL) {
+    if ( g_queue_is_empty(rtsp->out_queue) ) {
         ev_io_stop(loop, &rtsp->ev_io_write);
+        if ( rtsp->close_on_flush )
+            rtsp_client_disconnect(rtsp);
         return;
     }
-    written = send(rtsp->sd, outpkt->data, outpkt->len, MSG_DONTWAIT);
-    if ( written < outpkt->len ) {
-        fnc_perror("");
-        /* verify if this ever happens, as it is it'll still be popped
-           from the queue */
-        if ( errno == EAGAIN )
+
+    /* the queue is filled from the head, the oldest element is the
+       tail one */
+    for ( elem = rtsp->out_queue->tail;
+          elem != NULL && msg.msg_iovlen + 2 <= RTSP_TCP_WRITE_IOVECS;
+          elem = elem->prev ) {
+        msg.msg_iovlen += rtsp_outbuf_iov(elem->data, offset,
+                                          &iov[msg.msg_iovlen]);
+        offset = 0;
+    }
+
+    written = sendmsg(rtsp->sd, &msg, MSG_DONTWAIT);
+    if ( written < 0 ) {
+        /* try again once writable; nothing has been written */
+        if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
             return;
-    } else {
-        stats_account_sent(rtsp, written);
+
+        fnc_perror("");
+        rtsp_client_disconnect(rtsp);
+        return;
     }
 
-    g_byte_array_free(outpkt, TRUE);
+    stats_account_sent(rtsp, written);
+
+    /* drop what has been written completely, and remember where we
+       stopped within the rest */
+    while ( written > 0 ) {
+        RTSP_Outbuf *outbuf = g_queue_peek_tail(rtsp->out_queue);
+        const size_t len = rtsp_outbuf_len(outbuf);
+        const size_t left = len - rtsp->out_offset;
+
+        if ( (size_t)written < left ) {
+            rtsp->out_offset += written;
+            break;
+        }
+
+        written -= left;
+        rtsp->out_offset = 0;
+        rtsp->out_queue_bytes -= len;
+
+        g_queue_pop_tail(rtsp->out_queue);
+        rtsp_outbuf_free(outbuf);
+    }
 }
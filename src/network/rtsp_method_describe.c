@@ -27,10 +27,13 @@
 #include <config.h>
 
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
+#include <sys/stat.h>
 
 #include "fnc_log.h"
 #include "rtsp.h"
+#include "rtp.h"
 #include "feng.h"
 #include "media/media.h"
 #include "uri.h"
@@ -94,49 +97,327 @@ static void sdp_track_descr(gpointer element, gpointer user_data)
 }
 
 /**
- * @brief Create description for an SDP session
+ * @defgroup sdp_cache SDP descriptions cache
  *
- * @param uri URI of the resource to describe
+ * @brief Avoid probing stored files again on each DESCRIBE
+ *
+ * The part of the SDP description that depends only on the resource
+ * (its range and its tracks' media descriptions) is kept, for each
+ * vhost, in a least-recently-used cache of at most @ref
+ * cfg_vhost_t::sdp_cache_size entries, keyed by the resolved path of
+ * the file. An entry is only valid as long as the file keeps the same
+ * modification time and size, so that a cache hit costs a stat()
+ * rather than opening and probing the file.
  *
- * @return A new GString containing the complete description of the
- *         session or NULL if the resource was not found or no demuxer
- *         was found to handle it.
+ * Live resources are never cached.
+ *
+ * @{
  */
-static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
+
+typedef struct {
+    /** Path of the file, relative to the document root */
+    gchar *path;
+    time_t mtime;
+    off_t size;
+
+    /** Range and media descriptions of the resource */
+    GString *media;
+
+    /** Link of the entry in @ref SDPCache::lru */
+    GList *link;
+} SDPCacheEntry;
+
+struct SDPCache {
+    /** Entries by path */
+    GHashTable *entries;
+
+    /** Entries, most recently used first */
+    GQueue *lru;
+};
+
+/**
+ * @brief Lock protecting the caches of all the vhosts
+ */
+static GStaticMutex sdp_cache_lock = G_STATIC_MUTEX_INIT;
+
+static void sdp_cache_entry_free(gpointer entry_p)
 {
-    URI *uri = req->uri;
-    GString *descr = NULL;
-    double duration;
+    SDPCacheEntry *entry = entry_p;
 
-    float currtime_float, restime_float;
+    g_free(entry->path);
+    g_string_free(entry->media, true);
+    g_slice_free(SDPCacheEntry, entry);
+}
 
-    Resource *resource;
+/**
+ * @brief Look up the cached description of a file
+ *
+ * @param vhost The vhost serving the file
+ * @param path The path of the file within the vhost
+ * @param filestat The current status of the file
+ * @param descr The description to append the cached one to
+ *
+ * @retval true The cached description was appended to @p descr.
+ * @retval false The file is not cached, or was modified since.
+ */
+static gboolean sdp_cache_lookup(cfg_vhost_t *vhost, const char *path,
+                                 const struct stat *filestat,
+                                 GString *descr)
+{
+    SDPCacheEntry *entry;
+    gboolean found = false;
 
-    char *path;
+    g_static_mutex_lock(&sdp_cache_lock);
 
-    const char *inet_family;
+    if ( vhost->sdp_cache == NULL ||
+         (entry = g_hash_table_lookup(vhost->sdp_cache->entries, path)) == NULL )
+        goto end;
 
-    if ( rtsp->peer_sa == NULL ) {
-        fnc_log(FNC_LOG_ERR, "unable to identify address family for connection");
+    if ( entry->mtime != filestat->st_mtime ||
+         entry->size != filestat->st_size ) {
+        g_queue_delete_link(vhost->sdp_cache->lru, entry->link);
+        g_hash_table_remove(vhost->sdp_cache->entries, path);
+        goto end;
+    }
+
+    g_queue_unlink(vhost->sdp_cache->lru, entry->link);
+    g_queue_push_head_link(vhost->sdp_cache->lru, entry->link);
+
+    g_string_append_len(descr, entry->media->str, entry->media->len);
+    found = true;
+
+ end:
+    g_static_mutex_unlock(&sdp_cache_lock);
+    return found;
+}
+
+/**
+ * @brief Store the description of a file in the cache
+ *
+ * @param vhost The vhost serving the file
+ * @param path The path of the file within the vhost
+ * @param filestat The status of the file the description is for
+ * @param media The description to store; a copy is made.
+ */
+static void sdp_cache_store(cfg_vhost_t *vhost, const char *path,
+                            const struct stat *filestat,
+                            const GString *media)
+{
+    SDPCacheEntry *entry = g_slice_new(SDPCacheEntry);
+    struct SDPCache *cache;
+
+    entry->path = g_strdup(path);
+    entry->mtime = filestat->st_mtime;
+    entry->size = filestat->st_size;
+    entry->media = g_string_new_len(media->str, media->len);
+
+    g_static_mutex_lock(&sdp_cache_lock);
+
+    if ( (cache = vhost->sdp_cache) == NULL ) {
+        cache = vhost->sdp_cache = g_slice_new(struct SDPCache);
+        cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               NULL, sdp_cache_entry_free);
+        cache->lru = g_queue_new();
+    }
+
+    /* the key is owned by the entry, so remove the older one first */
+    if ( g_hash_table_lookup(cache->entries, path) != NULL ) {
+        SDPCacheEntry *old = g_hash_table_lookup(cache->entries, path);
+
+        g_queue_delete_link(cache->lru, old->link);
+        g_hash_table_remove(cache->entries, path);
+    }
+
+    g_queue_push_head(cache->lru, entry);
+    entry->link = cache->lru->head;
+    g_hash_table_insert(cache->entries, entry->path, entry);
+
+    while ( g_queue_get_length(cache->lru) > vhost->sdp_cache_size ) {
+        SDPCacheEntry *last = g_queue_pop_tail(cache->lru);
+
+        g_hash_table_remove(cache->entries, last->path);
+    }
+
+    g_static_mutex_unlock(&sdp_cache_lock);
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @brief Time a resource opened by DESCRIBE is kept for SETUP
+ */
+#define RTSP_DESCRIBED_KEEP_TIME 10
+
+/**
+ * @brief Close the resource kept from the last DESCRIBE, if any
+ *
+ * @param client The client that sent the DESCRIBE
+ */
+void rtsp_described_release(RTSP_Client *client)
+{
+    if ( client->described == NULL )
+        return;
+
+    r_close(client->described);
+    g_free(client->described_path);
+
+    client->described = NULL;
+    client->described_path = NULL;
+}
+
+/**
+ * @brief Take the resource opened by the last DESCRIBE
+ *
+ * @param client The client sending SETUP
+ * @param path The path of the resource to set up
+ * @param settings The packetization required by the transport being
+ *                 set up
+ *
+ * @return The resource opened for @p path by the last DESCRIBE
+ *         request of the client, if it was recent enough and is
+ *         packetized with @p settings; the caller now owns it. NULL
+ *         otherwise.
+ *
+ * Clients almost always set up the resource they just described, so
+ * keeping it open avoids opening and probing it twice.
+ */
+Resource *rtsp_described_take(RTSP_Client *client, const char *path,
+                               const MParserSettings *settings)
+{
+    Resource *resource = client->described;
+
+    if ( resource == NULL )
+        return NULL;
+
+    if ( ev_now(client->loop) > client->described_expiry ||
+         strcmp(client->described_path, path) != 0 ||
+         (resource->source == STORED_SOURCE &&
+          !mparser_settings_equal(&resource->settings, settings)) ) {
+        rtsp_described_release(client);
         return NULL;
     }
 
-    inet_family = rtsp->peer_sa->sa_family == AF_INET6 ? "IP6" : "IP4";
-    path = g_uri_unescape_string(uri->path, "/");
+    g_free(client->described_path);
+    client->described = NULL;
+    client->described_path = NULL;
+
+    return resource;
+}
+
+/**
+ * @brief Describe the range and the tracks of a resource
+ *
+ * @return A new GString with the resource-dependent part of an SDP
+ *         description.
+ */
+static GString *sdp_resource_descr(Resource *resource)
+{
+    GString *media = g_string_new("");
+    double duration;
+
+    if ((duration = resource->duration) > 0 &&
+        duration != HUGE_VAL)
+        g_string_append_printf(media, "a=range:npt=0-%f"SDP_EL, duration);
+
+    g_list_foreach(resource->tracks,
+                   sdp_track_descr,
+                   media);
+
+    return media;
+}
+
+/**
+ * @brief Store the description of an open resource in the cache
+ *
+ * @param vhost The vhost serving the resource
+ * @param path The path of the resource within the vhost, as in the
+ *             DESCRIBE requests
+ * @param resource The resource, opened with the packetization of a
+ *                 DESCRIBE on @p vhost
+ *
+ * Used to fill the cache before the resource is requested, see @ref
+ * prewarm; does nothing if the vhost has no cache.
+ */
+void sdp_cache_prewarm(cfg_vhost_t *vhost, const char *path,
+                       Resource *resource)
+{
+    gchar *mrl;
+    struct stat filestat;
+
+    if ( vhost->sdp_cache_size == 0 )
+        return;
+
+    mrl = g_strjoin("/", vhost->document_root, path, NULL);
+
+    if ( stat(mrl, &filestat) == 0 ) {
+        GString *media = sdp_resource_descr(resource);
+
+        sdp_cache_store(vhost, path, &filestat, media);
+        g_string_free(media, true);
+    }
+
+    g_free(mrl);
+}
+
+/**
+ * @brief Create the resource-dependent part of an SDP description
+ *
+ * @param client The client requesting the description; the resource
+ *               is kept on it for a following SETUP.
+ * @param path The path of the resource to describe
+ * @param mtime Where to store the modification time of the resource
+ *
+ * @return A new GString containing the range and the tracks'
+ *         descriptions, or NULL if the resource was not found or no
+ *         demuxer was found to handle it.
+ */
+static GString *sdp_media_descr(RTSP_Client *client, const char *path,
+                                time_t *mtime)
+{
+    GString *media;
+    Resource *resource;
+    MParserSettings settings;
+
+    rtsp_mparser_settings(client, path, false, &settings);
 
     fnc_log(FNC_LOG_DEBUG, "[SDP] opening %s", path);
-    if ( !(resource = r_open(path)) ) {
+    if ( !(resource = r_open(path, &settings)) ) {
         fnc_log(FNC_LOG_ERR, "[SDP] %s not found", path);
-        g_free(path);
         return NULL;
     }
-    g_free(path);
 
-    descr = g_string_new("v=0"SDP_EL);
+    media = sdp_resource_descr(resource);
+    *mtime = resource->mtime;
+
+    rtsp_described_release(client);
+    client->described = resource;
+    client->described_path = g_strdup(path);
+    client->described_expiry = ev_now(client->loop) + RTSP_DESCRIBED_KEEP_TIME;
+
+    return media;
+}
+
+/**
+ * @brief Append the resource-independent part of an SDP description
+ *
+ * @param descr The description to append to
+ * @param rtsp The client requesting the description
+ * @param uri URI of the resource to describe
+ * @param mtime Modification time of the resource, zero if unknown
+ */
+static void sdp_session_head(GString *descr, RTSP_Client *rtsp, URI *uri,
+                             time_t mtime)
+{
+    const char *const inet_family =
+        rtsp->peer_sa->sa_family == AF_INET6 ? "IP6" : "IP4";
 
     /* Near enough approximation to run it now */
-    currtime_float = NTP_time(time(NULL));
-    restime_float = resource->mtime ? NTP_time(resource->mtime) : currtime_float;
+    const float currtime_float = NTP_time(time(NULL));
+    const float restime_float = mtime ? NTP_time(mtime) : currtime_float;
+
+    g_string_append(descr, "v=0"SDP_EL);
 
     /* Network type: Internet; Address type: IP4. */
     g_string_append_printf(descr, "o=- %.0f %.0f IN %s %s"SDP_EL,
@@ -163,16 +444,73 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
 
     // control attribute. We should look if aggregate metod is supported?
     g_string_append(descr, "a=control:*"SDP_EL);
+}
 
-    if ((duration = resource->duration) > 0 &&
-        duration != HUGE_VAL)
-        g_string_append_printf(descr, "a=range:npt=0-%f"SDP_EL, duration);
+/**
+ * @brief Create description for an SDP session
+ *
+ * @param uri URI of the resource to describe
+ *
+ * @return A string from the @ref output_pool containing the complete
+ *         description of the session or NULL if the resource was not
+ *         found or no demuxer was found to handle it.
+ *
+ * For the files found in the @ref sdp_cache, the cached part is
+ * copied straight after the session-dependent lines.
+ */
+static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
+{
+    URI *uri = req->uri;
+    GString *descr, *media;
+    struct stat filestat;
+    gboolean cacheable = false;
+    time_t mtime = 0;
 
-    g_list_foreach(resource->tracks,
-                   sdp_track_descr,
-                   descr);
+    char *path;
 
-    r_close(resource);
+    if ( rtsp->peer_sa == NULL ) {
+        fnc_log(FNC_LOG_ERR, "unable to identify address family for connection");
+        return NULL;
+    }
+
+    path = g_uri_unescape_string(uri->path, "/");
+    descr = output_pool_string(1024);
+
+    if ( rtsp->vhost->sdp_cache_size > 0 &&
+         !g_str_has_prefix(path, "/virtual/") ) {
+        gchar *mrl = g_strjoin("/", rtsp->vhost->document_root,
+                               path, NULL);
+
+        cacheable = stat(mrl, &filestat) == 0;
+        g_free(mrl);
+    }
+
+    if ( cacheable ) {
+        sdp_session_head(descr, rtsp, uri, filestat.st_mtime);
+
+        if ( sdp_cache_lookup(rtsp->vhost, path, &filestat, descr) ) {
+            fnc_log(FNC_LOG_DEBUG, "[SDP] %s found in cache", path);
+            goto end;
+        }
+
+        g_string_truncate(descr, 0);
+    }
+
+    if ( (media = sdp_media_descr(rtsp, path, &mtime)) == NULL ) {
+        output_pool_string_free(descr);
+        g_free(path);
+        return NULL;
+    }
+
+    if ( cacheable )
+        sdp_cache_store(rtsp->vhost, path, &filestat, media);
+
+    sdp_session_head(descr, rtsp, uri, mtime);
+    g_string_append_len(descr, media->str, media->len);
+    g_string_free(media, true);
+
+ end:
+    g_free(path);
 
     fnc_log(FNC_LOG_INFO, "[SDP] description:\n%s", descr->str);
 
@@ -183,9 +521,14 @@ static GString *sdp_session_descr(RTSP_Client *rtsp, RFC822_Request *req)
  * RTSP DESCRIBE method handler
  * @param rtsp the buffer for which to handle the method
  * @param req The client request for the method
+ *
+ * Successful responses are sent from a template (see @ref
+ * rfc822_template), to which only the Content-Base and the
+ * description are added.
  */
 void RTSP_describe(RTSP_Client *rtsp, RFC822_Request *req)
 {
+    static volatile gsize describe_template = 0;
     GString *descr;
 
     if ( !rfc822_request_check_url(rtsp, req) )
@@ -199,15 +542,26 @@ void RTSP_describe(RTSP_Client *rtsp, RFC822_Request *req)
     if ( descr == NULL ) {
         rtsp_quick_response(rtsp, req, RTSP_NotFound);
     } else {
-        RFC822_Response *response = rfc822_response_new(req, RTSP_Ok);
+        const RFC822_Template *template;
+        GByteArray *message;
+        gchar *base;
+
+        if ( g_once_init_enter(&describe_template) ) {
+            RFC822_Headers *headers = rfc822_headers_new();
+
+            /* When we're going to have more than one option, add alternatives here */
+            rfc822_headers_set(headers,
+                               RTSP_Header_Content_Type,
+                               g_strdup("application/sdp"));
 
-        /* bluntly put it there */
-        response->body = descr;
+            g_once_init_leave(&describe_template,
+                              (gsize)rfc822_template_new(RFC822_Protocol_RTSP10,
+                                                         RTSP_Ok, headers));
+            rfc822_headers_destroy(headers);
+        }
 
-        /* When we're going to have more than one option, add alternatives here */
-        rfc822_headers_set(response->headers,
-                           RTSP_Header_Content_Type,
-                           g_strdup("application/sdp"));
+        template = (const RFC822_Template*)describe_template;
+        message = rfc822_template_begin(template, req);
 
         /* We can trust the req->object value since we already have checked it
          * beforehand. Since the object was already escaped by the client, we just
@@ -216,10 +570,11 @@ void RTSP_describe(RTSP_Client *rtsp, RFC822_Request *req)
          * Note: this _might_ not be what we want if we decide to redirect the
          * stream to different servers, but since we don't do that now...
          */
-        rfc822_headers_set(response->headers,
-                           RTSP_Header_Content_Base,
-                           g_strdup_printf("%s/", req->object));
+        base = g_strconcat(req->object, "/", NULL);
+        rfc822_template_header(message, RTSP_Header_Content_Base, base);
+        g_free(base);
 
-        rfc822_response_send(rtsp, response);
+        rfc822_template_send(rtsp, template, req, message, descr);
+        output_pool_string_free(descr);
     }
 }
@@ -30,14 +30,30 @@
  * RTSP OPTIONS method handler
  * @param rtsp the buffer for which to handle the method
  * @param req The client request for the method
+ *
+ * The response is the same for all the clients, so it's sent from a
+ * template (see @ref rfc822_template), built by the first request.
  */
 void RTSP_options(RTSP_Client *rtsp, RFC822_Request *req)
 {
-    RFC822_Response *response = rfc822_response_new(req, RTSP_Ok);
+    static volatile gsize options_template = 0;
+    const RFC822_Template *template;
+
+    if ( g_once_init_enter(&options_template) ) {
+        RFC822_Headers *headers = rfc822_headers_new();
+
+        rfc822_headers_set(headers,
+                           RTSP_Header_Public,
+                           g_strdup("OPTIONS,DESCRIBE,SETUP,PLAY,PAUSE,TEARDOWN"));
+
+        g_once_init_leave(&options_template,
+                          (gsize)rfc822_template_new(RFC822_Protocol_RTSP10,
+                                                     RTSP_Ok, headers));
+        rfc822_headers_destroy(headers);
+    }
 
-    rfc822_headers_set(response->headers,
-                       RTSP_Header_Public,
-                       g_strdup("OPTIONS,DESCRIBE,SETUP,PLAY,PAUSE,TEARDOWN"));
+    template = (const RFC822_Template*)options_template;
 
-    rfc822_response_send(rtsp, response);
+    rfc822_template_send(rtsp, template, req,
+                         rfc822_template_begin(template, req), NULL);
 }
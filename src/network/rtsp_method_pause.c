@@ -27,6 +27,8 @@
 #include "feng.h"
 #include "rtsp.h"
 #include "rtp.h"
+#include "fnc_log.h"
+#include "media/media.h"
 
 /**
  *  Actually pause playing the media using mediathread
@@ -40,9 +42,24 @@ void rtsp_do_pause(RTSP_Client *rtsp)
     /* Get the first range, so that we can record the pause point */
     RTSP_Range *range = g_queue_peek_head(rtsp_sess->play_requests);
 
-    range->begin_time += ev_now(rtsp->loop) - range->playback_time;
+    /* the live positions don't start from the stream's start, only
+       the time of the pause can tell where to resume in the recording */
+    if ( rtsp_sess->resource->source == LIVE_SOURCE )
+        range->paused_at = ev_now(rtsp->loop);
+    else {
+        /* in trick play the position moves at the requested speed */
+        range->begin_time += (ev_now(rtsp->loop) - range->playback_time) * range->scale;
+        if ( range->begin_time < 0 )
+            range->begin_time = 0;
+    }
     range->playback_time = -0.1;
 
+    /* the other viewers of a shared resource keep playing */
+    if ( r_shared(rtsp_sess->resource) &&
+         !rtsp_session_unshare(rtsp_sess) )
+        fnc_log(FNC_LOG_WARN, "[%s] unable to split off shared resource",
+                rtsp_sess->resource->mrl);
+
     rtp_session_gslist_pause(rtsp_sess->rtp_sessions);
 
     ev_timer_stop(rtsp->loop, &rtsp->ev_timeout);
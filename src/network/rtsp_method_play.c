@@ -45,6 +45,45 @@
 static RTSP_ResponseCode do_play(RTSP_session * rtsp_sess)
 {
     RTSP_Range *range = g_queue_peek_head(rtsp_sess->play_requests);
+    double position;
+
+    switch ( r_share_play(rtsp_sess->resource, range->begin_time,
+                          range->playback_time, &position) ) {
+    case SHARE_JOIN:
+        /* join the shared timeline where it is now */
+        range->begin_time = position;
+        range->scale = 1.0;
+        goto play;
+    case SHARE_SPLIT:
+        if ( !rtsp_session_unshare(rtsp_sess) )
+            return RTSP_InternalServerError;
+        break;
+    case SHARE_PRIVATE:
+        break;
+    }
+
+    /* a live resource played from a past position, or resumed after
+       a pause, is read from its recording, which is seekable */
+    if ( rtsp_sess->resource->source == LIVE_SOURCE &&
+         rtsp_sess->resource->live.timeshift != NULL &&
+         ( range->begin_time > 0 || range->paused_at > 0 ) ) {
+        if ( rtsp_session_timeshift(rtsp_sess) ) {
+            if ( range->paused_at > 0 )
+                range->begin_time = timeshift_position(rtsp_sess->resource,
+                                                       range->paused_at);
+        } else if ( range->begin_time > 0 )
+            return RTSP_InvalidRange;
+    }
+
+    /* without a recording, the live resource resumes where it is */
+    range->paused_at = 0;
+
+    /* only the resources able to send their keyframes alone do
+     * trick play, the others play at the normal speed; the speed
+     * applies from the seek below.
+     */
+    if ( r_set_scale(rtsp_sess->resource, range->scale) != 0 )
+        range->scale = 1.0;
 
     /* Don't try to seek if the source is not seekable;
      * parse_range_header() would have already ensured the range is
@@ -55,6 +94,7 @@ static RTSP_ResponseCode do_play(RTSP_session * rtsp_sess)
          r_seek(rtsp_sess->resource, range->begin_time) )
         return RTSP_InvalidRange;
 
+ play:
     rtsp_sess->cur_state = RTSP_SERVER_PLAYING;
 
     rtsp_sess->started = 1;
@@ -119,6 +159,12 @@ static void send_play_reply(RTSP_Client *client,
                        RTSP_Header_Range,
                        g_string_free(str, false));
 
+    /* the speed actually used, see do_play() */
+    if ( rfc822_headers_lookup(req->headers, RTSP_Header_Scale) != NULL )
+        rfc822_headers_set(response->headers,
+                           RTSP_Header_Scale,
+                           g_strdup_printf("%f", range->scale));
+
     /* Create RTP-Info header */
     g_slist_foreach(rtsp_session->rtp_sessions, rtp_session_send_play_reply, rtp_info);
 
@@ -131,6 +177,28 @@ static void send_play_reply(RTSP_Client *client,
     rfc822_response_send(client, response);
 }
 
+/**
+ * @brief Parse the Scale header, if any
+ *
+ * @param req The request to check
+ * @param scale Where to store the requested speed; left untouched
+ *              if the request has no Scale header.
+ *
+ * @retval false The header is not a valid, non-zero speed.
+ */
+static gboolean parse_scale_header(RFC822_Request *req, double *scale)
+{
+    const char *scale_hdr = rfc822_headers_lookup(req->headers, RTSP_Header_Scale);
+    char *end;
+
+    if ( scale_hdr == NULL )
+        return true;
+
+    *scale = g_ascii_strtod(scale_hdr, &end);
+
+    return end != scale_hdr && *end == '\0' && *scale != 0 && isfinite(*scale);
+}
+
 /**
  * @brief Parse the Range header and eventually add it to the session
  *
@@ -175,12 +243,14 @@ static RTSP_ResponseCode parse_range_header(RTSP_Client *client,
     static const RTSP_Range defaultrange = {
         .begin_time = 0,
         .end_time = -0.1,
-        .playback_time = -0.1
+        .playback_time = -0.1,
+        .scale = 1.0
     };
 
     RTSP_session *session = client->session;
     const char *range_hdr = rfc822_headers_lookup(req->headers, RTSP_Header_Range);
     RTSP_Range *range;
+    double scale;
 
     /* If we have no range header and there is no play request queued,
      * we interpret it as a request for the full resource, if there is one already,
@@ -188,6 +258,22 @@ static RTSP_ResponseCode parse_range_header(RTSP_Client *client,
      */
     if ( range_hdr == NULL &&
          (range = g_queue_peek_head(session->play_requests)) != NULL ) {
+        scale = range->scale;
+        if ( !parse_scale_header(req, &scale) )
+            return RTSP_BadRequest;
+
+        /* the range being sent keeps its speed, the one actually
+         * used is reported by send_play_reply() */
+        if ( session->cur_state == RTSP_SERVER_PLAYING ) {
+            if ( scale != range->scale )
+                fnc_log(FNC_LOG_INFO,
+                        "Ignoring Scale %f while playing at %f",
+                        scale, range->scale);
+            return RTSP_Ok;
+        }
+
+        range->scale = scale;
+
         range->playback_time = ev_now(client->loop);
 
         fnc_log(FNC_LOG_VERBOSE,
@@ -204,6 +290,11 @@ static RTSP_ResponseCode parse_range_header(RTSP_Client *client,
      * values to the starting values. */
     range = g_slice_dup(RTSP_Range, &defaultrange);
 
+    if ( !parse_scale_header(req, &range->scale) ) {
+        g_slice_free(RTSP_Range, range);
+        return RTSP_BadRequest;
+    }
+
     /* If there is any kind of parsing error, the range is considered
      * not implemented. It might not be entirely correct but until we
      * have better indications, it should be fine. */
@@ -244,6 +335,10 @@ static RTSP_ResponseCode parse_range_header(RTSP_Client *client,
     if ( range->end_time < 0 ||
          range->end_time > session->resource->duration)
         range->end_time = session->resource->duration;
+
+    /* played backward, the range ends at the start by default */
+    if ( range->scale < 0 && range->end_time >= range->begin_time )
+        range->end_time = 0;
 /*    else if ( range->end_time > session->resource->duration ) {
         g_slice_free(RTSP_Range, range);
         return RTSP_InvalidRange;
@@ -303,6 +398,14 @@ void RTSP_play(RTSP_Client *rtsp, RFC822_Request *req)
     if ( (error = parse_range_header(rtsp, req)) != RTSP_Ok )
         goto error_management;
 
+    /* the sessions already sending keep the budget they measured */
+    if ( rtsp_sess->cur_state != RTSP_SERVER_PLAYING &&
+         rtp_admission_exceeded(rtsp->vhost) ) {
+        fnc_log(FNC_LOG_INFO, "[admission] bandwidth budget exceeded, refusing PLAY");
+        error = RTSP_NotEnoughBandwidth;
+        goto error_management;
+    }
+
     if ( rtsp_sess->cur_state != RTSP_SERVER_PLAYING &&
          (error = do_play(rtsp_sess)) != RTSP_Ok )
         goto error_management;
@@ -40,13 +40,16 @@
  * Gets the track requested for the object
  *
  * @param rtsp_s the session where to save the addressed resource
+ * @param transports the transports requested; the preferred one
+ *                   decides how the resource is packetized
  *
  * @return The pointer to the requested track
  *
  * @retval NULL Unable to find the requested resource or track, or
  *              other errors. The client already received a response.
  */
-static Track *select_requested_track(RTSP_Client *client, RFC822_Request *req, RTSP_session *rtsp_s)
+static Track *select_requested_track(RTSP_Client *client, RFC822_Request *req,
+                                     RTSP_session *rtsp_s, GSList *transports)
 {
     char *trackname = NULL;
     Track *selected_track = NULL;
@@ -65,6 +68,8 @@ static Track *select_requested_track(RTSP_Client *client, RFC822_Request *req, R
         /* Here we don't know the URL and we have to find it out, we
          * check for the presence of the final '/' */
         char *path;
+        const struct ParsedTransport *preferred = transports->data;
+        MParserSettings settings;
 
         char *separator = strrchr(req->object, '/');
 
@@ -90,7 +95,11 @@ static Track *select_requested_track(RTSP_Client *client, RFC822_Request *req, R
                     path,
                     rtsp_s->resource_uri);
 
-        if (!(rtsp_s->resource = r_open(path))) {
+        rtsp_mparser_settings(client, path, preferred->protocol != RTP_UDP,
+                              &settings);
+
+        if ( !(rtsp_s->resource = rtsp_described_take(client, path, &settings)) &&
+             !(rtsp_s->resource = r_open(path, &settings)) ) {
             fnc_log(FNC_LOG_DEBUG, "Resource for %s not found", path);
 
             g_free(path);
@@ -187,10 +196,19 @@ void RTSP_setup(RTSP_Client *rtsp, RFC822_Request *req)
     //mediathread pointers
     RTP_session *rtp_s = NULL;
     RTSP_session *rtsp_s;
+    int admitted_kbps;
 
     if ( !rfc822_request_check_url(rtsp, req) )
         return;
 
+    /* Tracks added to an existing session are still accepted, as
+     * most of their data is going to be queued anyway. */
+    if ( rtsp->session == NULL && bq_memory_exhausted() ) {
+        fnc_log(FNC_LOG_WARN, "Queue memory limit reached, refusing session");
+        rtsp_quick_response(rtsp, req, RTSP_NotEnoughBandwidth);
+        return;
+    }
+
     /* Parse the transport header through Ragel-generated state machine.
      *
      * The full documentation of the Transport header syntax is available in
@@ -218,14 +236,22 @@ void RTSP_setup(RTSP_Client *rtsp, RFC822_Request *req)
      * couldn't be found, the function will take care of sending out
      * the error response, so we don't need to do anything else.
      */
-    if ( (req_track = select_requested_track(rtsp, req, rtsp_s)) == NULL )
+    if ( (req_track = select_requested_track(rtsp, req, rtsp_s, transports)) == NULL )
         return;
 
+    if ( (admitted_kbps = rtp_admission_reserve(rtsp->vhost, req_track)) < 0 ) {
+        rtsp_quick_response(rtsp, req, RTSP_NotEnoughBandwidth);
+        goto cleanup;
+    }
+
     if ( !(rtp_s = rtp_session_new(rtsp, req->object, req_track, transports)) ) {
+        rtp_admission_release(rtsp->vhost, admitted_kbps);
         rtsp_quick_response(rtsp, req, RTSP_UnsupportedTransport);
         goto cleanup;
     }
 
+    rtp_s->admitted_kbps = admitted_kbps;
+
     rtsp_s->rtp_sessions = g_slist_append(rtsp_s->rtp_sessions, rtp_s);
 
     send_setup_reply(rtsp, req, rtsp_s, rtp_s);
@@ -0,0 +1,252 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <stdbool.h>
+
+#include "feng.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "fnc_log.h"
+#include "media/media.h"
+
+/**
+ * @defgroup rtsp_resume Session resumption
+ * @ingroup rtsp_utils
+ *
+ * @brief Keep the sessions of dropped connections for a reconnect
+ *
+ * When @ref cfg_options_t::session_resume_grace is set, the RTSP
+ * session of a client whose connection drops is not freed: it is
+ * paused, its RTP sessions are detached from their transports and it
+ * is parked, with its resource and its track consumers, in a table
+ * keyed by session identifier.
+ *
+ * A new connection whose first request carries the same Session
+ * header takes the session back: the transports are moved to the new
+ * client, and the following PLAY continues from where the session
+ * was paused, without opening and probing the resource again. The
+ * sessions not taken back within the grace period are freed by a
+ * timer on the main loop.
+ *
+ * Only sessions whose transports all survive the connection can be
+ * parked: UDP, whose sockets are connected again to the new peer
+ * address, interleaved and multicast; SCTP associations can't.
+ *
+ * @{
+ */
+
+typedef struct {
+    RTSP_session *session;
+    ev_tstamp expiry;
+} ParkedSession;
+
+/** Parked sessions, by session identifier */
+static GHashTable *parked_sessions;
+static GStaticMutex parked_lock = G_STATIC_MUTEX_INIT;
+
+/** Timer of the main loop freeing the expired sessions */
+static ev_timer parked_sweeper;
+
+static void parked_session_free(gpointer parked_p)
+{
+    ParkedSession *parked = parked_p;
+
+    rtsp_session_free(parked->session);
+    g_slice_free(ParkedSession, parked);
+}
+
+static gboolean parked_session_expired(ATTR_UNUSED gpointer key,
+                                       gpointer parked_p,
+                                       gpointer now_p)
+{
+    ParkedSession *parked = parked_p;
+
+    if ( parked->expiry > *(ev_tstamp*)now_p )
+        return false;
+
+    fnc_log(FNC_LOG_INFO, "[resume] session %s expired",
+            parked->session->session_id);
+
+    return true;
+}
+
+static void parked_sweeper_cb(struct ev_loop *loop,
+                              ATTR_UNUSED ev_timer *w,
+                              ATTR_UNUSED int revents)
+{
+    ev_tstamp now = ev_now(loop);
+
+    g_static_mutex_lock(&parked_lock);
+    g_hash_table_foreach_remove(parked_sessions, parked_session_expired, &now);
+    g_static_mutex_unlock(&parked_lock);
+}
+
+static gboolean rtp_session_movable(RTP_session *rtp)
+{
+    return rtp->move_transport != NULL;
+}
+
+/**
+ * @brief Park the session of a client that is being freed
+ *
+ * @param client The client, still attached to its loop
+ *
+ * @retval true The session is parked and not owned by the client
+ *              anymore.
+ * @retval false The session can't be resumed and has to be freed.
+ *
+ * @note This function has to be called from within the client's
+ *       loop.
+ */
+gboolean rtsp_session_park(RTSP_Client *client)
+{
+    RTSP_session *session = client->session;
+    ParkedSession *parked;
+    GSList *item;
+
+    if ( feng_srv.session_resume_grace == 0 || session == NULL ||
+         session->rtp_sessions == NULL )
+        return false;
+
+    for ( item = session->rtp_sessions; item != NULL; item = item->next )
+        if ( !rtp_session_movable(item->data) )
+            return false;
+
+    if ( session->cur_state == RTSP_SERVER_PLAYING )
+        rtsp_do_pause(client);
+
+    for ( item = session->rtp_sessions; item != NULL; item = item->next ) {
+        RTP_session *rtp = item->data;
+
+        rtp->move_transport(rtp, NULL);
+
+        /* the session sends nothing until taken back */
+        rtp_admission_release(client->vhost, rtp->admitted_kbps);
+        rtp->admitted_kbps = 0;
+
+        rtp->client = NULL;
+    }
+
+    parked = g_slice_new(ParkedSession);
+    parked->session = session;
+    parked->expiry = ev_now(client->loop) + feng_srv.session_resume_grace;
+
+    g_static_mutex_lock(&parked_lock);
+    g_hash_table_replace(parked_sessions, session->session_id, parked);
+    g_static_mutex_unlock(&parked_lock);
+
+    client->session = NULL;
+
+    fnc_log(FNC_LOG_INFO, "[resume] session %s parked for %u seconds",
+            session->session_id, feng_srv.session_resume_grace);
+
+    return true;
+}
+
+/**
+ * @brief Take a parked session back on a new connection
+ *
+ * @param client The client presenting the session, without a session
+ *               of its own
+ * @param session_id The identifier from the request's Session header
+ *
+ * @retval true The session is now the client's.
+ * @retval false No such session is parked, or its transports could
+ *               not be moved to the client, in which case it is
+ *               freed.
+ */
+gboolean rtsp_session_resume(RTSP_Client *client, const char *session_id)
+{
+    RTSP_session *session;
+    ParkedSession *parked;
+    GSList *item;
+
+    if ( parked_sessions == NULL )
+        return false;
+
+    g_static_mutex_lock(&parked_lock);
+    if ( (parked = g_hash_table_lookup(parked_sessions, session_id)) != NULL )
+        g_hash_table_steal(parked_sessions, session_id);
+    g_static_mutex_unlock(&parked_lock);
+
+    if ( parked == NULL )
+        return false;
+
+    session = parked->session;
+    g_slice_free(ParkedSession, parked);
+
+    for ( item = session->rtp_sessions; item != NULL; item = item->next ) {
+        RTP_session *rtp = item->data;
+
+        if ( !rtp->move_transport(rtp, client) ) {
+            fnc_log(FNC_LOG_INFO, "[resume] unable to move session %s",
+                    session_id);
+            rtsp_session_free(session);
+            return false;
+        }
+
+        rtp->client = client;
+    }
+
+    client->session = session;
+
+    fnc_log(FNC_LOG_INFO, "[resume] session %s resumed", session_id);
+
+    return true;
+}
+
+/**
+ * @brief Start parking the sessions, if enabled by the configuration
+ */
+void rtsp_resume_init()
+{
+    if ( feng_srv.session_resume_grace == 0 )
+        return;
+
+    parked_sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            NULL, parked_session_free);
+
+    ev_timer_init(&parked_sweeper, parked_sweeper_cb, 1.0, 1.0);
+    ev_timer_start(feng_loop, &parked_sweeper);
+}
+
+/**
+ * @brief Free all the parked sessions
+ *
+ * Called once the client loops are stopped, so that no session is
+ * parked anymore.
+ */
+void rtsp_resume_cleanup()
+{
+    if ( parked_sessions == NULL )
+        return;
+
+    ev_timer_stop(feng_loop, &parked_sweeper);
+    g_hash_table_destroy(parked_sessions);
+    parked_sessions = NULL;
+}
+
+/**
+ * @}
+ */
@@ -23,6 +23,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #if HAVE_LINUX_SOCKIOS_H
@@ -36,34 +37,315 @@
 #include "fnc_log.h"
 #include "feng.h"
 
-static gboolean rtsp_sctp_send_pkt(RTSP_Client *rtsp, GByteArray *buffer,
-                                   const struct sctp_sndrcvinfo *sctp_info)
+/**
+ * @defgroup sctp_output SCTP output
+ *
+ * @brief Batched, partially reliable, output on SCTP associations
+ *
+ * All the messages of an association are queued on @ref
+ * RTSP_Client::sctp_pending, and sent in batches of @ref
+ * RTSP_SCTP_BATCH_SIZE, with sendmmsg() where available, at the end
+ * of the writer's tick or as soon as a batch is full. If the socket
+ * buffer is full, the client's write watcher is started and the rest
+ * is sent once the socket is writable, without blocking.
+ *
+ * RTP packets are sent unordered, so that a lost packet does not hold
+ * back the following ones of its stream, and with PR-SCTP timed
+ * reliability: the association stops retransmitting them @ref
+ * cfg_vhost_t::sctp_rtp_lifetime milliseconds after the time they
+ * were scheduled to be sent at. Packets whose lifetime expires while
+ * still queued are dropped without being sent. RTSP messages are
+ * sent reliably and in order.
+ *
+ * @{
+ */
+
+/**
+ * @brief Amount of messages sent with a single sendmmsg() call
+ */
+#define RTSP_SCTP_BATCH_SIZE 32
+
+/**
+ * @brief Maximum amount of RTP packets waiting for the socket
+ *
+ * Past this amount new RTP packets are dropped; RTSP messages are
+ * always queued.
+ */
+#define RTSP_SCTP_MAX_PENDING 512
+
+typedef struct {
+    /** RTSP message or RTCP report, or NULL */
+    GByteArray *data;
+    /** RTP packet, or NULL */
+    RTP_Buffer *rtp;
+    struct sctp_sndrcvinfo info;
+    /** Time past which the message is useless; zero if it has to
+     *  be delivered anyway */
+    ev_tstamp deadline;
+} SCTP_Outbuf;
+
+static size_t sctp_outbuf_len(const SCTP_Outbuf *outbuf)
+{
+    return outbuf->data ? outbuf->data->len : rtp_buffer_len(outbuf->rtp);
+}
+
+static void sctp_outbuf_free(RTSP_Client *rtsp, SCTP_Outbuf *outbuf)
 {
-    int written = sctp_send(rtsp->sd,
-                            buffer->data, buffer->len,
-                            sctp_info,
-                            MSG_DONTWAIT | MSG_EOR);
+    rtsp->out_queue_bytes -= sctp_outbuf_len(outbuf);
 
-    stats_account_sent(rtsp, written);
-    g_byte_array_free(buffer, TRUE);
+    if ( outbuf->data )
+        output_pool_array_free(outbuf->data);
+    if ( outbuf->rtp )
+        rtp_buffer_free(outbuf->rtp);
+
+    g_slice_free(SCTP_Outbuf, outbuf);
+}
+
+/**
+ * @brief Drop the queued messages whose lifetime is over
+ */
+static void rtsp_sctp_drop_expired(RTSP_Client *rtsp, ev_tstamp now)
+{
+    GPtrArray *pending = rtsp->sctp_pending;
+    guint i, kept = 0;
+
+    for ( i = 0; i < pending->len; i++ ) {
+        SCTP_Outbuf *outbuf = g_ptr_array_index(pending, i);
+
+        if ( outbuf->deadline != 0 && outbuf->deadline <= now ) {
+            sctp_outbuf_free(rtsp, outbuf);
+            continue;
+        }
+
+        g_ptr_array_index(pending, kept++) = outbuf;
+    }
+
+    g_ptr_array_set_size(pending, kept);
+}
+
+#ifndef HAVE_SENDMMSG
+struct rtsp_sctp_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+# define mmsghdr rtsp_sctp_mmsghdr
+
+/**
+ * @brief Fallback for systems lacking sendmmsg()
+ */
+static int rtsp_sctp_sendmmsg(int sd, struct mmsghdr *msgs, unsigned int vlen,
+                              int flags)
+{
+    unsigned int i;
+
+    for(i = 0; i < vlen; i++) {
+        ssize_t written = sendmsg(sd, &msgs[i].msg_hdr, flags);
+        if ( written < 0 )
+            return i > 0 ? (int)i : -1;
+        msgs[i].msg_len = written;
+    }
+
+    return vlen;
+}
+#else
+# define rtsp_sctp_sendmmsg sendmmsg
+#endif
+
+/**
+ * @brief Send out the messages queued for an association
+ *
+ * @retval false The association failed, and the client has to be
+ *               disconnected.
+ */
+static gboolean rtsp_sctp_flush(RTSP_Client *rtsp)
+{
+    GPtrArray *pending = rtsp->sctp_pending;
+
+    /* we're waiting for the socket to be writable already */
+    if ( ev_is_active(&rtsp->ev_io_write) )
+        return true;
+
+    rtsp_sctp_drop_expired(rtsp, ev_now(rtsp->loop));
+
+    while ( pending->len > 0 ) {
+        struct mmsghdr msgs[RTSP_SCTP_BATCH_SIZE];
+        struct iovec iovs[RTSP_SCTP_BATCH_SIZE*2];
+        char control[RTSP_SCTP_BATCH_SIZE][CMSG_SPACE(sizeof(struct sctp_sndrcvinfo))];
+        const guint nmsgs = MIN(pending->len, RTSP_SCTP_BATCH_SIZE);
+        const ev_tstamp now = ev_now(rtsp->loop);
+        guint i;
+        int sent;
+
+        memset(msgs, 0, sizeof(msgs));
+
+        for ( i = 0; i < nmsgs; i++ ) {
+            SCTP_Outbuf *outbuf = g_ptr_array_index(pending, i);
+            struct msghdr *hdr = &msgs[i].msg_hdr;
+            struct cmsghdr *cm;
+            struct sctp_sndrcvinfo *info;
+
+            hdr->msg_iov = &iovs[i*2];
+
+            if ( outbuf->data ) {
+                iovs[i*2].iov_base = outbuf->data->data;
+                iovs[i*2].iov_len = outbuf->data->len;
+                hdr->msg_iovlen = 1;
+            } else {
+                iovs[i*2].iov_base = outbuf->rtp->header;
+                iovs[i*2].iov_len = RTP_HEADER_SIZE;
+                iovs[i*2+1].iov_base = outbuf->rtp->payload->data;
+                iovs[i*2+1].iov_len = outbuf->rtp->payload->data_size;
+                hdr->msg_iovlen = 2;
+            }
+
+            hdr->msg_control = control[i];
+            hdr->msg_controllen = sizeof(control[i]);
+
+            cm = CMSG_FIRSTHDR(hdr);
+            cm->cmsg_level = IPPROTO_SCTP;
+            cm->cmsg_type = SCTP_SNDRCV;
+            cm->cmsg_len = CMSG_LEN(sizeof(struct sctp_sndrcvinfo));
+
+            info = (struct sctp_sndrcvinfo*)CMSG_DATA(cm);
+            *info = outbuf->info;
+
+            /* the lifetime left, in milliseconds; at least one since
+               zero means no limit */
+            if ( outbuf->deadline != 0 )
+                info->sinfo_timetolive = MAX((outbuf->deadline - now) * 1000, 1);
+        }
+
+        sent = rtsp_sctp_sendmmsg(rtsp->sd, msgs, nmsgs, MSG_DONTWAIT);
+
+        if ( sent < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) {
+                ev_io_start(rtsp->loop, &rtsp->ev_io_write);
+                return true;
+            }
 
-    if ( written < 0 ) {
-        fnc_perror("");
-        return FALSE;
-    } else
-        return TRUE;
+            fnc_perror("sendmmsg");
+            return false;
+        }
+
+        for ( i = 0; i < (guint)sent; i++ ) {
+            stats_account_sent(rtsp, msgs[i].msg_len);
+            sctp_outbuf_free(rtsp, g_ptr_array_index(pending, i));
+        }
+
+        g_ptr_array_remove_range(pending, 0, sent);
+
+        /* the socket buffer is full, wait for it to drain */
+        if ( (guint)sent < nmsgs ) {
+            ev_io_start(rtsp->loop, &rtsp->ev_io_write);
+            return true;
+        }
+    }
+
+    return true;
 }
 
-static gboolean rtp_sctp_send_rtp(RTP_session *rtp, GByteArray *buffer)
+/**
+ * @brief Queue a message on an association
+ *
+ * @param rtsp The client owning the association
+ * @param data The message to send, or NULL
+ * @param rtp The RTP packet to send, or NULL
+ * @param info The stream and flags to send the message with
+ * @param deadline Time past which the message is useless, or zero
+ *
+ * @retval false The message was dropped, as too many of them are
+ *               waiting already.
+ */
+static gboolean rtsp_sctp_queue(RTSP_Client *rtsp, GByteArray *data,
+                                RTP_Buffer *rtp,
+                                const struct sctp_sndrcvinfo *info,
+                                ev_tstamp deadline)
 {
-    return rtsp_sctp_send_pkt(rtp->client, buffer, &rtp->sctp.rtp);
+    SCTP_Outbuf *outbuf;
+
+    if ( rtp != NULL && rtsp->sctp_pending->len >= RTSP_SCTP_MAX_PENDING ) {
+        rtp_buffer_free(rtp);
+        return false;
+    }
+
+    outbuf = g_slice_new(SCTP_Outbuf);
+    outbuf->data = data;
+    outbuf->rtp = rtp;
+    outbuf->info = *info;
+    outbuf->deadline = deadline;
+
+    rtsp->out_queue_bytes += sctp_outbuf_len(outbuf);
+    g_ptr_array_add(rtsp->sctp_pending, outbuf);
+
+    return true;
 }
 
-static gboolean rtp_sctp_send_rtcp(RTP_session *rtp, GByteArray *buffer)
+/**
+ * @brief Resume sending the queued messages once the socket is writable
+ */
+void rtsp_sctp_write_cb(struct ev_loop *loop, ev_io *w,
+                        ATTR_UNUSED int revents)
 {
-    return rtsp_sctp_send_pkt(rtp->client, buffer, &rtp->sctp.rtcp);
+    RTSP_Client *rtsp = w->data;
+
+    ev_io_stop(loop, w);
+
+    if ( !rtsp_sctp_flush(rtsp) )
+        rtsp_client_disconnect(rtsp);
 }
 
+/**
+ * @brief Free the messages still queued on an association
+ */
+void rtsp_sctp_free(RTSP_Client *rtsp)
+{
+    guint i;
+
+    if ( rtsp->sctp_pending == NULL )
+        return;
+
+    for ( i = 0; i < rtsp->sctp_pending->len; i++ )
+        sctp_outbuf_free(rtsp, g_ptr_array_index(rtsp->sctp_pending, i));
+
+    g_ptr_array_free(rtsp->sctp_pending, true);
+}
+
+static gboolean rtp_sctp_send_rtp(RTP_session *rtp, RTP_Buffer *buffer)
+{
+    RTSP_Client *rtsp = rtp->client;
+    const ev_tstamp deadline = rtsp->vhost->sctp_rtp_lifetime ?
+        buffer->scheduled + rtsp->vhost->sctp_rtp_lifetime / 1000.0 : 0;
+
+    if ( !rtsp_sctp_queue(rtsp, NULL, buffer, &rtp->sctp.rtp, deadline) )
+        return false;
+
+    if ( rtsp->sctp_pending->len >= RTSP_SCTP_BATCH_SIZE )
+        rtsp_sctp_flush(rtsp);
+
+    return true;
+}
+
+static gboolean rtp_sctp_send_rtcp(RTP_session *rtp, const GByteArray *buffer)
+{
+    GByteArray *copy = output_pool_array(buffer->len);
+
+    g_byte_array_append(copy, buffer->data, buffer->len);
+
+    /* queued after the packets the report refers to */
+    rtsp_sctp_queue(rtp->client, copy, NULL, &rtp->sctp.rtcp, 0);
+
+    return rtsp_sctp_flush(rtp->client);
+}
+
+static void rtp_sctp_flush(RTP_session *rtp)
+{
+    rtsp_sctp_flush(rtp->client);
+}
+
+/**
+ * @}
+ */
+
 static void rtp_sctp_close_transport(ATTR_UNUSED RTP_session *rtp)
 {
 }
@@ -98,10 +380,16 @@ gboolean rtp_sctp_transport(RTSP_Client *rtsp,
     rtsp_interleaved_register(rtsp, rtp_s, parsed->rtp_channel, parsed->rtcp_channel);
 
     rtp_s->sctp.rtp.sinfo_stream = parsed->rtp_channel;
-    rtp_s->sctp.rtcp.sinfo_stream = parsed->rtp_channel;
+    rtp_s->sctp.rtp.sinfo_flags = SCTP_UNORDERED;
+#ifdef SCTP_PR_SCTP_TTL
+    if ( rtsp->vhost->sctp_rtp_lifetime )
+        rtp_s->sctp.rtp.sinfo_flags |= SCTP_PR_SCTP_TTL;
+#endif
+    rtp_s->sctp.rtcp.sinfo_stream = parsed->rtcp_channel;
 
     rtp_s->send_rtp = rtp_sctp_send_rtp;
     rtp_s->send_rtcp = rtp_sctp_send_rtcp;
+    rtp_s->flush_transport = rtp_sctp_flush;
     rtp_s->close_transport = rtp_sctp_close_transport;
 
     rtp_s->transport_string = g_strdup_printf("RTP/AVP/SCTP;server_streams=%d-%d;ssrc=%08X",
@@ -112,7 +400,7 @@ gboolean rtp_sctp_transport(RTSP_Client *rtsp,
 }
 
 /**
- * @brief Directly send SCTP data to the client
+ * @brief Send RTSP data to the client, on the control stream
  *
  * @param client The client to write the data to
  * @param data The GByteArray object to queue for sending
@@ -126,10 +414,13 @@ void rtsp_sctp_send_rtsp(RTSP_Client *client, GByteArray *buffer)
         .sinfo_stream = 0
     };
 
-    rtsp_sctp_send_pkt(client, buffer, &sctp_channel_zero);
+    rtsp_sctp_queue(client, buffer, NULL, &sctp_channel_zero, 0);
+
+    if ( !rtsp_sctp_flush(client) )
+        rtsp_client_disconnect(client);
 }
 
-void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
+void rtsp_sctp_read_cb(ATTR_UNUSED struct ev_loop *loop, ev_io *w,
                        ATTR_UNUSED int revents)
 {
     RTSP_Client *rtsp = w->data;
@@ -228,5 +519,5 @@ void rtsp_sctp_read_cb(struct ev_loop *loop, ev_io *w,
     g_byte_array_free(buffer, TRUE);
 
     if ( disconnect )
-        ev_unloop(loop, EVUNLOOP_ONE);
+        rtsp_client_disconnect(rtsp);
 }
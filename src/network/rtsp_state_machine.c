@@ -25,6 +25,7 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include "rtsp.h"
@@ -97,6 +98,9 @@ static gboolean rtsp_check_required_options(RTSP_Client *client, RFC822_Request
  * header, we are expecting that same session. If we're not expecting any
  * session or if the session differs from the expected one, we respond with a
  * 454 "Session Not Found" status.
+ *
+ * A connection without a session of its own can take back the one of a
+ * dropped connection, see @ref rtsp_session_resume.
  */
 static gboolean rtsp_check_session(RTSP_Client *client, RFC822_Request *req)
 {
@@ -110,7 +114,9 @@ static gboolean rtsp_check_session(RTSP_Client *client, RFC822_Request *req)
          */
         !session_hdr ||
         /* Otherwise, check if the session is present and corresponds. */
-        (session && strcmp(session_hdr, session->session_id) == 0)
+        (session && strcmp(session_hdr, session->session_id) == 0) ||
+        /* Or if it's a parked session this connection takes back. */
+        (!session && rtsp_session_resume(client, session_hdr))
         )
         return true;
 
@@ -135,6 +141,7 @@ static void rtsp_handle_request(RTSP_Client *client, RFC822_Request *req)
 {
     const char *cseq_hdr, *cseq_hdr_end;
     guint64 cseq_val;
+    ev_tstamp start;
 
     static const rtsp_method_function methods[] = {
         [RTSP_Method_DESCRIBE] = RTSP_describe,
@@ -145,6 +152,14 @@ static void rtsp_handle_request(RTSP_Client *client, RFC822_Request *req)
         [RTSP_Method_PAUSE]    = RTSP_pause
     };
 
+    static const int latencies[] = {
+        [RTSP_Method_DESCRIBE] = METRIC_DESCRIBE_LATENCY + 1,
+        [RTSP_Method_SETUP]    = METRIC_SETUP_LATENCY + 1,
+        [RTSP_Method_PLAY]     = METRIC_PLAY_LATENCY + 1
+    };
+
+    metrics_count(METRIC_RTSP_REQUESTS, 1);
+
     /* No CSeq found */
     if ( (cseq_hdr = rfc822_headers_lookup(req->headers, RTSP_Header_CSeq)) == NULL ) {
         /** @todo This should be corrected for RFC! */
@@ -183,13 +198,71 @@ static void rtsp_handle_request(RTSP_Client *client, RFC822_Request *req)
     /* We're safe to use the array of functions since rtsp_parse_request() takes
      * care of responding with an error if the method is not implemented.
      */
+    start = ev_time();
     methods[req->method_id](client, req);
 
+    /* zero for the methods whose latency is not measured */
+    if ( (size_t)req->method_id < G_N_ELEMENTS(latencies) &&
+         latencies[req->method_id] != 0 )
+        metrics_observe(latencies[req->method_id] - 1, ev_time() - start);
+
  error:
     rfc822_free_request(req);
     client->pending_request = NULL;
 }
 
+/**
+ * @brief Check whether the input holds a complete request line or
+ *        header block
+ *
+ * @param rtsp The client to check the input of
+ * @param headers Whether to look for the empty line ending the
+ *                headers, rather than the end of the first line
+ *
+ * The parsers are only run once this is true, so that they go
+ * through each byte of the input once; @ref
+ * RTSP_Client::input_scanned keeps the start of the last incomplete
+ * line, so that the next call resumes from there.
+ */
+gboolean rtsp_input_complete(RTSP_Client *rtsp, gboolean headers)
+{
+    const guint8 *const data = rtsp->input->data;
+    const size_t len = rtsp->input->len;
+    size_t line = rtsp->input_scanned;
+
+    while ( line < len ) {
+        const guint8 *lf;
+        size_t i = line;
+
+        /* CRLF is CR* LF, an empty line ends the headers */
+        if ( headers ) {
+            while ( i < len && data[i] == '\r' )
+                i++;
+
+            if ( i == len )
+                break;
+
+            if ( data[i] == '\n' ) {
+                rtsp->input_scanned = 0;
+                return true;
+            }
+        }
+
+        if ( (lf = memchr(data + i, '\n', len - i)) == NULL )
+            break;
+
+        if ( !headers ) {
+            rtsp->input_scanned = 0;
+            return true;
+        }
+
+        line = lf - data + 1;
+    }
+
+    rtsp->input_scanned = line;
+    return false;
+}
+
 static gboolean RTSP_handle_interleaved(RTSP_Client *rtsp) {
     uint16_t length;
 
@@ -214,6 +287,41 @@ static gboolean RTSP_handle_interleaved(RTSP_Client *rtsp) {
     return true;
 }
 
+/**
+ * @brief Redirect a request to another server
+ *
+ * @param req The request to redirect
+ * @param host The host, and optionally the port, of the server to
+ *             redirect to
+ *
+ * The request is answered with a 302 (Found) status, pointing to the
+ * same path on @p host.
+ */
+void rtsp_redirect(RTSP_Client *rtsp, RFC822_Request *req, const char *host)
+{
+    char *redir;
+    RFC822_Response *response = rfc822_response_new(req, RTSP_Found);
+
+    switch(req->proto) {
+        case RFC822_Protocol_HTTP10:
+        case RFC822_Protocol_HTTP11:
+            redir = g_strdup_printf("http://%s/%s", host, req->uri->path);
+        break;
+        default:
+            redir = g_strdup_printf("rtsp://%s/%s", host, req->uri->path);
+        break;
+    }
+
+    fnc_log(FNC_LOG_INFO, "Redirecting to %s", redir);
+
+    response->proto = req->proto;
+    rfc822_headers_set(response->headers,
+                       RFC822_Header_Location,
+                       strdup(redir));
+    rfc822_response_send(rtsp, response);
+    g_free(redir);
+}
+
 /**
  * @brief enforce connection limit as set by configuration
  *
@@ -222,41 +330,27 @@ static gboolean RTSP_handle_interleaved(RTSP_Client *rtsp) {
  * This function enforces connection limit by redirecting to a twin
  * server with a 302 (Found) status or, if no server had been designed
  * in the configuration, replying with a 453 status (Not Enough
- * Bandwidth)
+ * Bandwidth). Below the limit, the new sessions can still be
+ * redirected to a less loaded node, see @ref rtsp_cluster.
  */
 
 gboolean rtsp_connection_limit(RTSP_Client *rtsp, RFC822_Request *req)
 {
-    if (rtsp->vhost->connection_count > rtsp->vhost->max_connections) {
+    if ((guint)g_atomic_int_get(&rtsp->vhost->connection_count) >
+        rtsp->vhost->max_connections) {
         const char *twin = rtsp->vhost->twin;
         fnc_log(FNC_LOG_INFO, "Max connection reached");
         if (twin) {
-            char *redir;
-            RFC822_Response *response = rfc822_response_new(req, RTSP_Found);
-
-            switch(req->proto) {
-                case RFC822_Protocol_HTTP10:
-                case RFC822_Protocol_HTTP11:
-                    redir = g_strdup_printf("http://%s/%s", twin, req->uri->path);
-                break;
-                default:
-                    redir = g_strdup_printf("rtsp://%s/%s", twin, req->uri->path);
-                break;
-            }
-
-            fnc_log(FNC_LOG_INFO, "Redirecting to %s", redir);
-
-            response->proto = req->proto;
-            rfc822_headers_set(response->headers,
-                               RFC822_Header_Location,
-                               strdup(redir));
-            rfc822_response_send(rtsp, response);
-            g_free(redir);
+            rtsp_redirect(rtsp, req, twin);
         } else {
             rtsp_quick_response(rtsp, req, RTSP_NotEnoughBandwidth);
         }
         return false;
     }
+
+    if ( rtsp_cluster_redirect(rtsp, req) )
+        return false;
+
     return true;
 }
 
@@ -275,6 +369,9 @@ static gboolean RTSP_handle_new(RTSP_Client *rtsp) {
             .proto = RFC822_Protocol_Invalid
         };
 
+        if ( !rtsp_input_complete(rtsp, false) )
+            return false;
+
         request_line_len = ragel_parse_request_line((char*)rtsp->input->data,
                                                     rtsp->input->len,
                                                     &tmpreq);
@@ -328,6 +425,9 @@ static gboolean RTSP_handle_headers(RTSP_Client *rtsp) {
     size_t parsed_headers;
     int headers_res;
 
+    if ( !rtsp_input_complete(rtsp, true) )
+        return false;
+
     if ( rtsp->pending_request->headers == NULL )
         rtsp->pending_request->headers = rfc822_headers_new();
 
@@ -36,6 +36,7 @@
 #include "rtsp.h"
 #include "rtp.h"
 #include "uri.h"
+#include "fnc_log.h"
 #include "media/media.h"
 
 /**
@@ -103,9 +104,76 @@ RTSP_session *rtsp_session_new(RTSP_Client *rtsp)
                                       g_random_int());
     new->play_requests = g_queue_new();
 
+    metrics_gauge_add(METRIC_SESSIONS, 1);
+
     return new;
 }
 
+/**
+ * @brief Split a session off its shared resource
+ *
+ * @param session The session to split off
+ *
+ * @retval true The session now has a private resource.
+ * @retval false The file couldn't be opened again; the session is
+ *               left on the shared resource.
+ *
+ * @see r_unshare
+ */
+gboolean rtsp_session_unshare(RTSP_session *session)
+{
+    Resource *resource = r_unshare(session->resource);
+
+    if ( resource == NULL )
+        return false;
+
+    fnc_log(FNC_LOG_DEBUG, "[%s] splitting off shared resource",
+            session->resource->mrl);
+
+    rtp_session_gslist_rebind(session->rtp_sessions, resource);
+
+    r_close(session->resource);
+    session->resource = resource;
+
+    return true;
+}
+
+/**
+ * @brief Move a session from a live resource to its recording
+ *
+ * @param session The session to move, on a live resource recorded
+ *                for time-shift
+ *
+ * @retval true The session now reads the recording of the resource.
+ * @retval false Nothing is recorded yet, or the session is sent over
+ *               multicast; the session is left on the live resource.
+ *
+ * @see timeshift_open
+ */
+gboolean rtsp_session_timeshift(RTSP_session *session)
+{
+    Resource *resource;
+    GSList *item;
+
+    /* the multicast groups only carry the live packets */
+    for ( item = session->rtp_sessions; item != NULL; item = item->next )
+        if ( ((RTP_session*)item->data)->multicast != NULL )
+            return false;
+
+    if ( (resource = timeshift_open(session->resource)) == NULL )
+        return false;
+
+    fnc_log(FNC_LOG_DEBUG, "[%s] playing back the time-shift recording",
+            session->resource->mrl);
+
+    rtp_session_gslist_rebind(session->rtp_sessions, resource);
+
+    r_close(session->resource);
+    session->resource = resource;
+
+    return true;
+}
+
 /**
  * @brief Free resources for a RTSP session object
  *
@@ -130,6 +198,8 @@ void rtsp_session_free(RTSP_session *session)
 
     g_free(session->session_id);
     g_slice_free(RTSP_session, session);
+
+    metrics_gauge_add(METRIC_SESSIONS, -1);
 }
 
 
@@ -232,6 +302,72 @@ gboolean rtsp_check_invalid_state(RTSP_Client *client,
     return false;
 }
 
+/**
+ * @brief Check whether a resource is to be sent as MPEG-TS
+ *
+ * @param vhost The vhost the resource is requested on
+ * @param path The path of the resource
+ *
+ * The leading slashes of both the path and the configured prefixes
+ * are ignored, so that "/" matches all the resources of the vhost.
+ */
+static gboolean vhost_mp2t_path(cfg_vhost_t *vhost, const char *path)
+{
+    GList *item;
+
+    while ( *path == '/' )
+        path++;
+
+    for ( item = vhost->mp2t_paths; item != NULL; item = item->next ) {
+        const char *prefix = item->data;
+
+        while ( *prefix == '/' )
+            prefix++;
+
+        if ( g_str_has_prefix(path, prefix) )
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Get the packetization settings configured for a vhost
+ *
+ * @param vhost The vhost to get the settings of
+ * @param path The path of the resource the settings are for
+ * @param interleaved Whether the client gets RTP on its RTSP
+ *                    connection, whether TCP or SCTP, that doesn't
+ *                    share the path MTU limits of UDP.
+ * @param settings Where to store the settings
+ */
+void vhost_mparser_settings(cfg_vhost_t *vhost, const char *path,
+                            gboolean interleaved, MParserSettings *settings)
+{
+    settings->mtu = interleaved ? vhost->interleaved_mtu : vhost->mtu;
+    settings->bundle_time = vhost->audio_bundle_time;
+    settings->video_buffer_low = vhost->video_buffer_low;
+    settings->video_buffer_high = vhost->video_buffer_high;
+    settings->audio_buffer_low = vhost->audio_buffer_low;
+    settings->audio_buffer_high = vhost->audio_buffer_high;
+    settings->mp2t = vhost_mp2t_path(vhost, path);
+}
+
+/**
+ * @brief Get the packetization settings for a client
+ *
+ * @param client The client to get the settings for
+ * @param path See @ref vhost_mparser_settings
+ * @param interleaved See @ref vhost_mparser_settings
+ * @param settings Where to store the settings configured for the
+ *                 client's vhost
+ */
+void rtsp_mparser_settings(RTSP_Client *client, const char *path,
+                           gboolean interleaved, MParserSettings *settings)
+{
+    vhost_mparser_settings(client->vhost, path, interleaved, settings);
+}
+
 /**
  * @}
  */
@@ -0,0 +1,288 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "network/rtsp.h"
+#include "media/media.h"
+
+/**
+ * @defgroup prewarm Resource prewarming
+ *
+ * @brief Open the popular files before the clients ask for them
+ *
+ * The first client of a file pays for probing it, for building its
+ * seek index and for reading its first packets from the disk. The
+ * files listed by the @c prewarm-list of each vhost are instead
+ * opened in the background at startup, by a pool of @ref
+ * cfg_options_t::prewarm_threads threads, so that the DESCRIBE is
+ * answered from the SDP cache and the first PLAY finds the index and
+ * the data already in memory.
+ *
+ * Opening the file is enough to start the seek index build and the
+ * readahead of @ref avio_prefetch; the @c prewarm-readahead of the
+ * vhost has the kernel read further in. More files can be prewarmed
+ * while running with an HTTP GET on @ref cfg_options_t::prewarm_path.
+ *
+ * @{
+ */
+
+typedef struct {
+    cfg_vhost_t *vhost;
+    /** Path of the file within the vhost, with a leading slash */
+    gchar *path;
+} PrewarmJob;
+
+static GThreadPool *prewarm_pool;
+
+/**
+ * @brief Advise the kernel to read the first seconds of a file
+ */
+static void prewarm_readahead(const char *mrl, const struct stat *filestat,
+                              double duration, unsigned int seconds)
+{
+#ifdef POSIX_FADV_WILLNEED
+    off_t len;
+    int fd;
+
+    if ( seconds == 0 || duration <= 0 || duration == HUGE_VAL )
+        return;
+
+    len = seconds >= duration ? filestat->st_size :
+        (off_t)(filestat->st_size * (seconds / duration));
+
+    if ( (fd = open(mrl, O_RDONLY)) < 0 )
+        return;
+
+    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
+static void prewarm_job_run(gpointer job_p, ATTR_UNUSED gpointer user_data)
+{
+    PrewarmJob *job = job_p;
+    gchar *mrl = g_strconcat(job->vhost->document_root, job->path, NULL);
+    GTimer *timer = g_timer_new();
+    MParserSettings settings;
+    struct stat filestat;
+    Resource *resource;
+
+    vhost_mparser_settings(job->vhost, job->path, false, &settings);
+
+    if ( stat(mrl, &filestat) != 0 ||
+         (resource = r_open(job->path, &settings)) == NULL ) {
+        fnc_log(FNC_LOG_WARN, "[prewarm] unable to open %s", job->path);
+        goto end;
+    }
+
+    sdp_cache_prewarm(job->vhost, job->path, resource);
+    prewarm_readahead(mrl, &filestat, resource->duration,
+                      job->vhost->prewarm_readahead);
+
+    fnc_log(FNC_LOG_INFO, "[prewarm] %s: %u tracks in %.3f seconds",
+            job->path, g_list_length(resource->tracks),
+            g_timer_elapsed(timer, NULL));
+
+    r_close(resource);
+
+ end:
+    g_timer_destroy(timer);
+    g_free(mrl);
+    g_free(job->path);
+    g_slice_free(PrewarmJob, job);
+}
+
+/**
+ * @brief Queue the files matching a pattern for prewarming
+ *
+ * @param vhost The vhost to prewarm the files for
+ * @param pattern A glob(3) pattern relative to the document root of
+ *                @p vhost
+ *
+ * @return The number of files queued.
+ */
+guint prewarm_queue(cfg_vhost_t *vhost, const char *pattern)
+{
+    const size_t root_len = strlen(vhost->document_root);
+    gchar *full;
+    glob_t matches;
+    guint queued = 0;
+    size_t i;
+
+    if ( prewarm_pool == NULL || strstr(pattern, "..") != NULL )
+        return 0;
+
+    while ( *pattern == '/' )
+        pattern++;
+
+    full = g_strjoin("/", vhost->document_root, pattern, NULL);
+
+    if ( glob(full, 0, NULL, &matches) != 0 ) {
+        fnc_log(FNC_LOG_WARN, "[prewarm] no file matches %s", pattern);
+        g_free(full);
+        return 0;
+    }
+
+    for ( i = 0; i < matches.gl_pathc; i++ ) {
+        PrewarmJob *job;
+        struct stat filestat;
+
+        if ( stat(matches.gl_pathv[i], &filestat) != 0 ||
+             !S_ISREG(filestat.st_mode) )
+            continue;
+
+        job = g_slice_new(PrewarmJob);
+        job->vhost = vhost;
+        job->path = g_strdup(matches.gl_pathv[i] + root_len);
+
+        g_thread_pool_push(prewarm_pool, job, NULL);
+        queued++;
+    }
+
+    globfree(&matches);
+    g_free(full);
+
+    return queued;
+}
+
+/**
+ * @brief Queue the files listed by the @c prewarm-list of a vhost
+ *
+ * @return The number of files queued.
+ */
+static guint prewarm_queue_list(cfg_vhost_t *vhost)
+{
+    gchar *contents;
+    gchar **lines;
+    guint queued = 0;
+    size_t i;
+
+    if ( vhost->prewarm_list == NULL )
+        return 0;
+
+    if ( !g_file_get_contents(vhost->prewarm_list, &contents, NULL, NULL) ) {
+        fnc_log(FNC_LOG_ERR, "[prewarm] unable to read %s",
+                vhost->prewarm_list);
+        return 0;
+    }
+
+    lines = g_strsplit(contents, "\n", 0);
+    g_free(contents);
+
+    for ( i = 0; lines[i] != NULL; i++ ) {
+        const char *line = g_strstrip(lines[i]);
+
+        if ( *line == '\0' || *line == '#' )
+            continue;
+
+        queued += prewarm_queue(vhost, line);
+    }
+
+    g_strfreev(lines);
+
+    fnc_log(FNC_LOG_INFO, "[prewarm] %u files queued from %s",
+            queued, vhost->prewarm_list);
+
+    return queued;
+}
+
+static void prewarm_queue_list_cb(gpointer vhost_p,
+                                  ATTR_UNUSED gpointer user_data)
+{
+    prewarm_queue_list(vhost_p);
+}
+
+/**
+ * @brief Start prewarming the files listed for each vhost
+ *
+ * @note Has to be called after @ref r_init, the files being opened
+ *       the same way as for the clients.
+ */
+void prewarm_init()
+{
+    prewarm_pool = g_thread_pool_new(prewarm_job_run, NULL,
+                                     feng_srv.prewarm_threads,
+                                     false, NULL);
+
+    g_list_foreach(configured_vhosts, prewarm_queue_list_cb, NULL);
+}
+
+/**
+ * @brief Prewarm the files requested with an HTTP GET
+ *
+ * @param rtsp The client requesting it, on the vhost to prewarm the
+ *             files for
+ *
+ * The query string of the request is the URL-escaped pattern of the
+ * files (see @ref prewarm_queue); without a query string the
+ * vhost's list is read again.
+ */
+void feng_send_prewarm(RTSP_Client *rtsp)
+{
+    RFC822_Response *response =
+        rfc822_response_new(rtsp->pending_request, RTSP_Ok);
+    const char *query = strchr(rtsp->pending_request->object, '?');
+    guint queued;
+
+    if ( query != NULL && query[1] != '\0' ) {
+        gchar *pattern = g_uri_unescape_string(query + 1, NULL);
+
+        queued = pattern != NULL ? prewarm_queue(rtsp->vhost, pattern) : 0;
+        g_free(pattern);
+    } else
+        queued = prewarm_queue_list(rtsp->vhost);
+
+    response->body = g_string_new("");
+    g_string_printf(response->body, "%u files queued\n", queued);
+
+    rfc822_headers_set(response->headers,
+                       RTSP_Header_Content_Type,
+                       g_strdup("text/plain"));
+    rfc822_response_send(rtsp, response);
+}
+
+/**
+ * @brief Drop the files still queued, waiting for those being opened
+ */
+void prewarm_cleanup()
+{
+    if ( prewarm_pool == NULL )
+        return;
+
+    g_thread_pool_free(prewarm_pool, true, true);
+    prewarm_pool = NULL;
+}
+
+/**
+ * @}
+ */
@@ -29,10 +29,9 @@
 
 #include "feng.h"
 #include "network/rtsp.h"
+#include "network/rtp.h"
 #include "media/media.h"
 
-static size_t stats_total_bytes_sent;
-static size_t stats_total_bytes_read;
 static time_t stats_start_time;
 
 /**
@@ -52,7 +51,7 @@ void stats_account_read(RTSP_Client *rtsp, size_t bytes)
         return;
 
     rtsp->bytes_read += bytes;
-    stats_total_bytes_sent += bytes;
+    metrics_count(METRIC_BYTES_READ, bytes);
 }
 
 void stats_account_sent(RTSP_Client *rtsp, size_t bytes)
@@ -61,11 +60,37 @@ void stats_account_sent(RTSP_Client *rtsp, size_t bytes)
         return;
 
     rtsp->bytes_sent += bytes;
-    stats_total_bytes_read += bytes;
+    metrics_count(METRIC_BYTES_SENT, bytes);
 }
 
 /**
- * @brief Produce per client statistics
+ * @brief Statistics of a RTP session, copied out of the clients' list
+ */
+typedef struct {
+    gchar *uri;
+    RTP_ReceiverStats receiver;
+    gboolean thinning;
+} RTPStats;
+
+/**
+ * @brief Statistics of a client, copied out of the clients' list
+ *
+ * The JSON is only built once @ref clients_list_lock is released, so
+ * that connections and disconnections are not held back by it.
+ */
+typedef struct {
+    gchar *resource_uri;
+    gchar *remote_host;
+    size_t bytes_sent;
+    size_t bytes_read;
+    gboolean has_resource;
+    gsize queue_bytes;
+    guint lag_skips;
+    GArray *rtp;
+} ClientStats;
+
+/**
+ * @brief Copy the statistics of a client
  *
  * @note feed to g_slist_foreach
  */
@@ -74,23 +99,94 @@ static void client_stats(gpointer c, gpointer s)
 {
     RTSP_Client *client = c;
     RTSP_session *session = client->session;
-    json_object *clients_stats = s;
-    json_object *stats = json_object_new_object();
+    GArray *snapshot = s;
+    ClientStats stats;
+    GSList *item;
+
     // Sessionless clients are querying stats, let's ignore them.
     if (!session) return;
+
+    stats.resource_uri = g_strdup(session->resource_uri);
+    stats.remote_host = g_strdup(client->remote_host);
+    stats.bytes_sent = client->bytes_sent;
+    stats.bytes_read = client->bytes_read;
+    stats.has_resource = session->resource != NULL;
+    stats.queue_bytes = stats.has_resource ?
+        r_queue_bytes(session->resource) : 0;
+    stats.lag_skips = 0;
+    stats.rtp = g_array_new(false, false, sizeof(RTPStats));
+
+    for ( item = session->rtp_sessions; item != NULL; item = item->next ) {
+        RTP_session *rtp = item->data;
+        RTPStats track;
+
+        stats.lag_skips += rtp->lag_skips;
+
+        track.uri = g_strdup(rtp->uri);
+        track.receiver = rtp->receiver;
+        track.thinning = rtp->thinning;
+        g_array_append_val(stats.rtp, track);
+    }
+
+    g_array_append_val(snapshot, stats);
+}
+
+/**
+ * @brief Produce per client statistics from their copy
+ */
+
+static json_object *client_stats_json(ClientStats *client)
+{
+    json_object *stats = json_object_new_object();
+    json_object *rtp_stats = json_object_new_array();
+    guint i;
+
     json_object_object_add(stats, "resource_uri",
-        json_object_new_string(session->resource_uri));
+        json_object_new_string(client->resource_uri));
     json_object_object_add(stats, "user_agent",
         json_object_new_string("missing"/*client->stats->user_agent*/));
     json_object_object_add(stats, "remote_host",
         json_object_new_string(client->remote_host));
-    json_object_object_add(stats, "remote_host",
-        json_object_new_string(client->remote_host));
     json_object_object_add(stats, "bytes_sent",
         json_object_new_int(client->bytes_sent));
     json_object_object_add(stats, "bytes_read",
         json_object_new_int(client->bytes_read));
-    json_object_array_add(clients_stats, stats);
+    if ( client->has_resource )
+        json_object_object_add(stats, "queue_bytes",
+            json_object_new_int(client->queue_bytes));
+
+    for ( i = 0; i < client->rtp->len; i++ ) {
+        RTPStats *rtp = &g_array_index(client->rtp, RTPStats, i);
+        json_object *track = json_object_new_object();
+
+        json_object_object_add(track, "uri",
+            json_object_new_string(rtp->uri));
+        json_object_object_add(track, "reports",
+            json_object_new_int(rtp->receiver.reports));
+        json_object_object_add(track, "fraction_lost",
+            json_object_new_double(rtp->receiver.fraction_lost));
+        json_object_object_add(track, "cumulative_lost",
+            json_object_new_int(rtp->receiver.cumulative_lost));
+        json_object_object_add(track, "jitter",
+            json_object_new_double(rtp->receiver.jitter));
+        json_object_object_add(track, "rtt",
+            json_object_new_double(rtp->receiver.rtt));
+        json_object_object_add(track, "thinning",
+            json_object_new_boolean(rtp->thinning));
+        json_object_array_add(rtp_stats, track);
+
+        g_free(rtp->uri);
+    }
+
+    json_object_object_add(stats, "lag_skips",
+        json_object_new_int(client->lag_skips));
+    json_object_object_add(stats, "rtp", rtp_stats);
+
+    g_free(client->resource_uri);
+    g_free(client->remote_host);
+    g_array_free(client->rtp, true);
+
+    return stats;
 }
 
 /**
@@ -103,17 +199,45 @@ void feng_send_statistics(RTSP_Client *rtsp)
         rfc822_response_new(rtsp->pending_request, RTSP_Ok);
     json_object *stats = json_object_new_object();
     json_object *clients_stats = json_object_new_array();
+    json_object *pool_stats = json_object_new_object();
+    GArray *snapshot = g_array_new(false, false, sizeof(ClientStats));
+    MParserBufferPoolStats pool;
+    guint i;
 
     json_object_object_add(stats, "bytes_sent",
-        json_object_new_int(stats_total_bytes_sent));
+        json_object_new_int(metrics_counter_get(METRIC_BYTES_SENT)));
 
     json_object_object_add(stats, "bytes_read",
-        json_object_new_int(stats_total_bytes_read));
+        json_object_new_int(metrics_counter_get(METRIC_BYTES_READ)));
 
     json_object_object_add(stats, "uptime",
         json_object_new_int(time(NULL) - stats_start_time));
 
-    clients_each(client_stats, clients_stats);
+    mparser_buffer_pool_stats(&pool);
+
+    json_object_object_add(pool_stats, "hits",
+        json_object_new_int(pool.hits));
+    json_object_object_add(pool_stats, "misses",
+        json_object_new_int(pool.misses));
+    json_object_object_add(pool_stats, "oversize",
+        json_object_new_int(pool.oversize));
+    json_object_object_add(pool_stats, "recycled",
+        json_object_new_int(pool.recycled));
+    json_object_object_add(pool_stats, "trimmed",
+        json_object_new_int(pool.trimmed));
+
+    json_object_object_add(stats, "buffer_pool", pool_stats);
+
+    json_object_object_add(stats, "queue_bytes",
+        json_object_new_int(bq_memory_usage()));
+
+    clients_each(client_stats, snapshot);
+
+    for ( i = 0; i < snapshot->len; i++ )
+        json_object_array_add(clients_stats,
+            client_stats_json(&g_array_index(snapshot, ClientStats, i)));
+
+    g_array_free(snapshot, true);
 
     json_object_object_add(stats, "clients",
                            json_object_new_int(json_object_array_length(clients_stats)));
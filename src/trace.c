@@ -0,0 +1,216 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+
+#include <config.h>
+
+#include <time.h>
+#include <ev.h>
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#endif
+
+#include "feng.h"
+#include "trace.h"
+#include "media/media.h"
+#include "network/rtp.h"
+
+/**
+ * @defgroup pipeline_trace Pipeline tracing
+ *
+ * @brief Find out which stage of the pipeline makes a stream late
+ *
+ * Built with --enable-pipeline-trace, each packet gets a monotonic
+ * timestamp when it's read from the demuxer or the live source
+ * (carried over to all the buffers the parser makes out of it), and
+ * another when it's queued on its track; once sent, the delays
+ * between the stages, and between the scheduled and actual send
+ * time, are added to log2 histograms of its track, reported with the
+ * metrics (see @ref metrics).
+ *
+ * When sys/sdt.h is available, the same points are USDT probes of
+ * the "feng" provider, that bpftrace or SystemTap can attach to:
+ *
+ * - ingest(track)
+ * - queue(track, seq, demux_queue_us)
+ * - send(track, ssrc, seq, queue_wire_us, lateness_us)
+ *
+ * @{
+ */
+
+#ifdef HAVE_SYS_SDT_H
+# define TRACE_PROBE1(name, a) DTRACE_PROBE1(feng, name, a)
+# define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(feng, name, a, b, c)
+# define TRACE_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(feng, name, a, b, c, d, e)
+#else
+# define TRACE_PROBE1(name, a) do { } while(0)
+# define TRACE_PROBE3(name, a, b, c) do { } while(0)
+# define TRACE_PROBE5(name, a, b, c, d, e) do { } while(0)
+#endif
+
+static const char *const trace_stage_names[_TRACE_STAGE_MAX] = {
+    [TRACE_DEMUX_QUEUE] = "demux_queue",
+    [TRACE_QUEUE_WIRE] = "queue_wire",
+    [TRACE_DEMUX_WIRE] = "demux_wire",
+    [TRACE_SEND_LATENESS] = "send_lateness"
+};
+
+/**
+ * @brief Current monotonic time, in seconds
+ */
+double trace_now(void)
+{
+#if HAVE_CLOCK_GETTIME
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * .000000001;
+#else
+    return ev_time();
+#endif
+}
+
+/**
+ * @brief Mark the packet read for a track, before it's parsed
+ *
+ * The buffers the parser makes out of it get its time, see @ref
+ * trace_buffer_init.
+ */
+void trace_ingest(Track *tr)
+{
+    tr->trace.ingest = trace_now();
+
+    TRACE_PROBE1(ingest, tr->name);
+}
+
+static gint64 trace_to_us(double seconds)
+{
+    return seconds > 0 ? (gint64)(seconds * 1000000) : 0;
+}
+
+/**
+ * @brief Add a delay to one of the histograms of a track
+ *
+ * Bucket 0 holds delays under a microsecond, bucket n > 0 those
+ * between 2^(n-1) and 2^n microseconds, and the last one everything
+ * longer.
+ */
+static void trace_record(Track *tr, TraceStage stage, gint64 us)
+{
+    guint bucket = 0;
+
+    if ( us > 0 )
+        bucket = MIN(g_bit_storage((gulong)MIN(us, G_MAXINT32)),
+                     TRACE_BUCKETS - 1);
+
+    __sync_add_and_fetch(&tr->trace.histograms[stage][bucket], 1);
+    __sync_add_and_fetch(&tr->trace.sums[stage], us);
+}
+
+/**
+ * @brief Mark a buffer as queued
+ *
+ * @note Called by @ref track_write with the track's lock held, once
+ *       the buffer has its sequence number.
+ */
+void trace_queue(Track *tr, struct MParserBuffer *buffer)
+{
+    gint64 delay = 0;
+
+    buffer->trace_queued = trace_now();
+
+    if ( buffer->trace_ingest > 0 ) {
+        delay = trace_to_us(buffer->trace_queued - buffer->trace_ingest);
+        trace_record(tr, TRACE_DEMUX_QUEUE, delay);
+    }
+
+    TRACE_PROBE3(queue, tr->name, buffer->seq_no, delay);
+}
+
+/**
+ * @brief Mark a buffer as handed over to the transport
+ *
+ * @param session The session sending the buffer
+ * @param buffer The buffer sent
+ * @param scheduled The time the buffer was to be sent at, in the
+ *                  event loop's clock
+ */
+void trace_send(RTP_session *session, struct MParserBuffer *buffer,
+                double scheduled)
+{
+    Track *tr = session->track;
+    const double now = trace_now();
+    const gint64 queue_wire = trace_to_us(now - buffer->trace_queued);
+    const gint64 lateness = trace_to_us(ev_time() - scheduled);
+
+    trace_record(tr, TRACE_QUEUE_WIRE, queue_wire);
+    trace_record(tr, TRACE_SEND_LATENESS, lateness);
+
+    if ( buffer->trace_ingest > 0 )
+        trace_record(tr, TRACE_DEMUX_WIRE,
+                     trace_to_us(now - buffer->trace_ingest));
+
+    TRACE_PROBE5(send, tr->name, session->ssrc, buffer->seq_no,
+                 queue_wire, lateness);
+}
+
+/**
+ * @brief Report the histograms of a track, in Prometheus text format
+ *
+ * @param out The string to append to
+ * @param tr The track to report
+ * @param labels The labels identifying the track, already escaped
+ */
+void trace_append_metrics(GString *out, const Track *tr, const char *labels)
+{
+    guint stage, bucket;
+
+    for ( stage = 0; stage < _TRACE_STAGE_MAX; stage++ ) {
+        const char *name = trace_stage_names[stage];
+        guint64 count = 0;
+
+        for ( bucket = 0; bucket < TRACE_BUCKETS - 1; bucket++ ) {
+            count += tr->trace.histograms[stage][bucket];
+            g_string_append_printf(out,
+                                   "feng_pipeline_seconds_bucket{%s,stage=\"%s\",le=\"%g\"} %"
+                                   G_GUINT64_FORMAT "\n",
+                                   labels, name,
+                                   (double)((guint64)1 << bucket) / 1000000, count);
+        }
+        count += tr->trace.histograms[stage][TRACE_BUCKETS - 1];
+
+        g_string_append_printf(out,
+                               "feng_pipeline_seconds_bucket{%s,stage=\"%s\",le=\"+Inf\"} %"
+                               G_GUINT64_FORMAT "\n", labels, name, count);
+        g_string_append_printf(out,
+                               "feng_pipeline_seconds_sum{%s,stage=\"%s\"} %f\n",
+                               labels, name, tr->trace.sums[stage] / 1000000.0);
+        g_string_append_printf(out,
+                               "feng_pipeline_seconds_count{%s,stage=\"%s\"} %"
+                               G_GUINT64_FORMAT "\n", labels, name, count);
+    }
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,97 @@
+/* *
+ * This file is part of Feng
+ *
+ * Copyright (C) 2009 by LScube team <team@lscube.org>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ * */
+
+
+/**
+ * @file trace.h
+ * Per-packet timing of the pipeline, see @ref pipeline_trace
+ */
+
+#ifndef FN_TRACE_H
+#define FN_TRACE_H
+
+#include <glib.h>
+
+/**
+ * @addtogroup pipeline_trace
+ * @{
+ */
+
+/** Number of buckets of the per-track histograms */
+#define TRACE_BUCKETS 32
+
+typedef enum {
+    /** From ingest (demuxer or live source) to the track's queue */
+    TRACE_DEMUX_QUEUE,
+    /** From the queue to the transport */
+    TRACE_QUEUE_WIRE,
+    /** From ingest to the transport */
+    TRACE_DEMUX_WIRE,
+    /** Actual send time against the scheduled one */
+    TRACE_SEND_LATENESS,
+    _TRACE_STAGE_MAX
+} TraceStage;
+
+/**
+ * @brief Timing state of a track
+ */
+typedef struct TrackTrace {
+    /** Time the packet being parsed was read, see @ref trace_ingest */
+    double ingest;
+    /** log2 histograms, in microseconds, of each @ref TraceStage */
+    guint64 histograms[_TRACE_STAGE_MAX][TRACE_BUCKETS];
+    /** Sum of the delays of each histogram, in microseconds */
+    guint64 sums[_TRACE_STAGE_MAX];
+} TrackTrace;
+
+struct Track;
+struct MParserBuffer;
+struct RTP_session;
+
+#ifdef FENG_TRACE
+
+double trace_now(void);
+void trace_ingest(struct Track *tr);
+void trace_queue(struct Track *tr, struct MParserBuffer *buffer);
+void trace_send(struct RTP_session *session, struct MParserBuffer *buffer,
+                double scheduled);
+void trace_append_metrics(GString *out, const struct Track *tr,
+                          const char *labels);
+
+/** @brief Carry the ingest time of a track over to a new buffer */
+# define trace_buffer_init(tr, buffer) \
+    ((buffer)->trace_ingest = (tr)->trace.ingest)
+
+#else
+
+# define trace_ingest(tr) do { } while(0)
+# define trace_buffer_init(tr, buffer) do { } while(0)
+# define trace_queue(tr, buffer) do { } while(0)
+# define trace_send(session, buffer, scheduled) do { (void)(scheduled); } while(0)
+
+#endif
+
+/**
+ * @}
+ */
+
+#endif // FN_TRACE_H
@@ -0,0 +1,91 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "network/rtp.h"
+#include "bench.h"
+
+/* the globals main.c would define */
+const char feng_signature[] = PACKAGE "/" VERSION;
+struct ev_loop *feng_loop;
+GList *configured_sockets;
+GList *configured_vhosts;
+
+cfg_options_t feng_srv = {
+    .log_level = FNC_LOG_ERR,
+    .error_log = "stderr",
+    .buffered_frames = BUFFERED_FRAMES_DEFAULT
+};
+
+/** Minimum time to run each case for, in seconds */
+static double bench_min_time = 1.0;
+
+/**
+ * @brief Set up what the benchmarked code expects of the server
+ */
+void bench_init(void)
+{
+    const char *min_time = getenv("FENG_BENCH_TIME");
+
+    if (!g_thread_supported ()) g_thread_init (NULL);
+
+    if ( min_time != NULL && atof(min_time) > 0 )
+        bench_min_time = atof(min_time);
+
+    fnc_log_init("bench");
+}
+
+/**
+ * @brief Tell whether a case has to be run once more
+ *
+ * @param timer The timer started with the case
+ * @param iterations The iterations run so far
+ *
+ * The clock is only read every so often, so that it doesn't weigh on
+ * the cheapest cases.
+ */
+gboolean bench_running(GTimer *timer, guint64 iterations)
+{
+    return (iterations & 63) != 0 ||
+        g_timer_elapsed(timer, NULL) < bench_min_time;
+}
+
+/**
+ * @brief Print the result of a case
+ *
+ * @param benchmark Name of the benchmark program
+ * @param bcase Name of the case within the benchmark
+ * @param value The measure
+ * @param unit Unit of @p value
+ */
+void bench_report(const char *benchmark, const char *bcase,
+                  double value, const char *unit)
+{
+    printf("%s\t%s\t%.3f\t%s\n", benchmark, bcase, value, unit);
+    fflush(stdout);
+}
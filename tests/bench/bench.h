@@ -0,0 +1,65 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef FENG_BENCH_H
+#define FENG_BENCH_H
+
+#include <glib.h>
+
+/**
+ * @defgroup bench Micro-benchmarks
+ *
+ * @brief Throughput of the hot paths, outside of the server
+ *
+ * Each benchmark is a program linked against the server's objects
+ * (libfeng.a), which provides the globals main.c would, and runs on
+ * its own; "make bench" builds and runs them all.
+ *
+ * Results are printed on standard output one per line, as four
+ * tab-separated fields:
+ *
+ * @code
+ * <benchmark> <case> <value> <unit>
+ * @endcode
+ *
+ * so that runs can be compared with a plain diff or loaded in a
+ * spreadsheet; everything else goes to standard error.
+ *
+ * Each case is run repeatedly for at least the minimum time, one
+ * second unless the FENG_BENCH_TIME environment variable says
+ * otherwise.
+ *
+ * @{
+ */
+
+void bench_init(void);
+
+gboolean bench_running(GTimer *timer, guint64 iterations);
+
+void bench_report(const char *benchmark, const char *bcase,
+                  double value, const char *unit);
+
+/**
+ * @}
+ */
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "feng.h"
+#include "network/rtp.h"
+#include "media/media.h"
+#include "bench.h"
+
+/**
+ * @file
+ * @brief Buffer queue throughput, by number of consumers
+ *
+ * A track is written to in batches, as a parser would do for a frame,
+ * and each of its consumers is moved through the batch as the RTP
+ * sender does; the result is the rate at which buffers are delivered
+ * to the consumers, and the cost of each buffer written.
+ */
+
+/** Buffers written at once, about a video frame's worth */
+#define BATCH_SIZE 32
+
+/** Payload of each buffer */
+#define PAYLOAD_SIZE 1400
+
+static void consumer_drain(RTP_session *consumer)
+{
+    if ( bq_consumer_get(consumer) == NULL )
+        return;
+
+    while ( bq_consumer_move(consumer) )
+        bq_consumer_get(consumer);
+}
+
+static void bench_consumers(guint consumers)
+{
+    Track *tr = track_new(g_strdup("bench"));
+    RTP_session *sessions = g_new0(RTP_session, consumers);
+    GTimer *timer;
+    guint64 iterations = 0;
+    double elapsed;
+    gchar *bcase;
+    guint i;
+
+    tr->media_type = MP_video;
+
+    for ( i = 0; i < consumers; i++ ) {
+        sessions[i].track = tr;
+        bq_consumer_new(&sessions[i]);
+    }
+
+    timer = g_timer_new();
+    do {
+        for ( i = 0; i < BATCH_SIZE; i++ ) {
+            struct MParserBuffer *buffer = mparser_buffer_alloc(tr, PAYLOAD_SIZE);
+
+            buffer->timestamp = buffer->delivery = iterations * 0.04;
+            buffer->duration = 0.04;
+            buffer->marker = (i == BATCH_SIZE - 1);
+
+            track_write(tr, buffer);
+        }
+
+        for ( i = 0; i < consumers; i++ )
+            consumer_drain(&sessions[i]);
+    } while ( bench_running(timer, ++iterations) );
+    elapsed = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    bcase = g_strdup_printf("consumers=%u", consumers);
+    bench_report("bufferqueue", bcase,
+                 iterations * BATCH_SIZE * consumers / elapsed, "deliveries/s");
+    bench_report("bufferqueue", bcase,
+                 elapsed * 1e9 / (iterations * BATCH_SIZE), "ns/write");
+    g_free(bcase);
+
+    for ( i = 0; i < consumers; i++ )
+        bq_consumer_free(&sessions[i]);
+
+    g_free(sessions);
+    track_free(tr);
+}
+
+int main()
+{
+    static const guint consumers[] = { 1, 10, 100, 1000 };
+    gsize i;
+
+    bench_init();
+
+    for ( i = 0; i < G_N_ELEMENTS(consumers); i++ )
+        bench_consumers(consumers[i]);
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "network/rtp.h"
+#include "network/rtsp.h"
+#include "media/media.h"
+#include "bench.h"
+
+/**
+ * @file
+ * @brief Cost of setting up a session, without sockets
+ *
+ * A client is set up as if accepted on a connection, but its output
+ * is collected in memory; requests for a whole session, OPTIONS,
+ * DESCRIBE, one SETUP for each track (interleaved), PLAY and
+ * TEARDOWN, are put in its input buffer and handled by the state
+ * machine, as the client loop would do on reading them.
+ *
+ * The client loop never runs, so that no RTP is sent: the result is
+ * the cost of the control plane only, the sessions set up per second
+ * and the average time taken by each method, on the sample file given
+ * on the command line.
+ */
+
+enum {
+    BENCH_OPTIONS,
+    BENCH_DESCRIBE,
+    BENCH_SETUP,
+    BENCH_PLAY,
+    BENCH_TEARDOWN,
+    BENCH_METHODS
+};
+
+static const char *const method_names[BENCH_METHODS] = {
+    [BENCH_OPTIONS] = "OPTIONS",
+    [BENCH_DESCRIBE] = "DESCRIBE",
+    [BENCH_SETUP] = "SETUP",
+    [BENCH_PLAY] = "PLAY",
+    [BENCH_TEARDOWN] = "TEARDOWN"
+};
+
+/** Time spent in each method, and requests sent */
+static double method_time[BENCH_METHODS];
+static guint64 method_count[BENCH_METHODS];
+
+/** Output of the client for the last request */
+static GString *reply;
+
+static guint64 cseq;
+
+static void bench_write_data(ATTR_UNUSED RTSP_Client *client, GByteArray *data)
+{
+    g_string_append_len(reply, (const char*)data->data, data->len);
+    g_byte_array_free(data, true);
+}
+
+static void bench_write_rtp(ATTR_UNUSED RTSP_Client *client, RTP_Buffer *buffer)
+{
+    rtp_buffer_free(buffer);
+}
+
+static void bench_timeout_cb(ATTR_UNUSED struct ev_loop *loop,
+                             ATTR_UNUSED ev_timer *w,
+                             ATTR_UNUSED int revents)
+{
+}
+
+/**
+ * @brief Create a client as @ref rtsp_client_incoming_cb would
+ */
+static RTSP_Client *bench_client(void)
+{
+    RTSP_Client *client = g_slice_new0(RTSP_Client);
+    struct sockaddr_in sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    client->input = g_byte_array_new();
+    client->sd = -1;
+    client->socktype = RTSP_TCP;
+    client->out_queue = g_queue_new();
+    client->write_data = bench_write_data;
+    client->write_rtp = bench_write_rtp;
+
+    client->vhost = feng_default_vhost;
+    client->loop = feng_loop;
+
+    client->local_host = g_strdup("127.0.0.1");
+    client->remote_host = g_strdup("127.0.0.1");
+
+    client->sa_len = sizeof(sa);
+    client->peer_sa = g_slice_copy(sizeof(sa), &sa);
+    client->local_sa = g_slice_copy(sizeof(sa), &sa);
+
+    ev_init(&client->ev_timeout, bench_timeout_cb);
+    client->ev_timeout.repeat = 60;
+
+    return client;
+}
+
+/**
+ * @brief Have the client handle a request, and check its response
+ *
+ * @param method Index of the method, for the counters
+ * @param url The URL of the request
+ * @param headers Additional headers, each ending with a line break
+ *
+ * @return The response, valid until the next request.
+ */
+static const char *bench_request(RTSP_Client *client, int method,
+                                 const char *url, const char *headers)
+{
+    GString *request = g_string_new(NULL);
+    GTimer *timer;
+
+    g_string_printf(request,
+                    "%s %s RTSP/1.0\r\n"
+                    "CSeq: %" G_GUINT64_FORMAT "\r\n"
+                    "User-Agent: feng-bench\r\n"
+                    "%s"
+                    "\r\n",
+                    method_names[method], url, ++cseq, headers);
+
+    g_string_truncate(reply, 0);
+
+    timer = g_timer_new();
+    g_byte_array_append(client->input, (guint8*)request->str, request->len);
+    RTSP_handler(client);
+    method_time[method] += g_timer_elapsed(timer, NULL);
+    method_count[method]++;
+    g_timer_destroy(timer);
+
+    g_string_free(request, true);
+
+    if ( !g_str_has_prefix(reply->str, "RTSP/1.0 200 ") ) {
+        fnc_log(FNC_LOG_FATAL, "%s %s failed: %.*s", method_names[method], url,
+                (int)strcspn(reply->str, "\r\n"), reply->str);
+        exit(1);
+    }
+
+    return reply->str;
+}
+
+/**
+ * @brief Get the value of a header from the last response
+ */
+static gchar *reply_header(const char *name)
+{
+    gchar *line = g_strdup_printf("\r\n%s: ", name);
+    const char *value = strstr(reply->str, line);
+    gchar *ret = NULL;
+
+    if ( value != NULL ) {
+        value += strlen(line);
+        ret = g_strndup(value, strcspn(value, ";\r\n"));
+    }
+
+    g_free(line);
+    return ret;
+}
+
+/**
+ * @brief Get the track controls of the last DESCRIBE's SDP
+ */
+static GPtrArray *reply_controls(void)
+{
+    GPtrArray *controls = g_ptr_array_new();
+    const char *line = strstr(reply->str, "\r\n\r\n");
+
+    while ( line != NULL && (line = strstr(line, "\na=control:")) != NULL ) {
+        line += strlen("\na=control:");
+        if ( *line != '*' )
+            g_ptr_array_add(controls, g_strndup(line, strcspn(line, "\r\n")));
+    }
+
+    return controls;
+}
+
+/**
+ * @brief Set a whole session up and tear it down
+ */
+static void bench_session(RTSP_Client *client, const char *url)
+{
+    GPtrArray *controls;
+    gchar *session = NULL, *session_header = NULL, *play_headers;
+    guint i;
+
+    bench_request(client, BENCH_OPTIONS, url, "");
+
+    bench_request(client, BENCH_DESCRIBE, url, "Accept: application/sdp\r\n");
+    controls = reply_controls();
+
+    for ( i = 0; i < controls->len; i++ ) {
+        gchar *track_url = g_strdup_printf("%s/%s", url,
+                                           (char*)g_ptr_array_index(controls, i));
+        gchar *headers = g_strdup_printf("Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u\r\n"
+                                         "%s",
+                                         i * 2, i * 2 + 1,
+                                         session_header ? session_header : "");
+
+        bench_request(client, BENCH_SETUP, track_url, headers);
+
+        if ( session == NULL ) {
+            session = reply_header("Session");
+            session_header = g_strdup_printf("Session: %s\r\n", session);
+        }
+
+        g_free(headers);
+        g_free(track_url);
+        g_free(g_ptr_array_index(controls, i));
+    }
+    g_ptr_array_free(controls, true);
+
+    if ( session == NULL ) {
+        fnc_log(FNC_LOG_FATAL, "no tracks to set up in %s", url);
+        exit(1);
+    }
+
+    play_headers = g_strdup_printf("%sRange: npt=0.000-\r\n", session_header);
+    bench_request(client, BENCH_PLAY, url, play_headers);
+    g_free(play_headers);
+
+    bench_request(client, BENCH_TEARDOWN, url, session_header);
+
+    g_free(session_header);
+    g_free(session);
+}
+
+int main(int argc, char **argv)
+{
+    cfg_options_t options;
+    cfg_vhost_t vhost;
+    RTSP_Client *client;
+    GTimer *timer;
+    guint64 sessions = 0;
+    gchar *name, *url;
+    int i;
+
+    bench_init();
+    ffmpeg_init();
+
+    if ( argc != 2 ) {
+        g_printerr("usage: %s <sample file>\n", argv[0]);
+        return 1;
+    }
+
+    /* the defaults of an empty configuration */
+    memset(&options, 0, sizeof(options));
+    options.log_level = feng_srv.log_level;
+    options.error_log = g_strdup(feng_srv.error_log);
+    cfg_options_callback(&options);
+
+    memset(&vhost, 0, sizeof(vhost));
+    vhost.document_root = g_path_get_dirname(argv[1]);
+    cfg_vhost_callback(&vhost);
+    feng_default_vhost->access_log_file = fopen("/dev/null", "w");
+
+    feng_loop = ev_default_loop(0);
+    r_init();
+
+    reply = g_string_new(NULL);
+    client = bench_client();
+
+    name = g_path_get_basename(argv[1]);
+    url = g_strdup_printf("rtsp://127.0.0.1/%s", name);
+
+    timer = g_timer_new();
+    do
+        bench_session(client, url);
+    while ( bench_running(timer, ++sessions) );
+
+    bench_report("controlplane", name, sessions / g_timer_elapsed(timer, NULL),
+                 "sessions/s");
+    g_timer_destroy(timer);
+
+    for ( i = 0; i < BENCH_METHODS; i++ ) {
+        gchar *bcase = g_strdup_printf("%s:%s", name, method_names[i]);
+
+        bench_report("controlplane", bcase,
+                     method_time[i] * 1e6 / method_count[i], "us/request");
+        g_free(bcase);
+    }
+
+    g_free(url);
+    g_free(name);
+
+    return 0;
+}
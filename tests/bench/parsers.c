@@ -0,0 +1,192 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "feng.h"
+#include "fnc_log.h"
+#include "media/media.h"
+#include "bench.h"
+
+/**
+ * @file
+ * @brief Parsers throughput, on sample files
+ *
+ * The files given on the command line are opened as feng would, so
+ * that each track gets the parser for its codec, and their packets
+ * are read into memory beforehand; each track is then packetized
+ * over and over, without consumers, so that only the parser and the
+ * writes to the track's queue are measured.
+ *
+ * Only the H.264 sample is distributed (avroot/test.mov); the other
+ * parsers (AAC, Xiph, MPEG video, ...) are measured by passing files
+ * with those codecs.
+ */
+
+typedef struct {
+    uint8_t *data;
+    int size;
+    double pts, dts, duration;
+    gboolean keyframe;
+} BenchPacket;
+
+/** Packets of each stream, by stream index */
+static GPtrArray **read_packets(const char *path, unsigned int *nb_streams)
+{
+    AVFormatContext *avfc = NULL;
+    GPtrArray **streams;
+    AVPacket pkt;
+    unsigned int i;
+
+    if ( avformat_open_input(&avfc, path, NULL, NULL) != 0 ||
+         avformat_find_stream_info(avfc, NULL) < 0 ) {
+        fnc_log(FNC_LOG_ERR, "unable to read %s", path);
+        return NULL;
+    }
+
+    *nb_streams = avfc->nb_streams;
+    streams = g_new0(GPtrArray*, avfc->nb_streams);
+    for ( i = 0; i < avfc->nb_streams; i++ )
+        streams[i] = g_ptr_array_new();
+
+    while ( av_read_frame(avfc, &pkt) >= 0 ) {
+        const AVRational time_base = avfc->streams[pkt.stream_index]->time_base;
+        BenchPacket *packet = g_slice_new0(BenchPacket);
+
+        packet->data = g_memdup(pkt.data, pkt.size);
+        packet->size = pkt.size;
+        if ( pkt.pts != AV_NOPTS_VALUE )
+            packet->pts = pkt.pts * av_q2d(time_base);
+        if ( pkt.dts != AV_NOPTS_VALUE )
+            packet->dts = pkt.dts * av_q2d(time_base);
+        packet->duration = pkt.duration * av_q2d(time_base);
+        packet->keyframe = !!(pkt.flags & AV_PKT_FLAG_KEY);
+
+        g_ptr_array_add(streams[pkt.stream_index], packet);
+
+        av_free_packet(&pkt);
+    }
+
+    avformat_close_input(&avfc);
+
+    return streams;
+}
+
+static void bench_track(const char *name, Track *tr, GPtrArray *packets)
+{
+    GTimer *timer;
+    guint64 iterations = 0, bytes = 0;
+    double elapsed;
+    gchar *bcase;
+    guint i;
+
+    if ( packets->len == 0 )
+        return;
+
+    timer = g_timer_new();
+    do {
+        for ( i = 0; i < packets->len; i++ ) {
+            const BenchPacket *packet = g_ptr_array_index(packets, i);
+
+            tr->pts = packet->pts;
+            tr->dts = packet->dts;
+            tr->keyframe = packet->keyframe;
+            if ( packet->duration > 0 )
+                tr->frame_duration = packet->duration;
+
+            tr->parse(tr, packet->data, packet->size);
+            bytes += packet->size;
+        }
+
+        /* nobody consumes the buffers */
+        track_reset_queue(tr);
+    } while ( bench_running(timer, ++iterations) );
+    elapsed = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    bcase = g_strdup_printf("%s:%s:%s", tr->encoding_name, name, tr->name);
+    bench_report("parser", bcase, bytes / elapsed / (1024*1024), "MiB/s");
+    bench_report("parser", bcase, iterations * packets->len / elapsed, "packets/s");
+    g_free(bcase);
+}
+
+static void bench_file(const char *path)
+{
+    static const MParserSettings settings = {
+        .mtu = DEFAULT_MTU,
+        .video_buffer_low = DEFAULT_BUFFER_LOW,
+        .video_buffer_high = DEFAULT_BUFFER_HIGH,
+        .audio_buffer_low = DEFAULT_BUFFER_LOW,
+        .audio_buffer_high = DEFAULT_BUFFER_HIGH
+    };
+    gchar *name = g_path_get_basename(path);
+    cfg_vhost_t vhost;
+    GPtrArray **packets;
+    unsigned int nb_streams, i;
+    Resource *r;
+
+    /* the resource is looked up in the default vhost */
+    memset(&vhost, 0, sizeof(vhost));
+    vhost.document_root = g_path_get_dirname(path);
+    configured_vhosts = g_list_prepend(NULL, &vhost);
+
+    if ( (r = r_open(name, &settings)) == NULL ||
+         (packets = read_packets(path, &nb_streams)) == NULL ) {
+        fnc_log(FNC_LOG_ERR, "unable to open %s", path);
+        goto end;
+    }
+
+    for ( i = 0; i < nb_streams; i++ )
+        if ( r->stored.tracks[i] != NULL )
+            bench_track(name, r->stored.tracks[i], packets[i]);
+
+    /* the resource is not closed: that takes the demuxer pool, which is
+       not started here */
+
+ end:
+    g_list_free(configured_vhosts);
+    configured_vhosts = NULL;
+    g_free((char*)vhost.document_root);
+    g_free(name);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    bench_init();
+    ffmpeg_init();
+
+    if ( argc < 2 ) {
+        g_printerr("usage: %s <sample file>...\n", argv[0]);
+        return 1;
+    }
+
+    for ( i = 1; i < argc; i++ )
+        bench_file(argv[i]);
+
+    return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * feng is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * feng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with feng; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "feng.h"
+#include "rtsp.h"
+#include "bench.h"
+
+/**
+ * @file
+ * @brief RTSP parsers throughput, on the requests of real clients
+ *
+ * The requests a session is set up with, as sent by a few common
+ * clients, are parsed over and over by the request line and headers
+ * parsers, and their Transport and Range headers by the respective
+ * parsers; the result is the requests parsed per second by each,
+ * for each client.
+ */
+
+#define VLC_UA "User-Agent: LibVLC/2.0.8 (LIVE555 Streaming Media v2013.04.30)\r\n"
+#define FFMPEG_UA "User-Agent: Lavf54.29.104\r\n"
+#define QT_UA "User-Agent: QuickTime/7.6.6 (qtver=7.6.6;cpu=IA32;os=Mac 10.6.8)\r\n"
+#define STB_UA "User-Agent: Amino Aminet AmiNET130 OS/1.6 (kernel 2.6.23)\r\n"
+
+static const struct {
+    const char *client;
+    const char *request;
+} corpus[] = {
+    { "vlc",
+      "OPTIONS rtsp://media.example.com:554/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 2\r\n"
+      VLC_UA
+      "\r\n" },
+    { "vlc",
+      "DESCRIBE rtsp://media.example.com:554/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 3\r\n"
+      VLC_UA
+      "Accept: application/sdp\r\n"
+      "\r\n" },
+    { "vlc",
+      "SETUP rtsp://media.example.com:554/movies/test.mov/Track_0 RTSP/1.0\r\n"
+      "CSeq: 4\r\n"
+      VLC_UA
+      "Transport: RTP/AVP;unicast;client_port=50040-50041\r\n"
+      "\r\n" },
+    { "vlc",
+      "SETUP rtsp://media.example.com:554/movies/test.mov/Track_1 RTSP/1.0\r\n"
+      "CSeq: 5\r\n"
+      VLC_UA
+      "Transport: RTP/AVP;unicast;client_port=50042-50043\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "\r\n" },
+    { "vlc",
+      "PLAY rtsp://media.example.com:554/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 6\r\n"
+      VLC_UA
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "Range: npt=0.000-\r\n"
+      "\r\n" },
+    { "vlc",
+      "TEARDOWN rtsp://media.example.com:554/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 7\r\n"
+      VLC_UA
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "\r\n" },
+
+    { "ffmpeg",
+      "OPTIONS rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 1\r\n"
+      FFMPEG_UA
+      "\r\n" },
+    { "ffmpeg",
+      "DESCRIBE rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "Accept: application/sdp\r\n"
+      "CSeq: 2\r\n"
+      FFMPEG_UA
+      "\r\n" },
+    { "ffmpeg",
+      "SETUP rtsp://media.example.com/movies/test.mov/Track_0 RTSP/1.0\r\n"
+      "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n"
+      "CSeq: 3\r\n"
+      FFMPEG_UA
+      "\r\n" },
+    { "ffmpeg",
+      "SETUP rtsp://media.example.com/movies/test.mov/Track_1 RTSP/1.0\r\n"
+      "Transport: RTP/AVP/TCP;unicast;interleaved=2-3\r\n"
+      "CSeq: 4\r\n"
+      FFMPEG_UA
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "\r\n" },
+    { "ffmpeg",
+      "PLAY rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "Range: npt=0.000-\r\n"
+      "CSeq: 5\r\n"
+      FFMPEG_UA
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "\r\n" },
+    { "ffmpeg",
+      "TEARDOWN rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 6\r\n"
+      FFMPEG_UA
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "\r\n" },
+
+    { "quicktime",
+      "DESCRIBE rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 1\r\n"
+      "Accept: application/sdp\r\n"
+      "Bandwidth: 384000\r\n"
+      "Accept-Language: en-us\r\n"
+      QT_UA
+      "\r\n" },
+    { "quicktime",
+      "SETUP rtsp://media.example.com/movies/test.mov/Track_0 RTSP/1.0\r\n"
+      "CSeq: 2\r\n"
+      "Transport: RTP/AVP;unicast;client_port=6970-6971;mode=play\r\n"
+      "x-retransmit: our-retransmit\r\n"
+      "x-dynamic-rate: 1\r\n"
+      "x-transport-options: late-tolerance=2.384000\r\n"
+      "Bandwidth: 384000\r\n"
+      "Accept-Language: en-us\r\n"
+      QT_UA
+      "\r\n" },
+    { "quicktime",
+      "SETUP rtsp://media.example.com/movies/test.mov/Track_1 RTSP/1.0\r\n"
+      "CSeq: 3\r\n"
+      "Transport: RTP/AVP;unicast;client_port=6972-6973;mode=play\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "x-retransmit: our-retransmit\r\n"
+      "x-dynamic-rate: 1\r\n"
+      "x-transport-options: late-tolerance=2.384000\r\n"
+      "Bandwidth: 384000\r\n"
+      "Accept-Language: en-us\r\n"
+      QT_UA
+      "\r\n" },
+    { "quicktime",
+      "PLAY rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 4\r\n"
+      "Range: npt=0.000000-\r\n"
+      "x-prebuffer: maxtime=2.000000\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "Bandwidth: 384000\r\n"
+      "Accept-Language: en-us\r\n"
+      QT_UA
+      "\r\n" },
+    { "quicktime",
+      "TEARDOWN rtsp://media.example.com/movies/test.mov RTSP/1.0\r\n"
+      "CSeq: 5\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "Accept-Language: en-us\r\n"
+      QT_UA
+      "\r\n" },
+
+    { "settopbox",
+      "DESCRIBE rtsp://10.0.0.1:554/vod/test.mov RTSP/1.0\r\n"
+      "CSeq: 101\r\n"
+      "Accept: application/sdp\r\n"
+      STB_UA
+      "x-mayNotify:\r\n"
+      "\r\n" },
+    { "settopbox",
+      "SETUP rtsp://10.0.0.1:554/vod/test.mov/Track_0 RTSP/1.0\r\n"
+      "CSeq: 102\r\n"
+      "Transport: MP2T/H2221/UDP;unicast;destination=10.20.30.40;client_port=5000,"
+      "RAW/RAW/UDP;unicast;destination=10.20.30.40;client_port=5000,"
+      "RTP/AVP/UDP;unicast;destination=10.20.30.40;client_port=5000-5001;mode=play,"
+      "RTP/AVP;multicast;destination=232.1.1.1;port=5000-5001;ttl=16,"
+      "RTP/AVP/TCP;unicast;interleaved=0-1\r\n"
+      STB_UA
+      "x-mayNotify:\r\n"
+      "\r\n" },
+    { "settopbox",
+      "PLAY rtsp://10.0.0.1:554/vod/test.mov RTSP/1.0\r\n"
+      "CSeq: 103\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "Range: npt=1234.567-\r\n"
+      "Scale: 1.000000\r\n"
+      STB_UA
+      "\r\n" },
+    { "settopbox",
+      "PLAY rtsp://10.0.0.1:554/vod/test.mov RTSP/1.0\r\n"
+      "CSeq: 104\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      "Range: clock=20121012T101500.25Z-\r\n"
+      STB_UA
+      "\r\n" },
+    { "settopbox",
+      "GET_PARAMETER rtsp://10.0.0.1:554/vod/test.mov RTSP/1.0\r\n"
+      "CSeq: 105\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      STB_UA
+      "\r\n" },
+    { "settopbox",
+      "TEARDOWN rtsp://10.0.0.1:554/vod/test.mov RTSP/1.0\r\n"
+      "CSeq: 106\r\n"
+      "Session: 9A0C5E3B17D2F864\r\n"
+      STB_UA
+      "\r\n" }
+};
+
+/** A request of the corpus, split as the parsers see it */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t line_len;
+} CorpusRequest;
+
+/**
+ * @brief Collect the requests of a client from the corpus
+ */
+static GArray *corpus_requests(const char *client)
+{
+    GArray *requests = g_array_new(false, false, sizeof(CorpusRequest));
+    gsize i;
+
+    for ( i = 0; i < G_N_ELEMENTS(corpus); i++ ) {
+        CorpusRequest request;
+
+        if ( strcmp(corpus[i].client, client) != 0 )
+            continue;
+
+        request.data = corpus[i].request;
+        request.len = strlen(request.data);
+        request.line_len = strchr(request.data, '\n') - request.data + 1;
+        g_array_append_val(requests, request);
+    }
+
+    return requests;
+}
+
+/**
+ * @brief Collect the values of a header from the requests of a client
+ */
+static GPtrArray *corpus_headers(GArray *requests, RFC822_Header hdr)
+{
+    GPtrArray *values = g_ptr_array_new();
+    guint i;
+
+    for ( i = 0; i < requests->len; i++ ) {
+        const CorpusRequest *request = &g_array_index(requests, CorpusRequest, i);
+        RFC822_Headers *headers = rfc822_headers_new();
+        const char *value;
+        size_t read_size;
+
+        ragel_read_rtsp_headers(headers, request->data + request->line_len,
+                                request->len - request->line_len, &read_size);
+
+        if ( (value = rfc822_headers_lookup(headers, hdr)) != NULL )
+            g_ptr_array_add(values, g_strdup(value));
+
+        rfc822_headers_destroy(headers);
+    }
+
+    return values;
+}
+
+static void bench_request_line(const char *client, GArray *requests)
+{
+    GTimer *timer = g_timer_new();
+    guint64 iterations = 0;
+    guint i;
+
+    do {
+        for ( i = 0; i < requests->len; i++ ) {
+            const CorpusRequest *request = &g_array_index(requests, CorpusRequest, i);
+            RFC822_Request req;
+
+            if ( ragel_parse_request_line(request->data, request->len, &req) != request->line_len )
+                continue;
+
+            g_free(req.method_str);
+            g_free(req.protocol_str);
+            g_free(req.object);
+        }
+    } while ( bench_running(timer, ++iterations) );
+
+    bench_report("request_line", client,
+                 iterations * requests->len / g_timer_elapsed(timer, NULL),
+                 "requests/s");
+    g_timer_destroy(timer);
+}
+
+static void bench_headers(const char *client, GArray *requests)
+{
+    GTimer *timer = g_timer_new();
+    guint64 iterations = 0;
+    guint i;
+
+    do {
+        for ( i = 0; i < requests->len; i++ ) {
+            const CorpusRequest *request = &g_array_index(requests, CorpusRequest, i);
+            RFC822_Headers *headers = rfc822_headers_new();
+            size_t read_size;
+
+            ragel_read_rtsp_headers(headers, request->data + request->line_len,
+                                    request->len - request->line_len, &read_size);
+            rfc822_headers_destroy(headers);
+        }
+    } while ( bench_running(timer, ++iterations) );
+
+    bench_report("headers", client,
+                 iterations * requests->len / g_timer_elapsed(timer, NULL),
+                 "requests/s");
+    g_timer_destroy(timer);
+}
+
+static void transport_free(gpointer transport, ATTR_UNUSED gpointer unused)
+{
+    g_slice_free(struct ParsedTransport, transport);
+}
+
+static void bench_transport(const char *client, GPtrArray *transports)
+{
+    GTimer *timer = g_timer_new();
+    guint64 iterations = 0;
+    guint i;
+
+    do {
+        for ( i = 0; i < transports->len; i++ ) {
+            GSList *parsed = ragel_parse_transport_header(g_ptr_array_index(transports, i));
+
+            g_slist_foreach(parsed, transport_free, NULL);
+            g_slist_free(parsed);
+        }
+    } while ( bench_running(timer, ++iterations) );
+
+    bench_report("transport", client,
+                 iterations * transports->len / g_timer_elapsed(timer, NULL),
+                 "requests/s");
+    g_timer_destroy(timer);
+}
+
+static void bench_range(const char *client, GPtrArray *ranges)
+{
+    GTimer *timer = g_timer_new();
+    guint64 iterations = 0;
+    guint i;
+
+    do {
+        for ( i = 0; i < ranges->len; i++ ) {
+            RTSP_Range range;
+
+            ragel_parse_range_header(g_ptr_array_index(ranges, i), &range);
+        }
+    } while ( bench_running(timer, ++iterations) );
+
+    bench_report("range", client,
+                 iterations * ranges->len / g_timer_elapsed(timer, NULL),
+                 "requests/s");
+    g_timer_destroy(timer);
+}
+
+int main()
+{
+    static const char *const clients[] = {
+        "vlc", "ffmpeg", "quicktime", "settopbox"
+    };
+    gsize i;
+
+    bench_init();
+
+    for ( i = 0; i < G_N_ELEMENTS(clients); i++ ) {
+        GArray *requests = corpus_requests(clients[i]);
+        GPtrArray *transports = corpus_headers(requests, RTSP_Header_Transport);
+        GPtrArray *ranges = corpus_headers(requests, RTSP_Header_Range);
+
+        bench_request_line(clients[i], requests);
+        bench_headers(clients[i], requests);
+        bench_transport(clients[i], transports);
+        bench_range(clients[i], ranges);
+
+        g_ptr_array_foreach(transports, (GFunc)g_free, NULL);
+        g_ptr_array_free(transports, true);
+        g_ptr_array_foreach(ranges, (GFunc)g_free, NULL);
+        g_ptr_array_free(ranges, true);
+        g_array_free(requests, true);
+    }
+
+    return 0;
+}
@@ -26,13 +26,13 @@
     ragel_read_rtsp_headers(headers, string, sizeof(string)-1, read_size)
 
 void test_single_header() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     int res = ragel_read_constant_rtsp_headers(headers, "CSeq: 1\r\n", &read_size);
 
     g_assert_cmpint(res, ==, 0);
     g_assert_cmpint(read_size, ==, sizeof("CSeq: 1\r\n")-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 1);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 1);
 
     g_assert_cmpstr(rfc822_headers_lookup(headers, RTSP_Header_CSeq), ==, "1");
 
@@ -40,13 +40,13 @@ void test_single_header() {
 }
 
 void test_single_header_discarding() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     int res = ragel_read_constant_rtsp_headers(headers, "CSeq: 1\r\nMyTest", &read_size);
 
     g_assert_cmpint(res, ==, 0);
     g_assert_cmpint(read_size, ==, sizeof("CSeq: 1\r\n")-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 1);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 1);
 
     g_assert_cmpstr(rfc822_headers_lookup(headers, RTSP_Header_CSeq), ==, "1");
 
@@ -54,13 +54,13 @@ void test_single_header_discarding() {
 }
 
 void test_two_headers() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     int res = ragel_read_constant_rtsp_headers(headers, "CSeq: 1\r\nSession: Test\r\n", &read_size);
 
     g_assert_cmpint(res, ==, 0);
     g_assert_cmpint(read_size, ==, sizeof("CSeq: 1\r\nSession: Test\r\n")-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 2);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 2);
 
     g_assert_cmpstr(rfc822_headers_lookup(headers, RTSP_Header_CSeq), ==, "1");
     g_assert_cmpstr(rfc822_headers_lookup(headers, RTSP_Header_Session), ==, "Test");
@@ -70,13 +70,13 @@ void test_two_headers() {
 
 
 void test_two_headers_ending() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     int res = ragel_read_constant_rtsp_headers(headers, "CSeq: 1\r\nSession: Test\r\n\r\n", &read_size);
 
     g_assert_cmpint(res, ==, 1);
     g_assert_cmpint(read_size, ==, sizeof("CSeq: 1\r\nSession: Test\r\n\r\n")-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 2);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 2);
 
     g_assert_cmpstr(rfc822_headers_lookup(headers, RTSP_Header_CSeq), ==, "1");
     g_assert_cmpstr(rfc822_headers_lookup(headers, RTSP_Header_Session), ==, "Test");
@@ -85,46 +85,46 @@ void test_two_headers_ending() {
 }
 
 void test_unsupported_header() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     static const char headers_str[] = "MyFakeHeader: Value\r\n";
     int res = ragel_read_constant_rtsp_headers(headers, headers_str, &read_size);
 
     g_assert_cmpint(res, ==, 0);
     g_assert_cmpint(read_size, ==, sizeof(headers_str)-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 0);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 0);
 
     rfc822_headers_destroy(headers);
 }
 
 void test_unsupported_header_accept() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     static const char headers_str[] = "Accept: application/sdp\r\n";
     int res = ragel_read_constant_rtsp_headers(headers, headers_str, &read_size);
 
     g_assert_cmpint(res, ==, 0);
     g_assert_cmpint(read_size, ==, sizeof(headers_str)-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 0);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 0);
 
     rfc822_headers_destroy(headers);
 }
 
 void test_unsupported_header_sender() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     static const char headers_str[] = "Sender: test\r\n";
     int res = ragel_read_constant_rtsp_headers(headers, headers_str, &read_size);
 
     g_assert_cmpint(res, ==, 0);
     g_assert_cmpint(read_size, ==, sizeof(headers_str)-1);
-    g_assert_cmpint(g_hash_table_size(headers), ==, 0);
+    g_assert_cmpint(rfc822_headers_count(headers), ==, 0);
 
     rfc822_headers_destroy(headers);
 }
 
 void test_real_headers() {
-    GHashTable *headers = rfc822_headers_new();
+    RFC822_Headers *headers = rfc822_headers_new();
     size_t read_size = (size_t)-1;
     static const char headers_str[] = "CSeq: 1\r\nAccept: application/sdp\r\nBandwidth: 512000\r\nAccept-Language: en-US\r\nUser-Agent: QuickTime/7.6.3 (qtver=7.6.3;cpu=IA32;os=Mac 10.6)\r\n\r\n";
     int res = ragel_read_constant_rtsp_headers(headers, headers_str, &read_size);
@@ -0,0 +1,137 @@
+/*
+ * This file is part of feng
+ *
+ * Copyright (C) 2010 by LScube team <team@streaming.polito.it>
+ * See AUTHORS for more details
+ *
+ * NetEmbryo is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * NetEmbryo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NetEmbryo; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "src/feng.h"
+#include "media/media.h"
+#include <glib.h>
+#include "gtest-extra.h"
+
+static const uint8_t *naive_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+    for ( ; end - p >= 3; p++ )
+        if ( p[0] == 0 && p[1] == 0 && p[2] == 1 )
+            return p;
+
+    return end;
+}
+
+/* Mostly zeros and ones, so that there are plenty of start codes,
+ * and of almost-start codes */
+static void fill_random(uint8_t *buffer, size_t len, GRand *rand)
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+        switch ( g_rand_int_range(rand, 0, 4) ) {
+        case 0: case 1: buffer[i] = 0; break;
+        case 2: buffer[i] = 1; break;
+        default: buffer[i] = g_rand_int_range(rand, 0, 256); break;
+        }
+}
+
+void test_startcode_simple()
+{
+    static const uint8_t stream[] = {
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x00,
+        0x01, 0x68, 0xce, 0x00, 0x00, 0x03, 0x00, 0x00
+    };
+    const uint8_t *end = stream + sizeof(stream);
+
+    g_assert(mparser_find_startcode(stream, end) == stream + 1);
+    g_assert(mparser_find_startcode(stream + 2, end) == stream + 6);
+    g_assert(mparser_find_startcode(stream + 7, end) == end);
+    g_assert(mparser_find_startcode(end, end) == end);
+}
+
+void test_startcode_scanners()
+{
+    const MParserStartcodeScanner *scanner;
+    GRand *rand = g_rand_new_with_seed(0x000001);
+    uint8_t *buffer = g_malloc(512 + 64);
+    int round;
+
+    for ( round = 0; round < 2000; round++ ) {
+        const size_t offset = g_rand_int_range(rand, 0, 64);
+        const size_t len = g_rand_int_range(rand, 0, 512);
+        const uint8_t *start = buffer + offset, *end = start + len;
+
+        fill_random(buffer + offset, len, rand);
+
+        for ( scanner = mparser_startcode_scanners(); scanner->name; scanner++ ) {
+            const uint8_t *p = start, *expected = start;
+
+            do {
+                expected = naive_find_startcode(p, end);
+                g_assert_cmpuint(scanner->find(p, end) - start, ==,
+                                 expected - start);
+                p = expected + 1;
+            } while ( expected < end );
+        }
+    }
+
+    g_free(buffer);
+    g_rand_free(rand);
+}
+
+/* Run with -m perf to compare the bytes/sec of the scanners */
+void test_startcode_benchmark()
+{
+    static const size_t len = 16 << 20;
+    const MParserStartcodeScanner *scanner;
+    GRand *rand;
+    uint8_t *buffer;
+    size_t i;
+
+    if ( !g_test_perf() )
+        return;
+
+    /* coded data has very few zero bytes, and a start code every
+     * couple of packets */
+    rand = g_rand_new_with_seed(0x000001);
+    buffer = g_malloc(len);
+    for ( i = 0; i < len; i++ )
+        buffer[i] = g_rand_int_range(rand, 1, 256);
+    for ( i = 0; i + 3 < len; i += g_rand_int_range(rand, 512, 4096) ) {
+        buffer[i] = buffer[i + 1] = 0;
+        buffer[i + 2] = 1;
+    }
+
+    for ( scanner = mparser_startcode_scanners(); scanner->name; scanner++ ) {
+        const uint8_t *p, *end = buffer + len;
+        double elapsed;
+        int run;
+
+        g_test_timer_start();
+        for ( run = 0; run < 16; run++ )
+            for ( p = buffer; p < end; p += 3 )
+                if ( (p = scanner->find(p, end)) == end )
+                    break;
+        elapsed = g_test_timer_elapsed();
+
+        g_test_maximized_result(16.0 * len / elapsed,
+                                "%s: %.1f MB/s", scanner->name,
+                                16.0 * len / elapsed / (1 << 20));
+    }
+
+    g_free(buffer);
+    g_rand_free(rand);
+}